@@ -6,8 +6,16 @@
 #include CONFIG_HEADER_FILE
 #endif
 
+#include <errno.h>
+
 #include "basework/rq.h"
 #include "basework/async_call.h"
+#include "basework/arch/generic/rte_stdatomic.h"
+#ifdef CONFIG_BASEWORK_RQ_POOL
+#include "basework/rq_pool.h"
+
+static struct rq_pool *async_pool;
+#endif
 
 static void rq_async_execute(void *arg, size_t size) {
     struct call_param *cp = (struct call_param *)arg;
@@ -20,6 +28,11 @@ static void rq_async_execute(void *arg, size_t size) {
 int __async_call0(async_fn_t fn, bool urgent) {
     if (fn == NULL)
         return -EINVAL;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (async_pool)
+        return rq_pool_submit(async_pool, (void (*)(void *))(void *)fn, 
+            NULL, 0, urgent);
+#endif
     if (urgent)
         return rq_submit_urgent((void (*)(void *))(void *)fn, NULL);
     return rq_submit((void (*)(void *))(void *)fn, NULL);
@@ -28,6 +41,11 @@ int __async_call0(async_fn_t fn, bool urgent) {
 int __async_call1(async_fn_t fn, uintptr_t a1, bool urgent) {
     if (fn == NULL)
         return -EINVAL;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (async_pool)
+        return rq_pool_submit(async_pool, (void (*)(void *))(void *)fn, 
+            (void *)a1, 0, urgent);
+#endif
     if (urgent)
         return rq_submit_urgent((void (*)(void *))(void *)fn, (void *)a1);
     return rq_submit((void (*)(void *))(void *)fn, (void *)a1);
@@ -46,6 +64,11 @@ int __async_call(async_fn_t fn, uintptr_t a1, uintptr_t a2,
     param.a5 = a5;
     param.result = 0;
     param.done = done;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (async_pool)
+        return rq_pool_submit_cp(async_pool, rq_async_execute, &param, 
+            sizeof(param), 0, urgent);
+#endif
     if (urgent)
         return rq_submit_urgent_cp(rq_async_execute, &param, sizeof(param));
     return rq_submit_cp(rq_async_execute, &param, sizeof(param));
@@ -63,5 +86,152 @@ int ___async_call(struct call_param *param, async_fn_t fn, uintptr_t a1, uintptr
     param->a5 = a5;
     param->result = 0;
     param->done = done;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (async_pool)
+        return rq_pool_submit(async_pool, (void *)rq_async_execute, param, 
+            0, false);
+#endif
     return rq_submit((void *)rq_async_execute, param);
 }
+
+static void rq_async_future_execute(void *arg) {
+    struct async_future *f = (struct async_future *)arg;
+    struct async_future *next;
+
+    do {
+        /* 
+         * The future may be released by owner after it completed, So the 
+         * completion is posted before DONE and the future is not touched 
+         * after that
+         */
+        next = f->next;
+        f->next = NULL;
+        f->invoke(f);
+        rte_atomic_store_explicit(&f->state, ASYNC_FUTURE_COMPLETING, 
+            rte_memory_order_release);
+        os_completed(&f->completion);
+        rte_atomic_store_explicit(&f->state, ASYNC_FUTURE_DONE, 
+            rte_memory_order_release);
+        f = next;
+    } while (f);
+}
+
+static inline int async_future_state(struct async_future *f) {
+    return rte_atomic_load_explicit(&f->state, rte_memory_order_acquire);
+}
+
+static inline bool async_future_busy(int state) {
+    return state == ASYNC_FUTURE_PENDING || state == ASYNC_FUTURE_COMPLETING;
+}
+
+/*
+ * The completion has been posted, Wait for the worker to set DONE
+ */
+static void async_future_settle(struct async_future *f) {
+    while (async_future_state(f) != ASYNC_FUTURE_DONE)
+        os_thread_yield();
+}
+
+static void async_future_cancel(struct async_future *f) {
+    while (f) {
+        rte_atomic_store_explicit(&f->state, ASYNC_FUTURE_IDLE, 
+            rte_memory_order_release);
+        f = f->next;
+    }
+}
+
+static bool async_future_acquire(struct async_future *f) {
+    int state = async_future_state(f);
+
+    if (async_future_busy(state))
+        return false;
+    if (!rte_atomic_compare_exchange_strong_explicit(&f->state, &state, 
+        ASYNC_FUTURE_PENDING, rte_memory_order_acq_rel, 
+        rte_memory_order_acquire))
+        return false;
+
+    /* Drop the completion that nobody waited for */
+    os_completion_reinit(&f->completion);
+    return true;
+}
+
+void async_future_init(struct async_future *f, async_invoke_t invoke, 
+    void *arg) {
+    f->invoke = invoke;
+    f->next = NULL;
+    f->arg = arg;
+    f->result = 0;
+    f->state = ASYNC_FUTURE_IDLE;
+    os_completion_reinit(&f->completion);
+}
+
+int async_future_submit(struct async_future *f, bool urgent) {
+    int err;
+
+    if (f == NULL || f->invoke == NULL)
+        return -EINVAL;
+    if (!async_future_acquire(f))
+        return -EBUSY;
+
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (async_pool)
+        err = rq_pool_submit(async_pool, rq_async_future_execute, f, 0, urgent);
+    else
+#endif
+    if (urgent)
+        err = rq_submit_urgent(rq_async_future_execute, f);
+    else
+        err = rq_submit(rq_async_future_execute, f);
+    if (err)
+        async_future_cancel(f);
+    return err;
+}
+
+int async_future_then(struct async_future *f, struct async_future *next) {
+    if (f == NULL || next == NULL || next->invoke == NULL || f == next)
+        return -EINVAL;
+    if (async_future_busy(async_future_state(f)))
+        return -EBUSY;
+    if (!async_future_acquire(next))
+        return -EBUSY;
+
+    /* Append to the tail of chain */
+    while (f->next)
+        f = f->next;
+    f->next = next;
+    return 0;
+}
+
+bool async_future_done(struct async_future *f) {
+    return async_future_state(f) == ASYNC_FUTURE_DONE;
+}
+
+/*
+ * The completion is posted once after the state left PENDING, So it is 
+ * never lost even if the last timedwait has been timeout
+ */
+uintptr_t async_future_wait(struct async_future *f) {
+    while (async_future_state(f) == ASYNC_FUTURE_PENDING)
+        os_completion_wait(&f->completion);
+    async_future_settle(f);
+    return f->result;
+}
+
+int async_future_timedwait(struct async_future *f, uint32_t timeout) {
+    if (async_future_state(f) == ASYNC_FUTURE_PENDING) {
+        os_completion_timedwait(&f->completion, timeout);
+        if (async_future_state(f) == ASYNC_FUTURE_PENDING)
+            return -ETIMEDOUT;
+    }
+    async_future_settle(f);
+    return 0;
+}
+
+#ifdef CONFIG_BASEWORK_RQ_POOL
+int async_call_attach_pool(struct rq_pool *pool) {
+    if (pool && pool->itemsize < sizeof(struct call_param))
+        return -EINVAL;
+    async_pool = pool;
+    return 0;
+}
+#endif /* CONFIG_BASEWORK_RQ_POOL */
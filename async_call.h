@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "basework/os/osapi.h"
+
 #ifdef __cplusplus
 extern "C"{
 #endif
@@ -47,8 +49,8 @@ struct call_param {
 #define _ASYNC_CALL1(fn, a1) __async_call1((async_fn_t)fn, (uintptr_t)a1, false)
 #define _ASYNC_CALL2(fn, a1, a2) async_call2(fn, a1, a2)
 #define _ASYNC_CALL3(fn, a1, a2, a3) async_call3(fn, a1, a2, a3)
-#define _ASYNC_CALL4(fn, a1, a2, a3, a4) async_call4(fn, a1, a2, a4)
-#define _ASYNC_CALL5(fn, a1, a2, a3, a4, a5) async_call5(fn, a1, a2, a4, a5)
+#define _ASYNC_CALL4(fn, a1, a2, a3, a4) async_call4(fn, a1, a2, a3, a4)
+#define _ASYNC_CALL5(fn, a1, a2, a3, a4, a5) async_call5(fn, a1, a2, a3, a4, a5)
 #define _ASYNC_CALL_TEMPLATE(_ignore, a0, a1, a2, a3, a4, a5, _p, ...) _p
 
 /*
@@ -121,6 +123,107 @@ int __async_call(async_fn_t fn, uintptr_t a1, uintptr_t a2,
 
 int ___async_call(struct call_param *param, async_fn_t fn, uintptr_t a1, uintptr_t a2, 
     uintptr_t a3, uintptr_t a4, uintptr_t a5, async_done_t done);
+
+/*
+ * Async-future
+ *
+ * The future is an inline call record that owned by caller, It is submitted
+ * to run-queue by reference (No copy and memory allocation). The caller can
+ * poll or block on it, And the chained futures are executed in order after
+ * it completed (In the same run-queue context).
+ *
+ * Note: The future must be valid until it completed and only one thread
+ * can block on it at the same time.
+ */
+#define ASYNC_FUTURE_IDLE       0
+#define ASYNC_FUTURE_PENDING    1
+#define ASYNC_FUTURE_DONE       2
+#define ASYNC_FUTURE_COMPLETING 3 /* Completion posted but not DONE yet */
+
+struct async_future;
+typedef void (*async_invoke_t)(struct async_future *f);
+
+struct async_future {
+    async_invoke_t invoke;     /* Executed in run-queue context */
+    struct async_future *next; /* Continuation */
+    void *arg;                 /* User context */
+    uintptr_t result;
+    int state;
+    os_completion_declare(completion)
+};
+
+#define async_future_result(_f) (_f)->result
+#define async_future_arg(_f)    (_f)->arg
+
+/*
+ * async_future_init - Initialize future
+ *
+ * @f: future
+ * @invoke: user function (It can set f->result as return value)
+ * @arg: user context
+ */
+void async_future_init(struct async_future *f, async_invoke_t invoke, 
+    void *arg);
+
+/*
+ * async_future_submit - Submit future to run-queue
+ *
+ * @f: future
+ * @urgent: urgent call
+ * return 0 if success
+ */
+int async_future_submit(struct async_future *f, bool urgent);
+
+/*
+ * async_future_then - Chain a continuation to future
+ *
+ * The continuation is executed after @f completed, And it will be marked
+ * as pending until then. Both of them must not be pending
+ *
+ * @f: future
+ * @next: continuation
+ * return 0 if success
+ */
+int async_future_then(struct async_future *f, struct async_future *next);
+
+/*
+ * async_future_done - Poll the state of future
+ *
+ * @f: future
+ * return true if the future has been completed
+ */
+bool async_future_done(struct async_future *f);
+
+/*
+ * async_future_wait - Wait for future completed
+ *
+ * @f: future
+ * return the result of future
+ */
+uintptr_t async_future_wait(struct async_future *f);
+
+/*
+ * async_future_timedwait - Wait for future completed with timeout
+ *
+ * @f: future
+ * @timeout: timeout (ms)
+ * return 0 if success, -ETIMEDOUT if timeout
+ */
+int async_future_timedwait(struct async_future *f, uint32_t timeout);
+
+#ifdef CONFIG_BASEWORK_RQ_POOL
+struct rq_pool;
+
+/*
+ * async_call_attach_pool - Dispatch async-call to run-queue pool 
+ * instead of system run-queue
+ *
+ * @pool: run-queue pool (NULL: use system run-queue). The itemsize of pool
+ *        must not be less than sizeof(struct call_param)
+ * return 0 if success
+ */
+int async_call_attach_pool(struct rq_pool *pool);
+#endif /* CONFIG_BASEWORK_RQ_POOL */
     
 #ifdef __cplusplus
 }
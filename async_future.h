@@ -0,0 +1,107 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * C++ front-end of async-future
+ */
+
+#ifndef BASEWORK_ASYNC_FUTURE_H_
+#define BASEWORK_ASYNC_FUTURE_H_
+
+#include <stddef.h>
+#include <tuple>
+#include <utility>
+
+#include "basework/async_call.h"
+
+namespace base {
+namespace detail {
+
+template<size_t... I> struct async_index {};
+template<size_t N, size_t... I>
+struct async_make_index : async_make_index<N - 1, N - 1, I...> {};
+template<size_t... I>
+struct async_make_index<0, I...> { typedef async_index<I...> type; };
+
+template<typename R>
+struct async_result {
+    template<typename F, typename Tuple, size_t... I>
+    void invoke(F &fn, Tuple &args, async_index<I...>) {
+        value_ = fn(std::get<I>(args)...);
+    }
+    R get() const { return value_; }
+    R value_;
+};
+
+template<>
+struct async_result<void> {
+    template<typename F, typename Tuple, size_t... I>
+    void invoke(F &fn, Tuple &args, async_index<I...>) {
+        fn(std::get<I>(args)...);
+    }
+    void get() const {}
+};
+
+} //namespace detail
+
+/*
+ * async_task - Typed async call
+ *
+ * The function and arguments are stored in task object (No uintptr_t cast
+ * and memory allocation), The task must be valid until it completed.
+ *
+ * Example:
+ *     base::async_task<int (*)(int, int), int, int> task(add, 1, 2);
+ *     task.submit();
+ *     int sum = task.get();
+ */
+template<typename F, typename... Args>
+class async_task {
+public:
+    typedef decltype(std::declval<F &>()(std::declval<Args &>()...)) result_type;
+
+    explicit async_task(F fn, Args... args)
+        : fn_(fn), args_(args...), result_() {
+        async_future_init(&future_, &async_task::invoke, this);
+    }
+    ~async_task() = default;
+    async_task(const async_task &) = delete;
+    async_task &operator=(const async_task &) = delete;
+
+    int submit(bool urgent = false) {
+        return async_future_submit(&future_, urgent);
+    }
+    template<typename Task>
+    int then(Task &next) {
+        return async_future_then(&future_, next.future());
+    }
+    bool done() {
+        return async_future_done(&future_);
+    }
+    bool wait_for(uint32_t ms) {
+        return async_future_timedwait(&future_, ms) == 0;
+    }
+    result_type get() {
+        async_future_wait(&future_);
+        return result_.get();
+    }
+    struct ::async_future *future() {
+        return &future_;
+    }
+
+private:
+    static void invoke(struct ::async_future *f) {
+        async_task *task = static_cast<async_task *>(async_future_arg(f));
+        task->result_.invoke(task->fn_, task->args_,
+            typename detail::async_make_index<sizeof...(Args)>::type());
+    }
+
+private:
+    struct ::async_future future_;
+    F fn_;
+    std::tuple<Args...> args_;
+    detail::async_result<result_type> result_;
+};
+
+} //namespace base
+
+#endif /* BASEWORK_ASYNC_FUTURE_H_ */
@@ -35,9 +35,11 @@
 #include "basework/generic.h"
 #include "basework/os/osapi.h"
 #include "basework/malloc.h"
+#include "basework/bitops.h"
 #include "basework/dev/bcache.h"
 #include "basework/assert.h"
 #include "basework/log.h"
+#include "basework/arch/generic/rte_stdatomic.h"
 
 #define BDBUF_INVALID_DEV NULL
 
@@ -61,12 +63,56 @@
 #define BCACHE_MEMCPY(d, s, n) memcpy(d, s, n)
 #endif
 
+/*
+ * Bcache shards
+ *
+ * The buffer lookup container, LRU/modified/sync lists and waiters are
+ * partitioned into shards, and each shard has its own lock. The shard is
+ * selected by (dd, block >> BCACHE_SHARD_CLUSTER_SHIFT), So the consecutive
+ * blocks of a cluster are always in the same shard (The multi-block transfer
+ * of read-ahead and swapout never cross shards).
+ *
+ * Lock order: shard lock (ascending index) -> cache lock -> nothing
+ */
+#ifdef CONFIG_BCACHE_SHARDS
+#define BCACHE_SHARDS CONFIG_BCACHE_SHARDS
+#else
+#define BCACHE_SHARDS 1
+#endif
+#ifdef CONFIG_BCACHE_SHARD_CLUSTER_SHIFT
+#define BCACHE_SHARD_CLUSTER_SHIFT CONFIG_BCACHE_SHARD_CLUSTER_SHIFT
+#else
+#define BCACHE_SHARD_CLUSTER_SHIFT 4
+#endif
+
+#if (BCACHE_SHARDS & (BCACHE_SHARDS - 1)) != 0
+#error "BCACHE_SHARDS must be power of 2"
+#endif
+
+/*
+ * Replacement queues. The hot queue is the LRU list of shard (The free
+ * buffers are at the head of it)
+ */
+#define BCACHE_QUEUE_HOT  0
+#define BCACHE_QUEUE_COLD 1
+
+/* The number of evicted cold blocks that remembered by 2Q policy */
+#ifdef CONFIG_BCACHE_2Q_GHOSTS
+#define BCACHE_2Q_GHOSTS CONFIG_BCACHE_2Q_GHOSTS
+#else
+#define BCACHE_2Q_GHOSTS 16
+#endif
+
 /*
  * Bcache hashmap 
  */
 #ifdef CONFIG_BCACHE_HASH_MAP
 #ifndef BCACHE_TABLESIZE
-#define BCACHE_TABLESIZE 128
+#if BCACHE_SHARDS <= 8
+#define BCACHE_TABLESIZE (128 / BCACHE_SHARDS)
+#else
+#define BCACHE_TABLESIZE 16
+#endif
 #endif
 #define BCACHE_HASH_MASK (BCACHE_TABLESIZE - 1)
 #define BCACHE_HASH_SHIFT 8
@@ -80,6 +126,24 @@
  */
 #define bdbuf_config bcache_configuration
 
+/**
+ * The ring of io_depth requests. The requests are submitted to the driver
+ * without waiting, And the oldest one is completed only when all slots are
+ * in flight. It is used by the swapout transfers and the read-ahead task.
+ */
+struct bcache_io_ring {
+	uint32_t head;     /* The oldest request in flight */
+	uint32_t inflight; /* The number of requests in flight */
+	size_t slot_size;
+	char *slots;
+};
+
+struct bcache_io_slot {
+	os_completion_t done;
+	struct bcache_device *dd;
+	struct bcache_request req; /* The sg buffers follow */
+};
+
 /**
  * A swapout transfer transaction data. This data is passed to a worked thread
  * to handle the write phase of the transfer.
@@ -88,7 +152,7 @@ struct bcache_swapout_transfer {
 	struct rte_list bds;
 	struct bcache_device *dd;
 	bool syncing;
-	struct bcache_request write_req;
+	struct bcache_io_ring ring; /* The write requests in flight */
 };
 
 /**
@@ -117,6 +181,54 @@ struct bcache_devnode {
 	struct rte_list link;
 };
 
+struct bcache_ghost {
+	const struct bcache_device *dd;
+	bcache_num_t block;
+};
+
+/**
+ * The writer throttled by the dirty ratio of shard.
+ */
+struct bcache_dirty_waiter {
+	struct rte_list link;
+	os_completion_t done;
+};
+
+/**
+ * The shard of buffer cache. The buffers of a shard are never moved to
+ * other shards.
+ */
+struct bcache_shard {
+	os_mutex_t lock;
+	union bcache_tree {
+		struct bcache_buffer *tree;
+#ifdef CONFIG_BCACHE_HASH_MAP
+		struct rte_hlist hashq[BCACHE_TABLESIZE];
+#endif
+	} root;
+
+	struct rte_list lru;
+	struct rte_list modified;
+	struct rte_list sync;
+	struct bcache_waiters access_waiters;
+	struct bcache_waiters transfer_waiters;
+	struct bcache_waiters buffer_waiters;
+
+	/* 2Q policy (nr_cold and cold_max are in units of buffer_min) */
+	struct rte_list cold;
+	size_t nr_cold;
+	size_t cold_max;
+	unsigned int ghost_pos;
+	struct bcache_ghost ghosts[BCACHE_2Q_GHOSTS];
+
+	/* Dirty ratio (in units of buffer_min) */
+	size_t nr_units;
+	size_t nr_dirty;
+	size_t dirty_low;
+	size_t dirty_high;
+	struct rte_list dirty_waiters; /* struct bcache_dirty_waiter */
+} __rte_cache_aligned;
+
 /**
  * The BD buffer cache.
  */
@@ -130,24 +242,17 @@ struct bcache_cache {
 	size_t buffer_min_count;
 	size_t max_bds_per_group;
 	uint32_t flags;
-	os_mutex_t lock;
+	os_mutex_t lock; /* Protect sync state, workers, read-ahead and devices */
 	os_mutex_t sync_lock;
 	bool sync_active;
 	os_completion_t *sync_requester;
 	struct bcache_device *sync_device;
-	union bcache_tree {
-		struct bcache_buffer *tree;
-#ifdef CONFIG_BCACHE_HASH_MAP
-		struct rte_hlist hashq[BCACHE_TABLESIZE];
-#endif
-	} root;
 
-	struct rte_list lru;
-	struct rte_list modified;
-	struct rte_list sync;
-	struct bcache_waiters access_waiters;
-	struct bcache_waiters transfer_waiters;
-	struct bcache_waiters buffer_waiters;
+	struct bcache_shard shards[BCACHE_SHARDS];
+	uint32_t shard_mask;
+	size_t groups_per_shard;
+	int policy;
+	uint32_t io_depth;
 	struct bcache_swapout_transfer *swapout_transfer;
 	struct bcache_swapout_worker *swapout_workers;
 	size_t group_count;
@@ -157,6 +262,7 @@ struct bcache_cache {
 	os_thread_t *read_ahead_task;
 	os_completion_t read_ahead;
 	struct rte_list read_ahead_chain;
+	struct bcache_io_ring read_ahead_ring;
 	bool read_ahead_enabled;
 #endif
 
@@ -200,8 +306,8 @@ typedef enum {
 	bcache_hash_insert((_root), (_buf))
 #define bcache_container_remove(_root, _buf) \
 	bcache_hash_remove((_root), (_buf))
-#define bcache_container_gather_for_purge(_list, _dd) \
-	bcache_hash_gather_for_purge((_list), (_dd))
+#define bcache_container_gather_for_purge(_shard, _list, _dd) \
+	bcache_hash_gather_for_purge((_shard), (_list), (_dd))
 
 #else /* !CONFIG_BCACHE_HASH_MAP */
 #define bcache_container_search(_root, _dd, _block) \
@@ -210,8 +316,8 @@ typedef enum {
 	bcache_avl_insert((_root), (_buf))
 #define bcache_container_remove(_root, _buf) \
 	bcache_avl_remove((_root), (_buf))
-#define bcache_container_gather_for_purge(_list, _dd)                                    \
-	bcache_avl_gather_for_purge((_list), (_dd))
+#define bcache_container_gather_for_purge(_shard, _list, _dd) \
+	bcache_avl_gather_for_purge((_shard), (_list), (_dd))
 #endif /* CONFIG_BCACHE_HASH_MAP */
 
 #ifdef CONFIG_BCACHE_READ_AHEAD
@@ -286,6 +392,16 @@ void bcache_show_users(const char *where, struct bcache_buffer *bd) {
 #define BCACHE_MINIMUM_STACK_SIZE 1024
 #endif
 
+/* The longest pause of a writer that exceeds the high dirty ratio (ms) */
+#ifndef BCACHE_DIRTY_PAUSE_MAX
+#define BCACHE_DIRTY_PAUSE_MAX 100
+#endif
+
+/* The failed writebacks of a buffer before its modified data is dropped */
+#ifndef BCACHE_WRITE_RETRIES
+#define BCACHE_WRITE_RETRIES 3
+#endif
+
 /**
  * The default maximum height of 32 allows for AVL trees having between
  * 5,704,880 and 4,294,967,295 nodes, depending on order of insertion.  You may
@@ -303,6 +419,19 @@ void bcache_show_users(const char *where, struct bcache_buffer *bd) {
 #define bcache_unlock_cache() bcache_unlock(&bdbuf_cache.lock)
 #define bcache_lock_sync()    bcache_lock(&bdbuf_cache.sync_lock)
 #define bcache_unlock_sync()  bcache_unlock(&bdbuf_cache.sync_lock)
+#define bcache_lock_shard(shard)   bcache_lock(&(shard)->lock)
+#define bcache_unlock_shard(shard) bcache_unlock(&(shard)->lock)
+
+/*
+ * The statistics of device may be updated from different shards
+ */
+#if BCACHE_SHARDS > 1
+#define BCACHE_STAT_ADD(dd, field, n) \
+	rte_atomic_fetch_add_explicit(&(dd)->stats.field, n, rte_memory_order_relaxed)
+#else
+#define BCACHE_STAT_ADD(dd, field, n) (dd)->stats.field += (n)
+#endif
+#define BCACHE_STAT_INC(dd, field) BCACHE_STAT_ADD(dd, field, 1)
 
 #define bcache_fatal(err) rte_assert0((err) == 0)
 
@@ -376,6 +505,38 @@ bcache_group_release(struct bcache_buffer *bd) {
 	--bd->group->users;
 }
 
+static __rte_always_inline struct bcache_shard *
+bcache_shard_of(const struct bcache_device *dd, bcache_num_t block) {
+#if BCACHE_SHARDS > 1
+	uint32_t key = (uint32_t)((uintptr_t)dd >> 4) ^ 
+		(block >> BCACHE_SHARD_CLUSTER_SHIFT);
+
+	key ^= key >> 16;
+	key *= 0x45d9f3bu;
+	key ^= key >> 16;
+	return &bdbuf_cache.shards[key & bdbuf_cache.shard_mask];
+#else
+	(void) dd;
+	(void) block;
+	return &bdbuf_cache.shards[0];
+#endif
+}
+
+static __rte_always_inline struct bcache_shard *
+bcache_bd_shard(const struct bcache_buffer *bd) {
+#if BCACHE_SHARDS > 1
+	size_t idx = (size_t)(bd->group - bdbuf_cache.groups) / 
+		bdbuf_cache.groups_per_shard;
+
+	if (idx > bdbuf_cache.shard_mask)
+		idx = bdbuf_cache.shard_mask;
+	return &bdbuf_cache.shards[idx];
+#else
+	(void) bd;
+	return &bdbuf_cache.shards[0];
+#endif
+}
+
 static void 
 bcache_fatal_with_state(bcache_buf_state state, bcache_ecode error) {
 	pr_err("bcache crash state(%d) error(%d)\n", state, error);
@@ -847,20 +1008,22 @@ bcache_media_block(const struct bcache_device *dd, bcache_num_t block) {
 #endif /* CONFIG_BCACHE_BLOCK_POWEROF2_MEDIA_SIZE */
 
 static void 
-bcache_anonymous_wait(struct bcache_waiters *waiters) {
+bcache_anonymous_wait(struct bcache_shard *shard, 
+	struct bcache_waiters *waiters) {
 	/*
 	 * Indicate we are waiting.
 	 */
 	++waiters->count;
-	os_cv_wait(&waiters->cond_var, &bdbuf_cache.lock);
+	os_cv_wait(&waiters->cond_var, &shard->lock);
 	--waiters->count;
 }
 
 static void 
-bcache_wait(struct bcache_buffer *bd, struct bcache_waiters *waiters) {
+bcache_wait(struct bcache_shard *shard, struct bcache_buffer *bd, 
+	struct bcache_waiters *waiters) {
 	bcache_group_obtain(bd);
 	++bd->waiters;
-	bcache_anonymous_wait(waiters);
+	bcache_anonymous_wait(shard, waiters);
 	--bd->waiters;
 	bcache_group_release(bd);
 }
@@ -881,34 +1044,195 @@ bcache_wake_swapper(void) {
 }
 
 static __rte_always_inline bool 
-bcache_has_buffer_waiters(void) {
-	return bdbuf_cache.buffer_waiters.count;
+bcache_has_buffer_waiters(struct bcache_shard *shard) {
+	return shard->buffer_waiters.count;
 }
 
 static void 
-bcache_remove_from_tree(struct bcache_buffer *bd) {
-	if (bcache_container_remove(&bdbuf_cache.root, bd) != 0)
+bcache_remove_from_tree(struct bcache_shard *shard, struct bcache_buffer *bd) {
+	if (bcache_container_remove(&shard->root, bd) != 0)
 		bcache_fatal_with_state(bd->state, BCACHE_FATAL_TREE_RM);
 }
 
+static __rte_always_inline size_t 
+bcache_bd_units(const struct bcache_buffer *bd) {
+	return bdbuf_cache.max_bds_per_group / bd->group->bds_per_group;
+}
+
+/*
+ * The dirty buffers are the modified buffers that have not been taken by
+ * swapout. The buffers of a shard are only used by the blocks of it, So the
+ * dirty buffers are counted and limited for each shard.
+ */
+static __rte_always_inline bool 
+bcache_set_dirty(struct bcache_shard *shard, struct bcache_buffer *bd) {
+	if (bd->dirty)
+		return false;
+	bd->dirty = true;
+	shard->nr_dirty += bcache_bd_units(bd);
+	return true;
+}
+
+static __rte_always_inline void 
+bcache_clear_dirty(struct bcache_shard *shard, struct bcache_buffer *bd) {
+	if (bd->dirty) {
+		bd->dirty = false;
+		shard->nr_dirty -= bcache_bd_units(bd);
+	}
+}
+
+/*
+ * Returns the number of units that the background writeback should take.
+ * Once the dirty buffers exceed the low mark they are written back until
+ * half of the low mark is left, So the swapout is not woken for each buffer.
+ */
+static __rte_always_inline size_t 
+bcache_writeback_units(const struct bcache_shard *shard) {
+	if (shard->dirty_low == 0 || shard->nr_dirty <= shard->dirty_low)
+		return 0;
+	return shard->nr_dirty - shard->dirty_low / 2;
+}
+
+/*
+ * Returns the pause of the writer that dirtied a buffer (ms). The writer is
+ * paused if the dirty buffers exceed the high mark (Like balance_dirty_pages()
+ * of Linux) in proportion to the excess.
+ */
+static __rte_always_inline uint32_t 
+bcache_dirty_pause(const struct bcache_shard *shard) {
+	if (shard->dirty_high == 0 || shard->nr_dirty <= shard->dirty_high)
+		return 0;
+	return (uint32_t)(BCACHE_DIRTY_PAUSE_MAX * (shard->nr_dirty - shard->dirty_high) /
+		(shard->nr_units - shard->dirty_high + 1)) + 1;
+}
+
+/*
+ * The writer is queued on the shard before the shard is unlocked, So the
+ * writeback that completes in the meantime does not miss it.
+ */
+static __rte_always_inline void 
+bcache_add_dirty_waiter(struct bcache_shard *shard, 
+	struct bcache_dirty_waiter *waiter) {
+	os_completion_reinit(&waiter->done);
+	rte_list_add_tail(&waiter->link, &shard->dirty_waiters);
+}
+
+/*
+ * The pause ends early if the writeback brings the dirty buffers back below
+ * the high mark. The waiter is removed from the shard by the waker in that
+ * case, Otherwise it is removed here.
+ */
+static void 
+bcache_balance_dirty(struct bcache_shard *shard, struct bcache_device *dd, 
+	struct bcache_dirty_waiter *waiter, uint32_t pause) {
+	bcache_wake_swapper();
+	os_completion_timedwait(&waiter->done, pause);
+
+	bcache_lock_shard(shard);
+	if (!rte_list_empty(&waiter->link))
+		rte_list_del(&waiter->link);
+	bcache_unlock_shard(shard);
+
+	rte_atomic_fetch_add_explicit(&dd->stats.write_throttles, 1, 
+		rte_memory_order_relaxed);
+	rte_atomic_fetch_add_explicit(&dd->stats.write_throttle_ms, pause, 
+		rte_memory_order_relaxed);
+}
+
+/*
+ * Wake all the writers throttled by the shard. It is called with shard locked.
+ */
+static void 
+bcache_wake_dirty_waiters(struct bcache_shard *shard) {
+	if (shard->dirty_high != 0 && shard->nr_dirty > shard->dirty_high)
+		return;
+
+	while (!rte_list_empty(&shard->dirty_waiters)) {
+		struct bcache_dirty_waiter *waiter = rte_container_of(
+			shard->dirty_waiters.next, struct bcache_dirty_waiter, link);
+
+		rte_list_del_init(&waiter->link);
+		os_completed(&waiter->done);
+	}
+}
+
+static bool 
+bcache_dirty_ratio_valid(uint32_t low, uint32_t high) {
+	if (low > 100 || high > 100)
+		return false;
+	return low == 0 || high == 0 || low <= high;
+}
+
+/*
+ * The shards should be locked if the cache is running
+ */
+static void 
+bcache_set_dirty_limits(uint32_t low, uint32_t high) {
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++) {
+		struct bcache_shard *shard = &bdbuf_cache.shards[i];
+
+		shard->dirty_low = shard->nr_units * low / 100;
+		shard->dirty_high = shard->nr_units * high / 100;
+	}
+}
+
+/*
+ * Remove the buffer from the hot or cold queue
+ */
+static __rte_always_inline void 
+bcache_lru_remove(struct bcache_shard *shard, struct bcache_buffer *bd) {
+	if (bd->queue == BCACHE_QUEUE_COLD) {
+		shard->nr_cold -= bcache_bd_units(bd);
+		bd->queue = BCACHE_QUEUE_HOT;
+	}
+	rte_list_del(&bd->link);
+}
+
+static void 
+bcache_ghost_add(struct bcache_shard *shard, const struct bcache_buffer *bd) {
+	struct bcache_ghost *ghost = &shard->ghosts[shard->ghost_pos];
+
+	ghost->dd = bd->dd;
+	ghost->block = bd->block;
+	if (++shard->ghost_pos == BCACHE_2Q_GHOSTS)
+		shard->ghost_pos = 0;
+}
+
+static bool 
+bcache_ghost_take(struct bcache_shard *shard, const struct bcache_device *dd,
+	bcache_num_t block) {
+	for (int i = 0; i < BCACHE_2Q_GHOSTS; i++) {
+		struct bcache_ghost *ghost = &shard->ghosts[i];
+
+		if (ghost->dd == dd && ghost->block == block) {
+			ghost->dd = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
 static void 
-bcache_remove_from_tree_and_lru_list(struct bcache_buffer *bd) {
+bcache_remove_from_tree_and_lru_list(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
 	switch (bd->state) {
 	case BCACHE_STATE_FREE:
 		break;
 	case BCACHE_STATE_CACHED:
-		bcache_remove_from_tree(bd);
+		bcache_remove_from_tree(shard, bd);
 		break;
 	default:
 		bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_10);
 	}
-	rte_list_del(&bd->link);
+	bcache_lru_remove(shard, bd);
 }
 
 static void 
-bcache_make_free_and_add_to_lru_list(struct bcache_buffer *bd) {
+bcache_make_free_and_add_to_lru_list(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
 	bcache_set_state(bd, BCACHE_STATE_FREE);
-	rte_list_add(&bd->link, &bdbuf_cache.lru);
+	bd->referenced = false;
+	rte_list_add(&bd->link, &shard->lru);
 }
 
 static __rte_always_inline void 
@@ -917,31 +1241,55 @@ bcache_make_empty(struct bcache_buffer *bd) {
 }
 
 static void 
-bcache_make_cached_and_add_to_lru_list(struct bcache_buffer *bd) {
+bcache_make_cached_and_add_to_lru_list(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
 	bcache_set_state(bd, BCACHE_STATE_CACHED);
-	rte_list_add_tail(&bd->link, &bdbuf_cache.lru);
+
+	/* The 2Q policy keeps the buffer in cold queue until it is referenced again */
+	if (bdbuf_cache.policy == BCACHE_POLICY_2Q && !bd->referenced) {
+		bd->queue = BCACHE_QUEUE_COLD;
+		shard->nr_cold += bcache_bd_units(bd);
+		rte_list_add_tail(&bd->link, &shard->cold);
+	} else {
+		rte_list_add_tail(&bd->link, &shard->lru);
+	}
 }
 
-static void bcache_discard_buffer(struct bcache_buffer *bd) {
+static void bcache_discard_buffer(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
+	bcache_clear_dirty(shard, bd);
+	bd->write_retries = 0;
 	bcache_make_empty(bd);
 	if (bd->waiters == 0) {
-		bcache_remove_from_tree(bd);
-		bcache_make_free_and_add_to_lru_list(bd);
+		bcache_remove_from_tree(shard, bd);
+		bcache_make_free_and_add_to_lru_list(shard, bd);
 	}
 }
 
-static void 
-bcache_add_to_modified_list_after_access(struct bcache_buffer *bd) {
-	if (bdbuf_cache.sync_active && 
-		bdbuf_cache.sync_device == bd->dd) {
-		bcache_unlock_cache();
+static bool 
+bcache_is_sync_device(const struct bcache_device *dd) {
+	bool sync;
+
+	bcache_lock_cache();
+	sync = bdbuf_cache.sync_active && bdbuf_cache.sync_device == dd;
+	bcache_unlock_cache();
+	return sync;
+}
+
+static bool 
+bcache_add_to_modified_list_after_access(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
+	bool dirtied;
+
+	if (bcache_is_sync_device(bd->dd)) {
+		bcache_unlock_shard(shard);
 
 		/*
 		 * Wait for the sync lock.
 		 */
 		bcache_lock_sync();
 		bcache_unlock_sync();
-		bcache_lock_cache();
+		bcache_lock_shard(shard);
 	}
 
 	/*
@@ -960,22 +1308,27 @@ bcache_add_to_modified_list_after_access(struct bcache_buffer *bd) {
 		bd->hold_timer = bdbuf_config.swap_block_hold;
 
 	bcache_set_state(bd, BCACHE_STATE_MODIFIED);
-	rte_list_add_tail(&bd->link, &bdbuf_cache.modified);
+	rte_list_add_tail(&bd->link, &shard->modified);
+	dirtied = bcache_set_dirty(shard, bd);
 
 	if (bd->waiters)
-		bcache_wake(&bdbuf_cache.access_waiters);
-	else if (bcache_has_buffer_waiters())
+		bcache_wake(&shard->access_waiters);
+	else if (bcache_has_buffer_waiters(shard) || 
+		(dirtied && bcache_writeback_units(shard) > 0))
 		bcache_wake_swapper();
+
+	return dirtied;
 }
 
 static void 
-bcache_add_to_lru_list_after_access(struct bcache_buffer *bd) {
+bcache_add_to_lru_list_after_access(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
 	bcache_group_release(bd);
-	bcache_make_cached_and_add_to_lru_list(bd);
+	bcache_make_cached_and_add_to_lru_list(shard, bd);
 	if (bd->waiters)
-		bcache_wake(&bdbuf_cache.access_waiters);
+		bcache_wake(&shard->access_waiters);
 	else
-		bcache_wake(&bdbuf_cache.buffer_waiters);
+		bcache_wake(&shard->buffer_waiters);
 }
 
 static size_t bcache_bds_per_group(size_t size) {
@@ -994,18 +1347,20 @@ static size_t bcache_bds_per_group(size_t size) {
 	return bdbuf_cache.max_bds_per_group / bds_per_size;
 }
 
-static void bcache_discard_buffer_after_access(struct bcache_buffer *bd) {
+static void bcache_discard_buffer_after_access(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
 	bcache_group_release(bd);
-	bcache_discard_buffer(bd);
+	bcache_discard_buffer(shard, bd);
 
 	if (bd->waiters)
-		bcache_wake(&bdbuf_cache.access_waiters);
+		bcache_wake(&shard->access_waiters);
 	else
-		bcache_wake(&bdbuf_cache.buffer_waiters);
+		bcache_wake(&shard->buffer_waiters);
 }
 
 static struct bcache_buffer *
-bcache_group_realloc(struct bcache_group *group, size_t new_bds_per_group) {
+bcache_group_realloc(struct bcache_shard *shard, struct bcache_group *group, 
+	size_t new_bds_per_group) {
 	struct bcache_buffer *bd;
 	size_t bufs_per_bd;
 	size_t b;
@@ -1015,40 +1370,47 @@ bcache_group_realloc(struct bcache_group *group, size_t new_bds_per_group) {
 
 	bufs_per_bd = bdbuf_cache.max_bds_per_group / group->bds_per_group;
 	for (b = 0, bd = group->bdbuf; b < group->bds_per_group; b++, bd += bufs_per_bd)
-		bcache_remove_from_tree_and_lru_list(bd);
+		bcache_remove_from_tree_and_lru_list(shard, bd);
 
 	group->bds_per_group = new_bds_per_group;
 	bufs_per_bd = bdbuf_cache.max_bds_per_group / new_bds_per_group;
 	for (b = 1, bd = group->bdbuf + bufs_per_bd; b < group->bds_per_group;
 		 b++, bd += bufs_per_bd)
-		bcache_make_free_and_add_to_lru_list(bd);
+		bcache_make_free_and_add_to_lru_list(shard, bd);
 
 	if (b > 1)
-		bcache_wake(&bdbuf_cache.buffer_waiters);
+		bcache_wake(&shard->buffer_waiters);
 
 	return group->bdbuf;
 }
 
 static void 
-bcache_setup_empty_buffer(struct bcache_buffer *bd, struct bcache_device *dd, 
-	bcache_num_t block) {
+bcache_setup_empty_buffer(struct bcache_shard *shard, struct bcache_buffer *bd, 
+	struct bcache_device *dd, bcache_num_t block) {
 	bd->dd = dd;
 	bd->block = block;
 	bd->avl.left = NULL;
 	bd->avl.right = NULL;
 	bd->waiters = 0;
 
-	if (bcache_container_insert(&bdbuf_cache.root, bd) != 0)
+	/* The block evicted from cold queue recently is hot */
+	bd->referenced = bdbuf_cache.policy == BCACHE_POLICY_2Q && 
+		bcache_ghost_take(shard, dd, block);
+	if (bd->referenced)
+		BCACHE_STAT_INC(dd, ghost_hits);
+
+	if (bcache_container_insert(&shard->root, bd) != 0)
 		bcache_fatal(BCACHE_FATAL_RECYCLE);
 
 	bcache_make_empty(bd);
 }
 
 static struct bcache_buffer *
-bcache_get_buffer_from_lru_list(struct bcache_device *dd, bcache_num_t block) {
+bcache_get_buffer_from_list(struct bcache_shard *shard, struct rte_list *list,
+	struct bcache_device *dd, bcache_num_t block) {
 	struct rte_list *pos, *next;
 
-	rte_list_foreach_safe(pos, next, &bdbuf_cache.lru) {
+	rte_list_foreach_safe(pos, next, list) {
 		struct bcache_buffer *bd = rte_container_of(pos, struct bcache_buffer, link);
 		struct bcache_buffer *empty_bd = NULL;
 
@@ -1061,14 +1423,19 @@ bcache_get_buffer_from_lru_list(struct bcache_device *dd, bcache_num_t block) {
 		 */
 		if (bd->waiters == 0) {
 			if (bd->group->bds_per_group == dd->bds_per_group) {
-				bcache_remove_from_tree_and_lru_list(bd);
+				if (bd->state == BCACHE_STATE_CACHED) {
+					BCACHE_STAT_INC(bd->dd, evictions);
+					if (bd->queue == BCACHE_QUEUE_COLD)
+						bcache_ghost_add(shard, bd);
+				}
+				bcache_remove_from_tree_and_lru_list(shard, bd);
 				empty_bd = bd;
 			} else if (bd->group->users == 0)
-				empty_bd = bcache_group_realloc(bd->group, dd->bds_per_group);
+				empty_bd = bcache_group_realloc(shard, bd->group, dd->bds_per_group);
 		}
 
 		if (empty_bd != NULL) {
-			bcache_setup_empty_buffer(empty_bd, dd, block);
+			bcache_setup_empty_buffer(shard, empty_bd, dd, block);
 			return empty_bd;
 		}
 	}
@@ -1076,34 +1443,89 @@ bcache_get_buffer_from_lru_list(struct bcache_device *dd, bcache_num_t block) {
 	return NULL;
 }
 
-static struct bcache_swapout_transfer *
-bcache_swapout_transfer_alloc(void) {
+static struct bcache_buffer *
+bcache_get_buffer_from_lru_list(struct bcache_shard *shard, 
+	struct bcache_device *dd, bcache_num_t block) {
+	struct bcache_buffer *bd;
+
+	if (bdbuf_cache.policy == BCACHE_POLICY_2Q) {
+		bool has_free = !rte_list_empty(&shard->lru) &&
+			((struct bcache_buffer *)shard->lru.next)->state == BCACHE_STATE_FREE;
+
+		/*
+		 * Recycle the free buffers first, And then the cold buffers if the
+		 * cold queue exceeds its share. So the hot buffers are only recycled
+		 * when there are few cold buffers.
+		 */
+		if (!has_free && shard->nr_cold > shard->cold_max) {
+			bd = bcache_get_buffer_from_list(shard, &shard->cold, dd, block);
+			if (bd != NULL)
+				return bd;
+		}
+
+		bd = bcache_get_buffer_from_list(shard, &shard->lru, dd, block);
+		if (bd != NULL)
+			return bd;
+		return bcache_get_buffer_from_list(shard, &shard->cold, dd, block);
+	}
+
+	return bcache_get_buffer_from_list(shard, &shard->lru, dd, block);
+}
+
+static size_t bcache_io_slot_size(uint32_t max_blocks) {
 	/*
 	 * @note chrisj The struct bcache_request and the array at the end is a hack.
 	 * I am disappointment at finding code like this in RTEMS. The request should
 	 * have been a rtems_chain_control. Simple, fast and less storage as the node
 	 * is already part of the buffer structure.
 	 */
-	size_t transfer_size =
-		sizeof(struct bcache_swapout_transfer) +
-		(bdbuf_config.max_write_blocks * sizeof(struct bcache_sg_buffer));
+	return rte_roundup(sizeof(struct bcache_io_slot) +
+		(max_blocks * sizeof(struct bcache_sg_buffer)), 8);
+}
+
+static __rte_always_inline struct bcache_io_slot *
+bcache_io_slot(struct bcache_io_ring *ring, uint32_t idx) {
+	return (struct bcache_io_slot *)(ring->slots + idx * ring->slot_size);
+}
+
+static void 
+bcache_io_ring_init(struct bcache_io_ring *ring, void *slots, 
+	uint32_t max_blocks, uint32_t req) {
+	ring->head = 0;
+	ring->inflight = 0;
+	ring->slot_size = bcache_io_slot_size(max_blocks);
+	ring->slots = slots;
+	for (uint32_t i = 0; i < bdbuf_cache.io_depth; i++) {
+		struct bcache_io_slot *slot = bcache_io_slot(ring, i);
+
+		os_completion_reinit(&slot->done);
+		slot->req.req = req;
+		slot->req.done = bcache_transfer_done;
+		slot->req.io_task = &slot->done;
+	}
+}
+
+static struct bcache_swapout_transfer *
+bcache_swapout_transfer_alloc(void) {
+	size_t transfer_size = 
+		rte_roundup(sizeof(struct bcache_swapout_transfer), 8) +
+		bdbuf_cache.io_depth * bcache_io_slot_size(bdbuf_config.max_write_blocks);
 	return general_calloc(1, transfer_size);
 }
 
 static void 
 bcache_swapout_transfer_init(struct bcache_swapout_transfer *transfer,
-	os_completion_t *completion) {
+	void *io_slots) {
 	RTE_INIT_LIST(&transfer->bds);
 	transfer->dd = BDBUF_INVALID_DEV;
 	transfer->syncing = false;
-	transfer->write_req.req = BCACHE_DEV_REQ_WRITE;
-	transfer->write_req.done = bcache_transfer_done;
-	transfer->write_req.io_task = completion;
+	bcache_io_ring_init(&transfer->ring, io_slots, bdbuf_config.max_write_blocks,
+		BCACHE_DEV_REQ_WRITE);
 }
 
 static size_t bcache_swapout_worker_size(void) {
-	return sizeof(struct bcache_swapout_worker) +
-		   (bdbuf_config.max_write_blocks * sizeof(struct bcache_sg_buffer));
+	return rte_roundup(sizeof(struct bcache_swapout_worker), 8) +
+		bdbuf_cache.io_depth * bcache_io_slot_size(bdbuf_config.max_write_blocks);
 }
 
 static int bcache_swapout_workers_create(void) {
@@ -1123,7 +1545,8 @@ static int bcache_swapout_workers_create(void) {
 		 w++, worker_current += worker_size) {
 		struct bcache_swapout_worker *worker = (struct bcache_swapout_worker *)worker_current;
 		os_completion_reinit(&worker->swapout_sync);
-		bcache_swapout_transfer_init(&worker->transfer, &worker->swapout_sync);
+		bcache_swapout_transfer_init(&worker->transfer, worker_current + 
+			rte_roundup(sizeof(struct bcache_swapout_worker), 8));
 		rte_list_add_tail(&worker->link, &bdbuf_cache.swapout_free_workers);
 		worker->enabled = true;
 		sc = bcache_create_task("swap-worker", bdbuf_config.swapout_worker_priority,
@@ -1156,19 +1579,23 @@ static int bcache_do_init(void) {
 	if ((bdbuf_config.buffer_max % bdbuf_config.buffer_min) != 0)
 		return -EINVAL;
 
-	if (bcache_read_request_size(bdbuf_config.max_read_ahead_blocks) >
-		BCACHE_MINIMUM_STACK_SIZE / 8U)
-		return -EINVAL;
-
 	if ((bdbuf_config.stack_alloc && !bdbuf_config.stack_free) ||
 		(!bdbuf_config.stack_alloc && bdbuf_config.stack_free))
 		return -EINVAL;
 
+	if (bdbuf_config.policy != BCACHE_POLICY_LRU &&
+		bdbuf_config.policy != BCACHE_POLICY_2Q)
+		return -EINVAL;
+
+	if (!bcache_dirty_ratio_valid(bdbuf_config.dirty_ratio_low, 
+		bdbuf_config.dirty_ratio_high))
+		return -EINVAL;
+
+	bdbuf_cache.policy = bdbuf_config.policy;
+	bdbuf_cache.io_depth = bdbuf_config.io_depth? bdbuf_config.io_depth: 1;
+
 	bdbuf_cache.sync_device = NULL;
 	RTE_INIT_LIST(&bdbuf_cache.swapout_free_workers);
-	RTE_INIT_LIST(&bdbuf_cache.lru);
-	RTE_INIT_LIST(&bdbuf_cache.modified);
-	RTE_INIT_LIST(&bdbuf_cache.sync);
 #ifdef CONFIG_BCACHE_READ_AHEAD
 	RTE_INIT_LIST(&bdbuf_cache.read_ahead_chain);
 #endif
@@ -1176,9 +1603,19 @@ static int bcache_do_init(void) {
 
 	os_mtx_init(&bdbuf_cache.lock, 0);
 	os_mtx_init(&bdbuf_cache.sync_lock, 0);
-	os_cv_init(&bdbuf_cache.access_waiters.cond_var, NULL);
-	os_cv_init(&bdbuf_cache.transfer_waiters.cond_var, NULL);
-	os_cv_init(&bdbuf_cache.buffer_waiters.cond_var, NULL);
+	for (b = 0; b < BCACHE_SHARDS; b++) {
+		struct bcache_shard *shard = &bdbuf_cache.shards[b];
+
+		RTE_INIT_LIST(&shard->lru);
+		RTE_INIT_LIST(&shard->modified);
+		RTE_INIT_LIST(&shard->sync);
+		RTE_INIT_LIST(&shard->cold);
+		RTE_INIT_LIST(&shard->dirty_waiters);
+		os_mtx_init(&shard->lock, 0);
+		os_cv_init(&shard->access_waiters.cond_var, NULL);
+		os_cv_init(&shard->transfer_waiters.cond_var, NULL);
+		os_cv_init(&shard->buffer_waiters.cond_var, NULL);
+	}
 
 	bcache_lock_cache();
 
@@ -1190,6 +1627,29 @@ static int bcache_do_init(void) {
 	bdbuf_cache.group_count =
 		bdbuf_cache.buffer_min_count / bdbuf_cache.max_bds_per_group;
 
+	/*
+	 * Each shard has one group at least
+	 */
+	bdbuf_cache.shard_mask = BCACHE_SHARDS - 1;
+	while (bdbuf_cache.shard_mask && 
+		bdbuf_cache.shard_mask >= bdbuf_cache.group_count)
+		bdbuf_cache.shard_mask >>= 1;
+	bdbuf_cache.groups_per_shard = 
+		bdbuf_cache.group_count / (bdbuf_cache.shard_mask + 1);
+	if (bdbuf_cache.groups_per_shard == 0)
+		bdbuf_cache.groups_per_shard = 1;
+
+	/* The last shard takes the remaining groups */
+	for (b = 0; b <= bdbuf_cache.shard_mask; b++) {
+		size_t groups = bdbuf_cache.groups_per_shard;
+
+		if (b == bdbuf_cache.shard_mask)
+			groups = bdbuf_cache.group_count - b * bdbuf_cache.groups_per_shard;
+		bdbuf_cache.shards[b].nr_units = groups * bdbuf_cache.max_bds_per_group;
+	}
+	bcache_set_dirty_limits(bdbuf_config.dirty_ratio_low, 
+		bdbuf_config.dirty_ratio_high);
+
 	/*
 	 * Allocate the memory for the buffer descriptors.
 	 */
@@ -1229,11 +1689,21 @@ static int bcache_do_init(void) {
 		bd->group = group;
 		bd->buffer = buffer;
 
-		rte_list_add_tail(&bd->link, &bdbuf_cache.lru);
+		rte_list_add_tail(&bd->link, &bcache_bd_shard(bd)->lru);
+		bcache_bd_shard(bd)->cold_max++;
 		if ((b % bdbuf_cache.max_bds_per_group) == (bdbuf_cache.max_bds_per_group - 1))
 			group++;
 	}
 
+	/* The cold queue of 2Q policy takes 1/4 of the shard */
+	for (b = 0; b <= bdbuf_cache.shard_mask; b++) {
+		struct bcache_shard *shard = &bdbuf_cache.shards[b];
+
+		shard->cold_max /= 4;
+		if (shard->cold_max == 0)
+			shard->cold_max = 1;
+	}
+
 	for (b = 0, group = bdbuf_cache.groups, bd = bdbuf_cache.bds;
 		 b < bdbuf_cache.group_count; 
 		 b++, group++, bd += bdbuf_cache.max_bds_per_group) {
@@ -1250,7 +1720,8 @@ static int bcache_do_init(void) {
 
 	os_completion_reinit(&bdbuf_cache.swapout_signal);
 	bcache_swapout_transfer_init(bdbuf_cache.swapout_transfer, 
-		&bdbuf_cache.swapout_signal);
+		(char *)bdbuf_cache.swapout_transfer + 
+		rte_roundup(sizeof(struct bcache_swapout_transfer), 8));
 	bdbuf_cache.swapout_enabled = true;
 	sc = bcache_create_task("swap-thread", 
 							bdbuf_config.swapout_priority,
@@ -1268,6 +1739,15 @@ static int bcache_do_init(void) {
 
 #ifdef CONFIG_BCACHE_READ_AHEAD
 	if (bdbuf_config.max_read_ahead_blocks > 0) {
+		void *slots = general_calloc(bdbuf_cache.io_depth, 
+			bcache_io_slot_size(bdbuf_config.max_read_ahead_blocks));
+
+		if (slots == NULL) {
+			sc = -ENOMEM;
+			goto error;
+		}
+		bcache_io_ring_init(&bdbuf_cache.read_ahead_ring, slots,
+			bdbuf_config.max_read_ahead_blocks, BCACHE_DEV_REQ_READ);
 		bdbuf_cache.read_ahead_enabled = true;
 		os_completion_reinit(&bdbuf_cache.read_ahead);
 		sc = bcache_create_task("read-ahead", 
@@ -1286,6 +1766,7 @@ static int bcache_do_init(void) {
 error:
 #ifdef CONFIG_BCACHE_READ_AHEAD
 	bcache_delete_task(bdbuf_cache.read_ahead_task);
+	general_free(bdbuf_cache.read_ahead_ring.slots);
 #endif
 
 	bcache_delete_task(bdbuf_cache.swapout);
@@ -1324,14 +1805,14 @@ int bcache_init(void) {
 }
 
 static __rte_always_inline void 
-bcache_wait_for_access(struct bcache_buffer *bd) {
+bcache_wait_for_access(struct bcache_shard *shard, struct bcache_buffer *bd) {
 	while (true) {
 		switch (bd->state) {
 		case BCACHE_STATE_MODIFIED:
 			bcache_group_release(bd);
 			/* Fall through */
 		case BCACHE_STATE_CACHED:
-			rte_list_del(&bd->link);
+			bcache_lru_remove(shard, bd);
 			/* Fall through */
 		case BCACHE_STATE_EMPTY:
 			return;
@@ -1339,12 +1820,12 @@ bcache_wait_for_access(struct bcache_buffer *bd) {
 		case BCACHE_STATE_ACCESS_EMPTY:
 		case BCACHE_STATE_ACCESS_MODIFIED:
 		case BCACHE_STATE_ACCESS_PURGED:
-			bcache_wait(bd, &bdbuf_cache.access_waiters);
+			bcache_wait(shard, bd, &shard->access_waiters);
 			break;
 		case BCACHE_STATE_SYNC:
 		case BCACHE_STATE_TRANSFER:
 		case BCACHE_STATE_TRANSFER_PURGED:
-			bcache_wait(bd, &bdbuf_cache.transfer_waiters);
+			bcache_wait(shard, bd, &shard->transfer_waiters);
 			break;
 		default:
 			bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_7);
@@ -1353,10 +1834,11 @@ bcache_wait_for_access(struct bcache_buffer *bd) {
 }
 
 static void 
-bcache_request_sync_for_modified_buffer(struct bcache_buffer *bd) {
+bcache_request_sync_for_modified_buffer(struct bcache_shard *shard, 
+	struct bcache_buffer *bd) {
 	bcache_set_state(bd, BCACHE_STATE_SYNC);
 	rte_list_del(&bd->link);
-	rte_list_add_tail(&bd->link, &bdbuf_cache.sync);
+	rte_list_add_tail(&bd->link, &shard->sync);
 	bcache_wake_swapper();
 }
 
@@ -1367,13 +1849,13 @@ bcache_request_sync_for_modified_buffer(struct bcache_buffer *bd) {
  * @retval @c false Buffer is invalid and has to searched again.
  */
 static bool 
-bcache_wait_for_recycle(struct bcache_buffer *bd) {
+bcache_wait_for_recycle(struct bcache_shard *shard, struct bcache_buffer *bd) {
 	while (true) {
 		switch (bd->state) {
 		case BCACHE_STATE_FREE:
 			return true;
 		case BCACHE_STATE_MODIFIED:
-			bcache_request_sync_for_modified_buffer(bd);
+			bcache_request_sync_for_modified_buffer(shard, bd);
 			break;
 		case BCACHE_STATE_CACHED:
 		case BCACHE_STATE_EMPTY:
@@ -1386,19 +1868,19 @@ bcache_wait_for_recycle(struct bcache_buffer *bd) {
 				 * pong with another recycle waiter.  The state of the buffer is
 				 * arbitrary afterwards.
 				 */
-				bcache_anonymous_wait(&bdbuf_cache.buffer_waiters);
+				bcache_anonymous_wait(shard, &shard->buffer_waiters);
 				return false;
 			}
 		case BCACHE_STATE_ACCESS_CACHED:
 		case BCACHE_STATE_ACCESS_EMPTY:
 		case BCACHE_STATE_ACCESS_MODIFIED:
 		case BCACHE_STATE_ACCESS_PURGED:
-			bcache_wait(bd, &bdbuf_cache.access_waiters);
+			bcache_wait(shard, bd, &shard->access_waiters);
 			break;
 		case BCACHE_STATE_SYNC:
 		case BCACHE_STATE_TRANSFER:
 		case BCACHE_STATE_TRANSFER_PURGED:
-			bcache_wait(bd, &bdbuf_cache.transfer_waiters);
+			bcache_wait(shard, bd, &shard->transfer_waiters);
 			break;
 		default:
 			bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_8);
@@ -1407,7 +1889,7 @@ bcache_wait_for_recycle(struct bcache_buffer *bd) {
 }
 
 static void 
-bcache_wait_for_sync_done(struct bcache_buffer *bd) {
+bcache_wait_for_sync_done(struct bcache_shard *shard, struct bcache_buffer *bd) {
 	while (true) {
 		switch (bd->state) {
 		case BCACHE_STATE_CACHED:
@@ -1421,7 +1903,7 @@ bcache_wait_for_sync_done(struct bcache_buffer *bd) {
 		case BCACHE_STATE_SYNC:
 		case BCACHE_STATE_TRANSFER:
 		case BCACHE_STATE_TRANSFER_PURGED:
-			bcache_wait(bd, &bdbuf_cache.transfer_waiters);
+			bcache_wait(shard, bd, &shard->transfer_waiters);
 			break;
 		default:
 			bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_9);
@@ -1430,22 +1912,23 @@ bcache_wait_for_sync_done(struct bcache_buffer *bd) {
 }
 
 static __rte_always_inline void 
-bcache_wait_for_buffer(void) {
-	if (!rte_list_empty(&bdbuf_cache.modified))
+bcache_wait_for_buffer(struct bcache_shard *shard) {
+	if (!rte_list_empty(&shard->modified))
 		bcache_wake_swapper();
 
-	bcache_anonymous_wait(&bdbuf_cache.buffer_waiters);
+	bcache_anonymous_wait(shard, &shard->buffer_waiters);
 }
 
 static void 
-bcache_sync_after_access(struct bcache_buffer *bd) {
+bcache_sync_after_access(struct bcache_shard *shard, struct bcache_buffer *bd) {
 	bcache_set_state(bd, BCACHE_STATE_SYNC);
-	rte_list_add_tail(&bd->link, &bdbuf_cache.sync);
+	rte_list_add_tail(&bd->link, &shard->sync);
+	bcache_set_dirty(shard, bd);
 	if (bd->waiters)
-		bcache_wake(&bdbuf_cache.access_waiters);
+		bcache_wake(&shard->access_waiters);
 
 	bcache_wake_swapper();
-	bcache_wait_for_sync_done(bd);
+	bcache_wait_for_sync_done(shard, bd);
 
 	/*
 	 * We may have created a cached or empty buffer which may be recycled.
@@ -1453,20 +1936,21 @@ bcache_sync_after_access(struct bcache_buffer *bd) {
 	if (bd->waiters == 0 &&
 		(bd->state == BCACHE_STATE_CACHED || bd->state == BCACHE_STATE_EMPTY)) {
 		if (bd->state == BCACHE_STATE_EMPTY) {
-			bcache_remove_from_tree(bd);
-			bcache_make_free_and_add_to_lru_list(bd);
+			bcache_remove_from_tree(shard, bd);
+			bcache_make_free_and_add_to_lru_list(shard, bd);
 		}
-		bcache_wake(&bdbuf_cache.buffer_waiters);
+		bcache_wake(&shard->buffer_waiters);
 	}
 }
 
 static struct bcache_buffer *
-bcache_get_buffer_for_read_ahead(struct bcache_device *dd, bcache_num_t block) {
+bcache_get_buffer_for_read_ahead(struct bcache_shard *shard, 
+	struct bcache_device *dd, bcache_num_t block) {
 	struct bcache_buffer *bd = NULL;
 
-	bd = bcache_container_search(&bdbuf_cache.root, dd, block);
+	bd = bcache_container_search(&shard->root, dd, block);
 	if (bd == NULL) {
-		bd = bcache_get_buffer_from_lru_list(dd, block);
+		bd = bcache_get_buffer_from_lru_list(shard, dd, block);
 		if (bd != NULL)
 			bcache_group_obtain(bd);
 	} else
@@ -1480,28 +1964,35 @@ bcache_get_buffer_for_read_ahead(struct bcache_device *dd, bcache_num_t block) {
 }
 
 static struct bcache_buffer *
-bcache_get_buffer_for_access(struct bcache_device *dd, bcache_num_t block) {
+bcache_get_buffer_for_access(struct bcache_shard *shard, 
+	struct bcache_device *dd, bcache_num_t block) {
 	struct bcache_buffer *bd = NULL;
 
 	do {
-		bd = bcache_container_search(&bdbuf_cache.root, dd, block);
+		bd = bcache_container_search(&shard->root, dd, block);
 		if (bd != NULL) {
 			if (bd->group->bds_per_group != dd->bds_per_group) {
-				if (bcache_wait_for_recycle(bd)) {
-					bcache_remove_from_tree_and_lru_list(bd);
-					bcache_make_free_and_add_to_lru_list(bd);
-					bcache_wake(&bdbuf_cache.buffer_waiters);
+				if (bcache_wait_for_recycle(shard, bd)) {
+					bcache_remove_from_tree_and_lru_list(shard, bd);
+					bcache_make_free_and_add_to_lru_list(shard, bd);
+					bcache_wake(&shard->buffer_waiters);
 				}
 				bd = NULL;
+			} else if (bd->referenced) {
+				BCACHE_STAT_INC(dd, hot_hits);
+			} else {
+				/* Promote to hot queue when it is released */
+				BCACHE_STAT_INC(dd, cold_hits);
+				bd->referenced = true;
 			}
 		} else {
-			bd = bcache_get_buffer_from_lru_list(dd, block);
+			bd = bcache_get_buffer_from_lru_list(shard, dd, block);
 			if (bd == NULL)
-				bcache_wait_for_buffer();
+				bcache_wait_for_buffer(shard);
 		}
 	} while (bd == NULL);
 
-	bcache_wait_for_access(bd);
+	bcache_wait_for_access(shard, bd);
 	bcache_group_obtain(bd);
 	return bd;
 }
@@ -1530,10 +2021,9 @@ bcache_get(struct bcache_device *dd, bcache_num_t block,
 	struct bcache_buffer **bd_ptr) {
 	int sc = 0;
 	struct bcache_buffer *bd = NULL;
+	struct bcache_shard *shard;
 	bcache_num_t media_block;
 
-	bcache_lock_cache();
-
 	sc = bcache_get_media_block(dd, block, &media_block);
 	if (rte_likely(sc == 0)) {
 		/*
@@ -1542,7 +2032,9 @@ bcache_get(struct bcache_device *dd, bcache_num_t block,
 		pr_dbg("bdbuf:get: %" PRIu32 " (%" PRIu32 ") (dev = %08x)\n", media_block,
 				block, (unsigned)dd->dev);
 
-		bd = bcache_get_buffer_for_access(dd, media_block);
+		shard = bcache_shard_of(dd, media_block);
+		bcache_lock_shard(shard);
+		bd = bcache_get_buffer_for_access(shard, dd, media_block);
 
 		switch (bd->state) {
 		case BCACHE_STATE_CACHED:
@@ -1570,10 +2062,9 @@ bcache_get(struct bcache_device *dd, bcache_num_t block,
 		bcache_show_users("get", bd);
 		bcache_show_usage();
 #endif
+		bcache_unlock_shard(shard);
 	}
 
-	bcache_unlock_cache();
-
 	*bd_ptr = bd;
 
 	return sc;
@@ -1585,37 +2076,48 @@ bcache_transfer_done(struct bcache_request *req, int status) {
 	os_completed(req->io_task);
 }
 
+/*
+ * The failed writeback returns the buffer to the modified list (The group
+ * stays in use), And it is dirty again so the writers are throttled until
+ * it is written.
+ */
+static void 
+bcache_retry_writeback(struct bcache_shard *shard, struct bcache_buffer *bd) {
+	bd->write_retries++;
+	bd->hold_timer = bdbuf_config.swap_block_hold;
+	bcache_set_state(bd, BCACHE_STATE_MODIFIED);
+	rte_list_add_tail(&bd->link, &shard->modified);
+	bcache_set_dirty(shard, bd);
+}
+
+/*
+ * Wait for the completion of submitted request and update the state of
+ * buffers. The shard is locked when it returns.
+ */
 static int 
-bcache_execute_transfer_request(struct bcache_device *dd, 
-	struct bcache_request *req, bool cache_locked) {
+bcache_complete_transfer_request(struct bcache_shard *shard, 
+	struct bcache_device *dd, struct bcache_request *req) {
 	int sc = 0;
 	uint32_t transfer_index = 0;
 	bool wake_transfer_waiters = false;
 	bool wake_buffer_waiters = false;
 
-	if (cache_locked)
-		bcache_unlock_cache();
-
-	/* The return value will be ignored for transfer requests */
-	dd->ioctl(dd->phys_dev, BCACHE_IO_REQUEST, req);
-
 	/* Wait for transfer request completion */
 	os_completion_wait(req->io_task);
 	sc = req->status;
 
-	bcache_lock_cache();
+	bcache_lock_shard(shard);
 
-	/* Statistics */
 	/* Statistics */
 	if (req->req == BCACHE_DEV_REQ_READ) {
-		dd->stats.read_blocks += req->bufnum;
+		BCACHE_STAT_ADD(dd, read_blocks, req->bufnum);
 		if (sc != 0)
-			++dd->stats.read_errors;
+			BCACHE_STAT_INC(dd, read_errors);
 	} else {
-		dd->stats.write_blocks += req->bufnum;
-		++dd->stats.write_transfers;
+		BCACHE_STAT_ADD(dd, write_blocks, req->bufnum);
+		BCACHE_STAT_INC(dd, write_transfers);
 		if (sc != 0)
-			++dd->stats.write_errors;
+			BCACHE_STAT_INC(dd, write_errors);
 	}
 
 	for (transfer_index = 0; transfer_index < req->bufnum; ++transfer_index) {
@@ -1627,12 +2129,21 @@ bcache_execute_transfer_request(struct bcache_device *dd,
 		else
 			wake_buffer_waiters = true;
 
+		if (sc != 0 && req->req != BCACHE_DEV_REQ_READ &&
+			bd->state == BCACHE_STATE_TRANSFER &&
+			bd->write_retries < BCACHE_WRITE_RETRIES) {
+			bcache_retry_writeback(shard, bd);
+			continue;
+		}
+
 		bcache_group_release(bd);
 
-		if (sc == 0 && bd->state == BCACHE_STATE_TRANSFER)
-			bcache_make_cached_and_add_to_lru_list(bd);
-		else
-			bcache_discard_buffer(bd);
+		if (sc == 0 && bd->state == BCACHE_STATE_TRANSFER) {
+			bd->write_retries = 0;
+			bcache_make_cached_and_add_to_lru_list(shard, bd);
+		} else {
+			bcache_discard_buffer(shard, bd);
+		}
 
 #if (BCACHE_TRACE)
 		bcache_show_users("transfer", bd);
@@ -1640,44 +2151,49 @@ bcache_execute_transfer_request(struct bcache_device *dd,
 	}
 
 	if (wake_transfer_waiters)
-		bcache_wake(&bdbuf_cache.transfer_waiters);
+		bcache_wake(&shard->transfer_waiters);
 
 	if (wake_buffer_waiters)
-		bcache_wake(&bdbuf_cache.buffer_waiters);
+		bcache_wake(&shard->buffer_waiters);
 
-	if (!cache_locked)
-		bcache_unlock_cache();
+	if (req->req != BCACHE_DEV_REQ_READ)
+		bcache_wake_dirty_waiters(shard);
 
 	return sc;
 }
 
 static int 
-bcache_execute_read_request(struct bcache_device *dd,
-	struct bcache_buffer *bd, uint32_t transfer_count) {
-	struct bcache_request *req = NULL;
-	bcache_num_t media_block = bd->block;
-	uint32_t media_blocks_per_block = dd->media_blocks_per_block;
-	uint32_t block_size = dd->block_size;
-	uint32_t transfer_index = 1;
-	os_completion_t done;
+bcache_execute_transfer_request(struct bcache_device *dd, 
+	struct bcache_request *req, bool cache_locked) {
+	/* All buffers of request are in the same shard */
+	struct bcache_shard *shard = 
+		bcache_bd_shard((struct bcache_buffer *)req->bufs[0].user);
+	int sc;
 
-	/*
-	 * TODO: This type of request structure is wrong and should be removed.
-	 */
-#if defined(__GNUC__) || defined(__clang__)
-#define bdbuf_alloc(size) __builtin_alloca(size)
-#else
-	char buffer[4096];
-#define bdbuf_alloc(size) (void *)buffer
-	rte_assert(bcache_read_request_size(transfer_count) <= sizeof(buffer));
-#endif
+	if (cache_locked)
+		bcache_unlock_shard(shard);
 
-	os_completion_reinit(&done);
-	req = bdbuf_alloc(bcache_read_request_size(transfer_count));
-	req->req = BCACHE_DEV_REQ_READ;
-	req->done = bcache_transfer_done;
-	req->io_task = &done;
-	req->bufnum = 0;
+	/* The return value will be ignored for transfer requests */
+	dd->ioctl(dd->phys_dev, BCACHE_IO_REQUEST, req);
+
+	sc = bcache_complete_transfer_request(shard, dd, req);
+	if (!cache_locked)
+		bcache_unlock_shard(shard);
+
+	return sc;
+}
+
+/*
+ * Fill the read request with the buffer and the following empty buffers of
+ * the shard (Up to transfer_count). It is called with shard locked.
+ */
+static void 
+bcache_fill_read_request(struct bcache_shard *shard, struct bcache_device *dd,
+	struct bcache_buffer *bd, struct bcache_request *req, uint32_t transfer_count) {
+	bcache_num_t media_block = bd->block;
+	uint32_t media_blocks_per_block = dd->media_blocks_per_block;
+	uint32_t block_size = dd->block_size;
+	uint32_t transfer_index = 1;
 
 	bcache_set_state(bd, BCACHE_STATE_TRANSFER);
 
@@ -1693,7 +2209,11 @@ bcache_execute_read_request(struct bcache_device *dd,
 	while (transfer_index < transfer_count) {
 		media_block += media_blocks_per_block;
 
-		bd = bcache_get_buffer_for_read_ahead(dd, media_block);
+		/* The request is limited to the cluster of shard */
+		if (bcache_shard_of(dd, media_block) != shard)
+			break;
+
+		bd = bcache_get_buffer_for_read_ahead(shard, dd, media_block);
 		if (bd == NULL)
 			break;
 
@@ -1710,51 +2230,219 @@ bcache_execute_read_request(struct bcache_device *dd,
 	}
 
 	req->bufnum = transfer_index;
+}
+
+static int 
+bcache_execute_read_request(struct bcache_shard *shard, struct bcache_device *dd,
+	struct bcache_buffer *bd, uint32_t transfer_count) {
+	struct bcache_request *req = NULL;
+	os_completion_t done;
+
+	/*
+	 * TODO: This type of request structure is wrong and should be removed.
+	 */
+#if defined(__GNUC__) || defined(__clang__)
+#define bdbuf_alloc(size) __builtin_alloca(size)
+#else
+	char buffer[4096];
+#define bdbuf_alloc(size) (void *)buffer
+	rte_assert(bcache_read_request_size(transfer_count) <= sizeof(buffer));
+#endif
+
+	os_completion_reinit(&done);
+	req = bdbuf_alloc(bcache_read_request_size(transfer_count));
+	req->req = BCACHE_DEV_REQ_READ;
+	req->done = bcache_transfer_done;
+	req->io_task = &done;
+	req->bufnum = 0;
+
+	bcache_fill_read_request(shard, dd, bd, req, transfer_count);
 	return bcache_execute_transfer_request(dd, req, true);
 }
 
 #ifdef CONFIG_BCACHE_READ_AHEAD
+/*
+ * Read-ahead stream detector
+ *
+ * Each device tracks a few sequential streams (e.g. files that read in
+ * parallel). A miss that continues a stream arms its trigger, and a read-ahead
+ * request of stream window is queued when the trigger block is accessed. The
+ * window is doubled each time the read-ahead blocks are consumed and halved
+ * if they are evicted before access. A miss that does not belong to any
+ * stream replaces the least recently used one, So the random accesses cancel
+ * the read-ahead of stale streams.
+ *
+ * The stream state is protected by cache lock.
+ */
 static inline bool 
 bcache_is_read_ahead_active(const struct bcache_device *dd) {
 	return dd->read_ahead.node.next != NULL;
 }
 
+static inline uint32_t
+bcache_read_ahead_window_min(void) {
+	uint32_t window = bdbuf_config.max_read_ahead_blocks >> 2;
+	return window > 0? window: 1;
+}
+
 static void 
 bcache_read_ahead_cancel(struct bcache_device *dd) {
 	if (bcache_is_read_ahead_active(dd))
 		rte_list_del(&dd->read_ahead.node);
+	dd->read_ahead.pending = 0;
+	dd->read_ahead.peeks = 0;
+}
+
+static void
+bcache_read_ahead_stream_init(struct bcache_read_ahead_stream *s,
+	bcache_num_t block, uint32_t stamp) {
+	s->trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+	s->next = block;
+	s->start = block;
+	s->last = block;
+	s->nr_blocks = 0;
+	s->window = bcache_read_ahead_window_min();
+	s->stamp = stamp;
+	s->active = false;
 }
 
 static void 
 bcache_read_ahead_reset(struct bcache_device *dd) {
+	struct bcache_read_ahead *ra = &dd->read_ahead;
+
 	bcache_read_ahead_cancel(dd);
-	dd->read_ahead.trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+	for (int i = 0; i < BCACHE_READ_AHEAD_STREAMS; i++)
+		bcache_read_ahead_stream_init(&ra->streams[i], 0, 0);
+	ra->clock = 0;
 }
 
 static void 
 bcache_read_ahead_add_to_chain(struct bcache_device *dd) {
 	struct rte_list *list = &bdbuf_cache.read_ahead_chain;
+	if (bcache_is_read_ahead_active(dd))
+		return;
 	if (rte_list_empty(list))
 		os_completed(&bdbuf_cache.read_ahead);
 	rte_list_add_tail(&dd->read_ahead.node, list);
 }
 
-static __rte_always_inline void 
-bcache_check_read_ahead_trigger(struct bcache_device *dd, bcache_num_t block) {
-	if (bdbuf_cache.read_ahead_task != 0 && 
-		dd->read_ahead.trigger == block &&
-		!bcache_is_read_ahead_active(dd)) {
-		dd->read_ahead.nr_blocks = BCACHE_READ_AHEAD_SIZE_AUTO;
-		bcache_read_ahead_add_to_chain(dd);
+static void
+bcache_read_ahead_queue(struct bcache_device *dd, int idx, uint32_t nr_blocks) {
+	struct bcache_read_ahead *ra = &dd->read_ahead;
+
+	ra->streams[idx].nr_blocks = nr_blocks;
+	ra->pending |= 1u << idx;
+	bcache_read_ahead_add_to_chain(dd);
+}
+
+/*
+ * Take the least recently used stream for a new one. The read-ahead of
+ * the replaced stream is cancelled.
+ */
+static int
+bcache_read_ahead_stream_alloc(struct bcache_device *dd, bcache_num_t block) {
+	struct bcache_read_ahead *ra = &dd->read_ahead;
+	int victim = 0;
+
+	for (int i = 1; i < BCACHE_READ_AHEAD_STREAMS; i++) {
+		if (ra->streams[i].stamp < ra->streams[victim].stamp)
+			victim = i;
 	}
+	if (ra->streams[victim].active)
+		dd->stats.read_ahead_cancels++;
+	ra->pending &= ~(1u << victim);
+	ra->peeks &= ~(1u << victim);
+	bcache_read_ahead_stream_init(&ra->streams[victim], block, ++ra->clock);
+	dd->stats.streams[victim].window = ra->streams[victim].window;
+	return victim;
 }
 
+static void
+bcache_read_ahead_miss(struct bcache_device *dd, bcache_num_t block) {
+	struct bcache_read_ahead *ra = &dd->read_ahead;
+	struct bcache_read_ahead_stream *s;
+	int idx;
+
+	bcache_lock_cache();
+	for (idx = 0; idx < BCACHE_READ_AHEAD_STREAMS; idx++) {
+		s = &ra->streams[idx];
+		if (s->stamp == 0)
+			continue;
+
+		/* The read-ahead blocks are evicted before access */
+		if (block >= s->start && block < s->next) {
+			if (s->window > 1)
+				s->window >>= 1;
+			dd->stats.streams[idx].thrashes++;
+			dd->stats.streams[idx].window = s->window;
+			break;
+		}
+
+		/* The stream is continued but the read-ahead is behind */
+		if (block == s->last + 1 || block == s->next)
+			break;
+	}
+
+	if (idx < BCACHE_READ_AHEAD_STREAMS) {
+		/* Fire the read-ahead from the next block */
+		s->trigger = block;
+		s->next = block + 1;
+		s->start = s->next;
+		s->last = block;
+		s->stamp = ++ra->clock;
+		ra->pending &= ~(1u << idx);
+	} else {
+		/* Arm the trigger for the next block */
+		idx = bcache_read_ahead_stream_alloc(dd, block);
+		s = &ra->streams[idx];
+		s->trigger = block + 1;
+		s->next = block + 2;
+		s->start = s->next;
+	}
+	bcache_unlock_cache();
+}
+
+static void
+bcache_read_ahead_fire(struct bcache_device *dd, int idx, bcache_num_t block) {
+	struct bcache_read_ahead *ra = &dd->read_ahead;
+	struct bcache_read_ahead_stream *s = &ra->streams[idx];
+
+	bcache_lock_cache();
+	if (s->trigger == block && !(ra->pending & (1u << idx))) {
+		if (!s->active) {
+			s->active = true;
+			dd->stats.read_ahead_streams++;
+		} else if (s->start != s->next) {
+			/* The last read-ahead is consumed */
+			s->window <<= 1;
+			if (s->window > bdbuf_config.max_read_ahead_blocks)
+				s->window = bdbuf_config.max_read_ahead_blocks;
+		}
+		dd->stats.streams[idx].triggers++;
+		dd->stats.streams[idx].window = s->window;
+		s->trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+		s->last = block;
+		s->stamp = ++ra->clock;
+		bcache_read_ahead_queue(dd, idx, s->window);
+	}
+	bcache_unlock_cache();
+}
+
+/*
+ * The triggers are checked without lock at first so the cache hit path
+ * does not take the cache lock.
+ */
 static __rte_always_inline void 
-bcache_set_read_ahead_trigger(struct bcache_device *dd, bcache_num_t block) {
-	if (dd->read_ahead.trigger != block) {
-		bcache_read_ahead_cancel(dd);
-		dd->read_ahead.trigger = block + 1;
-		dd->read_ahead.next = block + 2;
+bcache_check_read_ahead_trigger(struct bcache_device *dd, bcache_num_t block) {
+	if (bdbuf_cache.read_ahead_task == 0)
+		return;
+
+	for (int i = 0; i < BCACHE_READ_AHEAD_STREAMS; i++) {
+		if (rte_atomic_load_explicit(&dd->read_ahead.streams[i].trigger,
+			rte_memory_order_relaxed) == block) {
+			bcache_read_ahead_fire(dd, i, block);
+			break;
+		}
 	}
 }
 #endif /* CONFIG_BCACHE_READ_AHEAD */
@@ -1764,35 +2452,37 @@ bcache_read(struct bcache_device *dd, bcache_num_t block,
 	struct bcache_buffer **bd_ptr) {
 	int sc = 0;
 	struct bcache_buffer *bd = NULL;
+	struct bcache_shard *shard;
 	bcache_num_t media_block;
 
-	bcache_lock_cache();
-
 	sc = bcache_get_media_block(dd, block, &media_block);
 	if (sc == 0) {
 		pr_dbg("bdbuf:read: %" PRIu32 " (%" PRIu32 ") (dev = %08x)\n", media_block,
 				block, (unsigned)dd->dev);
 
-		bd = bcache_get_buffer_for_access(dd, media_block);
+		shard = bcache_shard_of(dd, media_block);
+		bcache_lock_shard(shard);
+		bd = bcache_get_buffer_for_access(shard, dd, media_block);
 		
 		switch (bd->state) {
 		case BCACHE_STATE_CACHED:
-			++dd->stats.read_hits;
+			BCACHE_STAT_INC(dd, read_hits);
 			bcache_set_state(bd, BCACHE_STATE_ACCESS_CACHED);
 			break;
 		case BCACHE_STATE_MODIFIED:
-			++dd->stats.read_hits;
+			BCACHE_STAT_INC(dd, read_hits);
 			bcache_set_state(bd, BCACHE_STATE_ACCESS_MODIFIED);
 			break;
 		case BCACHE_STATE_EMPTY:
-			++dd->stats.read_misses;
+			BCACHE_STAT_INC(dd, read_misses);
 #ifdef CONFIG_BCACHE_READ_AHEAD
-			bcache_set_read_ahead_trigger(dd, block);
+			if (bdbuf_cache.read_ahead_task != 0 && !dd->read_ahead.disabled)
+				bcache_read_ahead_miss(dd, block);
 #endif
-			sc = bcache_execute_read_request(dd, bd, 1);
+			sc = bcache_execute_read_request(shard, dd, bd, 1);
 			if (sc == 0) {
 				bcache_set_state(bd, BCACHE_STATE_ACCESS_CACHED);
-				rte_list_del(&bd->link);
+				bcache_lru_remove(shard, bd);
 				bcache_group_obtain(bd);
 			} else {
 				bd = NULL;
@@ -1805,9 +2495,9 @@ bcache_read(struct bcache_device *dd, bcache_num_t block,
 #ifdef CONFIG_BCACHE_READ_AHEAD
 		bcache_check_read_ahead_trigger(dd, block);
 #endif
+		bcache_unlock_shard(shard);
 	}
 
-	bcache_unlock_cache();
 	*bd_ptr = bd;
 	return sc;
 }
@@ -1817,46 +2507,50 @@ bcache_peek(struct bcache_device *dd, bcache_num_t block,
 	uint32_t nr_blocks) {
 #ifdef CONFIG_BCACHE_READ_AHEAD
 	bcache_lock_cache();
-	if (bdbuf_cache.read_ahead_enabled && nr_blocks > 0) {
-		bcache_read_ahead_reset(dd);
-		dd->read_ahead.next = block;
-		dd->read_ahead.nr_blocks = nr_blocks;
-		bcache_read_ahead_add_to_chain(dd);
+	if (bdbuf_cache.read_ahead_enabled && !dd->read_ahead.disabled &&
+		nr_blocks > 0) {
+		int idx = bcache_read_ahead_stream_alloc(dd, block);
+
+		dd->read_ahead.peeks |= 1u << idx;
+		bcache_read_ahead_queue(dd, idx, nr_blocks);
 	}
 	bcache_unlock_cache();
 #endif /* CONFIG_BCACHE_READ_AHEAD */
 }
 
-static __rte_always_inline int 
-bcache_check_bd_and_lock_cache(struct bcache_buffer *bd, const char *kind) {
+static __rte_always_inline struct bcache_shard *
+bcache_check_bd_and_lock_shard(struct bcache_buffer *bd, const char *kind) {
+	struct bcache_shard *shard;
+
 	if (bd == NULL)
-		return -EINVAL;
+		return NULL;
 #if (BCACHE_TRACE)
 	pr_dbg("bdbuf:%s: %" PRIu32 "\n", kind, bd->block);
 	bcache_show_users(kind, bd);
 #endif
-	bcache_lock_cache();
-	return 0;
+	shard = bcache_bd_shard(bd);
+	bcache_lock_shard(shard);
+	return shard;
 }
 
 int 
 bcache_release(struct bcache_buffer *bd) {
-	int sc = 0;
+	struct bcache_shard *shard;
 
-	sc = bcache_check_bd_and_lock_cache(bd, "release");
-	if (sc != 0)
-		return sc;
+	shard = bcache_check_bd_and_lock_shard(bd, "release");
+	if (shard == NULL)
+		return -EINVAL;
 
 	switch (bd->state) {
 	case BCACHE_STATE_ACCESS_CACHED:
-		bcache_add_to_lru_list_after_access(bd);
+		bcache_add_to_lru_list_after_access(shard, bd);
 		break;
 	case BCACHE_STATE_ACCESS_EMPTY:
 	case BCACHE_STATE_ACCESS_PURGED:
-		bcache_discard_buffer_after_access(bd);
+		bcache_discard_buffer_after_access(shard, bd);
 		break;
 	case BCACHE_STATE_ACCESS_MODIFIED:
-		bcache_add_to_modified_list_after_access(bd);
+		bcache_add_to_modified_list_after_access(shard, bd);
 		break;
 	default:
 		bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_0);
@@ -1866,26 +2560,35 @@ bcache_release(struct bcache_buffer *bd) {
 #if (BCACHE_TRACE)
 	bcache_show_usage();
 #endif
-	bcache_unlock_cache();
+	bcache_unlock_shard(shard);
 	return 0;
 }
 
 int 
 bcache_release_modified(struct bcache_buffer *bd) {
-	int sc = 0;
+	struct bcache_shard *shard;
+	struct bcache_device *dd;
+	struct bcache_dirty_waiter waiter;
+	uint32_t pause = 0;
 
-	sc = bcache_check_bd_and_lock_cache(bd, "release modified");
-	if (sc != 0)
-		return sc;
+	shard = bcache_check_bd_and_lock_shard(bd, "release modified");
+	if (shard == NULL)
+		return -EINVAL;
+
+	dd = bd->dd;
 
 	switch (bd->state) {
 	case BCACHE_STATE_ACCESS_CACHED:
 	case BCACHE_STATE_ACCESS_EMPTY:
 	case BCACHE_STATE_ACCESS_MODIFIED:
-		bcache_add_to_modified_list_after_access(bd);
+		if (bcache_add_to_modified_list_after_access(shard, bd)) {
+			pause = bcache_dirty_pause(shard);
+			if (pause > 0)
+				bcache_add_dirty_waiter(shard, &waiter);
+		}
 		break;
 	case BCACHE_STATE_ACCESS_PURGED:
-		bcache_discard_buffer_after_access(bd);
+		bcache_discard_buffer_after_access(shard, bd);
 		break;
 	default:
 		bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_6);
@@ -1895,26 +2598,29 @@ bcache_release_modified(struct bcache_buffer *bd) {
 #if (BCACHE_TRACE)
 	bcache_show_usage();
 #endif
-	bcache_unlock_cache();
+	bcache_unlock_shard(shard);
+
+	if (pause > 0)
+		bcache_balance_dirty(shard, dd, &waiter, pause);
 	return 0;
 }
 
 int 
 bcache_sync(struct bcache_buffer *bd) {
-	int sc = 0;
+	struct bcache_shard *shard;
 
-	sc = bcache_check_bd_and_lock_cache(bd, "sync");
-	if (sc != 0)
-		return sc;
+	shard = bcache_check_bd_and_lock_shard(bd, "sync");
+	if (shard == NULL)
+		return -EINVAL;
 
 	switch (bd->state) {
 	case BCACHE_STATE_ACCESS_CACHED:
 	case BCACHE_STATE_ACCESS_EMPTY:
 	case BCACHE_STATE_ACCESS_MODIFIED:
-		bcache_sync_after_access(bd);
+		bcache_sync_after_access(shard, bd);
 		break;
 	case BCACHE_STATE_ACCESS_PURGED:
-		bcache_discard_buffer_after_access(bd);
+		bcache_discard_buffer_after_access(shard, bd);
 		break;
 	default:
 		bcache_fatal_with_state(bd->state, BCACHE_FATAL_STATE_5);
@@ -1924,7 +2630,7 @@ bcache_sync(struct bcache_buffer *bd) {
 #if (BCACHE_TRACE)
 	bcache_show_usage();
 #endif
-	bcache_unlock_cache();
+	bcache_unlock_shard(shard);
 	return 0;
 }
 
@@ -1962,6 +2668,58 @@ bcache_syncdev(struct bcache_device *dd) {
 	return 0;
 }
 
+/*
+ * Complete the oldest request of ring. It is called without any lock.
+ */
+static void 
+bcache_io_ring_reap(struct bcache_io_ring *ring) {
+	struct bcache_io_slot *slot = bcache_io_slot(ring, ring->head);
+	struct bcache_shard *shard = 
+		bcache_bd_shard((struct bcache_buffer *)slot->req.bufs[0].user);
+
+	bcache_complete_transfer_request(shard, slot->dd, &slot->req);
+	bcache_unlock_shard(shard);
+
+	if (++ring->head == bdbuf_cache.io_depth)
+		ring->head = 0;
+	ring->inflight--;
+}
+
+static void 
+bcache_io_ring_drain(struct bcache_io_ring *ring) {
+	while (ring->inflight > 0)
+		bcache_io_ring_reap(ring);
+}
+
+static struct bcache_request *
+bcache_io_ring_get(struct bcache_io_ring *ring) {
+	struct bcache_request *req;
+	uint32_t idx;
+
+	/* Complete the oldest request if all slots are in flight */
+	if (ring->inflight == bdbuf_cache.io_depth)
+		bcache_io_ring_reap(ring);
+
+	idx = ring->head + ring->inflight;
+	if (idx >= bdbuf_cache.io_depth)
+		idx -= bdbuf_cache.io_depth;
+
+	req = &bcache_io_slot(ring, idx)->req;
+	req->status = -1;
+	req->bufnum = 0;
+	return req;
+}
+
+static void 
+bcache_io_ring_submit(struct bcache_io_ring *ring, struct bcache_device *dd,
+	struct bcache_request *req) {
+	rte_container_of(req, struct bcache_io_slot, req)->dd = dd;
+	ring->inflight++;
+
+	/* The return value will be ignored for transfer requests */
+	dd->ioctl(dd->phys_dev, BCACHE_IO_REQUEST, req);
+}
+
 static void bcache_swapout_write(struct bcache_swapout_transfer *transfer) {
 	struct rte_list *node;
 
@@ -1975,27 +2733,38 @@ static void bcache_swapout_write(struct bcache_swapout_transfer *transfer) {
 		uint32_t last_block = 0;
 
 		struct bcache_device *dd = transfer->dd;
+		struct bcache_request *req = NULL;
 		uint32_t media_blocks_per_block = dd->media_blocks_per_block;
 		bool need_continuous_blocks =
 			(dd->phys_dev->capabilities & BCACHE_DEV_CAP_MULTISECTOR_CONT) != 0;
 
 		/*
-		 * Take as many buffers as configured and pass to the driver. Note, the
-		 * API to the drivers has an array of buffers and if a chain was passed
-		 * we could have just passed the list. If the driver API is updated it
-		 * should be possible to make this change with little effect in this
-		 * code. The array that is passed is broken in design and should be
-		 * removed. Merging members of a struct into the first member is
-		 * trouble waiting to happen.
+		 * The blocks of an erase unit are kept in the same request (The
+		 * transfer list is sorted), So the driver can write them with
+		 * one erase.
 		 */
-		transfer->write_req.status = -1;
-		transfer->write_req.bufnum = 0;
+		uint32_t erase_shift = dd->phys_dev->erase_shift;
+		uint32_t unit_blocks = 
+			((1u << erase_shift) + media_blocks_per_block - 1) / media_blocks_per_block;
+		bcache_num_t last_unit = 0;
+		uint32_t nr_units = 0;
 
-		while ((node = transfer->bds.next) != NULL) {
-			struct bcache_buffer *bd = (struct bcache_buffer *)node;
+		/*
+		 * Take as many buffers as configured and pass to the driver. Up to
+		 * io_depth requests are in flight at the same time, So the driver can
+		 * overlap them if it completes the requests asynchronously.
+		 */
+		while (!rte_list_empty(&transfer->bds)) {
+			struct bcache_buffer *bd;
 			bool write = false;
 
+			if (req == NULL)
+				req = bcache_io_ring_get(&transfer->ring);
+
+			node = transfer->bds.next;
+			bd = (struct bcache_buffer *)node;
 			rte_list_del(node);
+
 			/*
 			 * If the device only accepts sequential buffers and this is not the
 			 * first buffer (the first is always sequential, and the buffer is not
@@ -2004,22 +2773,30 @@ static void bcache_swapout_write(struct bcache_swapout_transfer *transfer) {
 			 */
 			pr_dbg("bdbuf:swapout write: bd:%" PRIu32 ", bufnum:%" PRIu32
 					" mode:%s\n",
-					bd->block, transfer->write_req.bufnum,
+					bd->block, req->bufnum,
 					need_continuous_blocks ? "MULTI" : "SCAT");
 
-			if (need_continuous_blocks && transfer->write_req.bufnum &&
+			if (need_continuous_blocks && req->bufnum &&
 				bd->block != last_block + media_blocks_per_block) {
 				rte_list_add(&bd->link, &transfer->bds);
 				write = true;
+			} else if (req->bufnum && (bd->block >> erase_shift) != last_unit &&
+				req->bufnum + unit_blocks > bdbuf_config.max_write_blocks) {
+				/* The next erase unit may not fit in this request */
+				rte_list_add(&bd->link, &transfer->bds);
+				write = true;
 			} else {
 				struct bcache_sg_buffer *buf;
-				buf = &transfer->write_req.bufs[transfer->write_req.bufnum];
-				transfer->write_req.bufnum++;
+				buf = &req->bufs[req->bufnum];
+				if (req->bufnum == 0 || (bd->block >> erase_shift) != last_unit)
+					nr_units++;
+				req->bufnum++;
 				buf->user = bd;
 				buf->block = bd->block;
 				buf->length = dd->block_size;
 				buf->buffer = bd->buffer;
 				last_block = bd->block;
+				last_unit = bd->block >> erase_shift;
 			}
 
 			/*
@@ -2028,16 +2805,22 @@ static void bcache_swapout_write(struct bcache_swapout_transfer *transfer) {
 			 */
 
 			if (rte_list_empty(&transfer->bds) ||
-				(transfer->write_req.bufnum >= bdbuf_config.max_write_blocks))
+				(req->bufnum >= bdbuf_config.max_write_blocks))
 				write = true;
 
 			if (write) {
-				bcache_execute_transfer_request(dd, &transfer->write_req, false);
-				transfer->write_req.status = -1;
-				transfer->write_req.bufnum = 0;
+				if (unit_blocks > 1) {
+					BCACHE_STAT_ADD(dd, write_erase_units, nr_units);
+					BCACHE_STAT_ADD(dd, write_erases_saved, req->bufnum - nr_units);
+				}
+				bcache_io_ring_submit(&transfer->ring, dd, req);
+				nr_units = 0;
+				req = NULL;
 			}
 		}
 
+		bcache_io_ring_drain(&transfer->ring);
+
 		/*
 		 * If sync'ing and the deivce is capability of handling a sync IO control
 		 * call perform the call.
@@ -2050,12 +2833,14 @@ static void bcache_swapout_write(struct bcache_swapout_transfer *transfer) {
 }
 
 static void 
-bcache_swapout_modified_processing(struct bcache_device **dd_ptr,
+bcache_swapout_modified_processing(struct bcache_shard *shard,
+	struct bcache_device **dd_ptr,
 	struct rte_list *chain, 
 	struct rte_list *transfer,
 	bool sync_active, 
 	bool update_timers,
-	uint32_t timer_delta) {
+	uint32_t timer_delta,
+	size_t *writeback) {
 
 	if (!rte_list_empty(chain)) {
 		struct rte_list *node = chain->next;
@@ -2081,8 +2866,18 @@ bcache_swapout_modified_processing(struct bcache_device **dd_ptr,
 			 */
 			if (sync_all || 
 				(sync_active && (*dd_ptr == bd->dd)) ||
-				bcache_has_buffer_waiters())
+				bcache_has_buffer_waiters(shard))
+				bd->hold_timer = 0;
+
+			/*
+			 * The dirty buffers exceed the low mark, So the oldest buffers of
+			 * the device are written back before their timers expire.
+			 */
+			if (bd->hold_timer && *writeback > 0 &&
+				(*dd_ptr == BDBUF_INVALID_DEV || *dd_ptr == bd->dd)) {
 				bd->hold_timer = 0;
+				BCACHE_STAT_INC(bd->dd, write_background);
+			}
 
 			if (bd->hold_timer) {
 				if (update_timers) {
@@ -2118,6 +2913,12 @@ bcache_swapout_modified_processing(struct bcache_device **dd_ptr,
 				 */
 				bcache_set_state(bd, BCACHE_STATE_TRANSFER);
 				rte_list_del(node);
+				if (bd->dirty) {
+					size_t units = bcache_bd_units(bd);
+
+					*writeback = *writeback > units? *writeback - units: 0;
+					bcache_clear_dirty(shard, bd);
+				}
 
 				while (node && tnode != transfer) {
 					struct bcache_buffer *tbd = (struct bcache_buffer *)tnode;
@@ -2140,19 +2941,16 @@ bcache_swapout_modified_processing(struct bcache_device **dd_ptr,
 	}
 }
 
+/*
+ * Gather the modified buffers of one shard for a device and write them.
+ * The workers are only used when no sync is active.
+ */
 static bool 
-bcache_swapout_processing(unsigned long timer_delta, bool update_timers,
+bcache_swapout_shard(struct bcache_shard *shard, unsigned long timer_delta, 
+	bool update_timers, bool sync_active, struct bcache_device *sync_device,
 	struct bcache_swapout_transfer *transfer) {
 	struct bcache_swapout_worker *worker = NULL;
-	bool transfered_buffers = false;
-	bool sync_active;
-
-	bcache_lock_cache();
-
-	/*
-	 * To set this to true you need the cache and the sync lock.
-	 */
-	sync_active = bdbuf_cache.sync_active;
+	size_t writeback;
 
 	/*
 	 * If a sync is active do not use a worker because the current code does not
@@ -2164,16 +2962,17 @@ bcache_swapout_processing(unsigned long timer_delta, bool update_timers,
 	 * sync operations.
 	 */
 	if (!sync_active) {
+		bcache_lock_cache();
 		if (!rte_list_empty(&bdbuf_cache.swapout_free_workers)) {
 			worker =
 				(struct bcache_swapout_worker *)bdbuf_cache.swapout_free_workers.next;
 			rte_list_del(&worker->link);
 			transfer = &worker->transfer;
 		}
+		bcache_unlock_cache();
 	}
 
 	RTE_INIT_LIST(&transfer->bds);
-	transfer->dd = BDBUF_INVALID_DEV;
 	transfer->syncing = sync_active;
 
 	/*
@@ -2181,28 +2980,30 @@ bcache_swapout_processing(unsigned long timer_delta, bool update_timers,
 	 * is for a buffer handle process the devices in the order on the sync
 	 * list. This means the dev is BDBUF_INVALID_DEV.
 	 */
-	if (sync_active)
-		transfer->dd = bdbuf_cache.sync_device;
+	transfer->dd = sync_active? sync_device: BDBUF_INVALID_DEV;
+
+	bcache_lock_shard(shard);
+	writeback = bcache_writeback_units(shard);
 
 	/*
 	 * If we have any buffers in the sync queue move them to the modified
 	 * list. The first sync buffer will select the device we use.
 	 */
-	bcache_swapout_modified_processing(&transfer->dd, &bdbuf_cache.sync,
-		&transfer->bds, true, false, timer_delta);
+	bcache_swapout_modified_processing(shard, &transfer->dd, &shard->sync,
+		&transfer->bds, true, false, timer_delta, &writeback);
 
 	/*
-	 * Process the cache's modified list.
+	 * Process the shard's modified list.
 	 */
-	bcache_swapout_modified_processing(&transfer->dd, &bdbuf_cache.modified,
-		&transfer->bds, sync_active, update_timers, timer_delta);
-											
+	bcache_swapout_modified_processing(shard, &transfer->dd, &shard->modified,
+		&transfer->bds, sync_active, update_timers, timer_delta, &writeback);
+
 	/*
 	 * We have all the buffers that have been modified for this device so the
-	 * cache can be unlocked because the state of each buffer has been set to
+	 * shard can be unlocked because the state of each buffer has been set to
 	 * TRANSFER.
 	 */
-	bcache_unlock_cache();
+	bcache_unlock_shard(shard);
 
 	/*
 	 * If there are buffers to transfer to the media transfer them.
@@ -2212,7 +3013,38 @@ bcache_swapout_processing(unsigned long timer_delta, bool update_timers,
 			os_completed(&worker->swapout_sync);
 		else
 			bcache_swapout_write(transfer);
-		transfered_buffers = true;
+		return true;
+	}
+
+	if (worker) {
+		bcache_lock_cache();
+		worker->transfer.dd = BDBUF_INVALID_DEV;
+		rte_list_add(&worker->link, &bdbuf_cache.swapout_free_workers);
+		bcache_unlock_cache();
+	}
+
+	return false;
+}
+
+static bool 
+bcache_swapout_processing(unsigned long timer_delta, bool update_timers,
+	struct bcache_swapout_transfer *transfer) {
+	struct bcache_device *sync_device;
+	bool transfered_buffers = false;
+	bool sync_active;
+
+	/*
+	 * To set this to true you need the cache and the sync lock.
+	 */
+	bcache_lock_cache();
+	sync_active = bdbuf_cache.sync_active;
+	sync_device = bdbuf_cache.sync_device;
+	bcache_unlock_cache();
+
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++) {
+		if (bcache_swapout_shard(&bdbuf_cache.shards[i], timer_delta,
+			update_timers, sync_active, sync_device, transfer))
+			transfered_buffers = true;
 	}
 
 	if (sync_active && !transfered_buffers) {
@@ -2294,7 +3126,7 @@ static void bcache_swapout_task(void * arg) {
 }
 
 static void 
-bcache_purge_list(struct rte_list *purge_list) {
+bcache_purge_list(struct bcache_shard *shard, struct rte_list *purge_list) {
 	struct rte_list *pos, *next;
 	bool wake_buffer_waiters = false;
 
@@ -2305,16 +3137,16 @@ bcache_purge_list(struct rte_list *purge_list) {
 		rte_list_del(pos);
 		if (bd->waiters == 0)
 			wake_buffer_waiters = true;
-		bcache_discard_buffer(bd);
+		bcache_discard_buffer(shard, bd);
 	}
 
 	if (wake_buffer_waiters)
-		bcache_wake(&bdbuf_cache.buffer_waiters);
+		bcache_wake(&shard->buffer_waiters);
 }
 
 static inline void
-__bcache_purge(struct rte_list* purge_list, struct bcache_buffer* cur,
-	const struct bcache_device* dd) {
+__bcache_purge(struct bcache_shard *shard, struct rte_list* purge_list, 
+	struct bcache_buffer* cur, const struct bcache_device* dd) {
 	if (cur->dd == dd) {
 		switch (cur->state) {
 		case BCACHE_STATE_FREE:
@@ -2323,13 +3155,13 @@ __bcache_purge(struct rte_list* purge_list, struct bcache_buffer* cur,
 		case BCACHE_STATE_TRANSFER_PURGED:
 			break;
 		case BCACHE_STATE_SYNC:
-			bcache_wake(&bdbuf_cache.transfer_waiters);
+			bcache_wake(&shard->transfer_waiters);
 			/* Fall through */
 		case BCACHE_STATE_MODIFIED:
 			bcache_group_release(cur);
 			/* Fall through */
 		case BCACHE_STATE_CACHED:
-			rte_list_del(&cur->link);
+			bcache_lru_remove(shard, cur);
 			rte_list_add_tail(&cur->link, purge_list);
 			break;
 		case BCACHE_STATE_TRANSFER:
@@ -2348,30 +3180,30 @@ __bcache_purge(struct rte_list* purge_list, struct bcache_buffer* cur,
 
 #ifdef CONFIG_BCACHE_HASH_MAP
 static void 
-bcache_hash_gather_for_purge(struct rte_list *purge_list,
-	const struct bcache_device *dd) {
-	for (size_t i = 0; i < rte_array_size(bdbuf_cache.root.hashq); i++) {
-		struct rte_hlist *head = &bdbuf_cache.root.hashq[i];
+bcache_hash_gather_for_purge(struct bcache_shard *shard, 
+	struct rte_list *purge_list, const struct bcache_device *dd) {
+	for (size_t i = 0; i < rte_array_size(shard->root.hashq); i++) {
+		struct rte_hlist *head = &shard->root.hashq[i];
 		struct rte_hnode *pos;
 		rte_hlist_foreach(pos, head) {
 			struct bcache_buffer *cur = rte_container_of(pos, 
 				struct bcache_buffer, hash);
-			__bcache_purge(purge_list, cur, dd);
+			__bcache_purge(shard, purge_list, cur, dd);
 		}
 	}
 }
 #else /* !CONFIG_BCACHE_HASH_MAP */
 static void 
-bcache_avl_gather_for_purge(struct rte_list *purge_list,
-	const struct bcache_device *dd) {
+bcache_avl_gather_for_purge(struct bcache_shard *shard, 
+	struct rte_list *purge_list, const struct bcache_device *dd) {
 	struct bcache_buffer *stack[BCACHE_AVL_MAX_HEIGHT];
 	struct bcache_buffer **prev = stack;
-	struct bcache_buffer *cur = bdbuf_cache.root.tree;
+	struct bcache_buffer *cur = shard->root.tree;
 
 	*prev = NULL;
 
 	while (cur != NULL) {
-		__bcache_purge(purge_list, cur, dd);
+		__bcache_purge(shard, purge_list, cur, dd);
 		if (cur->avl.left != NULL) {
 			/* Left */
 			++prev;
@@ -2402,22 +3234,35 @@ bcache_avl_gather_for_purge(struct rte_list *purge_list,
 
 
 static void 
-bcache_do_purge_dev(struct bcache_device *dd) {
+bcache_do_purge_dev(struct bcache_shard *shard, struct bcache_device *dd) {
 	struct rte_list purge_list;
 
 	RTE_INIT_LIST(&purge_list);
+	bcache_container_gather_for_purge(shard, &purge_list, dd);
+	bcache_purge_list(shard, &purge_list);
+}
+
+static void 
+bcache_purge_read_ahead(struct bcache_device *dd) {
 #ifdef CONFIG_BCACHE_READ_AHEAD
+	bcache_lock_cache();
 	bcache_read_ahead_reset(dd);
+	bcache_unlock_cache();
+#else
+	(void) dd;
 #endif
-	bcache_container_gather_for_purge(&purge_list, dd);
-	bcache_purge_list(&purge_list);
 }
 
 void 
 bcache_purge_dev(struct bcache_device *dd) {
-	bcache_lock_cache();
-	bcache_do_purge_dev(dd);
-	bcache_unlock_cache();
+	bcache_purge_read_ahead(dd);
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++) {
+		struct bcache_shard *shard = &bdbuf_cache.shards[i];
+
+		bcache_lock_shard(shard);
+		bcache_do_purge_dev(shard, dd);
+		bcache_unlock_shard(shard);
+	}
 }
 
 int 
@@ -2432,7 +3277,10 @@ bcache_set_block_size(struct bcache_device *dd, uint32_t block_size,
 	if (sync)
 		(void)bcache_syncdev(dd);
 
-	bcache_lock_cache();
+	/* Lock all shards in ascending order */
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++)
+		bcache_lock_shard(&bdbuf_cache.shards[i]);
+
 	if (block_size > 0) {
 		size_t bds_per_group = bcache_bds_per_group(block_size);
 		if (bds_per_group != 0) {
@@ -2456,72 +3304,123 @@ bcache_set_block_size(struct bcache_device *dd, uint32_t block_size,
 			dd->media_blocks_per_block = media_blocks_per_block;
 			dd->block_to_media_block_shift = block_to_media_block_shift;
 			dd->bds_per_group = bds_per_group;
-			bcache_do_purge_dev(dd);
+			for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++)
+				bcache_do_purge_dev(&bdbuf_cache.shards[i], dd);
 		} else {
 			sc = -EINVAL;
 		}
 	} else {
 		sc = -EINVAL;
 	}
-	bcache_unlock_cache();
+
+	for (unsigned int i = bdbuf_cache.shard_mask + 1; i > 0; i--)
+		bcache_unlock_shard(&bdbuf_cache.shards[i - 1]);
+	if (sc == 0)
+		bcache_purge_read_ahead(dd);
 	return sc;
 }
 
 #ifdef CONFIG_BCACHE_READ_AHEAD
+/*
+ * Submit the read-ahead request of stream to the ring of read-ahead task,
+ * The request is completed when its slot is reused or the task goes idle.
+ * A failed read-ahead leaves the blocks empty, So they are read on access.
+ * It is called with cache locked and returns with cache locked.
+ */
+static void
+bcache_read_ahead_stream(struct bcache_device *dd, int idx) {
+	struct bcache_io_ring *ring = &bdbuf_cache.read_ahead_ring;
+	struct bcache_read_ahead *ra = &dd->read_ahead;
+	struct bcache_read_ahead_stream *s = &ra->streams[idx];
+	bool peek = (ra->peeks & (1u << idx)) != 0;
+	bcache_num_t block = s->next;
+	uint32_t nr_blocks = s->nr_blocks;
+	uint32_t transfer_count = 0;
+	struct bcache_request *req;
+	struct bcache_shard *shard;
+	struct bcache_buffer *bd;
+	bcache_num_t media_block;
+
+	ra->peeks &= ~(1u << idx);
+	if (bcache_get_media_block(dd, block, &media_block) != 0) {
+		s->trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+		return;
+	}
+
+	/* Lock order: shard -> cache (The ring may complete a request of any shard) */
+	bcache_unlock_cache();
+	req = bcache_io_ring_get(ring);
+	shard = bcache_shard_of(dd, media_block);
+	bcache_lock_shard(shard);
+
+	bd = bcache_get_buffer_for_read_ahead(shard, dd, media_block);
+	if (bd != NULL) {
+		uint32_t blocks_until_end_of_disk = dd->block_count - block;
+
+		if (nr_blocks == BCACHE_READ_AHEAD_SIZE_AUTO ||
+			nr_blocks > blocks_until_end_of_disk)
+			nr_blocks = blocks_until_end_of_disk;
+		if (nr_blocks > bdbuf_config.max_read_ahead_blocks)
+			nr_blocks = bdbuf_config.max_read_ahead_blocks;
+
+		BCACHE_STAT_INC(dd, read_ahead_transfers);
+		if (peek)
+			BCACHE_STAT_INC(dd, read_ahead_peeks);
+		bcache_fill_read_request(shard, dd, bd, req, nr_blocks);
+		transfer_count = req->bufnum;
+	}
+	bcache_unlock_shard(shard);
+
+	if (transfer_count > 0)
+		bcache_io_ring_submit(ring, dd, req);
+
+	bcache_lock_cache();
+
+	/* The stream may be changed or replaced during the transfer */
+	if (s->next == block && !(ra->pending & (1u << idx))) {
+		if (transfer_count > 0) {
+			s->start = block;
+			s->next = block + transfer_count;
+			s->trigger = peek? BCACHE_READ_AHEAD_NO_TRIGGER: 
+				block + transfer_count / 2;
+			dd->stats.streams[idx].blocks += transfer_count;
+		} else if (!peek) {
+			/*
+			 * The block is in the cache already, Move the trigger to it so
+			 * the stream goes on when it is accessed.
+			 */
+			s->trigger = block;
+			s->next = block + 1;
+			s->start = s->next;
+		}
+	}
+}
+
 static void 
 bcache_read_ahead_task(void * arg) {
 	struct rte_list *list = &bdbuf_cache.read_ahead_chain;
-	struct rte_list *pos, *next;
 
 	while (bdbuf_cache.read_ahead_enabled) {
 		os_completion_wait(&bdbuf_cache.read_ahead);
 		bcache_lock_cache();
 
-		rte_list_foreach_safe(pos, next, list) {
-			struct bcache_device *dd = rte_container_of(pos, 
+		while (!rte_list_empty(list)) {
+			struct bcache_device *dd = rte_container_of(list->next, 
 				struct bcache_device, read_ahead.node);
-				
-			rte_list_del(pos);
-
-			bcache_num_t block = dd->read_ahead.next;
-			bcache_num_t media_block = 0;
-			int sc = bcache_get_media_block(dd, block, &media_block);
-			if (sc == 0) {
-				struct bcache_buffer *bd =
-					bcache_get_buffer_for_read_ahead(dd, media_block);
-
-				if (bd != NULL) {
-					uint32_t transfer_count = dd->read_ahead.nr_blocks;
-					uint32_t blocks_until_end_of_disk = dd->block_count - block;
-					uint32_t max_transfer_count = bdbuf_config.max_read_ahead_blocks;
-
-					if (transfer_count == BCACHE_READ_AHEAD_SIZE_AUTO) {
-						transfer_count = blocks_until_end_of_disk;
-						if (transfer_count >= max_transfer_count) {
-							transfer_count = max_transfer_count;
-							dd->read_ahead.trigger = block + transfer_count / 2;
-							dd->read_ahead.next = block + transfer_count;
-						} else {
-							dd->read_ahead.trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
-						}
-					} else {
-						if (transfer_count > blocks_until_end_of_disk)
-							transfer_count = blocks_until_end_of_disk;
-
-						if (transfer_count > max_transfer_count)
-							transfer_count = max_transfer_count;
+			struct bcache_read_ahead *ra = &dd->read_ahead;
 
-						++dd->stats.read_ahead_peeks;
-					}
+			rte_list_del(&ra->node);
+			while (ra->pending) {
+				int idx = ffs(ra->pending) - 1;
 
-					++dd->stats.read_ahead_transfers;
-					bcache_execute_read_request(dd, bd, transfer_count);
-				}
-			} else {
-				dd->read_ahead.trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+				ra->pending &= ~(1u << idx);
+				bcache_read_ahead_stream(dd, idx);
 			}
 		}
 		bcache_unlock_cache();
+
+		/* Complete the requests in flight before sleeping */
+		bcache_io_ring_drain(&bdbuf_cache.read_ahead_ring);
 	}
 	
 	os_thread_exit();
@@ -2543,6 +3442,80 @@ bcache_reset_device_stats(struct bcache_device *dd) {
 	bcache_unlock_cache();
 }
 
+int 
+bcache_set_policy(int policy) {
+	int err;
+
+	if (policy != BCACHE_POLICY_LRU && policy != BCACHE_POLICY_2Q)
+		return -EINVAL;
+
+	err = bcache_init();
+	if (err)
+		return err;
+
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++)
+		bcache_lock_shard(&bdbuf_cache.shards[i]);
+
+	bdbuf_cache.policy = policy;
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++) {
+		struct bcache_shard *shard = &bdbuf_cache.shards[i];
+
+		/* Move the cold buffers to the tail of hot queue */
+		while (!rte_list_empty(&shard->cold)) {
+			struct bcache_buffer *bd = (struct bcache_buffer *)shard->cold.next;
+
+			bcache_lru_remove(shard, bd);
+			rte_list_add_tail(&bd->link, &shard->lru);
+		}
+		memset(shard->ghosts, 0, sizeof(shard->ghosts));
+	}
+
+	for (unsigned int i = bdbuf_cache.shard_mask + 1; i > 0; i--)
+		bcache_unlock_shard(&bdbuf_cache.shards[i - 1]);
+	return 0;
+}
+
+int 
+bcache_set_dirty_ratio(uint32_t low, uint32_t high) {
+	int err;
+
+	if (!bcache_dirty_ratio_valid(low, high))
+		return -EINVAL;
+
+	err = bcache_init();
+	if (err)
+		return err;
+
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++)
+		bcache_lock_shard(&bdbuf_cache.shards[i]);
+
+	/* The new marks may release the throttled writers or start writeback */
+	bcache_set_dirty_limits(low, high);
+	for (unsigned int i = 0; i <= bdbuf_cache.shard_mask; i++)
+		bcache_wake_dirty_waiters(&bdbuf_cache.shards[i]);
+
+	for (unsigned int i = bdbuf_cache.shard_mask + 1; i > 0; i--)
+		bcache_unlock_shard(&bdbuf_cache.shards[i - 1]);
+
+	bcache_wake_swapper();
+	return 0;
+}
+
+int 
+bcache_set_read_ahead(struct bcache_device *dd, bool enable) {
+#ifdef CONFIG_BCACHE_READ_AHEAD
+	bcache_lock_cache();
+	dd->read_ahead.disabled = !enable;
+	if (!enable)
+		bcache_read_ahead_reset(dd);
+	bcache_unlock_cache();
+	return 0;
+#else
+	(void) dd;
+	return enable? -ENOTSUP: 0;
+#endif
+}
+
 int 
 bcache_ioctl(struct bcache_device *dd, uint32_t req, void *argp) {
 	int rc = 0;
@@ -2575,6 +3548,12 @@ bcache_ioctl(struct bcache_device *dd, uint32_t req, void *argp) {
 	case BCACHE_IO_RESETDEVSTATS:
 		bcache_reset_device_stats(dd);
 		break;
+	case BCACHE_IO_SETREADAHEAD:
+		rc = bcache_set_read_ahead(dd, *(uint32_t *)argp != 0);
+		break;
+	case BCACHE_IO_GETERASESIZE:
+		*(uint32_t *)argp = dd->media_block_size;
+		break;
 	default:
 		rc = -EINVAL;
 		break;
@@ -2607,13 +3586,38 @@ bcache_print_stats(const struct bcache_stats *stats,
 			" WRITE TRANSFERS      | %" PRIu32 "\n"
 			" WRITE BLOCKS         | %" PRIu32 "\n"
 			" WRITE ERRORS         | %" PRIu32 "\n"
+			" WRITE ERASE UNITS    | %" PRIu32 "\n"
+			" WRITE ERASES SAVED   | %" PRIu32 "\n"
+			" WRITE BACKGROUND     | %" PRIu32 "\n"
+			" WRITE THROTTLES      | %" PRIu32 "\n"
+			" WRITE THROTTLE MS    | %" PRIu32 "\n"
+			" HOT HITS             | %" PRIu32 "\n"
+			" COLD HITS            | %" PRIu32 "\n"
+			" GHOST HITS           | %" PRIu32 "\n"
+			" EVICTIONS            | %" PRIu32 "\n"
+			" READ AHEAD STREAMS   | %" PRIu32 "\n"
+			" READ AHEAD CANCELS   | %" PRIu32 "\n"
 			"----------------------+------------------------------------------------"
 			"--------\n",
 			media_block_size, media_block_count, block_size, stats->read_hits,
 			stats->read_misses, stats->read_ahead_transfers, stats->read_ahead_peeks,
 			stats->read_blocks, stats->read_errors, stats->write_transfers,
-			stats->write_blocks, stats->write_errors
+			stats->write_blocks, stats->write_errors, stats->write_erase_units,
+			stats->write_erases_saved, stats->write_background,
+			stats->write_throttles, stats->write_throttle_ms, stats->hot_hits,
+			stats->cold_hits, stats->ghost_hits, stats->evictions,
+			stats->read_ahead_streams, stats->read_ahead_cancels
 	);
+	for (int i = 0; i < BCACHE_READ_AHEAD_STREAMS; i++) {
+		const struct bcache_stream_stats *st = &stats->streams[i];
+
+		if (st->triggers == 0 && st->thrashes == 0)
+			continue;
+		pr_vout(printer,
+			" STREAM %-2d            | triggers %" PRIu32 " blocks %" PRIu32 
+			" thrashes %" PRIu32 " window %" PRIu32 "\n",
+			i, st->triggers, st->blocks, st->thrashes, st->window);
+	}
 }
 
 int 
@@ -2633,11 +3637,20 @@ bcache_disk_init_phys(struct bcache_device *dd,
 	dd->ioctl = handler;
 	dd->driver_data = driver_data;
 #ifdef CONFIG_BCACHE_READ_AHEAD
-	dd->read_ahead.trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+	bcache_read_ahead_reset(dd);
 #endif
 	if (block_count > 0) {
+		uint32_t erase_size;
+
 		if ((*handler)(dd, BCACHE_IO_CAPABILITIES, &dd->capabilities)) 
 			dd->capabilities = 0;
+
+		/* The erase unit must be power of 2 multiple of media block */
+		if ((*handler)(dd, BCACHE_IO_GETERASESIZE, &erase_size) == 0 &&
+			erase_size > block_size && !(erase_size & (erase_size - 1))) {
+			while ((block_size << dd->erase_shift) < erase_size)
+				dd->erase_shift++;
+		}
 		return bcache_set_block_size(dd, block_size, false);
 	}
 
@@ -2657,7 +3670,7 @@ bcache_disk_init_log(struct bcache_device *dd,
 	dd->ioctl = phys_dd->ioctl;
 	dd->driver_data = phys_dd->driver_data;
 #ifdef CONFIG_BCACHE_READ_AHEAD
-	dd->read_ahead.trigger = BCACHE_READ_AHEAD_NO_TRIGGER;
+	bcache_read_ahead_reset(dd);
 #endif
 
 	if (phys_dd->phys_dev == phys_dd) {
@@ -2751,6 +3764,98 @@ bcache_blkdev_write(struct bcache_device *dd, const void *buffer,
 	return (ssize_t)count;
 }
 
+/*
+ * The mapped buffer is in an access state: It is not on the modified list for
+ * swapout, and a purge only marks it ACCESS_PURGED. The data is kept until
+ * the buffer is released.
+ */
+ssize_t 
+bcache_blkdev_map(struct bcache_device *dd, off_t offset, size_t count,
+	struct bcache_map *map) {
+	bcache_num_t block;
+	size_t block_offset;
+	size_t len;
+
+	if (dd == NULL || map == NULL || count == 0)
+		return -EINVAL;
+
+	block = offset >> dd->block_size_shift;
+	block_offset = offset & (dd->block_size - 1);
+	if (rte_unlikely(bcache_read(dd, block, &map->bd))) {
+		map->bd = NULL;
+		return -EIO;
+	}
+
+	len = dd->block_size - block_offset;
+	if (len > count)
+		len = count;
+
+	map->data = map->bd->buffer + block_offset;
+	map->len = len;
+	return (ssize_t)len;
+}
+
+ssize_t 
+bcache_blkdev_mapv(struct bcache_device *dd, off_t offset, size_t count,
+	struct bcache_map *maps, int nmaps) {
+	size_t mapped = 0;
+	size_t max_maps;
+	int i;
+
+	if (dd == NULL || maps == NULL || nmaps <= 0 || count == 0)
+		return -EINVAL;
+
+	/*
+	 * The blocks are held together, So they must not take all the buffers
+	 * of a shard. Otherwise the read of next block may wait for ever.
+	 */
+	max_maps = bdbuf_cache.shards[0].nr_units / 
+		(bdbuf_cache.max_bds_per_group / dd->bds_per_group) / 2;
+	if ((size_t)nmaps > max_maps)
+		return -EINVAL;
+
+	for (i = 0; i < nmaps && mapped < count; i++) {
+		ssize_t len = bcache_blkdev_map(dd, offset + (off_t)mapped, 
+			count - mapped, &maps[i]);
+
+		if (rte_unlikely(len < 0)) {
+			bcache_blkdev_unmapv(maps, i);
+			return len;
+		}
+		mapped += (size_t)len;
+	}
+
+	for ( ; i < nmaps; i++) {
+		maps[i].data = NULL;
+		maps[i].len = 0;
+		maps[i].bd = NULL;
+	}
+
+	return (ssize_t)mapped;
+}
+
+int 
+bcache_blkdev_unmap(struct bcache_map *map) {
+	int err;
+
+	if (map == NULL || map->bd == NULL)
+		return -EINVAL;
+
+	err = bcache_release(map->bd);
+	map->data = NULL;
+	map->len = 0;
+	map->bd = NULL;
+	return err;
+}
+
+void 
+bcache_blkdev_unmapv(struct bcache_map *maps, int nmaps) {
+	for (int i = 0; i < nmaps; i++) {
+		if (maps[i].bd != NULL)
+			bcache_blkdev_unmap(&maps[i]);
+	}
+}
+
 int 
 bcache_blkdev_ioctl(struct bcache_device *dd, unsigned int request,
 	void *buffer) {
@@ -130,6 +130,8 @@ bcache_request_done(struct bcache_request *req, int status) {
 #define BCACHE_IO_PURGEDEV         9
 #define BCACHE_IO_GETDEVSTATS      10
 #define BCACHE_IO_RESETDEVSTATS    11
+#define BCACHE_IO_GETERASESIZE     12  /* Erase unit of media in bytes (uint32_t) */
+#define BCACHE_IO_SETREADAHEAD     13  /* Enable (1) or disable (0) read-ahead (uint32_t) */
 
 /**
  * @name Block Device Driver Capabilities
@@ -187,6 +189,51 @@ int bcache_blkdev_sync(bool purge_dev);
 int bcache_blkdev_ioctl(struct bcache_device *dd, unsigned int request,
 	void *buffer);
 
+/**
+ * @brief Read-only view of the cached data of a block.
+ */
+struct bcache_map {
+	const void *data;
+	size_t len;
+	struct bcache_buffer *bd;
+};
+
+/**
+ * @brief Maps the cached data at the offset without copy.
+ *
+ * The span is limited to the block of the offset. The block is held like
+ * bcache_read(), So swapout does not take it and a purge of the device does
+ * not free it until bcache_blkdev_unmap(). Other accessors of the block wait
+ * for the unmap.
+ *
+ * @retval Positive The number of bytes mapped (map->data and map->len).
+ * @retval -EINVAL Invalid parameter.
+ * @retval -EIO The block can not be read.
+ */
+ssize_t bcache_blkdev_map(struct bcache_device *dd, off_t offset, size_t count,
+	struct bcache_map *map);
+
+/**
+ * @brief Maps a span over several blocks (One map for each block).
+ *
+ * The maps that are not used are cleared, So bcache_blkdev_unmapv() can be
+ * called with nmaps. The number of maps must not exceed half of the buffers
+ * of a shard because all the blocks are held together.
+ *
+ * @retval Positive The number of bytes mapped (Less than count if the maps
+ *         are not enough).
+ * @retval -EINVAL Invalid parameter.
+ * @retval -EIO A block can not be read (Nothing is mapped).
+ */
+ssize_t bcache_blkdev_mapv(struct bcache_device *dd, off_t offset, size_t count,
+	struct bcache_map *maps, int nmaps);
+
+/**
+ * @brief Releases the block of the map.
+ */
+int bcache_blkdev_unmap(struct bcache_map *map);
+void bcache_blkdev_unmapv(struct bcache_map *maps, int nmaps);
+
 /**
  * @brief Prints the block device statistics.
  */
@@ -206,14 +253,18 @@ void bcache_print_stats(const struct bcache_stats *stats, uint32_t media_block_s
 #define BCACHE_READ_AHEAD_SIZE_AUTO (0)
 
 /**
- * @brief Block device read-ahead control.
+ * @brief The number of sequential streams tracked per device.
  */
-struct bcache_read_ahead {
-	/**
-	 * @brief Chain node for the read-ahead request queue of the read-ahead task.
-	 */
-	struct rte_list node;
+#ifdef CONFIG_BCACHE_READ_AHEAD_STREAMS
+#define BCACHE_READ_AHEAD_STREAMS CONFIG_BCACHE_READ_AHEAD_STREAMS
+#else
+#define BCACHE_READ_AHEAD_STREAMS 4
+#endif
 
+/**
+ * @brief Sequential stream of read-ahead detector.
+ */
+struct bcache_read_ahead_stream {
 	/**
 	 * @brief Block value to trigger the read-ahead request.
 	 *
@@ -231,6 +282,19 @@ struct bcache_read_ahead {
 	 */
 	bcache_num_t next;
 
+	/**
+	 * @brief First block of the last read-ahead request.
+	 *
+	 * The blocks in [start, next) have been read ahead, A miss in this range
+	 * means that the blocks were evicted before they are accessed.
+	 */
+	bcache_num_t start;
+
+	/**
+	 * @brief The last block of the stream that accessed.
+	 */
+	bcache_num_t last;
+
 	/**
 	 * @brief Size of the next read-ahead request in blocks.
 	 *
@@ -238,6 +302,66 @@ struct bcache_read_ahead {
 	 * of the disk but at most the configured max_read_ahead_blocks.
 	 */
 	uint32_t nr_blocks;
+
+	/**
+	 * @brief Read-ahead window in blocks.
+	 *
+	 * It is doubled when the read-ahead blocks are consumed and halved when
+	 * they are evicted before access.
+	 */
+	uint32_t window;
+
+	/**
+	 * @brief LRU stamp (0: The stream is not used).
+	 */
+	uint32_t stamp;
+
+	/**
+	 * @brief The stream has been detected as sequential.
+	 */
+	bool active;
+};
+
+/**
+ * @brief Block device read-ahead control.
+ */
+struct bcache_read_ahead {
+	/**
+	 * @brief Chain node for the read-ahead request queue of the read-ahead task.
+	 */
+	struct rte_list node;
+
+	/**
+	 * @brief Bitmap of the streams that wait for the read-ahead task.
+	 */
+	uint32_t pending;
+
+	/**
+	 * @brief Bitmap of the pending streams requested by @a bcache_peek.
+	 */
+	uint32_t peeks;
+
+	/**
+	 * @brief The clock of stream LRU stamps.
+	 */
+	uint32_t clock;
+
+	/**
+	 * @brief The read-ahead of device is disabled by @a bcache_set_read_ahead.
+	 */
+	bool disabled;
+
+	struct bcache_read_ahead_stream streams[BCACHE_READ_AHEAD_STREAMS];
+};
+
+/**
+ * @brief Read-ahead statistics of stream.
+ */
+struct bcache_stream_stats {
+	uint32_t triggers;  /* Read-ahead requests triggered by sequential access */
+	uint32_t blocks;    /* Blocks read ahead */
+	uint32_t thrashes;  /* Read-ahead blocks that evicted before access */
+	uint32_t window;    /* Current read-ahead window */
 };
 
 /**
@@ -255,6 +379,22 @@ struct bcache_stats {
 	uint32_t write_transfers;
 	uint32_t write_blocks;
 	uint32_t write_errors;
+	uint32_t write_erase_units;   /* Erase units written by swapout */
+	uint32_t write_erases_saved;  /* Erases saved by coalescing blocks of erase unit */
+	uint32_t write_background;    /* Blocks written back early by the dirty ratio */
+	uint32_t write_throttles;     /* Writers paused by the dirty ratio */
+	uint32_t write_throttle_ms;   /* Time of the pauses (ms, May be ended early) */
+
+	/* Replacement policy */
+	uint32_t hot_hits;    /* Hits on the buffers that referenced more than once */
+	uint32_t cold_hits;   /* Hits on the buffers that referenced once (Promoted) */
+	uint32_t ghost_hits;  /* Misses on the blocks that evicted from cold queue recently */
+	uint32_t evictions;   /* Cached buffers that recycled for other blocks */
+
+	/* Read-ahead */
+	uint32_t read_ahead_streams;  /* Sequential streams detected */
+	uint32_t read_ahead_cancels;  /* Sequential streams replaced by random access */
+	struct bcache_stream_stats streams[BCACHE_READ_AHEAD_STREAMS];
 };
 
 /**
@@ -279,6 +419,7 @@ struct bcache_device {
 	bcache_num_t block_count;
 	uint32_t media_blocks_per_block;
 	int block_to_media_block_shift;
+	uint32_t erase_shift;  /* log2 of media blocks per erase unit */
 	size_t bds_per_group;
 	bcache_device_ioctl ioctl;
 	void *driver_data;
@@ -479,6 +620,10 @@ struct bcache_buffer {
 	uint32_t hold_timer;
 	int references;
 	void *user;
+	uint8_t queue;   /* Replacement queue (BCACHE_QUEUE_xxx) */
+	bool referenced; /* Referenced again since it was loaded */
+	bool dirty;      /* Counted in the dirty buffers of cache */
+	uint8_t write_retries; /* Failed writebacks of the modified data */
 };
 #else /* __cplusplus */
 struct bcache_buffer;
@@ -518,8 +663,24 @@ struct bcache_config {
 	int read_ahead_priority;
 	void *(*stack_alloc)(size_t size);
 	void *(*stack_free)(void *ptr);
+	int policy;   /* Replacement policy (BCACHE_POLICY_xxx) */
+	uint32_t io_depth; /* Swapout and read-ahead requests in flight per task (0: 1) */
+	uint32_t dirty_ratio_low;  /* Percent of cache to start background writeback (0: off) */
+	uint32_t dirty_ratio_high; /* Percent of cache to throttle the writers (0: off) */
 };
 
+/**
+ * Buffer replacement policy
+ *
+ * BCACHE_POLICY_LRU: Plain LRU
+ * BCACHE_POLICY_2Q:  Scan resistant 2Q. The blocks that referenced once stay
+ *                    in the cold queue (1/4 of buffers) and only the blocks
+ *                    that referenced again are promoted to the hot LRU queue,
+ *                    So a sequential pass can not flush the hot blocks.
+ */
+#define BCACHE_POLICY_LRU 0
+#define BCACHE_POLICY_2Q  1
+
 /**
  * External reference to the configuration.
  *
@@ -570,6 +731,14 @@ extern const struct bcache_config bcache_configuration;
 #define BCACHE_READ_AHEAD_TASK_PRIORITY_DEFAULT                                     \
 	BCACHE_SWAPOUT_TASK_PRIORITY_DEFAULT
 
+/**
+ * Default dirty ratio. The swapout writes back the oldest modified buffers
+ * before their hold timers expire if the modified buffers exceed the low
+ * ratio of cache, and the writers are throttled if they exceed the high ratio.
+ */
+#define BCACHE_DIRTY_RATIO_LOW_DEFAULT  25
+#define BCACHE_DIRTY_RATIO_HIGH_DEFAULT 50
+
 /**
  * Default task stack size for swap-out and worker tasks.
  */
@@ -808,6 +977,50 @@ void bcache_purge_dev(struct bcache_device *dd);
 int bcache_set_block_size(struct bcache_device *dd, uint32_t block_size,
 											 bool sync);
 
+/**
+ * @brief Changes the buffer replacement policy of the cache.
+ *
+ * The initial policy is bcache_configuration.policy. The cached blocks are
+ * kept, but the history of 2Q policy is dropped.
+ *
+ * @param policy [in] BCACHE_POLICY_LRU or BCACHE_POLICY_2Q
+ *
+ * @retval 0 Successful operation.
+ * @retval -EINVAL Invalid policy.
+ */
+int bcache_set_policy(int policy);
+
+/**
+ * @brief Sets the dirty ratio of cache.
+ *
+ * The initial ratio is bcache_configuration.dirty_ratio_low/high. If the
+ * modified buffers exceed the low ratio, the swapout writes the oldest of
+ * them back until half of the low ratio is left. If they exceed the high
+ * ratio, the writer that modified a buffer is paused in proportion to the
+ * excess (until the writeback brings them back below the high ratio).
+ *
+ * @param low [in] Percent of cache to start background writeback (0: off)
+ * @param high [in] Percent of cache to throttle the writers (0: off)
+ *
+ * @retval 0 Successful operation.
+ * @retval -EINVAL Invalid ratio.
+ */
+int bcache_set_dirty_ratio(uint32_t low, uint32_t high);
+
+/**
+ * @brief Enables or disables the read-ahead of device.
+ *
+ * The read-ahead is enabled for a new device. If it is disabled, the streams
+ * of device are reset and bcache_peek is ignored.
+ *
+ * @param dd [in] The disk device.
+ * @param enable [in] Enable the read-ahead
+ *
+ * @retval 0 Successful operation.
+ * @retval -ENOTSUP Enable without CONFIG_BCACHE_READ_AHEAD.
+ */
+int bcache_set_read_ahead(struct bcache_device *dd, bool enable);
+
 /**
  * @brief Returns the block device statistics.
  */
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Erase unit writer of flash backed bcache devices
+ */
+
+#ifdef CONFIG_HEADER_FILE
+#include CONFIG_HEADER_FILE
+#endif
+
+#include <string.h>
+
+#include "basework/generic.h"
+#include "basework/dev/bcache_flash.h"
+
+int 
+bcache_flash_write_units(struct bcache_flash_media *fm, 
+	struct bcache_request *r) {
+	const struct bcache_flash_ops *ops = fm->ops;
+	struct bcache_sg_buffer *sg = r->bufs;
+	struct bcache_sg_buffer *end = sg + r->bufnum;
+	uint32_t unit_blocks = fm->erase_size / fm->blksize;
+	int err = 0;
+
+	while (sg < end) {
+		bcache_num_t unit = sg->block / unit_blocks;
+		uint32_t offset = fm->start + unit * fm->erase_size;
+		struct bcache_sg_buffer *first = sg;
+		uint32_t covered = 0;
+
+		for ( ; sg < end && sg->block / unit_blocks == unit; sg++)
+			covered += sg->length;
+
+		if (covered == fm->erase_size) {
+			/* No read back if all blocks of unit are written */
+			err = ops->erase(fm->dev, offset, fm->erase_size);
+			for ( ; first < sg && err >= 0; first++) {
+				uint32_t pos = fm->start + first->block * fm->blksize;
+				err = ops->write(fm->dev, pos, first->buffer, first->length);
+			}
+		} else {
+			os_mtx_lock(&fm->lock);
+			err = ops->read(fm->dev, offset, fm->unit_buf, fm->erase_size);
+			if (err >= 0) {
+				for ( ; first < sg; first++) {
+					uint32_t pos = (first->block % unit_blocks) * fm->blksize;
+					memcpy(fm->unit_buf + pos, first->buffer, first->length);
+				}
+				err = ops->erase(fm->dev, offset, fm->erase_size);
+				if (err >= 0)
+					err = ops->write(fm->dev, offset, fm->unit_buf, fm->erase_size);
+			}
+			os_mtx_unlock(&fm->lock);
+		}
+		if (rte_unlikely(err < 0))
+			return err;
+	}
+	return 0;
+}
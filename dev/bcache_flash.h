@@ -0,0 +1,58 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Erase unit writer of flash backed bcache devices
+ */
+#ifndef BASEWORK_DEV_BCACHE_FLASH_H_
+#define BASEWORK_DEV_BCACHE_FLASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "basework/os/osapi.h"
+#include "basework/dev/bcache.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * The flash operations of media. They return a negative error code on failure
+ */
+struct bcache_flash_ops {
+	int (*read)(void *dev, uint32_t offset, void *buf, size_t size);
+	int (*write)(void *dev, uint32_t offset, const void *buf, size_t size);
+	int (*erase)(void *dev, uint32_t offset, size_t size);
+};
+
+/*
+ * The flash media whose erase unit is divided into blocks of bcache device
+ */
+struct bcache_flash_media {
+	const struct bcache_flash_ops *ops;
+	void *dev;
+	uint32_t start;      /* Offset of the first block on flash */
+	uint32_t blksize;
+	uint32_t erase_size;
+	os_mutex_t lock;     /* Protect unit_buf */
+	uint8_t *unit_buf;   /* Buffer for read-modify-write of erase unit */
+};
+
+/*
+ * bcache_flash_write_units - Write the blocks of request with one erase per
+ * erase unit. The blocks are sorted and the blocks of an erase unit are in
+ * the same request (See bcache_swapout_write), The unit is read back at
+ * first if it is not fully covered by the request.
+ *
+ * @fm: flash media (unit_buf must be erase_size bytes)
+ * @r: write request
+ *
+ * return 0 if success
+ */
+int bcache_flash_write_units(struct bcache_flash_media *fm, 
+	struct bcache_request *r);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASEWORK_DEV_BCACHE_FLASH_H_ */
@@ -39,8 +39,14 @@
 #define NR_BLKS CONFIG_BLKDEV_NR_BUFS
 
 #ifndef _WIN32
-_Static_assert(CONFIG_BLKDEV_NR_BUFS >= 1 && CONFIG_BLKDEV_NR_BUFS < 20, "");
+_Static_assert(CONFIG_BLKDEV_NR_BUFS >= 1, "");
 #endif
+
+/*
+ * The time compare of hold timer (The clock may wrap around)
+ */
+#define bh_time_after(a, b) ((long)((b) - (a)) < 0)
+
 enum bh_state {
     BH_STATE_INVALD = 0,
     BH_STATE_DIRTY,
@@ -48,11 +54,12 @@ enum bh_state {
 };
 
 struct bh_desc {
-    struct rte_list link;
+    struct rte_list link;  /* LRU list (cached) or dirty list (dirty) */
+    struct rte_hnode hash; /* Hashed if the buffer is valid */
     char *buffer;
     size_t blkno; /* block number */
     enum bh_state state;
-    long hold;
+    unsigned long expire; /* The time to write back (dirty) */
 #ifndef CONFIG_ASSERT_DISABLE
     struct disk_device *dd;
 #endif
@@ -63,6 +70,12 @@ struct bh_statitics {
     long cache_missed;
 };
 
+/*
+ * The valid buffers are indexed by a hash table. The clean buffers are kept
+ * in LRU order on cached_list, and the dirty buffers are kept in the order
+ * of their expire time on dirty_list (The hold time is set only when the
+ * buffer becomes dirty). So the sweep only visits the expired buffers.
+ */
 struct block_device {
     os_mutex_t mtx;
     struct disk_device *dd;
@@ -71,6 +84,9 @@ struct block_device {
     struct rte_list link;
     struct bh_desc *bh;
     char *buffer;
+    struct rte_hlist *hashq;
+    uint32_t hash_mask;
+    unsigned long clock; /* Advanced by the sweep (ms) */
     struct bh_statitics stat;
 };
 
@@ -78,9 +94,36 @@ static os_timer_t bh_timer;
 static RTE_LIST(created_list);
 static os_mutex_t bdev_mutex;
 
+static inline struct rte_hlist *
+bh_hash_head(struct block_device *bdev, size_t blkno) {
+    return &bdev->hashq[blkno & bdev->hash_mask];
+}
+
+static inline void 
+bh_hash_insert(struct block_device *bdev, struct bh_desc *bh) {
+    rte_hlist_add_head(&bh->hash, bh_hash_head(bdev, bh->blkno));
+}
+
+static inline void 
+bh_hash_remove(struct bh_desc *bh) {
+    rte_hlist_del_init(&bh->hash);
+}
+
+static struct bh_desc *
+bh_hash_search(struct block_device *bdev, size_t blkno) {
+    struct rte_hnode *pos;
+
+    rte_hlist_foreach(pos, bh_hash_head(bdev, blkno)) {
+        struct bh_desc *bh = rte_container_of(pos, struct bh_desc, hash);
+        if (bh->blkno == blkno)
+            return bh;
+    }
+    return NULL;
+}
+
 static inline void 
 bh_enqueue_dirty(struct block_device *bdev, struct bh_desc *bh) {
-    bh->hold = CONFIG_BLKDEV_HOLD_TIME;
+    bh->expire = bdev->clock + CONFIG_BLKDEV_HOLD_TIME;
     rte_list_add_tail(&bh->link, &bdev->dirty_list);
 }
 
@@ -89,25 +132,27 @@ bh_enqueue_cached(struct block_device *bdev, struct bh_desc *bh) {
     rte_list_add_tail(&bh->link, &bdev->cached_list);
 }
 
+/*
+ * Write back the dirty buffers that expire in the time (from now). The dirty
+ * list is sorted by the expire time, So it stops at the first one that does
+ * not expire.
+ */
 static int 
 blkdev_sync_locked(struct block_device *bdev, long expired, 
     int max_blks, bool invalid) {
-    struct rte_list *pos, *next;
+    unsigned long deadline = bdev->clock + expired;
     struct disk_device *dd;
     struct bh_desc *bh;
     uint32_t ofs;
     int err = 0;
 
-    rte_list_foreach_safe(pos, next, &bdev->dirty_list) {
+    while (!rte_list_empty(&bdev->dirty_list)) {
+        bh = rte_container_of(bdev->dirty_list.next, struct bh_desc, link);
+        if (bh_time_after(bh->expire, deadline))
+            break;
         if (--max_blks < 0)
             break;
 
-        bh = rte_container_of(pos, struct bh_desc, link);
-        if (bh->hold > expired) {
-            bh->hold -= expired;
-            continue;
-        }
-        
         dd = bdev->dd;
         rte_assert(bdev->dd == bh->dd);
 
@@ -126,18 +171,25 @@ blkdev_sync_locked(struct block_device *bdev, long expired,
         }
 
         rte_list_del(&bh->link);
-        if (rte_unlikely(invalid))
+        if (rte_unlikely(invalid)) {
             bh->state = BH_STATE_INVALD;
-        else
+            bh_hash_remove(bh);
+            rte_list_add(&bh->link, &bdev->cached_list);
+        } else {
             bh->state = BH_STATE_CACHED;
-        bh_enqueue_cached(bdev, bh);
+            bh_enqueue_cached(bdev, bh);
+        }
     }
 
     return err;
 }
 
+/*
+ * @elapsed: The time that the clock of devices is advanced
+ * @expired: Write back the buffers that expire in the time
+ */
 static int 
-bdev_sync(long expired, int max_blks, bool invalid) {
+bdev_sync(long elapsed, long expired, int max_blks, bool invalid) {
     struct rte_list *pos;
     int err = 0;
 
@@ -146,6 +198,7 @@ bdev_sync(long expired, int max_blks, bool invalid) {
         struct block_device *bdev = rte_container_of(pos, 
             struct block_device, link);
         os_mtx_lock(&bdev->mtx);
+        bdev->clock += elapsed;
         err |= blkdev_sync_locked(bdev, expired, max_blks, invalid);
         if (expired > CONFIG_BLKDEV_SWAP_PERIOD)
             disk_device_ioctl(bdev->dd, DISK_SYNC, NULL);
@@ -157,60 +210,71 @@ bdev_sync(long expired, int max_blks, bool invalid) {
 static void 
 bh_check_cb(os_timer_t timer, void *arg) {
     (void) arg;
-    int err = bdev_sync(CONFIG_BLKDEV_SWAP_PERIOD, 3, false);
+    int err = bdev_sync(CONFIG_BLKDEV_SWAP_PERIOD, 0, 3, false);
     if (err)
         pr_warn("flush data failed(%d)\n", err);
     os_timer_mod(timer, CONFIG_BLKDEV_SWAP_PERIOD);
 }
 
+/*
+ * The dirty buffer stays on the dirty list with its expire time
+ */
 static int 
 bh_release_modified(struct block_device *bdev, struct bh_desc *bh) {
-    bh->state = BH_STATE_DIRTY;
-    bh_enqueue_dirty(bdev, bh);
+    switch (bh->state) {
+    case BH_STATE_INVALD:
+        bh_hash_insert(bdev, bh);
+        /* Fall through */
+    case BH_STATE_CACHED:
+        bh->state = BH_STATE_DIRTY;
+        bh_enqueue_dirty(bdev, bh);
+        break;
+    default:
+        break;
+    }
     return 0;
 }
 
 static int 
 bh_release(struct block_device *bdev, struct bh_desc *bh) {
-    if (bh->state == BH_STATE_DIRTY)
-        bh_enqueue_dirty(bdev, bh);
-    else
+    switch (bh->state) {
+    case BH_STATE_CACHED:
         bh_enqueue_cached(bdev, bh);
+        break;
+    case BH_STATE_INVALD:
+        /* Reuse it first */
+        rte_list_add(&bh->link, &bdev->cached_list);
+        break;
+    default:
+        break;
+    }
     return 0;
 }
 
 /*
- * The cache block search use list is simplest but not fit lots of blocks
- * If so should use balance binrary tree
+ * The clean buffer is taken from the LRU list and the dirty buffer is left
+ * on the dirty list, So the hit path is O(1)
  */
 static struct bh_desc *bh_search_locked(struct block_device *bdev, uint32_t blkno) {
-    struct rte_list *pos, *next;
     struct bh_desc *bh;
 
-    rte_list_foreach_safe(pos, next, &bdev->cached_list) {
-        bh = rte_container_of(pos, struct bh_desc, link);
-        if (bh->blkno == blkno) {
-            rte_assert(bdev->dd == bh->dd);
-            bdev->stat.cache_hits++;
+    bh = bh_hash_search(bdev, blkno);
+    if (bh != NULL) {
+        rte_assert(bdev->dd == bh->dd);
+        bdev->stat.cache_hits++;
+        if (bh->state == BH_STATE_CACHED)
             rte_list_del(&bh->link);
-            return bh;
-        }
-    }
-    rte_list_foreach_safe(pos, next, &bdev->dirty_list) {
-        bh = rte_container_of(pos, struct bh_desc, link);
-        if (bh->blkno == blkno) {
-            rte_assert(bdev->dd == bh->dd);
-            bdev->stat.cache_hits++;
-            rte_list_del(&bh->link);
-            return bh;
-        }
+        return bh;
     }
+
     if (rte_list_empty(&bdev->cached_list)) 
         blkdev_sync_locked(bdev, CONFIG_BLKDEV_HOLD_TIME, 1, false);
     
     bdev->stat.cache_missed++;
     bh = rte_container_of(bdev->cached_list.next, struct bh_desc, link);
     rte_list_del(&bh->link);
+    if (bh->state != BH_STATE_INVALD)
+        bh_hash_remove(bh);
     bh->blkno = blkno;
     bh->state = BH_STATE_INVALD;
     return bh;
@@ -247,6 +311,7 @@ bh_read_locked(struct block_device *bdev, uint32_t blkno, struct bh_desc **pbh)
     }
 
     bh->state = BH_STATE_CACHED;
+    bh_hash_insert(bdev, bh);
     *pbh = bh;
     return 0;
 }
@@ -255,7 +320,9 @@ static int
 bdev_init(struct disk_device *dd, int nrblk) {
     struct block_device *bdev;
     size_t bdev_size;
+    size_t hash_size;
     size_t size;
+    uint32_t nr_hash;
 
     if (dd == NULL || nrblk == 0)
         return -EINVAL;
@@ -263,28 +330,39 @@ bdev_init(struct disk_device *dd, int nrblk) {
     if (dd->bdev)
         return -EEXIST;
 
-    size = dd->blk_size + sizeof(struct bh_desc);
+    /* The hash table has one bucket for each buffer at least */
+    for (nr_hash = 1; nr_hash < (uint32_t)nrblk; nr_hash <<= 1);
+
+    size = RTE_ALIGN(sizeof(struct bh_desc), sizeof(void *)) + dd->blk_size;
+    size = RTE_ALIGN(size, sizeof(void *));
     bdev_size = RTE_ALIGN(sizeof(*bdev), RTE_CACHE_LINE_SIZE);
-    bdev = general_malloc(bdev_size + size * nrblk);
+    hash_size = RTE_ALIGN(nr_hash * sizeof(struct rte_hlist), sizeof(void *));
+    bdev = general_malloc(bdev_size + hash_size + size * nrblk);
     assert(bdev != NULL);
 
     memset(bdev, 0, sizeof(*bdev));
     os_mtx_init(&bdev->mtx, 0);
     RTE_INIT_LIST(&bdev->cached_list);
     RTE_INIT_LIST(&bdev->dirty_list);
-    bdev->bh = (struct bh_desc *)((char *)bdev + bdev_size);
+    bdev->hashq = (struct rte_hlist *)((char *)bdev + bdev_size);
+    bdev->hash_mask = nr_hash - 1;
+    for (uint32_t i = 0; i < nr_hash; i++)
+        RTE_INIT_HLIST(&bdev->hashq[i]);
+    bdev->bh = (struct bh_desc *)((char *)bdev->hashq + hash_size);
     bdev->dd = dd;
     dd->bdev = bdev;
     
     for (int i = 0; i < nrblk; i++) {
-        bdev->bh->blkno = (size_t)-1;
-        bdev->bh->buffer = (char *)(bdev->bh + 1);
-        bdev->bh->state = BH_STATE_INVALD;
+        struct bh_desc *bh = (struct bh_desc *)((char *)bdev->bh + size * i);
+
+        bh->blkno = (size_t)-1;
+        bh->buffer = (char *)bh + RTE_ALIGN(sizeof(struct bh_desc), sizeof(void *));
+        bh->state = BH_STATE_INVALD;
+        RTE_INIT_HLIST_NODE(&bh->hash);
 #ifndef CONFIG_ASSERT_DISABLE
-        bdev->bh->dd = dd;
+        bh->dd = dd;
 #endif
-        rte_list_add(&bdev->bh->link, &bdev->cached_list);
-        bdev->bh = (void *)((char *)bdev->bh + size);
+        rte_list_add(&bh->link, &bdev->cached_list);
     }
 
     os_mtx_lock(&bdev_mutex);
@@ -295,12 +373,12 @@ bdev_init(struct disk_device *dd, int nrblk) {
 
 int 
 simple_blkdev_sync(void) {
-    return bdev_sync(CONFIG_BLKDEV_HOLD_TIME, INT32_MAX, false);
+    return bdev_sync(0, CONFIG_BLKDEV_HOLD_TIME, INT32_MAX, false);
 }
 
 int 
 simple_blkdev_sync_invalid(void) {
-    return bdev_sync(CONFIG_BLKDEV_HOLD_TIME, INT32_MAX, true);
+    return bdev_sync(0, CONFIG_BLKDEV_HOLD_TIME, INT32_MAX, true);
 }
 
 ssize_t 
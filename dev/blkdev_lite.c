@@ -13,6 +13,7 @@
 
 #include "basework/dev/blkdev.h"
 #include "basework/dev/disk.h"
+#include "basework/dev/flash_erased.h"
 #include "basework/generic.h"
 #include "basework/log.h"
 #include "basework/os/osapi.h"
@@ -51,54 +52,6 @@ struct line_region {
 
 static struct blkdev_wrbuffer blk_buffer;
 
-#if CONFIG_BLKDEV_WRSIZE > 0
-static bool is_wrblock_dirty(const uint8_t *buf, uint32_t offset, 
-    size_t size) {
-#define LOOP_INLINE_SIZE 16
-    const uint32_t *p = (const uint32_t *)&buf[offset];
-    size_t count = size >> 2;
-    size_t n = (count + LOOP_INLINE_SIZE - 1) / LOOP_INLINE_SIZE;
-    uint32_t val = UINT32_MAX;
-
-    switch (count & (LOOP_INLINE_SIZE - 1)) {
-    case 0: do {    val &= *p++;
-
-#if LOOP_INLINE_SIZE > 8
-    case 15:        val &= *p++;
-    case 14:        val &= *p++;
-    case 13:        val &= *p++;
-    case 12:        val &= *p++;
-    case 11:        val &= *p++;
-    case 10:        val &= *p++;
-    case 9:         val &= *p++;
-    case 8:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 8 */
-
-#if LOOP_INLINE_SIZE > 4
-    case 7:         val &= *p++;
-    case 6:         val &= *p++;
-    case 5:         val &= *p++;
-    case 4:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 4 */
-
-#if LOOP_INLINE_SIZE > 2
-    case 3:         val &= *p++;
-    case 2:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 2 */
-
-#if LOOP_INLINE_SIZE > 0
-    case 1:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 0 */
-                    if (val != UINT32_MAX)
-                        return true;
-            } while (--n > 0);
-    }
-
-    return false;
-#undef LOOP_INLINE_SIZE
-}
-#endif /* CONFIG_BLKDEV_WRSIZE > 0 */
-
 static bool region_intersect(const struct line_region *a, 
     const struct line_region *b, struct line_region *out) {
     out->beg = rte_max(a->beg, b->beg);
@@ -133,7 +86,7 @@ static int flush_cache_block(struct disk_device *dd) {
             return err;
         
         for (size_t i = 0; i < BLOCKS_PER_BUFFER; i++) {
-            if (is_wrblock_dirty(bb->buf, ofs, WRITE_BLOCK_SIZE)) {
+            if (!flash_range_erased(&bb->buf[ofs], WRITE_BLOCK_SIZE)) {
                 err = disk_device_write(dd, &bb->buf[ofs], WRITE_BLOCK_SIZE, 
                     bb->offset + ofs);
                 if (err < 0)
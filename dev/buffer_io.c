@@ -12,6 +12,7 @@
 #include <string.h>
 
 #include "basework/dev/disk.h"
+#include "basework/dev/flash_erased.h"
 #include "basework/generic.h"
 #include "basework/log.h"
 #include "basework/malloc.h"
@@ -32,52 +33,6 @@ struct line_region {
 static struct buffered_io *buffered_created;
 static os_mutex_t list_mutex;
 
-static bool is_wrblock_dirty(const uint8_t *buf, uint32_t offset, 
-    size_t size) {
-#define LOOP_INLINE_SIZE 16
-    const uint32_t *p = (const uint32_t *)&buf[offset];
-    size_t count = size >> 2;
-    size_t n = (count + LOOP_INLINE_SIZE - 1) / LOOP_INLINE_SIZE;
-    uint32_t val = UINT32_MAX;
-
-    switch (count & (LOOP_INLINE_SIZE - 1)) {
-    case 0: do {    val &= *p++;
-
-#if LOOP_INLINE_SIZE > 8
-    case 15:        val &= *p++;
-    case 14:        val &= *p++;
-    case 13:        val &= *p++;
-    case 12:        val &= *p++;
-    case 11:        val &= *p++;
-    case 10:        val &= *p++;
-    case 9:         val &= *p++;
-    case 8:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 8 */
-
-#if LOOP_INLINE_SIZE > 4
-    case 7:         val &= *p++;
-    case 6:         val &= *p++;
-    case 5:         val &= *p++;
-    case 4:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 4 */
-
-#if LOOP_INLINE_SIZE > 2
-    case 3:         val &= *p++;
-    case 2:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 2 */
-
-#if LOOP_INLINE_SIZE > 0
-    case 1:         val &= *p++;
-#endif /* LOOP_INLINE_SIZE > 0 */
-                    if (val != UINT32_MAX)
-                        return true;
-            } while (--n > 0);
-    }
-
-    return false;
-#undef LOOP_INLINE_SIZE
-}
-
 static bool region_intersect(const struct line_region *a, 
     const struct line_region *b, struct line_region *out) {
     out->beg = rte_max(a->beg, b->beg);
@@ -86,52 +41,130 @@ static bool region_intersect(const struct line_region *a,
     return out->beg <= out->end;
 }
 
-static int write_eraseable_block(struct disk_device *dd, const void *buf, 
-    size_t blksize, uint32_t offset) {
+static int write_eraseable_block(struct buffered_io *bio, const void *buf, 
+    uint32_t offset) {
     int err;
-    err = disk_device_erase(dd, offset, blksize);
+    err = disk_device_erase(bio->dd, offset, bio->size);
     if (err < 0)
         return err;
     
-    err = disk_device_write(dd, buf, blksize, offset);
+    bio->stat.erases++;
+    err = disk_device_write(bio->dd, buf, bio->size, offset);
     if (err < 0)
         return err;
 
+    bio->stat.writes++;
     return 0;    
 }
 
+static int buffered_flush_block(struct buffered_io *bio, 
+    struct buffered_block *blk) {
+    bool erase = true;
+    int err;
+
+    if (!blk->dirty)
+        return 0;
+
+#ifdef CONFIG_BUFFERED_IO_PROGRAM_IN_PLACE
+    /* Only bits were cleared, So program it over the old data */
+    erase = blk->erase;
+#endif
+    if (erase) {
+        err = disk_device_erase(bio->dd, blk->offset, bio->size);
+        if (err < 0)
+            return err;
+        bio->stat.erases++;
+    } else {
+        bio->stat.erase_skips++;
+    }
+
+    if (bio->wrlimit) {
+        size_t blknum = bio->size / WRITE_BLOCK_SIZE;
+        size_t ofs = 0;
+
+        for (size_t i = 0; i < blknum; i++) {
+            if (!flash_range_erased(&blk->buf[ofs], WRITE_BLOCK_SIZE)) {
+                err = disk_device_write(bio->dd, &blk->buf[ofs], WRITE_BLOCK_SIZE, 
+                    blk->offset + ofs);
+                if (err < 0)
+                    return err;
+                bio->stat.writes++;
+            }
+            ofs += WRITE_BLOCK_SIZE;
+        }
+    } else {
+        err = disk_device_write(bio->dd, blk->buf, bio->size, blk->offset);
+        if (err < 0)
+            return err;
+        bio->stat.writes++;
+    }
+
+    blk->dirty = false;
+    blk->erase = false;
+    return 0;
+}
+
+/*
+ * Get the dirty block that was modified earliest
+ */
+static struct buffered_block *buffered_oldest_dirty(struct buffered_io *bio) {
+    struct buffered_block *oldest = NULL;
+
+    for (int i = 0; i < bio->nr_blks; i++) {
+        struct buffered_block *blk = &bio->blks[i];
+        if (!blk->dirty)
+            continue;
+        if (oldest == NULL || 
+            bio->clock - blk->stamp > bio->clock - oldest->stamp)
+            oldest = blk;
+    }
+    return oldest;
+}
+
 int buffered_flush_locked(struct buffered_io *bio) {
     if (bio->dirty) {
-        if (bio->wrlimit) {
-            size_t blknum = bio->size / WRITE_BLOCK_SIZE;
-            size_t ofs = 0;
-            int err;
+        struct buffered_block *blk;
 
-            err = disk_device_erase(bio->dd, bio->offset, bio->size);
-            if (err < 0)
-                return err;
-            
-            for (size_t i = 0; i < blknum; i++) {
-                if (is_wrblock_dirty(bio->buf, ofs, WRITE_BLOCK_SIZE)) {
-                    err = disk_device_write(bio->dd, &bio->buf[ofs], WRITE_BLOCK_SIZE, 
-                        bio->offset + ofs);
-                    if (err < 0)
-                        return err;
-                }
-                ofs += WRITE_BLOCK_SIZE;
-            }
-        } else {
-            int err = write_eraseable_block(bio->dd, bio->buf, 
-                bio->size, bio->offset);
-            if (err < 0)
+        /* 
+         * Write back in the order of modification, So the block that 
+         * was written last (e.g. a header) never reaches the disk 
+         * before the data written ahead of it
+         */
+        while ((blk = buffered_oldest_dirty(bio)) != NULL) {
+            int err = buffered_flush_block(bio, blk);
+            if (err)
                 return err;
         }
-
         bio->dirty = false;
     }
     return 0;
 }
 
+static struct buffered_block *buffered_lookup(struct buffered_io *bio, 
+    uint32_t offset) {
+    for (int i = 0; i < bio->nr_blks; i++) {
+        if (bio->blks[i].offset == offset)
+            return &bio->blks[i];
+    }
+    return NULL;
+}
+
+/*
+ * Get the block that is not used for the longest time
+ */
+static struct buffered_block *buffered_lru_block(struct buffered_io *bio) {
+    struct buffered_block *victim = &bio->blks[0];
+
+    for (int i = 0; i < bio->nr_blks; i++) {
+        struct buffered_block *blk = &bio->blks[i];
+        if (blk->offset == UINT32_MAX)
+            return blk;
+        if (bio->clock - blk->stamp > bio->clock - victim->stamp)
+            victim = blk;
+    }
+    return victim;
+}
+
 ssize_t buffered_read(struct buffered_io *bio, void *buf, size_t size, 
     uint32_t offset) {
     int err = disk_device_read(bio->dd, buf, size, offset);
@@ -152,21 +185,25 @@ ssize_t buffered_read(struct buffered_io *bio, void *buf, size_t size,
          * We'll have to read it again because other threads 
          * may have been modified 
          */
-        if (bio->dirty) {
+        for (int i = 0; i < bio->nr_blks && bio->dirty; i++) {
+            struct buffered_block *blk = &bio->blks[i];
             struct line_region reader = {
                 .beg = offset,
                 .end = offset + size - 1
             };
             struct line_region cache = {
-                .beg = bio->offset,
-                .end = bio->offset + bio->size - 1
+                .beg = blk->offset,
+                .end = blk->offset + bio->size - 1
             };
             struct line_region out;
 
+            if (!blk->dirty)
+                continue;
+
             if (region_intersect(&reader, &cache, &out)) {
                 memcpy(
                     (char *)buf + out.beg - offset, 
-                    bio->buf + out.beg - cache.beg, 
+                    blk->buf + out.beg - cache.beg, 
                     out.end - out.beg + 1
                 );
             }
@@ -180,6 +217,7 @@ ssize_t buffered_read(struct buffered_io *bio, void *buf, size_t size,
 
 ssize_t buffered_write(struct buffered_io *bio, const void *buf, size_t size, 
     uint32_t offset) {
+    struct buffered_block *blk;
     const char *pbuf = (const char *)buf;
     size_t bytes = size;
     uint32_t aligned_ofs;
@@ -191,15 +229,25 @@ ssize_t buffered_write(struct buffered_io *bio, const void *buf, size_t size,
     while (size > 0) {
         blkin_ofs = offset & bio->mask;
 
+        if (rte_likely(!bio->panic))
+            MTX_LOCK(&bio->mtx);
+
         /*
-         * Write to whole eraseable block
+         * Write to whole eraseable block (The cached copy is out of date)
          */
         if (rte_unlikely(blkin_ofs == 0 && size >= bio->size)) {
-            ret = write_eraseable_block(bio->dd, pbuf, bio->size, 
-                offset);
+            blk = buffered_lookup(bio, offset);
+            if (blk != NULL) {
+                blk->offset = UINT32_MAX;
+                blk->dirty = false;
+            }
+
+            ret = write_eraseable_block(bio, pbuf, offset);
             if (ret < 0)
-                goto _exit;
+                goto _unlock;
             
+            if (rte_likely(!bio->panic))
+                MTX_UNLOCK(&bio->mtx);
             offset += bio->size;
             pbuf += bio->size;
             size -= bio->size;
@@ -209,31 +257,41 @@ ssize_t buffered_write(struct buffered_io *bio, const void *buf, size_t size,
         /* Calculator block algined address */
         aligned_ofs = offset & ~bio->mask;
 
-        if (rte_likely(!bio->panic))
-            MTX_LOCK(&bio->mtx);
-
         /*
-         * If the offset not in the cache range then
-         * synchronize the cached data to disk 
+         * If the offset not in the cache then synchronize the 
+         * least recently used block to disk and reuse it
          */
-        if (bio->offset != aligned_ofs) {
-            ret = buffered_flush_locked(bio);
+        blk = buffered_lookup(bio, aligned_ofs);
+        if (blk == NULL) {
+            blk = buffered_lru_block(bio);
+            ret = buffered_flush_block(bio, blk);
             if (ret)
                 goto _unlock;
 
             /* Read a block of data into a buffer */
-            ret = disk_device_read(bio->dd, bio->buf, bio->size,
+            blk->offset = UINT32_MAX;
+            ret = disk_device_read(bio->dd, blk->buf, bio->size,
                 aligned_ofs);
             if (ret < 0)
                 goto _unlock;
 
-            bio->offset = aligned_ofs;
+            blk->offset = aligned_ofs;
+            blk->erase = false;
+            bio->stat.fills++;
+        } else {
+            bio->stat.hits++;
         }
 
         /* Copy data to write buffer */
         remain = bio->size - blkin_ofs;
         cplen  = rte_min(size, remain);
-        memcpy(bio->buf + blkin_ofs, pbuf, cplen);
+#ifdef CONFIG_BUFFERED_IO_PROGRAM_IN_PLACE
+        if (!blk->erase)
+            blk->erase = !flash_range_programmable(blk->buf + blkin_ofs, pbuf, cplen);
+#endif
+        memcpy(blk->buf + blkin_ofs, pbuf, cplen);
+        blk->stamp = ++bio->clock;
+        blk->dirty = true;
         bio->dirty = true;
 
         if (rte_likely(!bio->panic))
@@ -247,24 +305,23 @@ ssize_t buffered_write(struct buffered_io *bio, const void *buf, size_t size,
 
     return bytes;
 _unlock:
-    MTX_UNLOCK(&bio->mtx);
-_exit:
+    if (rte_likely(!bio->panic))
+        MTX_UNLOCK(&bio->mtx);
     return ret;
 }
 
 static int buffered_ioflush_locked(struct buffered_io *bio, bool invalid) {
-    int err = 0;
-    if (bio->dirty) {
-        err = buffered_flush_locked(bio);
-        if (!err && invalid)
-            bio->offset = UINT32_MAX;
+    int err = buffered_flush_locked(bio);
+    if (!err && invalid) {
+        for (int i = 0; i < bio->nr_blks; i++)
+            bio->blks[i].offset = UINT32_MAX;
     }
     return err;
 }
 
 int buffered_ioflush(struct buffered_io *bio, bool invalid) {
     int err = 0;
-    if (bio->dirty) {
+    if (bio->dirty || invalid) {
         MTX_LOCK(&bio->mtx);
         err = buffered_ioflush_locked(bio, invalid);
         MTX_UNLOCK(&bio->mtx);
@@ -294,18 +351,27 @@ void buffered_iopanic(void) {
         iter->panic = true;
 }
 
+void buffered_iostat(struct buffered_io *bio, struct buffered_iostat *stat) {
+    MTX_LOCK(&bio->mtx);
+    *stat = bio->stat;
+    MTX_UNLOCK(&bio->mtx);
+}
+
 int buffered_ioinit(struct disk_device *dd, struct buffered_io *bio, 
-    void *blkbuf, size_t blksize, bool wrlimit) {
+    void *blkbuf, size_t blksize, size_t nr_blks, bool wrlimit) {
     size_t erase_blksz;
     size_t newsize;
     int err;
 
-    if (dd == NULL || bio == NULL)
+    if (dd == NULL || bio == NULL || blkbuf == NULL)
         return -EINVAL;
 
     if (blksize & (blksize - 1)) 
         return -EINVAL;
 
+    if (nr_blks == 0 || nr_blks > CONFIG_BUFFERED_IO_MAX_BLKS)
+        return -EINVAL;
+
     MTX_INIT(&bio->mtx);
     MTX_LOCK(&bio->mtx);
 
@@ -321,10 +387,18 @@ int buffered_ioinit(struct disk_device *dd, struct buffered_io *bio,
     bio->dirty   = false;
     bio->panic   = false;
     bio->wrlimit = wrlimit;
-    bio->offset  = UINT32_MAX;
     bio->size    = newsize;
     bio->mask    = newsize - 1;
-    bio->buf     = blkbuf;
+    bio->clock   = 0;
+    bio->nr_blks = (uint16_t)nr_blks;
+    memset(&bio->stat, 0, sizeof(bio->stat));
+    for (size_t i = 0; i < nr_blks; i++) {
+        bio->blks[i].offset = UINT32_MAX;
+        bio->blks[i].stamp  = 0;
+        bio->blks[i].dirty  = false;
+        bio->blks[i].erase  = false;
+        bio->blks[i].buf    = (uint8_t *)blkbuf + i * blksize;
+    }
     err          = 0;
 
     /* Add new node to created list */
@@ -338,8 +412,8 @@ _unlock:
     return err;
 }
 
-int buffered_iocreate(struct disk_device *dd, size_t blksize, bool wrlimit,
-    struct buffered_io **pbio) {
+int buffered_iocreate(struct disk_device *dd, size_t blksize, size_t nr_blks,
+    bool wrlimit, struct buffered_io **pbio) {
     struct buffered_io *bio;
     int err;
 
@@ -349,12 +423,15 @@ int buffered_iocreate(struct disk_device *dd, size_t blksize, bool wrlimit,
     if (dd == NULL || pbio == NULL)
         return -EINVAL;
 
-    bio = general_calloc(1, blksize + sizeof(*bio));
+    if (nr_blks == 0 || nr_blks > CONFIG_BUFFERED_IO_MAX_BLKS)
+        return -EINVAL;
+
+    bio = general_calloc(1, blksize * nr_blks + sizeof(*bio));
     if (bio == NULL)
         return -ENOMEM;
 
     bio->allocated = true;
-    err = buffered_ioinit(dd, bio, bio + 1, blksize, wrlimit);
+    err = buffered_ioinit(dd, bio, bio + 1, blksize, nr_blks, wrlimit);
     if (err)
         goto _freem;
 
@@ -11,18 +11,43 @@ extern "C"{
 #endif
 struct disk_device;
 
+/*
+ * The maximum number of block buffers for each buffered_io
+ */
+#ifndef CONFIG_BUFFERED_IO_MAX_BLKS
+#define CONFIG_BUFFERED_IO_MAX_BLKS 4
+#endif
+
+struct buffered_block {
+    uint32_t   offset;
+    uint32_t   stamp; /* Last access time (LRU) */
+    bool       dirty;
+    bool       erase; /* The dirty data can not be programmed without erase */
+    uint8_t    *buf;
+};
+
+struct buffered_iostat {
+    uint32_t   hits;    /* Write hits of the cached blocks */
+    uint32_t   fills;   /* Blocks that are read into the buffer */
+    uint32_t   erases;  /* Erase operations of the disk */
+    uint32_t   writes;  /* Write operations of the disk */
+    uint32_t   erase_skips; /* Flushes that are programmed without erase */
+};
+
 struct buffered_io {
     struct disk_device *dd;
     struct buffered_io *next;
     os_mutex_t mtx;
-    uint32_t   offset;
     uint32_t   size;  /* Block size */
     uint32_t   mask;  /* Block size mask */
-    bool       dirty;
+    uint32_t   clock;
+    uint16_t   nr_blks;
+    bool       dirty; /* Any block is dirty */
     bool       allocated;
     bool       wrlimit;
     bool       panic;
-    uint8_t    *buf;  /* Block buffer */
+    struct buffered_iostat stat;
+    struct buffered_block blks[CONFIG_BUFFERED_IO_MAX_BLKS];
 };
 
 /*
@@ -38,15 +63,33 @@ ssize_t buffered_read(struct buffered_io *bio, void *buf, size_t size,
 ssize_t buffered_write(struct buffered_io *bio, const void *buf, size_t size,
     uint32_t offset);
 
+/*
+ * buffered_ioflush - Write back all dirty blocks
+ *
+ * The dirty blocks are written in the order they were last modified
+ * (oldest first). So if a block is written after the others (e.g. a
+ * header that points to the data), It reaches the disk after them.
+ * The replacement of a block by buffered_write() also writes the oldest
+ * one first. Writes of whole blocks bypass the cache and go to disk
+ * immediately.
+ */
 int buffered_ioflush(struct buffered_io *bio, bool invalid);
 
 int buffered_ioflush_all(bool invalid);
 
+/*
+ * buffered_ioinit - Initialize buffered I/O object
+ * @blkbuf: The buffer of blocks (blksize * nr_blks bytes)
+ * @nr_blks: The number of blocks that are cached (LRU replacement),
+ *           The dirty block is written back when it is replaced or flushed
+ */
 int buffered_ioinit(struct disk_device *dd, struct buffered_io *bio,
-    void *blkbuf, size_t blksize, bool wrlimit);
+    void *blkbuf, size_t blksize, size_t nr_blks, bool wrlimit);
+
+int buffered_iocreate(struct disk_device *dd, size_t blksize, size_t nr_blks,
+    bool wrlimit, struct buffered_io **pbio);
 
-int buffered_iocreate(struct disk_device *dd, size_t blksize, bool wrlimit,
-    struct buffered_io **pbio);
+void buffered_iostat(struct buffered_io *bio, struct buffered_iostat *stat);
 
 int buffered_iodestroy(struct buffered_io *bio);
 
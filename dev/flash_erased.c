@@ -0,0 +1,176 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Erased-state check of flash data
+ *
+ * The data is scanned with the widest vector of the target (AVX2/SSE2 on
+ * host and NEON on Cortex-A), Otherwise 64-bit words are used. The result
+ * is accumulated for a chunk and checked once, So the loop has no branch
+ * for each word.
+ */
+
+#ifdef CONFIG_HEADER_FILE
+#include CONFIG_HEADER_FILE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "basework/dev/flash_erased.h"
+
+#define CHUNK_SIZE 64
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * Check the chunks of CHUNK_SIZE bytes and return the number of bytes checked
+ */
+static size_t erased_chunks(const uint8_t *p, size_t size, bool *erased) {
+    size_t n = size & ~(size_t)(CHUNK_SIZE - 1);
+    size_t i;
+
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        __m256i acc = _mm256_and_si256(
+            _mm256_loadu_si256((const __m256i *)(p + i)),
+            _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+        if (!_mm256_testc_si256(acc, ones))
+            goto _dirty;
+    }
+#elif defined(__SSE2__)
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        __m128i acc = _mm_and_si128(
+            _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                _mm_loadu_si128((const __m128i *)(p + i + 16))),
+            _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_set1_epi8((char)0xFF))) != 0xFFFF)
+            goto _dirty;
+    }
+#elif defined(__ARM_NEON)
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        uint8x16_t acc = vandq_u8(
+            vandq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+            vandq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+        uint64x2_t v = vreinterpretq_u64_u8(acc);
+        if ((vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) != UINT64_MAX)
+            goto _dirty;
+    }
+#else
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        uint64_t acc = load64(p + i) & load64(p + i + 8) &
+            load64(p + i + 16) & load64(p + i + 24) &
+            load64(p + i + 32) & load64(p + i + 40) &
+            load64(p + i + 48) & load64(p + i + 56);
+        if (acc != UINT64_MAX)
+            goto _dirty;
+    }
+#endif
+    *erased = true;
+    return n;
+
+_dirty:
+    *erased = false;
+    return n;
+}
+
+static size_t programmable_chunks(const uint8_t *old, const uint8_t *data,
+    size_t size, bool *ok) {
+    size_t n = size & ~(size_t)(CHUNK_SIZE - 1);
+    size_t i;
+
+    /* The bits that have to be set: data & ~old */
+#if defined(__AVX2__)
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        __m256i acc = _mm256_or_si256(
+            _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(old + i)),
+                _mm256_loadu_si256((const __m256i *)(data + i))),
+            _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(old + i + 32)),
+                _mm256_loadu_si256((const __m256i *)(data + i + 32))));
+        if (!_mm256_testz_si256(acc, acc))
+            goto _failed;
+    }
+#elif defined(__SSE2__)
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        __m128i acc = _mm_setzero_si128();
+        for (size_t j = 0; j < CHUNK_SIZE; j += 16) {
+            acc = _mm_or_si128(acc, _mm_andnot_si128(
+                _mm_loadu_si128((const __m128i *)(old + i + j)),
+                _mm_loadu_si128((const __m128i *)(data + i + j))));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+            goto _failed;
+    }
+#elif defined(__ARM_NEON)
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (size_t j = 0; j < CHUNK_SIZE; j += 16)
+            acc = vorrq_u8(acc, vbicq_u8(vld1q_u8(data + i + j), vld1q_u8(old + i + j)));
+        uint64x2_t v = vreinterpretq_u64_u8(acc);
+        if ((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) != 0)
+            goto _failed;
+    }
+#else
+    for (i = 0; i < n; i += CHUNK_SIZE) {
+        uint64_t acc = 0;
+        for (size_t j = 0; j < CHUNK_SIZE; j += 8)
+            acc |= load64(data + i + j) & ~load64(old + i + j);
+        if (acc != 0)
+            goto _failed;
+    }
+#endif
+    *ok = true;
+    return n;
+
+_failed:
+    *ok = false;
+    return n;
+}
+
+bool flash_range_erased(const void *buf, size_t size) {
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t acc = UINT64_MAX;
+    bool erased;
+    size_t n;
+
+    n = erased_chunks(p, size, &erased);
+    if (!erased)
+        return false;
+
+    for ( ; n + 8 <= size; n += 8)
+        acc &= load64(p + n);
+    for ( ; n < size; n++)
+        acc &= p[n] | ~(uint64_t)0xFF;
+
+    return acc == UINT64_MAX;
+}
+
+bool flash_range_programmable(const void *old, const void *data, size_t size) {
+    const uint8_t *po = (const uint8_t *)old;
+    const uint8_t *pd = (const uint8_t *)data;
+    uint64_t acc = 0;
+    bool ok;
+    size_t n;
+
+    n = programmable_chunks(po, pd, size, &ok);
+    if (!ok)
+        return false;
+
+    for ( ; n + 8 <= size; n += 8)
+        acc |= load64(pd + n) & ~load64(po + n);
+    for ( ; n < size; n++)
+        acc |= pd[n] & ~po[n] & 0xFF;
+
+    return acc == 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Erased-state check of flash data
+ */
+#ifndef BASEWORK_DEV_FLASH_ERASED_H_
+#define BASEWORK_DEV_FLASH_ERASED_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * flash_range_erased - Check whether the data is all 0xFF (erased state)
+ * @buf: data buffer (No alignment is required)
+ * @size: data size
+ *
+ * return true if all bytes are 0xFF
+ */
+bool flash_range_erased(const void *buf, size_t size);
+
+/*
+ * flash_range_programmable - Check whether the data can be programmed over
+ * the old data without erase. The program operation of NOR flash can only
+ * clear bits, So it is true if (old & data) == data
+ *
+ * @old: The current data of flash
+ * @data: The new data
+ * @size: data size
+ */
+bool flash_range_programmable(const void *old, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASEWORK_DEV_FLASH_ERASED_H_ */
@@ -668,7 +668,7 @@ int pt_file_init(struct ptfs_class *ctx, const char *name, uint32_t start,
         ctx->flush      = ptblk_flush;
     } else if (iotype == PTFS_IO_LITE) {
         size_t devblksz = disk_device_get_block_size(ctx->dd);
-        err = buffered_iocreate(ctx->dd, devblksz, false, &ctx->bio);
+        err = buffered_iocreate(ctx->dd, devblksz, 2, false, &ctx->bio);
         if (err) {
             pr_err("Create buffered-I/O failed(%d)\n", err);
             return err;
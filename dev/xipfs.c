@@ -26,6 +26,7 @@
 #include "basework/minmax.h"
 #include "basework/system.h"
 #include "basework/generic.h"
+#include "basework/lib/crc.h"
 
 
 struct xip_file {
@@ -46,17 +47,14 @@ struct xipfs_observer {
     struct xipfs_context *ctx;
 };
 
-struct free_area {
-    uint16_t blkofs;
-    uint16_t blknum;
-};
-
-struct scan_result {
-    struct free_area areas[CONFIG_XIPFS_MAXFILES + 1];
-    uint16_t count;
-};
-
 #define XIPFS_MAGIC BUILD_NAME('X', 'P', 'F', 'S')
+#define XIPFS_JOURNAL_MAGIC BUILD_NAME('X', 'P', 'J', 'N')
+
+/*
+ * The inode has two copies in the first block, And they are written
+ * alternately. So the power failure during writing does not destroy it
+ */
+#define XIPFS_INODE_COPY_OFFSET (CONFIG_XIPFS_BLKSIZE / 2)
 #define BUILD_NAME(_a, _b, _c, _d) \
     (((uint32_t)(_d) << 24) | \
      ((uint32_t)(_c) << 16) | \
@@ -84,8 +82,12 @@ struct scan_result {
 
 _Static_assert(XIPFS_MAX_INODES >= CONFIG_XIPFS_MAXFILES, "");
 _Static_assert(!(CONFIG_XIPFS_BLKSIZE & (CONFIG_XIPFS_BLKSIZE - 1)), "");
+_Static_assert(sizeof(struct xipfs_inode) <= XIPFS_INODE_COPY_OFFSET, "");
 
 static int check_free_space(struct xipfs_context *ctx, size_t reqblksz);
+static void extent_rebuild_locked(struct xipfs_context *ctx);
+static int compact_step_locked(struct xipfs_context *ctx, char *blkbuf);
+static int compact_move_locked(struct xipfs_context *ctx, char *blkbuf);
 
 static struct xip_file fds_table[XIPFS_MAXFILE_OPENED];
 
@@ -136,6 +138,66 @@ static inline void delayed_sync(struct xipfs_context *ctx, bool force) {
         os_timer_mod(ctx->timer, XIPFS_SYNC_PERIOD);
 }
 
+static uint16_t inode_crc(struct xipfs_inode *inode) {
+    uint16_t hcrc = inode->hcrc;
+    uint16_t crc;
+
+    inode->hcrc = 0;
+    crc = lib_crc16((const uint8_t *)inode, sizeof(*inode));
+    inode->hcrc = hcrc;
+    return crc;
+}
+
+static inline bool inode_is_valid(struct xipfs_inode *inode) {
+    return inode->magic == XIPFS_MAGIC && inode->hcrc == inode_crc(inode);
+}
+
+static int inode_write_locked(struct xipfs_context *ctx) {
+    uint32_t copy = ctx->icopy ^ 1;
+    int err;
+
+    ctx->inode.seq++;
+    ctx->inode.hcrc = inode_crc(&ctx->inode);
+    err = blkdev_write(ctx->dd, &ctx->inode, sizeof(ctx->inode), 
+        ctx->offset + copy * XIPFS_INODE_COPY_OFFSET);
+    if (err < 0)
+        return err;
+
+    ctx->icopy = (uint8_t)copy;
+    ctx->dirty = false;
+    return 0;
+}
+
+/*
+ * Load the newest copy of inode. The filesystem that has only one copy
+ * (The old version) has no checksum.
+ */
+static int inode_load_locked(struct xipfs_context *ctx) {
+    struct xipfs_inode *copy;
+    int err;
+
+    err = blkdev_read(ctx->dd, &ctx->inode, sizeof(ctx->inode), ctx->offset);
+    if (err < 0)
+        return err;
+
+    copy = general_malloc(sizeof(*copy));
+    if (copy == NULL)
+        return -ENOMEM;
+
+    ctx->icopy = 0;
+    err = blkdev_read(ctx->dd, copy, sizeof(*copy), 
+        ctx->offset + XIPFS_INODE_COPY_OFFSET);
+    if (err >= 0 && inode_is_valid(copy)) {
+        if (!inode_is_valid(&ctx->inode) ||
+            (int32_t)(copy->seq - ctx->inode.seq) > 0) {
+            memcpy(&ctx->inode, copy, sizeof(*copy));
+            ctx->icopy = 1;
+        }
+    }
+    general_free(copy);
+    return 0;
+}
+
 static inline uint32_t idx_to_offset(struct xipfs_context *ctx, 
     uint32_t idx, uint32_t *end) {
     uint32_t start = ctx->offset + (idx << const_ilog2(CONFIG_XIPFS_BLKSIZE));
@@ -143,6 +205,28 @@ static inline uint32_t idx_to_offset(struct xipfs_context *ctx,
     return start;
 }
 
+static inline bool journal_is_active(const struct xipfs_inode *inode) {
+    return inode->journal.magic == XIPFS_JOURNAL_MAGIC;
+}
+
+static inline bool file_is_moving(struct xipfs_context *ctx, 
+    const struct fmeta_data *pmeta) {
+    return journal_is_active(&ctx->inode) && 
+        &ctx->inode.meta[ctx->inode.journal.file] == pmeta;
+}
+
+/*
+ * If the file is being moved, the blocks that have been moved 
+ * are at the destination
+ */
+static inline uint32_t file_blkidx(struct xipfs_context *ctx, 
+    const struct fmeta_data *pmeta, uint32_t idx) {
+    if (rte_unlikely(file_is_moving(ctx, pmeta)) && 
+        idx < ctx->inode.journal.done)
+        return ctx->inode.journal.dst + idx;
+    return pmeta->blkofs + idx;
+}
+
 static uint32_t extofs_to_inofs(struct xipfs_context *ctx, 
 	struct fmeta_data *pmeta, uint32_t offset, uint32_t *end) {
     uint8_t idx = offset >> const_ilog2(CONFIG_XIPFS_BLKSIZE);
@@ -150,7 +234,7 @@ static uint32_t extofs_to_inofs(struct xipfs_context *ctx,
 
     uint32_t ofs = offset & (CONFIG_XIPFS_BLKSIZE - 1);
     uint32_t start = idx_to_offset(ctx,
-        IDX_CONVERT(pmeta->blkofs + idx), end);
+        IDX_CONVERT(file_blkidx(ctx, pmeta, idx)), end);
 
     pr_dbg("%s idx(%d) start(%x) offset(%d)\n", 
         __func__, idx, start, offset);
@@ -165,12 +249,6 @@ static inline void bitvect_clear(uint32_t *bitmap, uint32_t idx) {
     bitmap[idx >> 5] &= ~BIT((idx & 31));
 }
 
-static void bitvec_move(uint32_t *bitmap, uint32_t dstidx, 
-    uint32_t srcidx) {
-    bitvect_clear(bitmap, srcidx);
-    bitvect_set(bitmap, dstidx);
-}
-
 static int idx_alloc(uint32_t *bitmap, size_t n, uint32_t offset) {
     uint32_t ofs = offset & 31;
     for (uint32_t index = 0, i = offset >> 5; i < n; i++) {
@@ -205,10 +283,111 @@ static inline int inode_free(struct xipfs_inode *inode, int idx) {
         rte_array_size(inode->i_bitmap), idx);
 }
 
+/*
+ * Remove blocks from the free area that contains them
+ */
+static void extent_take_locked(struct xipfs_context *ctx, 
+    uint32_t blkofs, uint32_t blknum) {
+    struct xipfs_extent *e = ctx->extents;
+    uint32_t end = blkofs + blknum;
+    uint16_t i;
+
+    if (blknum == 0)
+        return;
+
+    for (i = 0; i < ctx->nextents; i++) {
+        if (blkofs < (uint32_t)e[i].blkofs + e[i].blknum)
+            break;
+    }
+    assert(i < ctx->nextents);
+    assert(blkofs >= e[i].blkofs && end <= (uint32_t)e[i].blkofs + e[i].blknum);
+
+    if (blkofs == e[i].blkofs) {
+        e[i].blkofs += blknum;
+        e[i].blknum -= blknum;
+        if (e[i].blknum == 0) {
+            memmove(&e[i], &e[i + 1], (ctx->nextents - i - 1) * sizeof(*e));
+            ctx->nextents--;
+        }
+    } else if (end == (uint32_t)e[i].blkofs + e[i].blknum) {
+        e[i].blknum -= blknum;
+    } else {
+        /* Split the free area */
+        assert(ctx->nextents < XIPFS_MAX_EXTENTS);
+        memmove(&e[i + 2], &e[i + 1], (ctx->nextents - i - 1) * sizeof(*e));
+        e[i + 1].blkofs = end;
+        e[i + 1].blknum = e[i].blkofs + e[i].blknum - end;
+        e[i].blknum = blkofs - e[i].blkofs;
+        ctx->nextents++;
+    }
+    ctx->freeblks -= blknum;
+}
+
+/*
+ * Add blocks to the free areas and merge them with the neighbours
+ */
+static void extent_give_locked(struct xipfs_context *ctx, 
+    uint32_t blkofs, uint32_t blknum) {
+    struct xipfs_extent *e = ctx->extents;
+    uint32_t end = blkofs + blknum;
+    bool prev, next;
+    uint16_t i;
+
+    if (blknum == 0)
+        return;
+
+    for (i = 0; i < ctx->nextents; i++) {
+        if (e[i].blkofs > blkofs)
+            break;
+    }
+
+    prev = i > 0 && (uint32_t)e[i - 1].blkofs + e[i - 1].blknum == blkofs;
+    next = i < ctx->nextents && e[i].blkofs == end;
+    if (prev && next) {
+        e[i - 1].blknum += blknum + e[i].blknum;
+        memmove(&e[i], &e[i + 1], (ctx->nextents - i - 1) * sizeof(*e));
+        ctx->nextents--;
+    } else if (prev) {
+        e[i - 1].blknum += blknum;
+    } else if (next) {
+        e[i].blkofs = blkofs;
+        e[i].blknum += blknum;
+    } else {
+        assert(ctx->nextents < XIPFS_MAX_EXTENTS);
+        memmove(&e[i + 1], &e[i], (ctx->nextents - i) * sizeof(*e));
+        e[i].blkofs = blkofs;
+        e[i].blknum = blknum;
+        ctx->nextents++;
+    }
+    ctx->freeblks += blknum;
+}
+
+static void blocks_reserve_locked(struct xipfs_context *ctx, 
+    uint32_t blkofs, uint32_t blknum) {
+    for (uint32_t i = blkofs; i < blkofs + blknum; i++)
+        bitvect_set(ctx->inode.i_bitmap, i);
+    extent_take_locked(ctx, blkofs, blknum);
+}
+
+static void blocks_release_locked(struct xipfs_context *ctx, 
+    uint32_t blkofs, uint32_t blknum) {
+    for (uint32_t i = blkofs; i < blkofs + blknum; i++)
+        inode_free(&ctx->inode, i);
+    extent_give_locked(ctx, blkofs, blknum);
+}
+
 static void file_metadata_clear_locked(struct xipfs_context *ctx, 
     struct fmeta_data *pmeta) {
-    for (int i = 0; i < (int)pmeta->blknum; i++)
-        inode_free(&ctx->inode, pmeta->blkofs + i);
+    /* Cancel the movement and free the destination blocks */
+    if (file_is_moving(ctx, pmeta)) {
+        struct xipfs_journal *j = &ctx->inode.journal;
+        uint32_t end = rte_min_t(uint32_t, j->dst + pmeta->blknum, pmeta->blkofs);
+
+        blocks_release_locked(ctx, j->dst, end - j->dst);
+        j->magic = 0;
+    }
+    blocks_release_locked(ctx, pmeta->blkofs, pmeta->blknum);
+    ctx->maps[pmeta - ctx->inode.meta] = 0;
     memset(pmeta, 0, sizeof(*pmeta));
     ctx->dirty = true;
 }
@@ -253,6 +432,29 @@ static void file_free(struct xip_file *filp) {
 	filp->used = false;
 }
 
+static bool file_is_writing(const struct fmeta_data *pmeta) {
+	for (size_t i = 0; i < rte_array_size(fds_table); i++) {
+		const struct xip_file *filp = &fds_table[i];
+		if (filp->used && 
+			(filp->oflags & VFS_O_MASK) != VFS_O_RDONLY &&
+			(pmeta == NULL || filp->pmeta == pmeta))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * The file that is opened or mapped must stay at its address
+ */
+static bool file_is_pinned(struct xipfs_context *ctx, 
+    const struct fmeta_data *pmeta) {
+	for (size_t i = 0; i < rte_array_size(fds_table); i++) {
+		if (fds_table[i].used && fds_table[i].pmeta == pmeta)
+			return true;
+	}
+	return ctx->maps[pmeta - ctx->inode.meta] > 0;
+}
+
 static int curr_avaliable_space(struct xipfs_context *ctx, 
     struct xip_file *filp, uint32_t offset, 
     uint32_t *start, uint32_t *end) {
@@ -266,6 +468,7 @@ static int curr_avaliable_space(struct xipfs_context *ctx,
             pr_err("allocate inode failed\n");
             return -ENODATA;
         }
+        extent_take_locked(ctx, newidx, 1);
 
         if (rte_unlikely(pmeta->blknum == 0))
             pmeta->blkofs = (uint16_t)newidx;
@@ -318,10 +521,11 @@ struct xip_file *fxip_ll_open(struct xipfs_context *ctx,
         strncpy(pmeta->name, name, MAX_XIPFS_FILENAME-1);
     }
 
-    MTX_UNLOCK(&ctx->mtx);
+    /* The compactor checks the opened files under the lock */
     filp->pmeta = pmeta;
     filp->oflags = mode & VFS_O_MASK;
     filp->oflags |= PFLILE_O_FLAGS;
+    MTX_UNLOCK(&ctx->mtx);
     return filp;
 
 _free_fp:
@@ -445,6 +649,10 @@ int fxip_ll_close(struct xipfs_context *ctx, struct xip_file *filp) {
         blkdev_sync();
     file_free(filp);
 	xipfs_dump(&ctx->inode);
+
+    /* The compactor is paused by the writer */
+    if (!file_is_writing(NULL))
+        os_timer_mod(ctx->compact_timer, CONFIG_XIPFS_COMPACT_DELAY);
     MTX_UNLOCK(&ctx->mtx);
     return 0;
 }
@@ -496,6 +704,7 @@ int fxip_ll_unlink(struct xipfs_context *ctx, const char *name) {
 		pr_dbg("%s delete %s\n", name);
         file_metadata_clear_locked(ctx, pmeta);
         delayed_sync(ctx, ctx->dirty);
+        os_timer_mod(ctx->compact_timer, CONFIG_XIPFS_COMPACT_DELAY);
         err = 0;
         goto _unlock;
     }
@@ -547,26 +756,32 @@ static void fxip_sync_check(os_timer_t timer, void *arg) {
     (void) timer;
     if (ctx->dirty) {
         MTX_LOCK(&ctx->mtx);
-        if (ctx->dirty) {
-            ctx->dirty = false;
-            blkdev_write(ctx->dd, &ctx->inode, 
-                sizeof(ctx->inode), ctx->offset);
-        }
+        if (ctx->dirty)
+            inode_write_locked(ctx);
         MTX_UNLOCK(&ctx->mtx);
     }
 }
 
 void fxip_ll_reset(struct xipfs_context *ctx) {
+    uint32_t seq;
+
 	pr_dbg("Format xip filesystem\n");
 	
     MTX_LOCK(&ctx->mtx);
+    seq = ctx->inode.seq;
     memset(&ctx->inode, 0, sizeof(ctx->inode));
     ctx->inode.magic = XIPFS_MAGIC;
 
+    /* The old copy of inode must not be newer */
+    ctx->inode.seq = seq;
+
 	/* 
 	 * The first block is used to save filesystem information 
 	 */
     ctx->inode.i_bitmap[0] = 0x1;
+    ctx->jsynced = 0;
+    memset(ctx->maps, 0, sizeof(ctx->maps));
+    extent_rebuild_locked(ctx);
 	
     ctx->dirty = true;
     delayed_sync(ctx, ctx->dirty);
@@ -574,20 +789,149 @@ void fxip_ll_reset(struct xipfs_context *ctx) {
     MTX_UNLOCK(&ctx->mtx);
 }
 
-uint32_t fxip_ll_map(struct xipfs_context *ctx, struct xip_file *filp, 
-    size_t *size) {
+int fxip_ll_map(struct xipfs_context *ctx, struct xip_file *filp, 
+    size_t *size, uint32_t *paddr) {
     uint32_t end, addr;
+    int err = 0;
 	
-    if (size)
-        *size = filp->pmeta->size;
-	
+    /* The file data must be contiguous */
+    MTX_LOCK(&ctx->mtx);
+    if (file_is_moving(ctx, filp->pmeta)) {
+        char *blkbuf = cache_blk_alloc(CONFIG_XIPFS_BLKSIZE);
+        
+        if (blkbuf == NULL) {
+            err = -ENOMEM;
+            goto _unlock;
+        }
+        while (file_is_moving(ctx, filp->pmeta)) {
+            err = compact_move_locked(ctx, blkbuf);
+            if (err < 0)
+                break;
+        }
+        cache_blk_free(blkbuf);
+
+        /* The source is half moved, So the address is not valid */
+        if (err < 0) {
+            pr_err("%s move %s failed(%d)\n", __func__, filp->pmeta->name, err);
+            goto _unlock;
+        }
+        err = 0;
+    }
+
+    /* The mapped file is not moved by the compactor */
+    if (ctx->maps[filp->pmeta - ctx->inode.meta] < UINT8_MAX)
+        ctx->maps[filp->pmeta - ctx->inode.meta]++;
     addr = idx_to_offset(ctx, 
         IDX_CONVERT(filp->pmeta->blkofs), &end);
+    if (size)
+        *size = filp->pmeta->size;
+    *paddr = addr;
+    MTX_UNLOCK(&ctx->mtx);
 
 	pr_dbg("%s map %s to memory 0x%08x (blkofs: %d)\n", __func__, 
 		filp->pmeta->name, addr, filp->pmeta->blkofs);
 	
-    return addr;
+    return 0;
+
+_unlock:
+    MTX_UNLOCK(&ctx->mtx);
+    return err;
+}
+
+int fxip_ll_unmap(struct xipfs_context *ctx, const char *name) {
+    struct fmeta_data *pmeta;
+    int err = -ENOENT;
+
+    if (!ctx || !name)
+        return -EINVAL;
+
+    MTX_LOCK(&ctx->mtx);
+    pmeta = file_search(&ctx->inode, name);
+    if (pmeta) {
+        uint8_t *maps = &ctx->maps[pmeta - ctx->inode.meta];
+
+        err = -EINVAL;
+        if (*maps > 0) {
+            if (--(*maps) == 0)
+                os_timer_mod(ctx->compact_timer, CONFIG_XIPFS_COMPACT_DELAY);
+            err = 0;
+        }
+    }
+    MTX_UNLOCK(&ctx->mtx);
+    return err;
+}
+
+/*
+ * The journal that was written to disk is checked before resumption
+ */
+static void journal_check_locked(struct xipfs_context *ctx) {
+    struct xipfs_journal *j = &ctx->inode.journal;
+    const struct fmeta_data *pmeta;
+
+    ctx->jsynced = 0;
+    if (!journal_is_active(&ctx->inode))
+        return;
+
+    pmeta = &ctx->inode.meta[j->file];
+    if (j->file >= CONFIG_XIPFS_MAXFILES || !pmeta->used ||
+        j->dst >= pmeta->blkofs || j->done >= pmeta->blknum) {
+        pr_warn("Drop the invalid journal (file: %d dst: %d done: %d)\n",
+            j->file, j->dst, j->done);
+        memset(j, 0, sizeof(*j));
+        ctx->dirty = true;
+        return;
+    }
+
+    ctx->jsynced = j->done;
+    pr_dbg("Resume moving %s (dst: %d done: %d)\n", pmeta->name, j->dst, j->done);
+}
+
+static void fxip_compact_check(os_timer_t timer, void *arg) {
+    struct xipfs_context *ctx = arg;
+    char *blkbuf;
+    int ret;
+
+    MTX_LOCK(&ctx->mtx);
+
+    /* The writer may be using the reserved free space */
+    if (file_is_writing(NULL))
+        goto _unlock;
+
+    blkbuf = cache_blk_alloc(CONFIG_XIPFS_BLKSIZE);
+    if (blkbuf == NULL)
+        goto _unlock;
+
+    ret = compact_step_locked(ctx, blkbuf);
+    cache_blk_free(blkbuf);
+    if (ret > 0)
+        os_timer_mod(timer, CONFIG_XIPFS_COMPACT_PERIOD);
+    else if (ret < 0 && ret != -EBUSY)
+        pr_err("compact filesystem failed(%d)\n", ret);
+
+_unlock:
+    MTX_UNLOCK(&ctx->mtx);
+}
+
+int fxip_ll_compact(struct xipfs_context *ctx, int max_steps) {
+    char *blkbuf;
+    int ret = 0;
+
+    if (!ctx)
+        return -EINVAL;
+
+    blkbuf = cache_blk_alloc(CONFIG_XIPFS_BLKSIZE);
+    if (blkbuf == NULL) 
+        return -ENOMEM;
+
+    MTX_LOCK(&ctx->mtx);
+    while (max_steps < 0 || max_steps-- > 0) {
+        ret = compact_step_locked(ctx, blkbuf);
+        if (ret <= 0)
+            break;
+    }
+    MTX_UNLOCK(&ctx->mtx);
+    cache_blk_free(blkbuf);
+    return ret;
 }
 
 static int shutdown_listen(struct observer_base *nb,
@@ -619,13 +963,15 @@ int fxip_ll_init(struct xipfs_context *ctx, const char *name,
     err = os_timer_create(&ctx->timer, fxip_sync_check, 
         ctx, false);
     assert(err == 0);
+    err = os_timer_create(&ctx->compact_timer, fxip_compact_check, 
+        ctx, false);
+    assert(err == 0);
     if (start == UINT32_MAX)
         ctx->offset = ctx->dd->addr;
     else
         ctx->offset = start;
 
-    err = blkdev_read(ctx->dd, &ctx->inode, 
-        sizeof(ctx->inode), ctx->offset);
+    err = inode_load_locked(ctx);
     MTX_UNLOCK(&ctx->mtx);
     if (err < 0)
         return err;
@@ -635,6 +981,13 @@ int fxip_ll_init(struct xipfs_context *ctx, const char *name,
     if (ctx->inode.magic != XIPFS_MAGIC) {
         pr_warn("XIPFS is invalid\n");
         fxip_ll_reset(ctx);
+    } else {
+        /* Resume the compactor that was interrupted */
+        MTX_LOCK(&ctx->mtx);
+        journal_check_locked(ctx);
+        extent_rebuild_locked(ctx);
+        MTX_UNLOCK(&ctx->mtx);
+        os_timer_mod(ctx->compact_timer, CONFIG_XIPFS_COMPACT_DELAY);
     }
 	
     return 0;
@@ -655,80 +1008,79 @@ int fxip_ll_ioctl(struct xipfs_context *ctx, struct xip_file *filp,
         filp->i16_idx_offset = (int16_t)ret;
         if (ret > 0) 
             ret = 0;
+    } else if (cmd == XIPFS_IOGET_FRAGINFO) {
+        struct xipfs_fraginfo *info = arg;
+        uint16_t largest = 0;
+
+        for (uint16_t i = 0; i < ctx->nextents; i++)
+            largest = rte_max_t(uint16_t, largest, ctx->extents[i].blknum);
+        info->free_blks = ctx->freeblks;
+        info->largest_blks = largest;
+        info->extents = ctx->nextents;
+        info->frag = ctx->freeblks? 
+            1000 - (uint32_t)largest * 1000 / ctx->freeblks: 0;
+        ret = 0;
+    } else if (cmd == XIPFS_IOGET_BLKOFS) {
+        *(uint16_t *)arg = filp->pmeta->blkofs;
+        ret = 0;
     }
 
     MTX_UNLOCK(&ctx->mtx);
     return ret;
 }
 
-static void scan_area(const struct xipfs_inode *inode, struct scan_result *r) {
-    /* 
-     * Scan filesystem bitmap 
-     */
+/*
+ * Build the free areas from the bitmap. It is done only once when the
+ * filesystem is loaded, and the free areas are updated with the bitmap
+ */
+static void extent_rebuild_locked(struct xipfs_context *ctx) {
+    const struct xipfs_inode *inode = &ctx->inode;
     uint32_t freeblks = 0;
     uint32_t freeblk_ofs = 0;
 
-    memset(r, 0, sizeof(*r));
-    for (uint32_t i = 0; i < rte_array_size(inode->i_bitmap); i++) {
-        if (inode->i_bitmap[i] != UINT32_MAX) {
-            uint32_t ofs = 0;
-            uint32_t base = i << 5;
-
-            while (ofs < 32) {
-                if (base + ofs >= XIPFS_MAX_INODES)
-                    goto _next;
-
-                if (!(inode->i_bitmap[i] & BIT(ofs))) {
-                    /* Recording the first free block */
-                    if (freeblks == 0)
-                        freeblk_ofs = base + ofs;
-
-                    freeblks++;
-                } else {
-                    if (freeblks > 0) {
-                        r->areas[r->count].blkofs = freeblk_ofs;
-                        r->areas[r->count].blknum = freeblks;
-                        r->count++;
-                    }
-                    freeblk_ofs = freeblks = 0;
-                }
-                ofs++;
-            }
+    ctx->nextents = 0;
+    ctx->freeblks = 0;
+    for (uint32_t i = 0; i <= XIPFS_MAX_INODES; i++) {
+        if (i < XIPFS_MAX_INODES && !(inode->i_bitmap[i >> 5] & BIT(i & 31))) {
+            /* Recording the first free block */
+            if (freeblks == 0)
+                freeblk_ofs = i;
+            freeblks++;
+        } else if (freeblks > 0) {
+            ctx->extents[ctx->nextents].blkofs = freeblk_ofs;
+            ctx->extents[ctx->nextents].blknum = freeblks;
+            ctx->nextents++;
+            ctx->freeblks += freeblks;
+            freeblks = 0;
         }
     }
-
-_next:
-    if (freeblks > 0) {
-        r->areas[r->count].blkofs = freeblk_ofs;
-        r->areas[r->count].blknum = freeblks;
-        r->count++;
-    }
 }
 
-static int match_freeblock(const struct scan_result *r, size_t reqblksz, 
-    size_t *freespace) {
-    int best_matched = -1;
-    uint16_t min_diff = UINT16_MAX;
-    size_t blksz = 0;
+/*
+ * We use best fit to minimize data movement. The small files are put at
+ * the end of free area, So the large files are able to use the beginning
+ */
+static int extent_match_locked(struct xipfs_context *ctx, size_t reqblksz) {
+    const struct xipfs_extent *best = NULL;
 
-    /*
-     * We use best fit to minimize data movement
-     */
-    for (uint16_t i = 0; i < r->count; i++) {
-        if (r->areas[i].blknum >= reqblksz) {
-            uint32_t diff = r->areas[i].blknum - reqblksz;
-            if (diff < min_diff) {
-                min_diff = diff;
-                best_matched = r->areas[i].blkofs;
-            }
+    for (uint16_t i = 0; i < ctx->nextents; i++) {
+        const struct xipfs_extent *e = &ctx->extents[i];
+
+        if (e->blknum >= reqblksz && (best == NULL || e->blknum < best->blknum)) {
+            best = e;
+            if (e->blknum == reqblksz)
+                break;
         }
-        blksz += r->areas[i].blknum;
     }
 
-    if (freespace)
-        *freespace = blksz;
+    if (best == NULL)
+        return -1;
 
-    return best_matched;
+#if CONFIG_XIPFS_LARGE_FILE_BLKS > 0
+    if (reqblksz > 0 && reqblksz < CONFIG_XIPFS_LARGE_FILE_BLKS)
+        return best->blkofs + best->blknum - reqblksz;
+#endif
+    return best->blkofs;
 }
 
 static struct fmeta_data *find_fmeta_by_blkidx(struct xipfs_inode *inode, 
@@ -769,72 +1121,137 @@ static int move_data_block(struct disk_device *dd, char *blkbuf,
     return 0;
 }
 
-static int file_block_move(struct xipfs_context *ctx, uint32_t first_dstidx, 
-    uint32_t first_srcidx, uint32_t idxcnt, char *blkbuf) {
-    struct fmeta_data *pmeta;
-    uint32_t srcofs, dstofs;
-    uint32_t end;
+static int inode_sync_locked(struct xipfs_context *ctx) {
     int err;
 
-    /* Data blocks can only be moved from back to front */
-    assert(first_dstidx < first_srcidx);
+    err = inode_write_locked(ctx);
+    if (err < 0)
+        return err;
 
-    /*
-     * Ensure that the block does not belong to any files
-     */
-    pmeta = find_fmeta_by_blkidx(&ctx->inode, first_dstidx);
-    if (pmeta != NULL) {
-        pr_err("The block(%d) is not free\n", first_dstidx);
-        return -EINVAL;
-    }
+    return blkdev_sync();
+}
 
-    pmeta = find_fmeta_by_blkidx(&ctx->inode, first_srcidx);
-    if (pmeta == NULL) {
-        pr_err("Block(%d) corresponding file not found\n", first_srcidx);
-        return -ENODATA;
+/*
+ * Start to move the first file that follows a free area. The files in use
+ * are skipped, So the file behind them is moved into the next free area
+ */
+static int compact_begin_locked(struct xipfs_context *ctx) {
+    struct xipfs_journal *j = &ctx->inode.journal;
+    const struct xipfs_extent *e;
+    struct fmeta_data *pmeta = NULL;
+    uint32_t blkidx, end;
+
+    /* The free space is contiguous */
+    if (ctx->nextents <= 1)
+        return 0;
+
+    for (e = ctx->extents; e < ctx->extents + ctx->nextents; e++) {
+        blkidx = e->blkofs + e->blknum;
+        if (blkidx >= XIPFS_MAX_INODES)
+            break;
+
+        pmeta = find_fmeta_by_blkidx(&ctx->inode, blkidx);
+        if (pmeta == NULL || pmeta->blkofs != blkidx) {
+            pr_err("Block(%d) corresponding file not found\n", blkidx);
+            return -ENODATA;
+        }
+        if (!file_is_pinned(ctx, pmeta))
+            break;
+        pmeta = NULL;
     }
 
-    /* 
-     * Ensure that the block corresponds to the same file information 
-     */
-    if (pmeta->blkofs != first_srcidx ||
-        pmeta->blknum != idxcnt) {
-        pr_err("File information is not right\n");
-        return -EINVAL;
+    /* Only the files in use can be moved */
+    if (pmeta == NULL)
+        return -EBUSY;
+
+    j->file = (uint16_t)(pmeta - ctx->inode.meta);
+    j->dst  = e->blkofs;
+    j->done = 0;
+    j->magic = XIPFS_JOURNAL_MAGIC;
+    ctx->jsynced = 0;
+
+    /* Reserve the destination blocks */
+    end = rte_min_t(uint32_t, j->dst + pmeta->blknum, pmeta->blkofs);
+    blocks_reserve_locked(ctx, j->dst, end - j->dst);
+    ctx->dirty = true;
+
+    pr_dbg("Move %s from block(%d) to block(%d)\n", pmeta->name, 
+        pmeta->blkofs, j->dst);
+    return 1;
+}
+
+/*
+ * Move one block of the file. The destination block may be the source block
+ * that has been moved (The gap is less than the file). So the progress is
+ * written to disk before it is overwritten, and the step that is interrupted
+ * by power failure is done again.
+ */
+static int compact_move_locked(struct xipfs_context *ctx, char *blkbuf) {
+    struct xipfs_journal *j = &ctx->inode.journal;
+    struct fmeta_data *pmeta;
+    uint32_t srcofs, dstofs;
+    uint32_t gap, end;
+    int err;
+
+    pmeta = &ctx->inode.meta[j->file];
+    gap = pmeta->blkofs - j->dst;
+    if (j->done >= gap && ctx->jsynced < j->done - gap + 1) {
+        err = inode_sync_locked(ctx);
+        if (err < 0)
+            return err;
+        ctx->jsynced = j->done;
     }
 
-    /*
-     * Move file data
-     */
-    for (uint32_t i = 0; i < idxcnt; i++) {
-        dstofs = idx_to_offset(ctx, first_dstidx, &end);
-        srcofs = idx_to_offset(ctx, first_srcidx, &end);
-        err = move_data_block(ctx->dd, blkbuf, dstofs, srcofs);
+    /* The cached data of blocks is out of date after the movement */
+    blkdev_sync_invalid();
+    dstofs = idx_to_offset(ctx, j->dst + j->done, &end);
+    srcofs = idx_to_offset(ctx, pmeta->blkofs + j->done, &end);
+    err = move_data_block(ctx->dd, blkbuf, dstofs, srcofs);
+    if (err < 0)
+        return err;
+
+    j->done++;
+    ctx->dirty = true;
+    if (j->done == pmeta->blknum) {
+        uint32_t first = rte_max_t(uint32_t, pmeta->blkofs, j->dst + pmeta->blknum);
+
+        /* Free the source blocks that are not covered by destination */
+        blocks_release_locked(ctx, first, 
+            (uint32_t)pmeta->blkofs + pmeta->blknum - first);
+        pmeta->blkofs = j->dst;
+        memset(j, 0, sizeof(*j));
+        err = inode_sync_locked(ctx);
         if (err < 0)
             return err;
-        
-        bitvec_move(ctx->inode.i_bitmap, first_dstidx, first_srcidx);
-        first_dstidx++;
-        first_srcidx++;
+        pr_dbg("%s has been moved to block(%d)\n", pmeta->name, pmeta->blkofs);
     }
 
-    pmeta->blkofs = first_dstidx - idxcnt;
+    return 1;
+}
 
-    return 0;
+/*
+ * return 1 if there is more work, 0 if the free space is contiguous
+ */
+static int compact_step_locked(struct xipfs_context *ctx, char *blkbuf) {
+    int err;
+
+    if (!journal_is_active(&ctx->inode)) {
+        err = compact_begin_locked(ctx);
+        if (err <= 0)
+            return err;
+    } else if (file_is_pinned(ctx, &ctx->inode.meta[ctx->inode.journal.file])) {
+        /* The file is opened after it starts moving */
+        return -EBUSY;
+    }
+
+    return compact_move_locked(ctx, blkbuf);
 }
 
 static int check_free_space(struct xipfs_context *ctx, size_t reqblksz) {
-    struct scan_result r;
-    size_t freesz;
+    char *blkbuf;
     int ret;
 
-    /*
-     * Gathering information about the space available 
-     * on the file system
-     */
-    scan_area(&ctx->inode, &r);
-
-    ret = match_freeblock(&r, reqblksz, &freesz);
+    ret = extent_match_locked(ctx, reqblksz);
     if (ret >= 0) {
         /* 
          * If we have found the right block then return 
@@ -845,48 +1262,30 @@ static int check_free_space(struct xipfs_context *ctx, size_t reqblksz) {
     /* 
      * If there is no enough free space, return error code 
      */
-    if (freesz < reqblksz)
+    if (ctx->freeblks < reqblksz)
         return -EFBIG;
 
     /*
      * No suitable and contiguous free area is found, 
-     * we must move the disk data
+     * we must finish the compactor work now (The space is not
+     * reserved before, So it is done in the caller's context)
      */
-    char *blkbuf = cache_blk_alloc(CONFIG_XIPFS_BLKSIZE);
+    blkbuf = cache_blk_alloc(CONFIG_XIPFS_BLKSIZE);
     if (blkbuf == NULL) 
         return -ENOMEM;
 
-    blkdev_sync();
-
-    for (uint16_t i = 1; i < r.count; i++) {
-        const struct free_area *parea = &r.areas[i - 1];
-        uint32_t fblk_start = parea->blkofs + parea->blknum;
-
-        assert(r.areas[i].blkofs > fblk_start);
-        ret = file_block_move(ctx, 
-            parea->blkofs,
-            fblk_start, 
-            r.areas[i].blkofs - fblk_start,
-            blkbuf
-            );
-        if (ret < 0)
-            break;
-
-        /* Update area information */
-        r.areas[i].blkofs -= parea->blknum;
-        r.areas[i].blknum += parea->blknum;
-
-        /*
-         * If we have enough free space then return
-         */
-        if (r.areas[i].blknum >= reqblksz) {
-            ret = r.areas[i].blkofs;
-            pr_dbg("merge finished (new-index: %d)\n", ret);
+    do {
+        int err = compact_step_locked(ctx, blkbuf);
+        if (err <= 0) {
+            ret = err? err: -EFBIG;
             break;
         }
-    }
 
+        ret = extent_match_locked(ctx, reqblksz);
+    } while (ret < 0);
+
+    if (ret >= 0)
+        pr_dbg("merge finished (new-index: %d)\n", ret);
     cache_blk_free(blkbuf);
-    
     return ret;
 }
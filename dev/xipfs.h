@@ -25,9 +25,35 @@ extern "C"{
 #define CONFIG_XIPFS_MAXFILES   15
 #endif
 
+#ifndef CONFIG_XIPFS_COMPACT_DELAY
+#define CONFIG_XIPFS_COMPACT_DELAY  1000 /* ms */
+#endif
+
+#ifndef CONFIG_XIPFS_COMPACT_PERIOD
+#define CONFIG_XIPFS_COMPACT_PERIOD 50   /* ms */
+#endif
+
+#ifndef CONFIG_XIPFS_LARGE_FILE_BLKS
+#define CONFIG_XIPFS_LARGE_FILE_BLKS 0   /* blocks */
+#endif
+
 #define XIPFS_MAX_INODES (CONFIG_XIPFS_SIZE / CONFIG_XIPFS_BLKSIZE)
 #define XIPFS_IMAP_SIZE  ((XIPFS_MAX_INODES + 31) / 32)
 #define XIPFS_FMAP_SIZE  ((CONFIG_XIPFS_MAXFILES + 31) / 32)
+#define XIPFS_MAX_EXTENTS ((XIPFS_MAX_INODES + 1) / 2)
+
+/*
+ * XIPFS I/O control type
+ */
+#define XIPFS_IOGET_FRAGINFO 0x0201 /* arg: struct xipfs_fraginfo * */
+#define XIPFS_IOGET_BLKOFS   0x0202 /* arg: uint16_t *, The first block of file */
+
+struct xipfs_fraginfo {
+    uint16_t free_blks;    /* The number of free blocks */
+    uint16_t largest_blks; /* The largest contiguous free blocks */
+    uint16_t extents;      /* The number of free areas */
+    uint16_t frag;         /* Fragmentation: 1000 - largest * 1000 / free (permille) */
+};
 
 struct xip_file;
 struct fmeta_data {
@@ -40,12 +66,32 @@ struct fmeta_data {
     uint16_t chksum;
 };
 
+/*
+ * The compactor moves a file to the lower free blocks one block per step.
+ * The blocks before 'done' have been moved to 'dst'.
+ */
+struct xipfs_journal {
+    uint32_t magic;  /* Valid if a file is being moved */
+    uint16_t file;   /* The index of file metadata */
+    uint16_t dst;    /* The first destination block */
+    uint16_t done;   /* The number of blocks that have been moved */
+    uint16_t reserved;
+};
+
+/* The free area that is sorted by block index */
+struct xipfs_extent {
+    uint16_t blkofs;
+    uint16_t blknum;
+};
+
 struct xipfs_inode {
 	uint32_t i_bitmap[XIPFS_IMAP_SIZE];
     struct fmeta_data meta[CONFIG_XIPFS_MAXFILES];
     uint16_t hcrc;
     uint16_t nfiles;
 	uint32_t magic;
+    struct xipfs_journal journal;
+    uint32_t seq;    /* The write sequence of inode copies */
 };
 
 struct xipfs_context {
@@ -53,7 +99,14 @@ struct xipfs_context {
     os_mutex_t mtx;
     struct disk_device *dd;
     os_timer_t timer;
+    os_timer_t compact_timer;
     uint32_t offset; /* content offset */
+    struct xipfs_extent extents[XIPFS_MAX_EXTENTS];
+    uint16_t nextents;
+    uint16_t freeblks;
+    uint16_t jsynced; /* The journal progress that has been written to disk */
+    uint8_t maps[CONFIG_XIPFS_MAXFILES]; /* The live mappings of each file */
+    uint8_t icopy;    /* The inode copy that is newest */
     bool dirty;
 };
 
@@ -75,8 +128,34 @@ int fxip_ll_ioctl(struct xipfs_context *ctx, struct xip_file *filp,
     uint32_t cmd, void *arg);
 int fxip_ll_check(const char *dev, uint32_t offset);
 void fxip_ll_reset(struct xipfs_context *ctx);
-uint32_t fxip_ll_map(struct xipfs_context *ctx, struct xip_file *filp, 
-    size_t *size);
+
+/*
+ * fxip_ll_map - Get the address of file data
+ *
+ * The compactor does not move the file that is opened or mapped. The
+ * mapping lives until fxip_ll_unmap() or unlink (vfs_mmap has no unmap,
+ * So the file that is mapped by it stays at the address)
+ * @paddr: The offset of file data on the device
+ *
+ * Return 0 on success, -ENOMEM or the error of moving the file that is
+ * being compacted (The file is not mapped)
+ */
+int fxip_ll_map(struct xipfs_context *ctx, struct xip_file *filp, 
+    size_t *size, uint32_t *paddr);
+int fxip_ll_unmap(struct xipfs_context *ctx, const char *name);
+
+/*
+ * fxip_ll_compact - Run the compactor synchronously
+ * @max_steps: The maximum number of blocks that are moved (< 0: unlimited)
+ *
+ * The background compactor runs after unlink and close. The free space is
+ * not reserved for the file that is created, So VFS_IOSET_FILESIZE still
+ * runs the remaining steps synchronously if no hole is large enough. The
+ * files in use are skipped (-EBUSY if only they can be moved).
+ *
+ * return 1 if there is more work, 0 if the free space is contiguous
+ */
+int fxip_ll_compact(struct xipfs_context *ctx, int max_steps);
     
 #ifdef __cplusplus
 }
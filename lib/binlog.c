@@ -0,0 +1,614 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Deferred binary log
+ *
+ * The records are queued in a lock-free MPSC ring (lib/mpsc_ring.h). So no
+ * lock is held by the caller of log, and the records are consumed in the
+ * order of reservation by the drain timer.
+ */
+
+#ifdef CONFIG_HEADER_FILE
+#include CONFIG_HEADER_FILE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "basework/generic.h"
+#include "basework/hook.h"
+#include "basework/system.h"
+#include "basework/arch/generic/rte_stdatomic.h"
+#include "basework/os/osapi_timer.h"
+#include "basework/lib/binlog.h"
+#include "basework/lib/disklog.h"
+#include "basework/lib/mpsc_ring.h"
+
+enum binlog_arg {
+    BINLOG_ARG_NONE,
+    BINLOG_ARG_INT,
+    BINLOG_ARG_LONG,
+    BINLOG_ARG_LLONG,
+    BINLOG_ARG_SIZE,
+    BINLOG_ARG_PTRDIFF,
+    BINLOG_ARG_PTR,
+    BINLOG_ARG_STR,
+    BINLOG_ARG_HEXDUMP,
+    BINLOG_ARG_STOP  /* Unknown conversion, the rest is output as text */
+};
+
+struct binlog_spec {
+    const char *end;  /* The end of conversion specification */
+    int type;
+    int stars;        /* The number of '*' (int arguments before value) */
+    int width;        /* The width in digits */
+    bool star_width;  /* The width is given by argument */
+};
+
+struct binlog_ring {
+    struct mpsc_ring ring;
+    uint32_t dropped;
+    uint8_t buf[CONFIG_BINLOG_BUFFER_SIZE] __rte_aligned(8);
+};
+
+struct binlog_context {
+    struct printer *text;
+    os_timer_t timer;
+    struct observer_base obs;
+    uint32_t draining;
+    bool started;
+    bool disk;
+    size_t staged;
+    uint8_t stage[2 * CONFIG_BINLOG_RECORD_MAX] __rte_aligned(4);
+};
+
+#define BINLOG_HDR_SIZE \
+    (sizeof(struct binlog_record) + sizeof(uintptr_t))
+
+#define BINLOG_FLAGS \
+    ((sizeof(void *) == 8? BINLOG_F_PTR64: 0) | \
+     (sizeof(long) == 8? BINLOG_F_LONG64: 0))
+
+_Static_assert(!(CONFIG_BINLOG_BUFFER_SIZE & (CONFIG_BINLOG_BUFFER_SIZE - 1)), "");
+_Static_assert(CONFIG_BINLOG_RECORD_MAX >= 32 &&
+    CONFIG_BINLOG_RECORD_MAX <= CONFIG_BINLOG_BUFFER_SIZE / 4, "");
+_Static_assert(CONFIG_BINLOG_STRING_MAX < CONFIG_BINLOG_RECORD_MAX, "");
+_Static_assert(sizeof(size_t) == sizeof(void *), "");
+
+static struct binlog_ring binlog_ring = {
+    .ring = MPSC_RING_INITIALIZER(binlog_ring.buf, CONFIG_BINLOG_BUFFER_SIZE)
+};
+static struct binlog_context binlog_ctx;
+
+uint32_t RTE_WEAKHOOK(_binlog_clock, void) {
+    return (uint32_t)os_timer_gettime();
+}
+
+static size_t binlog_argsize(int type) {
+    switch (type) {
+    case BINLOG_ARG_INT:
+        return sizeof(int);
+    case BINLOG_ARG_LONG:
+        return sizeof(long);
+    case BINLOG_ARG_LLONG:
+        return sizeof(long long);
+    case BINLOG_ARG_SIZE:
+        return sizeof(size_t);
+    case BINLOG_ARG_PTRDIFF:
+        return sizeof(ptrdiff_t);
+    case BINLOG_ARG_PTR:
+        return sizeof(void *);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Parse the conversion specification after '%'. The conversions are
+ * the same as _IO_Vprintf()
+ */
+static void binlog_parse(const char *fmt, struct binlog_spec *spec) {
+    bool dot = false;
+    int lflag = 0;
+    int jflag = 0, zflag = 0, tflag = 0;
+
+    spec->stars = 0;
+    spec->width = 0;
+    spec->star_width = false;
+    for (;;) {
+        int ch = (unsigned char)*fmt++;
+
+        switch (ch) {
+        case '.':
+            dot = true;
+            continue;
+        case '#': case '+': case '-':
+            continue;
+        case '*':
+            spec->stars++;
+            if (!dot)
+                spec->star_width = true;
+            continue;
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': {
+            int n = ch - '0';
+
+            while (*fmt >= '0' && *fmt <= '9')
+                n = n * 10 + *fmt++ - '0';
+            if (!dot)
+                spec->width = n;
+            continue;
+        }
+        case 'h':
+            continue;
+        case 'l':
+            lflag++;
+            continue;
+        case 'j':
+            jflag = 1;
+            continue;
+        case 'z':
+            zflag = 1;
+            continue;
+        case 't':
+            tflag = 1;
+            continue;
+        case '%':
+            spec->type = BINLOG_ARG_NONE;
+            break;
+        case 'c':
+            spec->type = BINLOG_ARG_INT;
+            break;
+        case 'd': case 'i': case 'o': case 'u':
+        case 'x': case 'X': case 'y':
+            if (jflag || lflag > 1)
+                spec->type = BINLOG_ARG_LLONG;
+            else if (tflag)
+                spec->type = BINLOG_ARG_PTRDIFF;
+            else if (lflag)
+                spec->type = BINLOG_ARG_LONG;
+            else if (zflag)
+                spec->type = BINLOG_ARG_SIZE;
+            else
+                spec->type = BINLOG_ARG_INT;
+            break;
+        case 'p':
+            spec->type = BINLOG_ARG_PTR;
+            break;
+        case 's':
+            spec->type = BINLOG_ARG_STR;
+            break;
+        case 'D':
+            spec->type = BINLOG_ARG_HEXDUMP;
+            break;
+        default:
+            spec->type = BINLOG_ARG_STOP;
+            fmt--;
+            break;
+        }
+        break;
+    }
+    spec->end = fmt;
+}
+
+static size_t binlog_put_bytes(uint8_t *p, size_t ofs, size_t max,
+    const void *src, size_t size) {
+    size_t n = RTE_ALIGN(size, 4);
+
+    if (ofs + n > max)
+        return 0;
+    memcpy(p + ofs, src, size);
+    memset(p + ofs + size, 0, n - size);
+    return n;
+}
+
+static size_t binlog_put_string(uint8_t *p, size_t ofs, size_t max,
+    const char *s) {
+    size_t len, n;
+
+    if (s == NULL)
+        s = "(null)";
+    for (len = 0; len < CONFIG_BINLOG_STRING_MAX && s[len]; len++);
+    n = RTE_ALIGN(len + 1, 4);
+    if (ofs + n > max)
+        return 0;
+    memcpy(p + ofs, s, len);
+    memset(p + ofs + len, 0, n - len);
+    return n;
+}
+
+/*
+ * Pack the arguments to record and return the record size
+ */
+static size_t binlog_encode(uint8_t *p, const char *fmt, va_list ap) {
+    struct binlog_record *rec = (struct binlog_record *)p;
+    uintptr_t fmtaddr = (uintptr_t)fmt;
+    size_t ofs = BINLOG_HDR_SIZE;
+    struct binlog_spec spec;
+
+    rec->magic = BINLOG_MAGIC;
+    rec->flags = BINLOG_FLAGS;
+    rec->timestamp = _binlog_clock();
+    memcpy(p + sizeof(*rec), &fmtaddr, sizeof(fmtaddr));
+
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        union {
+            int i;
+            long l;
+            long long ll;
+            size_t z;
+            ptrdiff_t t;
+            void *ptr;
+        } v;
+        size_t n = 1;
+        int width;
+
+        binlog_parse(fmt + 1, &spec);
+        fmt = spec.end;
+        if (spec.type == BINLOG_ARG_STOP)
+            break;
+
+        width = spec.width;
+        for (int i = 0; i < spec.stars && n > 0; i++) {
+            v.i = va_arg(ap, int);
+            if (i == 0 && spec.star_width)
+                width = v.i < 0? -v.i: v.i;
+            n = binlog_put_bytes(p, ofs, CONFIG_BINLOG_RECORD_MAX, &v.i, sizeof(v.i));
+            ofs += n;
+        }
+
+        switch (spec.type) {
+        case BINLOG_ARG_NONE:
+            continue;
+        case BINLOG_ARG_INT:
+            v.i = va_arg(ap, int);
+            break;
+        case BINLOG_ARG_LONG:
+            v.l = va_arg(ap, long);
+            break;
+        case BINLOG_ARG_LLONG:
+            v.ll = va_arg(ap, long long);
+            break;
+        case BINLOG_ARG_SIZE:
+            v.z = va_arg(ap, size_t);
+            break;
+        case BINLOG_ARG_PTRDIFF:
+            v.t = va_arg(ap, ptrdiff_t);
+            break;
+        case BINLOG_ARG_PTR:
+            v.ptr = va_arg(ap, void *);
+            break;
+        case BINLOG_ARG_STR:
+            if (n > 0)
+                n = binlog_put_string(p, ofs, CONFIG_BINLOG_RECORD_MAX,
+                    va_arg(ap, const char *));
+            ofs += n;
+            goto _next;
+        case BINLOG_ARG_HEXDUMP: {
+            const uint8_t *data = va_arg(ap, const uint8_t *);
+            const char *sep = va_arg(ap, const char *);
+            uint16_t len = (uint16_t)rte_min_t(int, width? width: 16,
+                CONFIG_BINLOG_STRING_MAX);
+
+            if (n > 0)
+                n = binlog_put_bytes(p, ofs, CONFIG_BINLOG_RECORD_MAX, &len, sizeof(len));
+            ofs += n;
+            if (n > 0)
+                n = binlog_put_bytes(p, ofs, CONFIG_BINLOG_RECORD_MAX, data, len);
+            ofs += n;
+            if (n > 0)
+                n = binlog_put_string(p, ofs, CONFIG_BINLOG_RECORD_MAX, sep);
+            ofs += n;
+            goto _next;
+        }
+        default:
+            break;
+        }
+
+        if (n > 0)
+            n = binlog_put_bytes(p, ofs, CONFIG_BINLOG_RECORD_MAX,
+                &v, binlog_argsize(spec.type));
+        ofs += n;
+_next:
+        if (n == 0) {
+            rec->flags |= BINLOG_F_TRUNC;
+            break;
+        }
+    }
+
+    rec->size = (uint16_t)ofs;
+    return ofs;
+}
+
+static int binlog_format(void *context, const char *fmt, va_list ap) {
+    uint8_t buf[CONFIG_BINLOG_RECORD_MAX] __rte_aligned(8);
+    struct binlog_ring *ring = context;
+    size_t recsz;
+    void *rec;
+
+    if (fmt == NULL)
+        return 0;
+
+    recsz = binlog_encode(buf, fmt, ap);
+    rec = mpsc_ring_reserve(&ring->ring, recsz);
+    if (rec == NULL) {
+        rte_atomic_fetch_add_explicit(&ring->dropped, 1, rte_memory_order_relaxed);
+        return 0;
+    }
+
+    memcpy(rec, buf, recsz);
+    mpsc_ring_commit(&ring->ring, rec);
+    return (int)recsz;
+}
+
+static void binlog_put_text(struct printer *out, const char *s, size_t len) {
+    if (len > 0)
+        virt_format(out, "%.*s", (int)len, s);
+}
+
+static bool binlog_get(const uint8_t **pp, const uint8_t *end,
+    void *v, size_t size) {
+    if (*pp + RTE_ALIGN(size, 4) > end)
+        return false;
+    memcpy(v, *pp, size);
+    *pp += RTE_ALIGN(size, 4);
+    return true;
+}
+
+static const char *binlog_get_string(const uint8_t **pp, const uint8_t *end) {
+    const char *s = (const char *)*pp;
+    size_t len;
+
+    for (len = 0; *pp + len < end && s[len]; len++);
+    if (*pp + len >= end)
+        return NULL;
+    *pp += RTE_ALIGN(len + 1, 4);
+    return s;
+}
+
+/*
+ * Format one record. Every conversion is output with its own argument,
+ * and the '*' is replaced with the value in the record
+ */
+static void binlog_replay(struct printer *out, const struct binlog_record *rec) {
+    const uint8_t *p = (const uint8_t *)rec + BINLOG_HDR_SIZE;
+    const uint8_t *end = (const uint8_t *)rec + rec->size;
+    struct binlog_spec spec;
+    const char *fmt, *next;
+    uintptr_t fmtaddr;
+    char seg[48];
+
+    memcpy(&fmtaddr, rec + 1, sizeof(fmtaddr));
+    fmt = (const char *)fmtaddr;
+    while ((next = strchr(fmt, '%')) != NULL) {
+        union {
+            int i;
+            long l;
+            long long ll;
+            size_t z;
+            ptrdiff_t t;
+            void *ptr;
+        } v;
+        const char *s = next + 1;
+        size_t len = 0;
+        bool ok = true;
+
+        binlog_parse(s, &spec);
+        if (spec.type == BINLOG_ARG_STOP || spec.end - next > 16)
+            break;
+
+        binlog_put_text(out, fmt, next - fmt);
+        fmt = spec.end;
+
+        /* Rebuild the conversion specification */
+        seg[len++] = '%';
+        for ( ; s < spec.end; s++) {
+            if (*s == '*') {
+                ok = binlog_get(&p, end, &v.i, sizeof(v.i));
+                if (!ok)
+                    break;
+                len += snprintf(seg + len, sizeof(seg) - len, "%d",
+                    v.i < 0 && s[-1] == '.'? 0: v.i);
+            } else {
+                seg[len++] = *s;
+            }
+        }
+        seg[len] = '\0';
+        if (!ok)
+            goto _trunc;
+
+        switch (spec.type) {
+        case BINLOG_ARG_NONE:
+            virt_format(out, "%%");
+            continue;
+        case BINLOG_ARG_STR:
+            s = binlog_get_string(&p, end);
+            if (s == NULL)
+                goto _trunc;
+            virt_format(out, seg, s);
+            continue;
+        case BINLOG_ARG_HEXDUMP: {
+            const uint8_t *data;
+            uint16_t n;
+
+            if (!binlog_get(&p, end, &n, sizeof(n)) || p + RTE_ALIGN(n, 4) > end)
+                goto _trunc;
+            data = p;
+            p += RTE_ALIGN(n, 4);
+            s = binlog_get_string(&p, end);
+            if (s == NULL)
+                goto _trunc;
+            snprintf(seg, sizeof(seg), "%%%dD", (int)n);
+            virt_format(out, seg, data, s);
+            continue;
+        }
+        default:
+            break;
+        }
+
+        if (!binlog_get(&p, end, &v, binlog_argsize(spec.type)))
+            goto _trunc;
+
+        switch (spec.type) {
+        case BINLOG_ARG_INT:
+            virt_format(out, seg, v.i);
+            break;
+        case BINLOG_ARG_LONG:
+            virt_format(out, seg, v.l);
+            break;
+        case BINLOG_ARG_LLONG:
+            virt_format(out, seg, v.ll);
+            break;
+        case BINLOG_ARG_SIZE:
+            virt_format(out, seg, v.z);
+            break;
+        case BINLOG_ARG_PTRDIFF:
+            virt_format(out, seg, v.t);
+            break;
+        case BINLOG_ARG_PTR:
+            virt_format(out, seg, v.ptr);
+            break;
+        default:
+            break;
+        }
+    }
+
+    binlog_put_text(out, fmt, strlen(fmt));
+    return;
+
+_trunc:
+    virt_format(out, "<truncated>\n");
+}
+
+int binlog_decode(struct printer *out, const void *buf, size_t size) {
+    const uint8_t *p = buf;
+    const uint8_t *end = p + size;
+    int count = 0;
+
+    if (out == NULL || buf == NULL)
+        return -EINVAL;
+
+    while (p + BINLOG_HDR_SIZE <= end) {
+        const struct binlog_record *rec = (const struct binlog_record *)p;
+
+        if (rec->magic != BINLOG_MAGIC || rec->size < BINLOG_HDR_SIZE ||
+            p + rec->size > end)
+            break;
+
+        /* The records of other image cannot be formatted here */
+        if ((rec->flags & (BINLOG_F_PTR64 | BINLOG_F_LONG64)) == BINLOG_FLAGS) {
+            binlog_replay(out, rec);
+            count++;
+        }
+        p += RTE_ALIGN(rec->size, 4);
+    }
+    return count;
+}
+
+#ifndef CONFIG_BOOTLOADER
+static void binlog_stage_flush(struct binlog_context *ctx) {
+    if (ctx->staged > 0) {
+        disklog_input((const char *)ctx->stage, ctx->staged);
+        ctx->staged = 0;
+    }
+}
+
+static void binlog_stage(struct binlog_context *ctx,
+    const struct binlog_record *rec) {
+    if (ctx->staged + rec->size > sizeof(ctx->stage))
+        binlog_stage_flush(ctx);
+    memcpy(ctx->stage + ctx->staged, rec, rec->size);
+    ctx->staged += rec->size;
+}
+#else
+#define binlog_stage_flush(...) (void)0
+#define binlog_stage(...) (void)0
+#endif /* CONFIG_BOOTLOADER */
+
+int binlog_drain(void) {
+    struct binlog_context *ctx = &binlog_ctx;
+    struct binlog_ring *ring = &binlog_ring;
+    const struct binlog_record *rec;
+    size_t len;
+    int count = 0;
+
+    /* Only one consumer is allowed */
+    if (rte_atomic_exchange_explicit(&ctx->draining, 1, rte_memory_order_acquire))
+        return 0;
+
+    while ((rec = mpsc_ring_peek(&ring->ring, &len)) != NULL) {
+        if (ctx->text)
+            binlog_replay(ctx->text, rec);
+        if (ctx->disk)
+            binlog_stage(ctx, rec);
+
+        /* The slot is cleared before it can be reserved again */
+        mpsc_ring_consume(&ring->ring);
+        count++;
+    }
+
+    if (ctx->disk)
+        binlog_stage_flush(ctx);
+    rte_atomic_store_explicit(&ctx->draining, 0, rte_memory_order_release);
+    return count;
+}
+
+uint32_t binlog_dropped(void) {
+    return rte_atomic_load_explicit(&binlog_ring.dropped, rte_memory_order_relaxed);
+}
+
+static void binlog_drain_timer(os_timer_t timer, void *arg) {
+    (void) arg;
+    binlog_drain();
+    os_timer_mod(timer, CONFIG_BINLOG_DRAIN_PERIOD);
+}
+
+static int binlog_drain_listen(struct observer_base *nb,
+	unsigned long action, void *data) {
+    (void) nb;
+    (void) action;
+    (void) data;
+    binlog_drain();
+    return 0;
+}
+
+int binlog_init(struct printer *text, bool disk) {
+    struct binlog_context *ctx = &binlog_ctx;
+    int err;
+
+    if (ctx->started)
+        return -EALREADY;
+
+#ifdef CONFIG_BOOTLOADER
+    if (disk)
+        return -ENOTSUP;
+#else
+    if (disk) {
+        err = disklog_init();
+        if (err)
+            return err;
+    }
+#endif
+
+    ctx->text = text;
+    ctx->disk = disk;
+    err = os_timer_create(&ctx->timer, binlog_drain_timer, NULL, false);
+    if (err)
+        return err;
+
+    /* Drain the records before disklog is synchronized */
+    ctx->obs.update = binlog_drain_listen;
+    ctx->obs.priority = 20;
+    system_add_observer(&ctx->obs);
+    ctx->started = true;
+    return os_timer_add(ctx->timer, CONFIG_BINLOG_DRAIN_PERIOD);
+}
+
+void binlog_format_init(struct printer *pr) {
+    assert(pr != NULL);
+    pr->format = binlog_format;
+    pr->context = &binlog_ring;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Deferred binary log
+ *
+ * The printer records the address of format string, timestamp and the raw
+ * arguments only. The records are formatted later by the drain timer, or
+ * written to disklog as binary and decoded on host (tools/binlog).
+ */
+#ifndef BASEWORK_LIB_BINLOG_H_
+#define BASEWORK_LIB_BINLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "basework/lib/printer.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#ifndef CONFIG_BINLOG_BUFFER_SIZE
+#define CONFIG_BINLOG_BUFFER_SIZE  4096 /* Must be power of 2 */
+#endif
+
+#ifndef CONFIG_BINLOG_RECORD_MAX
+#define CONFIG_BINLOG_RECORD_MAX   128
+#endif
+
+#ifndef CONFIG_BINLOG_STRING_MAX
+#define CONFIG_BINLOG_STRING_MAX   48
+#endif
+
+#ifndef CONFIG_BINLOG_DRAIN_PERIOD
+#define CONFIG_BINLOG_DRAIN_PERIOD 100 /* ms */
+#endif
+
+/*
+ * Binary record (little-endian, 4 bytes aligned)
+ *
+ * | magic | flags | size | timestamp | fmt (4/8 bytes) | arguments ... |
+ *
+ * The arguments are packed in the order of format string. Integers use
+ * their natural size and are padded to 4 bytes. Strings are copied
+ * with the terminating null ('%D' copies the data bytes that have
+ * a 16-bit length before them).
+ */
+#define BINLOG_MAGIC     0xB7
+#define BINLOG_F_PAD     0x01 /* Padding at the end of ring (never output) */
+#define BINLOG_F_PTR64   0x02 /* The pointer and size_t are 64 bits */
+#define BINLOG_F_LONG64  0x04 /* The long is 64 bits */
+#define BINLOG_F_TRUNC   0x08 /* The arguments are truncated */
+
+struct binlog_record {
+    uint8_t  magic;
+    uint8_t  flags;
+    uint16_t size; /* Record size including header */
+    uint32_t timestamp;
+};
+
+/*
+ * binlog_format_init - Initialize a deferred binary log printer
+ * @pr: printer object
+ */
+void binlog_format_init(struct printer *pr);
+
+/*
+ * binlog_init - Start the drain timer of binary log
+ * @text: The printer that formats the records (NULL if not used)
+ * @disk: Write binary records to disklog
+ * return 0 if success
+ */
+int binlog_init(struct printer *text, bool disk);
+
+/*
+ * binlog_drain - Output the records that have been committed
+ * return the number of records
+ */
+int binlog_drain(void);
+
+/*
+ * binlog_decode - Format the binary records with printer
+ * (The format strings must be in the current image)
+ *
+ * @out: output printer
+ * @buf: record buffer
+ * @size: buffer size
+ * return the number of records
+ */
+int binlog_decode(struct printer *out, const void *buf, size_t size);
+
+/*
+ * binlog_dropped - Get the number of records that are dropped because
+ * the ring is full
+ */
+uint32_t binlog_dropped(void);
+
+/*
+ * _binlog_clock - Get the timestamp of record (milliseconds)
+ * (The default implement is based on os_timer_gettime())
+ */
+uint32_t _binlog_clock(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASEWORK_LIB_BINLOG_H_ */
@@ -1,5 +1,9 @@
 /*
  * Copyright 2022 wtcat
+ *
+ * The log is copied into a RAM staging ring without lock (So it can be
+ * written from interrupt context), and the flush timer moves it to the
+ * partition in erase-block aligned chunks.
  */
 
 #ifdef CONFIG_HEADER_FILE
@@ -9,18 +13,28 @@
 
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
 
 #include "basework/assert.h"
+#include "basework/arch/generic/rte_stdatomic.h"
 #include "basework/dev/disk.h"
 #include "basework/dev/partition.h"
 #include "basework/dev/buffer_io.h"
 #include "basework/dev/blkdev.h"
 #include "basework/lib/printer.h"
 #include "basework/lib/disklog.h"
+#include "basework/lib/mpsc_ring.h"
 #include "basework/log.h"
 #include "basework/minmax.h"
 #include "basework/malloc.h"
 #include "basework/system.h"
+#include "basework/os/osapi.h"
+#include "basework/os/osapi_timer.h"
+#include "basework/hook.h"
+#ifdef CONFIG_DISKLOG_COMPRESS
+#include "basework/lib/crc.h"
+#include "basework/thirdparty/lz4/lz4.h"
+#endif
 
 struct disk_log {
     uint32_t magic;
@@ -31,8 +45,17 @@ struct disk_log {
     uint32_t wr_ofs;
     uint32_t rd_ofs;
     uint32_t d_size;
+#ifdef CONFIG_DISKLOG_COMPRESS
+    uint32_t rd_seq;  /* The oldest segment that has not been consumed */
+#endif
 };
 
+#ifdef CONFIG_DISKLOG_COMPRESS
+#define DISKLOG_FILE_MAGIC (DISKLOG_MAGIC + 1)
+#else
+#define DISKLOG_FILE_MAGIC DISKLOG_MAGIC
+#endif
+
 struct disklog_ctx {
     struct disk_log file;
     os_mutex_t mtx;
@@ -51,6 +74,7 @@ struct disklog_ctx {
     bool read_locked;
     bool log_dirty;
     bool should_stop;
+    bool initialized;
 };
 
 
@@ -68,24 +92,927 @@ struct disklog_ctx {
 #define MTX_UNLOCK()     os_mtx_unlock(&logctx.mtx)
 #define MTX_INIT()       os_mtx_init(&logctx.mtx, 0)
 
+#ifndef CONFIG_DISKLOG_STAGE_SIZE
+#define CONFIG_DISKLOG_STAGE_SIZE   4096 /* Power of 2 (0: disabled) */
+#endif
+
+#ifndef CONFIG_DISKLOG_STAGE_PERIOD
+#define CONFIG_DISKLOG_STAGE_PERIOD 100 /* ms */
+#endif
+
+#ifndef CONFIG_DISKLOG_DROP_SLOTS
+#define CONFIG_DISKLOG_DROP_SLOTS   16  /* Power of 2 */
+#endif
+
+#define DISKLOG_DROP_MASK (CONFIG_DISKLOG_DROP_SLOTS - 1)
+_Static_assert(!(CONFIG_DISKLOG_DROP_SLOTS & DISKLOG_DROP_MASK), "");
 
 static struct disklog_ctx logctx;
+static struct disklog_drop disklog_drop_table[CONFIG_DISKLOG_DROP_SLOTS];
+static uint32_t disklog_drop_total;
+
+#if CONFIG_DISKLOG_STAGE_SIZE > 0
+struct disklog_stage {
+    struct mpsc_ring ring;
+    uint32_t bytes;   /* Log bytes that have been reserved */
+    size_t skip;      /* Bytes of the oldest record that have been written */
+    os_timer_t timer;
+    uint8_t buf[CONFIG_DISKLOG_STAGE_SIZE] __rte_aligned(8);
+};
+
+/*
+ * Each input is staged as one record, So it is never interleaved with
+ * the others. The slot must be less than half of ring, And the longer
+ * input is written to partition directly
+ */
+#define DISKLOG_STAGE_RECORD \
+    (CONFIG_DISKLOG_STAGE_SIZE / 2 - 2 * sizeof(struct mpsc_slot))
+
+_Static_assert(CONFIG_DISKLOG_STAGE_SIZE >= 256 &&
+    !(CONFIG_DISKLOG_STAGE_SIZE & (CONFIG_DISKLOG_STAGE_SIZE - 1)), "");
+_Static_assert(DISKLOG_STAGE_RECORD <= UINT16_MAX, "");
+
+static struct disklog_stage logstage = {
+    .ring = MPSC_RING_INITIALIZER(logstage.buf, CONFIG_DISKLOG_STAGE_SIZE)
+};
+#endif /* CONFIG_DISKLOG_STAGE_SIZE > 0 */
+
+#ifdef CONFIG_DISKLOG_COMPRESS
+#ifndef CONFIG_DISKLOG_SEGMENT_RAW
+#define CONFIG_DISKLOG_SEGMENT_RAW  16384 /* The maximum text of segment */
+#endif
+
+#define DISKLOG_SEG_CHUNK 512
+
+_Static_assert(CONFIG_DISKLOG_SEGMENT_RAW >= 2 * DISKLOG_SEG_CHUNK &&
+    CONFIG_DISKLOG_SEGMENT_RAW <= UINT16_MAX, "");
+
+struct disklog_segidx {
+    uint32_t seq;       /* 0: invalid */
+    uint32_t ts_first;
+    uint32_t ts_last;
+};
+
+struct disklog_segctx {
+    struct disklog_segidx *index; /* The headers of segments (by slot) */
+    uint32_t nsegs;
+    uint32_t slot;      /* Slot of the open segment */
+    uint32_t seq;       /* Sequence number of the open segment */
+    uint8_t *img;       /* Image of the open segment (one block) */
+    size_t comp_len;    /* Chunk bytes in image */
+    char *raw;          /* Text of the open segment */
+    size_t raw_len;
+    size_t raw_done;    /* Text that has been compressed */
+    LZ4_stream_t *stream;
+    bool dirty;         /* The image has not been stored */
+};
+
+static struct disklog_segctx logseg;
+#endif /* CONFIG_DISKLOG_COMPRESS */
+
+uint32_t RTE_WEAKHOOK(_disklog_clock, void) {
+    return (uint32_t)(os_timer_gettime() / 1000);
+}
+
+/*
+ * Find the drop counter of producer (open addressing). The free slot is
+ * claimed with CAS, So it can be called from any context
+ */
+static struct disklog_drop *disklog_drop_lookup(void *owner) {
+    uint32_t hash = (uint32_t)((uintptr_t)owner >> 2);
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu;
+    hash ^= hash >> 16;
+    for (unsigned int i = 0; i < CONFIG_DISKLOG_DROP_SLOTS; i++) {
+        struct disklog_drop *drop = 
+            &disklog_drop_table[(hash + i) & DISKLOG_DROP_MASK];
+        void *key = rte_atomic_load_explicit(&drop->owner, rte_memory_order_acquire);
+
+        if (key == NULL) {
+            if (rte_atomic_compare_exchange_strong_explicit(&drop->owner, &key, owner,
+                rte_memory_order_acq_rel, rte_memory_order_acquire))
+                return drop;
+        }
+        if (key == owner)
+            return drop;
+    }
+    return NULL;
+}
+
+static void disklog_drop_account(size_t size) {
+    struct disklog_drop *drop;
+    void *owner;
+
+    if (os_in_isr())
+        owner = DISKLOG_DROP_ISR;
+    else
+        owner = os_thread_self();
+
+    rte_atomic_fetch_add_explicit(&disklog_drop_total, 1, rte_memory_order_relaxed);
+    drop = disklog_drop_lookup(owner);
+    if (drop) {
+        rte_atomic_fetch_add_explicit(&drop->count, 1, rte_memory_order_relaxed);
+        rte_atomic_fetch_add_explicit(&drop->bytes, (uint32_t)size, 
+            rte_memory_order_relaxed);
+    }
+}
+
+static bool disklog_panic(void) {
+#ifdef CONFIG_DISKLOG_BIO
+    return logctx.bio != NULL && logctx.bio->panic;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_DISKLOG_COMPRESS
+/*
+ * Segment writer: The text of open segment is kept in RAM as the dictionary
+ * of LZ4 stream, and compressed by chunk. The segment is stored when it is
+ * full or disklog is synchronized (The same block is rewritten)
+ */
+static inline uint32_t disklog_seg_offset(uint32_t slot) {
+    return logctx.offset + logctx.file.start + slot * logctx.blksz;
+}
+
+static void disklog_seg_open_locked(uint32_t slot, uint32_t seq) {
+    struct disklog_segctx *seg = &logseg;
+
+    seg->slot = slot;
+    seg->seq = seq;
+    seg->comp_len = 0;
+    seg->raw_len = 0;
+    seg->raw_done = 0;
+    seg->dirty = false;
+    seg->index[slot].seq = seq;
+    seg->index[slot].ts_first = 0;
+    seg->index[slot].ts_last = 0;
+    memset(seg->img, 0xFF, logctx.blksz);
+    LZ4_resetStream_fast(seg->stream);
+}
+
+static void disklog_seg_store_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+    struct disklog_seghdr *hdr = (struct disklog_seghdr *)seg->img;
+    struct disklog_segidx *idx = &seg->index[seg->slot];
+
+    if (!seg->dirty)
+        return;
+
+    hdr->magic = DISKLOG_SEG_MAGIC;
+    hdr->seq = seg->seq;
+    hdr->ts_first = idx->ts_first;
+    hdr->ts_last = idx->ts_last;
+    hdr->raw_size = (uint16_t)seg->raw_done;
+    hdr->comp_size = (uint16_t)seg->comp_len;
+    hdr->flags = 0;
+    hdr->crc = 0;
+    hdr->crc = lib_crc16(seg->img, sizeof(*hdr) + seg->comp_len);
+#ifdef CONFIG_DISKLOG_BIO
+    buffered_write(logctx.bio, seg->img, logctx.blksz, 
+        disklog_seg_offset(seg->slot));
+#else
+    blkdev_write(logctx.dd, seg->img, logctx.blksz, 
+        disklog_seg_offset(seg->slot));
+#endif /* CONFIG_DISKLOG_BIO */
+    seg->dirty = false;
+}
+
+/*
+ * Compress the pending text of open segment.
+ * return false if the segment is full (The pending text is not changed)
+ */
+static bool disklog_seg_compress_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+    size_t pending = seg->raw_len - seg->raw_done;
+    size_t room = logctx.blksz - sizeof(struct disklog_seghdr) - seg->comp_len;
+    uint8_t *p = seg->img + sizeof(struct disklog_seghdr) + seg->comp_len;
+    uint16_t csize;
+    int ret;
+
+    if (pending == 0)
+        return true;
+    if (room <= sizeof(csize))
+        return false;
+
+    ret = LZ4_compress_fast_continue(seg->stream, seg->raw + seg->raw_done,
+        (char *)p + sizeof(csize), (int)pending, (int)(room - sizeof(csize)), 1);
+    if (ret <= 0)
+        return false;
+
+    csize = (uint16_t)ret;
+    memcpy(p, &csize, sizeof(csize));
+    seg->comp_len += sizeof(csize) + csize;
+    seg->raw_done = seg->raw_len;
+    seg->dirty = true;
+    return true;
+}
+
+/*
+ * Store the open segment and start the next one with @len bytes of the
+ * pending text
+ */
+static void disklog_seg_next_locked(const char *text, size_t len) {
+    struct disklog_segctx *seg = &logseg;
+    uint32_t ts = seg->index[seg->slot].ts_last;
+
+    disklog_seg_store_locked();
+    disklog_seg_open_locked((seg->slot + 1) % seg->nsegs, seg->seq + 1);
+    if (len > 0) {
+        memmove(seg->raw, text, len);
+        seg->raw_len = len;
+        seg->index[seg->slot].ts_first = ts;
+        seg->index[seg->slot].ts_last = ts;
+        disklog_seg_compress_locked();
+    }
+}
+
+static void disklog_seg_commit_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+
+    if (disklog_seg_compress_locked()) {
+        if (seg->raw_len == CONFIG_DISKLOG_SEGMENT_RAW)
+            disklog_seg_next_locked(NULL, 0);
+        return;
+    }
+
+    /* The segment is full, So the pending text goes to the next one */
+    disklog_seg_next_locked(seg->raw + seg->raw_done, 
+        seg->raw_len - seg->raw_done);
+}
+
+static void disklog_seg_sync_locked(void) {
+    disklog_seg_commit_locked();
+    disklog_seg_store_locked();
+}
+
+static int disklog_seg_write_locked(const char *buf, size_t size) {
+    struct disklog_segctx *seg = &logseg;
+    uint32_t now = _disklog_clock();
+
+    while (size > 0) {
+        struct disklog_segidx *idx = &seg->index[seg->slot];
+        size_t bytes;
+
+        bytes = MIN(size, DISKLOG_SEG_CHUNK - (seg->raw_len - seg->raw_done));
+        bytes = MIN(bytes, CONFIG_DISKLOG_SEGMENT_RAW - seg->raw_len);
+        if (seg->raw_len == 0)
+            idx->ts_first = now;
+        idx->ts_last = now;
+        memcpy(seg->raw + seg->raw_len, buf, bytes);
+        seg->raw_len += bytes;
+        buf += bytes;
+        size -= bytes;
+
+        if (seg->raw_len - seg->raw_done == DISKLOG_SEG_CHUNK ||
+            seg->raw_len == CONFIG_DISKLOG_SEGMENT_RAW)
+            disklog_seg_commit_locked();
+    }
+
+	logctx.log_dirty = true;
+    return 0;
+}
+
+static void disklog_seg_reset_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+
+    /* Called by initialization before the segment buffer is ready */
+    if (seg->raw == NULL) {
+        logctx.file.rd_seq = 0;
+        return;
+    }
+
+    /* The open segment may have been stored, So skip it */
+    logctx.file.rd_seq = seg->seq + 1;
+    seg->dirty = false;
+    disklog_seg_open_locked((seg->slot + 1) % seg->nsegs, seg->seq + 1);
+}
+#endif /* CONFIG_DISKLOG_COMPRESS */
+
+/*
+ * Write log to partition (The caller must hold the lock)
+ */
+static int disklog_write_locked(const char *buf, size_t size) {
+#ifdef CONFIG_DISKLOG_COMPRESS
+    return disklog_seg_write_locked(buf, size);
+#else
+    struct disk_log *filp = &logctx.file;
+    size_t remain = size;
+    uint32_t wr_ofs, bytes;
+    int ret;
+
+    wr_ofs = filp->wr_ofs;
+    while (remain > 0) {
+        bytes = MIN(filp->end - wr_ofs, remain);
+#ifdef CONFIG_DISKLOG_BIO
+        ret = buffered_write(logctx.bio, buf, bytes, 
+            logctx.offset + wr_ofs);
+#else
+        ret = blkdev_write(logctx.dd, buf, bytes, 
+            logctx.offset + wr_ofs);
+#endif /* CONFIG_DISKLOG_BIO */
+        if (ret < 0) 
+            goto _next;
+        
+        remain -= bytes;
+        wr_ofs += bytes;
+        buf += bytes;
+        if (wr_ofs >= filp->end)
+            wr_ofs = filp->start;
+    }
+
+    filp->d_size += size - remain;
+    if (filp->d_size > filp->size) {
+        filp->d_size = filp->size;
+        filp->rd_ofs = wr_ofs;
+    }
+    ret = 0;
+_next:
+    filp->wr_ofs = wr_ofs;
+	logctx.log_dirty = true;
+    return ret;
+#endif /* CONFIG_DISKLOG_COMPRESS */
+}
+
+#if CONFIG_DISKLOG_STAGE_SIZE > 0
+/*
+ * Move the staged log to partition. If @all is false, only the bytes
+ * that fill up whole erase blocks are written (The tail of last record
+ * is kept in ring)
+ */
+static void disklog_stage_flush_locked(bool all) {
+    struct disklog_stage *stage = &logstage;
+    size_t len, quota = SIZE_MAX;
+    const char *rec;
+
+    if (!all) {
+        size_t staged = rte_atomic_load_explicit(&stage->bytes, 
+            rte_memory_order_relaxed);
+        size_t room = logctx.blksz - (logctx.file.wr_ofs % logctx.blksz);
+
+        if (staged < room)
+            return;
+        quota = room + (staged - room) / logctx.blksz * logctx.blksz;
+    }
+
+    while (quota > 0 && (rec = mpsc_ring_peek(&stage->ring, &len)) != NULL) {
+        size_t bytes = MIN(len - stage->skip, quota);
+
+        disklog_write_locked(rec + stage->skip, bytes);
+        rte_atomic_fetch_sub_explicit(&stage->bytes, (uint32_t)bytes, 
+            rte_memory_order_relaxed);
+        quota -= bytes;
+        stage->skip += bytes;
+        if (stage->skip < len)
+            break;
+
+        stage->skip = 0;
+        mpsc_ring_consume(&stage->ring);
+    }
+}
+
+/*
+ * The producer never waits for the lock. If the ring is full, the thread
+ * (not interrupt) flushes it when the lock is free, or the log is dropped
+ */
+static void *disklog_stage_reserve(size_t bytes) {
+    struct disklog_stage *stage = &logstage;
+    void *rec;
+
+    rec = mpsc_ring_reserve(&stage->ring, bytes);
+    if (rte_unlikely(rec == NULL)) {
+        if (!logctx.initialized || os_in_isr() || MTX_TRYLOCK())
+            return NULL;
+        disklog_stage_flush_locked(true);
+        MTX_UNLOCK();
+        rec = mpsc_ring_reserve(&stage->ring, bytes);
+    }
+    return rec;
+}
+
+static int disklog_stage_input(const char *buf, size_t size) {
+    struct disklog_stage *stage = &logstage;
+    void *rec;
+    int ret;
+
+    /* The long input can never be staged, So write it directly */
+    if (size > DISKLOG_STAGE_RECORD) {
+        if (!logctx.initialized || os_in_isr()) {
+            disklog_drop_account(size);
+            return -ENOSPC;
+        }
+        MTX_LOCK();
+        disklog_stage_flush_locked(true);
+        ret = disklog_write_locked(buf, size);
+        MTX_UNLOCK();
+        return ret;
+    }
+
+    rec = disklog_stage_reserve(size);
+    if (rec == NULL) {
+        disklog_drop_account(size);
+        return -ENOSPC;
+    }
+
+    memcpy(rec, buf, size);
+    rte_atomic_fetch_add_explicit(&stage->bytes, (uint32_t)size, 
+        rte_memory_order_relaxed);
+    mpsc_ring_commit(&stage->ring, rec);
+    return 0;
+}
+
+static bool disklog_stage_pending(void) {
+    return rte_atomic_load_explicit(&logstage.bytes, rte_memory_order_relaxed) > 0;
+}
+
+static void disklog_stage_timer(os_timer_t timer, void *arg) {
+    (void) arg;
+    if (MTX_TRYLOCK() == 0) {
+        /* Write all of them if the ring is going to be full */
+        disklog_stage_flush_locked(
+            mpsc_ring_used(&logstage.ring) >= CONFIG_DISKLOG_STAGE_SIZE / 2);
+        MTX_UNLOCK();
+    }
+    os_timer_mod(timer, CONFIG_DISKLOG_STAGE_PERIOD);
+}
+#else
+#define disklog_stage_flush_locked(...) (void)0
+#define disklog_stage_pending() false
+#endif /* CONFIG_DISKLOG_STAGE_SIZE > 0 */
+
+#ifdef CONFIG_DISKLOG_COMPRESS
+static struct disklog_segidx *disklog_seg_lookup(uint32_t seq, uint32_t *slot) {
+    struct disklog_segctx *seg = &logseg;
+    uint32_t distance = seg->seq - seq;
+    uint32_t n;
+
+    if (seq == 0 || seq > seg->seq || distance >= seg->nsegs)
+        return NULL;
+
+    n = (seg->slot + seg->nsegs - distance) % seg->nsegs;
+    if (seg->index[n].seq != seq)
+        return NULL;
+    if (slot)
+        *slot = n;
+    return &seg->index[n];
+}
+
+static uint32_t disklog_seg_first_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+    uint32_t first = seg->seq - MIN(seg->seq - 1, seg->nsegs - 1);
+
+    return rte_max(first, logctx.file.rd_seq);
+}
+
+static int disklog_seg_load_locked(uint32_t seq, uint8_t *img) {
+    struct disklog_seghdr *hdr = (struct disklog_seghdr *)img;
+    uint16_t crc;
+    uint32_t slot;
+    int ret;
+
+    if (!disklog_seg_lookup(seq, &slot))
+        return -ENOENT;
+
+#ifdef CONFIG_DISKLOG_BIO
+    ret = buffered_read(logctx.bio, img, logctx.blksz, disklog_seg_offset(slot));
+#else
+    ret = blkdev_read(logctx.dd, img, logctx.blksz, disklog_seg_offset(slot));
+#endif /* CONFIG_DISKLOG_BIO */
+    if (ret < 0)
+        return ret;
+
+    if (hdr->magic != DISKLOG_SEG_MAGIC || hdr->seq != seq ||
+        hdr->comp_size > logctx.blksz - sizeof(*hdr))
+        return -EIO;
+    crc = hdr->crc;
+    hdr->crc = 0;
+    if (lib_crc16(img, sizeof(*hdr) + hdr->comp_size) != crc)
+        return -EIO;
+    hdr->crc = crc;
+    return (int)(sizeof(*hdr) + hdr->comp_size);
+}
+
+static int disklog_seg_decode(const uint8_t *img, char *text, size_t size) {
+    const struct disklog_seghdr *hdr = (const struct disklog_seghdr *)img;
+    const uint8_t *p = img + sizeof(*hdr);
+    const uint8_t *end = p + hdr->comp_size;
+    int len = 0;
+
+    if (hdr->raw_size > size)
+        return -ENOSPC;
+
+    while (p + sizeof(uint16_t) <= end) {
+        uint16_t csize;
+        int ret;
+
+        memcpy(&csize, p, sizeof(csize));
+        p += sizeof(csize);
+        if (p + csize > end)
+            return -EIO;
+
+        /* The text that has been decoded is the dictionary */
+        ret = LZ4_decompress_safe_usingDict((const char *)p, text + len, csize,
+            (int)size - len, text, len);
+        if (ret < 0)
+            return -EIO;
+        len += ret;
+        p += csize;
+    }
+    return len == hdr->raw_size? len: -EIO;
+}
+
+static void disklog_seg_free_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+
+    general_free(seg->index);
+    general_free(seg->img);
+    general_free(seg->raw);
+    general_free(seg->stream);
+    seg->index = NULL;
+    seg->img = NULL;
+    seg->raw = NULL;
+    seg->stream = NULL;
+    seg->nsegs = 0;
+}
+
+static int disklog_seg_init_locked(void) {
+    struct disklog_segctx *seg = &logseg;
+    struct disklog_seghdr hdr;
+    uint32_t newest = 0, slot = 0;
+    int ret;
+
+    /* The pending chunk must fit in an empty segment */
+    if (logctx.blksz < 1024 || logctx.blksz > UINT16_MAX ||
+        logctx.file.size < logctx.blksz)
+        return -EINVAL;
+
+    seg->nsegs = logctx.file.size / logctx.blksz;
+    seg->index = general_calloc(seg->nsegs, sizeof(struct disklog_segidx));
+    seg->img = general_malloc(logctx.blksz);
+    seg->raw = general_malloc(CONFIG_DISKLOG_SEGMENT_RAW);
+    seg->stream = general_malloc(sizeof(LZ4_stream_t));
+    if (!seg->index || !seg->img || !seg->raw || !seg->stream) {
+        ret = -ENOMEM;
+        goto _free;
+    }
+
+    LZ4_initStream(seg->stream, sizeof(LZ4_stream_t));
+
+    /* Build the index from segment headers */
+    for (uint32_t i = 0; i < seg->nsegs; i++) {
+#ifdef CONFIG_DISKLOG_BIO
+        ret = buffered_read(logctx.bio, &hdr, sizeof(hdr), disklog_seg_offset(i));
+#else
+        ret = blkdev_read(logctx.dd, &hdr, sizeof(hdr), disklog_seg_offset(i));
+#endif /* CONFIG_DISKLOG_BIO */
+        if (ret < 0)
+            goto _free;
+        if (hdr.magic != DISKLOG_SEG_MAGIC || hdr.seq == 0 ||
+            hdr.comp_size > logctx.blksz - sizeof(hdr))
+            continue;
+
+        seg->index[i].seq = hdr.seq;
+        seg->index[i].ts_first = hdr.ts_first;
+        seg->index[i].ts_last = hdr.ts_last;
+        if (hdr.seq > newest) {
+            newest = hdr.seq;
+            slot = i;
+        }
+    }
+
+    /* The new log is written to the next segment of the newest one */
+    if (newest > 0)
+        slot = (slot + 1) % seg->nsegs;
+    disklog_seg_open_locked(slot, rte_max(newest + 1, logctx.file.rd_seq));
+    return 0;
+
+_free:
+    disklog_seg_free_locked();
+    return ret;
+}
+
+static int disklog_seg_output(bool (*output)(void *ctx, char *buf, size_t size), 
+    void *ctx, size_t maxsize, bool compressed) {
+    struct disklog_segctx *seg = &logseg;
+    char *buffer = NULL, *text = NULL;
+    uint8_t *img;
+    int ret;
+
+    if (output == NULL)
+        return -EINVAL;
+
+    if (logctx.upload_pending)
+        return -EBUSY;
+
+    if (maxsize == 0)
+        maxsize = 1024;
+
+    img = general_malloc(logctx.blksz);
+    if (!compressed) {
+        buffer = general_malloc(maxsize + 1);
+        text = general_malloc(CONFIG_DISKLOG_SEGMENT_RAW);
+    }
+    if (img == NULL || (!compressed && (buffer == NULL || text == NULL))) {
+        ret = -ENOMEM;
+        goto _free;
+    }
+
+    logctx.upload_pending = true;
+    MTX_LOCK();
+    disklog_stage_flush_locked(true);
+    disklog_seg_sync_locked();
+    for (uint32_t seq = disklog_seg_first_locked(); seq <= seg->seq; seq++) {
+        int len;
+
+        if (logctx.should_stop) {
+            ret = 0;
+            goto _next;
+        }
+
+        if (seq == seg->seq && seg->raw_len == 0)
+            break;
+
+        /* The broken segment is skipped */
+        len = disklog_seg_load_locked(seq, img);
+        if (len < 0)
+            continue;
+
+        if (compressed) {
+            if (!output(ctx, (char *)img, len)) {
+                ret = -EIO;
+                goto _next;
+            }
+            continue;
+        }
+
+        len = disklog_seg_decode(img, text, CONFIG_DISKLOG_SEGMENT_RAW);
+        for (int ofs = 0; ofs < len; ) {
+            size_t bytes = MIN((size_t)(len - ofs), maxsize);
+
+            memcpy(buffer, text + ofs, bytes);
+            if (!output(ctx, buffer, bytes)) {
+                ret = -EIO;
+                goto _next;
+            }
+            ofs += bytes;
+        }
+    }
+
+    /* All of the segments have been consumed */
+    if (seg->raw_len > 0)
+        disklog_seg_next_locked(NULL, 0);
+    logctx.file.rd_seq = seg->seq;
+    logctx.log_dirty = true;
+    ret = 0;
+_next:
+    MTX_UNLOCK();
+    logctx.upload_pending = false;
+_free:
+    general_free(img);
+    general_free(buffer);
+    general_free(text);
+    return ret;
+}
+
+static ssize_t disklog_seg_read(char *buffer, size_t maxlen, bool first) {
+    static struct {
+        uint32_t seq;
+        size_t len;
+        size_t pos;
+        char *text;
+        uint8_t *img;
+    } rd;
+    struct disklog_segctx *seg = &logseg;
+    size_t copied = 0;
+    int ret;
+
+    if (!buffer || !maxlen)
+        return -EINVAL;
+
+    ret = MTX_TRYLOCK();
+    if (ret) {
+        if (logctx.upload_pending)
+            return -EBUSY;
+        MTX_LOCK();
+    }
+
+    if (first) {
+        if (rd.text == NULL)
+            rd.text = general_malloc(CONFIG_DISKLOG_SEGMENT_RAW);
+        if (rd.img == NULL)
+            rd.img = general_malloc(logctx.blksz);
+        if (rd.text == NULL || rd.img == NULL) {
+            MTX_UNLOCK();
+            return -ENOMEM;
+        }
+        disklog_stage_flush_locked(true);
+        rd.seq = disklog_seg_first_locked();
+        rd.len = rd.pos = 0;
+    }
+
+    while (copied < maxlen) {
+        size_t bytes;
+
+        if (rd.pos == rd.len) {
+            if (rd.text == NULL || rd.seq > seg->seq)
+                break;
+
+            /* The text of open segment is in RAM */
+            if (rd.seq == seg->seq) {
+                memcpy(rd.text, seg->raw, seg->raw_len);
+                rd.len = seg->raw_len;
+            } else {
+                ret = disklog_seg_load_locked(rd.seq, rd.img);
+                if (ret > 0)
+                    ret = disklog_seg_decode(rd.img, rd.text,
+                        CONFIG_DISKLOG_SEGMENT_RAW);
+                rd.len = ret > 0? ret: 0;
+            }
+            rd.pos = 0;
+            rd.seq++;
+            continue;
+        }
+
+        bytes = MIN(maxlen - copied, rd.len - rd.pos);
+        memcpy(buffer + copied, rd.text + rd.pos, bytes);
+        rd.pos += bytes;
+        copied += bytes;
+    }
+    MTX_UNLOCK();
+    return (ssize_t)copied;
+}
+
+int disklog_segment_range(uint32_t *first, uint32_t *last) {
+    if (!first || !last)
+        return -EINVAL;
+    if (!logctx.initialized)
+        return -ENODEV;
+
+    MTX_LOCK();
+    *first = disklog_seg_first_locked();
+    *last = logseg.seq;
+    MTX_UNLOCK();
+    return 0;
+}
+
+int disklog_segment_find(uint32_t time, uint32_t *seq) {
+    struct disklog_segctx *seg = &logseg;
+    int ret = -ENOENT;
+
+    if (!seq)
+        return -EINVAL;
+    if (!logctx.initialized)
+        return -ENODEV;
+
+    MTX_LOCK();
+    for (uint32_t n = disklog_seg_first_locked(); n <= seg->seq; n++) {
+        struct disklog_segidx *idx = disklog_seg_lookup(n, NULL);
+
+        if (idx && idx->ts_last >= time && 
+            (n < seg->seq || seg->raw_len > 0)) {
+            *seq = n;
+            ret = 0;
+            break;
+        }
+    }
+    MTX_UNLOCK();
+    return ret;
+}
+
+ssize_t disklog_segment_read(uint32_t seq, void *buf, size_t size, bool text,
+    struct disklog_seghdr *info) {
+    struct disklog_segctx *seg = &logseg;
+    uint8_t *img;
+    int ret;
+
+    if (!buf)
+        return -EINVAL;
+    if (!logctx.initialized)
+        return -ENODEV;
+
+    img = general_malloc(logctx.blksz);
+    if (img == NULL)
+        return -ENOMEM;
+
+    MTX_LOCK();
+    if (seq < logctx.file.rd_seq) {
+        ret = -ENOENT;
+        goto _next;
+    }
+
+    /* The open segment must be stored before it is read */
+    if (seq == seg->seq) {
+        disklog_stage_flush_locked(true);
+        disklog_seg_sync_locked();
+    }
+
+    ret = disklog_seg_load_locked(seq, img);
+    if (ret < 0)
+        goto _next;
+
+    if (info)
+        memcpy(info, img, sizeof(*info));
+    if (text) {
+        ret = disklog_seg_decode(img, buf, size);
+    } else {
+        if ((size_t)ret > size) {
+            ret = -ENOSPC;
+            goto _next;
+        }
+        memcpy(buf, img, ret);
+    }
+_next:
+    MTX_UNLOCK();
+    general_free(img);
+    return ret;
+}
+
+int disklog_segment_output(bool (*output)(void *ctx, char *buf, size_t size), 
+    void *ctx) {
+    return disklog_seg_output(output, ctx, 0, true);
+}
+
+#else /* !CONFIG_DISKLOG_COMPRESS */
+int disklog_segment_range(uint32_t *first, uint32_t *last) {
+    (void) first;
+    (void) last;
+    return -ENOTSUP;
+}
+
+int disklog_segment_find(uint32_t time, uint32_t *seq) {
+    (void) time;
+    (void) seq;
+    return -ENOTSUP;
+}
+
+ssize_t disklog_segment_read(uint32_t seq, void *buf, size_t size, bool text,
+    struct disklog_seghdr *info) {
+    (void) seq;
+    (void) buf;
+    (void) size;
+    (void) text;
+    (void) info;
+    return -ENOTSUP;
+}
+
+int disklog_segment_output(bool (*output)(void *ctx, char *buf, size_t size), 
+    void *ctx) {
+    (void) output;
+    (void) ctx;
+    return -ENOTSUP;
+}
+#endif /* CONFIG_DISKLOG_COMPRESS */
 
 static void disklog_reset_locked(void) {
     struct disk_log *filp = &logctx.file;
     size_t blksz = logctx.blksz;
     
-    filp->magic  = DISKLOG_MAGIC;
+    filp->magic  = DISKLOG_FILE_MAGIC;
     filp->start  = blksz;
     filp->size   = ((logctx.len - blksz) / blksz) * blksz;
     filp->end    = filp->start + filp->size;
     filp->rd_ofs = filp->start;
     filp->wr_ofs = filp->start;
     filp->d_size = 0;
+#ifdef CONFIG_DISKLOG_COMPRESS
+    disklog_seg_reset_locked();
+#endif
+}
+
+static void disklog_flush_locked(void) {
+#ifdef CONFIG_DISKLOG_BIO
+	rte_assert(logctx.bio != NULL);
+	disklog_stage_flush_locked(true);
+#ifdef CONFIG_DISKLOG_COMPRESS
+	disklog_seg_sync_locked();
+#endif
+	if (logctx.bio->panic) {
+		buffered_flush_locked(logctx.bio);
+		disk_device_erase(logctx.bio->dd, logctx.offset, logctx.blksz);
+		disk_device_write(logctx.bio->dd, &logctx.file, 
+			sizeof(logctx.file), logctx.offset);
+	} else {
+	    int ret = buffered_write(logctx.bio, &logctx.file, 
+	        sizeof(logctx.file), logctx.offset);
+	    rte_assert(ret > 0);
+	    (void) ret;
+		buffered_ioflush(logctx.bio, false);
+	}
+#else /* CONFIG_DISKLOG_BIO */
+    rte_assert(logctx.dd != NULL);
+    disklog_stage_flush_locked(true);
+#ifdef CONFIG_DISKLOG_COMPRESS
+    disklog_seg_sync_locked();
+#endif
+    blkdev_write(logctx.dd, &logctx.file, sizeof(logctx.file),
+        logctx.offset);
+    blkdev_sync();
+#endif /* CONFIG_DISKLOG_BIO */
 }
 
 static void disklog_sync(bool wait) {
-    if (logctx.log_dirty) {
+    if (logctx.log_dirty || disklog_stage_pending()) {
     	int err;
     
 	    if (wait) {
@@ -95,9 +1022,10 @@ static void disklog_sync(bool wait) {
 		}
 
 		if (err == 0) {
+	        disklog_stage_flush_locked(true);
 	        if (logctx.log_dirty) {
 	            logctx.log_dirty = false;
-	            disklog_flush();
+	            disklog_flush_locked();
 	        }
 	        MTX_UNLOCK();
 	    }
@@ -123,40 +1051,29 @@ static void disklog_swap(os_timer_t timer, void *arg) {
 void disklog_reset(void) {
     MTX_LOCK();
     logctx.read_locked = false;
+    disklog_stage_flush_locked(true);
     disklog_reset_locked();
     MTX_UNLOCK();
 }
 
 void disklog_flush(void) {
-#ifdef CONFIG_DISKLOG_BIO
-	rte_assert(logctx.bio != NULL);
-	if (logctx.bio->panic) {
-		buffered_flush_locked(logctx.bio);
-		disk_device_erase(logctx.bio->dd, logctx.offset, logctx.blksz);
-		disk_device_write(logctx.bio->dd, &logctx.file, 
-			sizeof(logctx.file), logctx.offset);
-	} else {
-	    int ret = buffered_write(logctx.bio, &logctx.file, 
-	        sizeof(logctx.file), logctx.offset);
-	    rte_assert(ret > 0);
-	    (void) ret;
-		buffered_ioflush(logctx.bio, false);
-	}
-#else /* CONFIG_DISKLOG_BIO */
-    rte_assert(logctx.dd != NULL);
-    blkdev_write(logctx.dd, &logctx.file, sizeof(logctx.file),
-        logctx.offset);
-    blkdev_sync();
-#endif /* CONFIG_DISKLOG_BIO */
+    /* The scheduler is stopped after panic, So flush it directly */
+    if (rte_unlikely(disklog_panic())) {
+        disklog_flush_locked();
+        return;
+    }
+
+    MTX_LOCK();
+    disklog_flush_locked();
+    MTX_UNLOCK();
 }
 
 int disklog_init(void) {
     const struct disk_partition *dp_dev;
     struct disk_device *dd;
-    static bool initialized;
     int ret;
 
-    if (initialized)
+    if (logctx.initialized)
         return 0;
 
     MTX_INIT();
@@ -166,7 +1083,7 @@ int disklog_init(void) {
 
     MTX_LOCK();
 #ifdef CONFIG_DISKLOG_BIO
-    ret = buffered_iocreate(dd, dd->blk_size, false, &logctx.bio);
+    ret = buffered_iocreate(dd, dd->blk_size, 2, false, &logctx.bio);
     if (ret) {
         rte_assert(0);
         goto _unlock;
@@ -193,11 +1110,23 @@ int disklog_init(void) {
         rte_assert(0);
         goto _unlock;
     }
-    if (logctx.file.magic != DISKLOG_MAGIC)
+    if (logctx.file.magic != DISKLOG_FILE_MAGIC)
         disklog_reset_locked();
 
+#ifdef CONFIG_DISKLOG_COMPRESS
+    ret = disklog_seg_init_locked();
+    if (ret) {
+        rte_assert(0);
+        goto _unlock;
+    }
+#endif
+
     os_timer_create(&logctx.timer, disklog_swap, 
         NULL, false);
+#if CONFIG_DISKLOG_STAGE_SIZE > 0
+    os_timer_create(&logstage.timer, disklog_stage_timer, 
+        NULL, false);
+#endif
     
     /* Register observer for system shutdown/reoot */
     logctx.obs.update = disklog_sync_listen;
@@ -205,9 +1134,12 @@ int disklog_init(void) {
     system_add_observer(&logctx.obs);
 
 	logctx.log_dirty = false;
-    initialized = true;
+    logctx.initialized = true;
     ret = 0;
     os_timer_add(logctx.timer, DISLOG_SWAP_PERIOD);
+#if CONFIG_DISKLOG_STAGE_SIZE > 0
+    os_timer_add(logstage.timer, CONFIG_DISKLOG_STAGE_PERIOD);
+#endif
 
 _unlock:
     MTX_UNLOCK();
@@ -215,83 +1147,40 @@ _unlock:
 }
 
 int disklog_input(const char *buf, size_t size) {
-#ifdef CONFIG_DISKLOG_BIO
-    struct buffered_io *bio;
-#else
-    struct disk_device *dd;
-#endif
-    size_t remain = size;
-    uint32_t wr_ofs, bytes;
-    int ret;
-
     if (buf == NULL || size == 0)
         return -EINVAL;
 
     if (logctx.read_locked) 
         return -EBUSY;
 
-#ifdef CONFIG_DISKLOG_BIO
-	bio = logctx.bio;
-	if (rte_likely(!bio->panic)) {
-	    ret = MTX_TRYLOCK();
-	    if (ret) {
-	        if (logctx.upload_pending)
-	            return -EBUSY;
-	        MTX_LOCK();
-	    }
-	}
-#else /* !CONFIG_DISKLOG_BIO */
-    dd = logctx.dd;
-    ret = MTX_TRYLOCK();
-    if (ret) {
-        if (logctx.upload_pending)
-            return -EBUSY;
-        MTX_LOCK();
+    /* The scheduler is stopped after panic, So write it directly */
+    if (rte_unlikely(disklog_panic())) {
+        disklog_stage_flush_locked(true);
+        return disklog_write_locked(buf, size);
     }
-#endif /* CONFIG_DISKLOG_BIO */
 
-    struct disk_log *filp = &logctx.file;
-    wr_ofs = filp->wr_ofs;
-
-    while (remain > 0) {
-        bytes = MIN(filp->end - wr_ofs, remain);
-#ifdef CONFIG_DISKLOG_BIO
-        ret = buffered_write(bio, buf, bytes, 
-            logctx.offset + wr_ofs);
+#if CONFIG_DISKLOG_STAGE_SIZE > 0
+    return disklog_stage_input(buf, size);
 #else
-        ret = blkdev_write(dd, buf, bytes, 
-            logctx.offset + wr_ofs);
-#endif /* CONFIG_DISKLOG_BIO */
-        if (ret < 0) 
-            goto _next;
-        
-        remain -= bytes;
-        wr_ofs += bytes;
-        buf += bytes;
-        if (wr_ofs >= filp->end)
-            wr_ofs = filp->start;
-    }
-
-    filp->d_size += size - remain;
-    if (filp->d_size > filp->size) {
-        filp->d_size = filp->size;
-        filp->rd_ofs = wr_ofs;
+    int ret = MTX_TRYLOCK();
+    if (ret) {
+        if (logctx.upload_pending) {
+            disklog_drop_account(size);
+            return -EBUSY;
+        }
+        MTX_LOCK();
     }
-    ret = 0;
-_next:
-    filp->wr_ofs = wr_ofs;
-	logctx.log_dirty = true;
-#ifdef CONFIG_DISKLOG_BIO
-	if (rte_likely(!bio->panic))
-    	MTX_UNLOCK();
-#else
+    ret = disklog_write_locked(buf, size);
     MTX_UNLOCK();
-#endif /* CONFIG_DISKLOG_BIO */
     return ret;
+#endif /* CONFIG_DISKLOG_STAGE_SIZE > 0 */
 }
 
 int disklog_ouput(bool (*output)(void *ctx, char *buf, size_t size), 
     void *ctx, size_t maxsize) {
+#ifdef CONFIG_DISKLOG_COMPRESS
+    return disklog_seg_output(output, ctx, maxsize, false);
+#else
 #define LOG_SIZE 1024
     uint32_t rd_ofs, bytes;
     char *buffer;
@@ -313,6 +1202,7 @@ int disklog_ouput(bool (*output)(void *ctx, char *buf, size_t size),
     ret = 0;
     logctx.upload_pending = true;
     MTX_LOCK();
+    disklog_stage_flush_locked(true);
     struct disk_log *filp = &logctx.file;
     size_t size = filp->d_size;
     size_t remain = size;
@@ -352,9 +1242,13 @@ _next:
 	logctx.upload_pending = false;
     general_free(buffer);
     return ret;    
+#endif /* CONFIG_DISKLOG_COMPRESS */
 }
 
 ssize_t disklog_read(char *buffer, size_t maxlen, bool first) {
+#ifdef CONFIG_DISKLOG_COMPRESS
+    return disklog_seg_read(buffer, maxlen, first);
+#else
     static struct disk_log rdlog;
     uint32_t rd_ofs, bytes;
     int ret = 0;
@@ -369,8 +1263,10 @@ ssize_t disklog_read(char *buffer, size_t maxlen, bool first) {
         MTX_LOCK();
     }
 
-    if (first)
+    if (first) {
+        disklog_stage_flush_locked(true);
         rdlog = logctx.file;
+    }
 
     size_t size = rdlog.d_size;
     size_t remain = MIN(maxlen, size);
@@ -398,15 +1294,21 @@ ssize_t disklog_read(char *buffer, size_t maxlen, bool first) {
 _next:
     MTX_UNLOCK();
     return ret;   
+#endif /* CONFIG_DISKLOG_COMPRESS */
 }
 
 void disklog_upload_cb(struct log_upload_class *luc) {
+    int err;
+
     if (!luc || !luc->upload)
         return;
     if (luc->begin)
         luc->begin(luc->ctx);
 
-    int err = disklog_ouput(luc->upload, luc->ctx, luc->maxsize);
+    if (luc->compressed)
+        err = disklog_segment_output(luc->upload, luc->ctx);
+    else
+        err = disklog_ouput(luc->upload, luc->ctx, luc->maxsize);
 
     if (luc->end)
         luc->end(luc->ctx, err);
@@ -418,3 +1320,28 @@ int disklog_read_lock(bool enable) {
     MTX_UNLOCK();
     return 0;
 }
+
+size_t disklog_drop_snapshot(struct disklog_drop *buf, size_t n) {
+    size_t count = 0;
+
+    if (!buf)
+        return 0;
+    for (unsigned int i = 0; i < CONFIG_DISKLOG_DROP_SLOTS && count < n; i++) {
+        struct disklog_drop *drop = &disklog_drop_table[i];
+        void *owner = rte_atomic_load_explicit(&drop->owner, rte_memory_order_acquire);
+
+        if (owner) {
+            buf[count].owner = owner;
+            buf[count].count = rte_atomic_load_explicit(&drop->count, 
+                rte_memory_order_relaxed);
+            buf[count].bytes = rte_atomic_load_explicit(&drop->bytes, 
+                rte_memory_order_relaxed);
+            count++;
+        }
+    }
+    return count;
+}
+
+uint32_t disklog_dropped(void) {
+    return rte_atomic_load_explicit(&disklog_drop_total, rte_memory_order_relaxed);
+}
@@ -5,6 +5,7 @@
 #define BASEWORK_LIB_DISKLOG_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <sys/types.h>
 
@@ -17,12 +18,44 @@ extern "C"{
     typedef long int ssize_t;
 #endif
 
+/* The owner of drop counter for interrupt context */
+#define DISKLOG_DROP_ISR ((void *)1)
+
+struct disklog_drop {
+    void *owner;     /* Producer thread or DISKLOG_DROP_ISR */
+    uint32_t count;  /* The number of dropped inputs */
+    uint32_t bytes;  /* The number of dropped bytes */
+};
+
+/*
+ * Compressed segment (CONFIG_DISKLOG_COMPRESS, little-endian)
+ *
+ * | header | chunk ... | 0xFF ... |  (One erase block)
+ *
+ * The chunk is a 16-bit compressed size and a LZ4 block. The chunks of
+ * segment are one LZ4 stream (The previous text is the dictionary), So
+ * every segment can be decoded alone.
+ */
+#define DISKLOG_SEG_MAGIC 0x474c5344 /* "DSLG" */
+
+struct disklog_seghdr {
+    uint32_t magic;
+    uint32_t seq;       /* Sequence number (Start from 1) */
+    uint32_t ts_first;  /* Timestamp of the first log (_disklog_clock()) */
+    uint32_t ts_last;   /* Timestamp of the last log */
+    uint16_t raw_size;  /* Text size */
+    uint16_t comp_size; /* Chunk bytes after header */
+    uint16_t flags;
+    uint16_t crc;       /* CRC16 of header (crc = 0) and chunks */
+};
+
 struct log_upload_class {
     void (*begin)(void *ctx);
     bool (*upload)(void *ctx, char *buf, size_t size);
     void (*end)(void *ctx, int err);
     void *ctx;
     size_t maxsize;
+    bool compressed; /* Upload the segments without decompression */
 };
 
 /*
@@ -39,18 +72,18 @@ void disklog_reset(void);
 
 /*
  * disklog_flush - sync log-buffer to disk
- * 
- * @panic: system panic
+ * (The staged log is written too, It must not be called with disklog locked)
  */
-
 void disklog_flush(void);
 
 /*
  * disklog_input - Write log to disk
+ * (The log is staged in RAM without lock, So it can be called from interrupt)
  * 
  * @buf: log buffer pointer
  * @size: log size
- * return 0 if success
+ * return 0 if success (-ENOSPC: The staging ring is full and log is dropped,
+ * The long log is never written partly)
  */
 int disklog_input(const char *buf, size_t size);
 
@@ -90,6 +123,73 @@ void disklog_upload_cb(struct log_upload_class *luc);
  */
 int disklog_read_lock(bool enable);
 
+/*
+ * disklog_segment_range - Get the sequence numbers of segments that can be read
+ * (The last one is the segment that is being written)
+ *
+ * @first: the oldest segment
+ * @last: the newest segment
+ * return 0 if success
+ */
+int disklog_segment_range(uint32_t *first, uint32_t *last);
+
+/*
+ * disklog_segment_find - Find the oldest segment that has log at or after @time
+ * (The result is wrong for the segments of previous boots if _disklog_clock()
+ *  is not overwritten, The segments are searched in order of sequence)
+ *
+ * @time: timestamp (_disklog_clock())
+ * @seq: sequence number of segment
+ * return 0 if success
+ */
+int disklog_segment_find(uint32_t time, uint32_t *seq);
+
+/*
+ * disklog_segment_read - Read a segment
+ *
+ * @seq: sequence number of segment
+ * @buf: data buffer
+ * @size: buffer size
+ * @text: decompress segment (else return the segment image)
+ * @info: segment header (can be NULL)
+ * return the data size if success
+ */
+ssize_t disklog_segment_read(uint32_t seq, void *buf, size_t size, bool text,
+    struct disklog_seghdr *info);
+
+/*
+ * disklog_segment_output - Pass the compressed segments to user callback
+ * (One segment image per callback, The segments are consumed)
+ *
+ * @output: segment output callback
+ * @ctx: user parameter
+ * return 0 if success
+ */
+int disklog_segment_output(bool (*output)(void *ctx, char *buf, size_t size), 
+    void *ctx);
+
+/*
+ * _disklog_clock - Get the timestamp of segment (seconds)
+ * (The default implement returns the seconds since boot, So it restarts
+ *  from zero after reboot. The platform should overwrite it with RTC)
+ */
+uint32_t _disklog_clock(void);
+
+/*
+ * disklog_drop_snapshot - Copy the drop counters of producers
+ * 
+ * @buf: counter buffer
+ * @n: the number of counters that can be stored in buffer
+ * return the number of counters
+ */
+size_t disklog_drop_snapshot(struct disklog_drop *buf, size_t n);
+
+/*
+ * disklog_dropped - Get the total number of dropped inputs
+ * (Including the producers that have no counter)
+ */
+uint32_t disklog_dropped(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Lock-free multi-producer single-consumer ring of variable-size records
+ *
+ * The producers reserve space with CAS on head and commit the record by
+ * setting the first word of slot. The consumer stops at the first record
+ * that has not been committed, So the records are consumed in the order
+ * of reservation. A record is never split at the end of ring (The rest
+ * space is filled with a padding slot).
+ *
+ * The free space of ring is always zero (The consumer clears the records),
+ * So the commit word of a new slot can never be stale.
+ */
+#ifndef BASEWORK_LIB_MPSC_RING_H_
+#define BASEWORK_LIB_MPSC_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "basework/generic.h"
+#include "basework/arch/generic/rte_stdatomic.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+struct mpsc_ring {
+    uint32_t head;    /* Reserved by producers */
+    uint32_t tail;    /* Consumed by the only consumer */
+    uint32_t size;    /* Must be power of 2 */
+    uint8_t *buf;     /* 8 bytes aligned and zeroed */
+};
+
+struct mpsc_slot {
+    uint32_t commit;  /* Non-zero if the record is committed */
+    uint16_t len;     /* Data size */
+    uint16_t pad;     /* Padding slot at the end of ring */
+};
+
+#define MPSC_SLOT_SIZE(_len) \
+    RTE_ALIGN(sizeof(struct mpsc_slot) + (_len), 8)
+
+#define MPSC_RING_INITIALIZER(_buf, _size) \
+    { 0, 0, (_size), (uint8_t *)(_buf) }
+
+static inline void mpsc_ring_init(struct mpsc_ring *ring, void *buf,
+    size_t size) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->size = (uint32_t)size;
+    ring->buf = (uint8_t *)buf;
+    memset(buf, 0, size);
+}
+
+/*
+ * mpsc_ring_reserve - Reserve space for a record (Multi-producer safe)
+ *
+ * @ring: ring object
+ * @len: data size (The slot must be less than half of ring)
+ * return the data pointer of record or NULL if the ring is full
+ */
+static inline void *mpsc_ring_reserve(struct mpsc_ring *ring, size_t len) {
+    uint32_t need = MPSC_SLOT_SIZE(len);
+    uint32_t mask = ring->size - 1;
+    uint32_t head, tail, pad;
+    struct mpsc_slot *slot;
+
+    head = rte_atomic_load_explicit(&ring->head, rte_memory_order_relaxed);
+    do {
+        uint32_t ofs = head & mask;
+
+        pad = (ring->size - ofs < need)? ring->size - ofs: 0;
+        tail = rte_atomic_load_explicit(&ring->tail, rte_memory_order_acquire);
+        if (head + pad + need - tail > ring->size)
+            return NULL;
+    } while (!rte_atomic_compare_exchange_weak_explicit(&ring->head, &head,
+        head + pad + need, rte_memory_order_acq_rel, rte_memory_order_relaxed));
+
+    if (pad > 0) {
+        slot = (struct mpsc_slot *)&ring->buf[head & mask];
+        slot->len = (uint16_t)(pad - sizeof(struct mpsc_slot));
+        slot->pad = 1;
+        rte_atomic_store_explicit(&slot->commit, 1, rte_memory_order_release);
+        head += pad;
+    }
+
+    slot = (struct mpsc_slot *)&ring->buf[head & mask];
+    slot->len = (uint16_t)len;
+    slot->pad = 0;
+    return slot + 1;
+}
+
+/*
+ * mpsc_ring_commit - Publish the record that has been reserved
+ *
+ * @ring: ring object
+ * @data: the pointer that returned by mpsc_ring_reserve()
+ */
+static inline void mpsc_ring_commit(struct mpsc_ring *ring, void *data) {
+    struct mpsc_slot *slot = (struct mpsc_slot *)data - 1;
+    (void) ring;
+    rte_atomic_store_explicit(&slot->commit, 1, rte_memory_order_release);
+}
+
+/*
+ * mpsc_ring_cancel - Discard the record that has been reserved
+ * (The consumer skips it as a padding slot)
+ *
+ * @ring: ring object
+ * @data: the pointer that returned by mpsc_ring_reserve()
+ */
+static inline void mpsc_ring_cancel(struct mpsc_ring *ring, void *data) {
+    struct mpsc_slot *slot = (struct mpsc_slot *)data - 1;
+    (void) ring;
+    slot->pad = 1;
+    rte_atomic_store_explicit(&slot->commit, 1, rte_memory_order_release);
+}
+
+/*
+ * mpsc_ring_peek - Get the oldest record that has been committed
+ * (Consumer only)
+ *
+ * @ring: ring object
+ * @len: data size of record
+ * return the data pointer of record or NULL if there is nothing to consume
+ */
+static inline void *mpsc_ring_peek(struct mpsc_ring *ring, size_t *len) {
+    uint32_t tail = rte_atomic_load_explicit(&ring->tail, rte_memory_order_relaxed);
+
+    for ( ; ; ) {
+        struct mpsc_slot *slot;
+        uint32_t n;
+
+        if (tail == rte_atomic_load_explicit(&ring->head, rte_memory_order_acquire))
+            return NULL;
+
+        slot = (struct mpsc_slot *)&ring->buf[tail & (ring->size - 1)];
+        if (!rte_atomic_load_explicit(&slot->commit, rte_memory_order_acquire))
+            return NULL;
+        if (!slot->pad) {
+            *len = slot->len;
+            return slot + 1;
+        }
+
+        n = MPSC_SLOT_SIZE(slot->len);
+        memset(slot, 0, n);
+        tail += n;
+        rte_atomic_store_explicit(&ring->tail, tail, rte_memory_order_release);
+    }
+}
+
+/*
+ * mpsc_ring_consume - Release the record that returned by mpsc_ring_peek()
+ * (Consumer only)
+ *
+ * @ring: ring object
+ */
+static inline void mpsc_ring_consume(struct mpsc_ring *ring) {
+    uint32_t tail = rte_atomic_load_explicit(&ring->tail, rte_memory_order_relaxed);
+    struct mpsc_slot *slot =
+        (struct mpsc_slot *)&ring->buf[tail & (ring->size - 1)];
+    uint32_t n = MPSC_SLOT_SIZE(slot->len);
+
+    memset(slot, 0, n);
+    tail += n;
+    rte_atomic_store_explicit(&ring->tail, tail, rte_memory_order_release);
+}
+
+/*
+ * mpsc_ring_used - Get the bytes that have been reserved (including slot header)
+ */
+static inline uint32_t mpsc_ring_used(struct mpsc_ring *ring) {
+    return rte_atomic_load_explicit(&ring->head, rte_memory_order_relaxed) -
+        rte_atomic_load_explicit(&ring->tail, rte_memory_order_relaxed);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASEWORK_LIB_MPSC_RING_H_ */
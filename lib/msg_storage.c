@@ -1,5 +1,21 @@
 /*
  * Copyright 2023 wtcat
+ *
+ * Message storage
+ *
+ * | checkpoint 0 | checkpoint 1 | journal (circular) ... |
+ *
+ * The message and every change of state are appended to the journal as a
+ * small record (A message record only holds the text that has been used).
+ * The database and state are written to one of the checkpoint slots in turn
+ * when the journal grows MESSAGE_JOURNAL_LIMIT bytes since last checkpoint,
+ * So the records that should be replayed at mount time are bounded.
+ *
+ * A message record is kept in the journal until it is removed, If the
+ * space of oldest message is needed then it is moved to the journal head.
+ *
+ * The messages are indexed by time and by type in RAM (Rebuilt at mount
+ * time), So they can be counted and paged without walking the list.
  */
 
 #ifdef CONFIG_HEADER_FILE
@@ -17,6 +33,7 @@
 #include "basework/os/osapi.h"
 #include "basework/system.h"
 #include "basework/generic.h"
+#include "basework/minmax.h"
 #include "basework/log.h"
 #include "basework/lib/msg_storage.h"
 #include "basework/lib/crc.h"
@@ -24,24 +41,83 @@
 #include "basework/bitops.h"
 
 #define MESSAGE_CHECK_PERIOD   (60 * 1000)
-#define MESSAGE_STATE_OFFSET   4096
-#define MESSAGE_CONTENT_OFFSET 8192
+#define MESSAGE_STATE_OFFSET   4096 /* The state of old format */
+#define MESSAGE_CHECKPOINT_SIZE RTE_ALIGN(sizeof(struct msg_checkpoint), 4096)
+#define MESSAGE_JOURNAL_OFFSET (2 * MESSAGE_CHECKPOINT_SIZE)
 #define NULL_NODE UINT16_MAX
 #define INVALID_TYPE 0
 #define MESSAGE_BITMAP_SIZE ((MAX_MESSAGES + 31) / 32)
 #define MSG_FILENAME "msgfile.db"
 
+enum msg_record_type {
+    MSG_REC_PAD = 1,  /* The rest space at the end of journal */
+    MSG_REC_ADD,      /* index: slot  data: message */
+    MSG_REC_MOVE,     /* index: slot  data: message (Relocated) */
+    MSG_REC_REMOVE,   /* index: slot */
+    MSG_REC_NOTIF,    /* index: message type  arg: notification state */
+    MSG_REC_SWITCH,   /* arg: notification switch */
+    MSG_REC_BITVEC    /* data: bit-vector */
+};
+
+struct msg_record {
+#define MESSAGE_RECORD_MAGIC 0x4a4d
+    uint16_t magic;
+    uint8_t  type;
+    uint8_t  arg;
+    uint16_t index;
+    uint16_t len;      /* Data size */
+    uint32_t pos;      /* Journal position of the record */
+    uint16_t crc;      /* CRC16 of the record (crc = 0) and data */
+    uint16_t reserved;
+};
+
+/* The message in journal (Followed by contact and text) */
+struct msg_packed {
+    uint32_t timestamp;
+    uint16_t id;
+    uint16_t type;
+    uint16_t c_len;
+    uint16_t m_len;
+    uint16_t c_size;   /* Stored bytes of contact */
+    uint16_t m_size;   /* Stored bytes of text */
+};
+
+#define MESSAGE_RECORD_MAX \
+    (sizeof(struct msg_record) + sizeof(struct msg_packed) + \
+    MAX_CONTACT_SIZE + MAX_MESSAGE_SIZE)
+
+/*
+ * The journal must hold all messages and the records since last checkpoint
+ */
+#if defined(CONFIG_MSG_STORAGE_JOURNAL_SIZE) && CONFIG_MSG_STORAGE_JOURNAL_SIZE > 0
+#define MESSAGE_JOURNAL_SIZE CONFIG_MSG_STORAGE_JOURNAL_SIZE
+#else
+#define MESSAGE_JOURNAL_SIZE \
+    RTE_ALIGN((MAX_MESSAGES + 4) * MESSAGE_RECORD_MAX * 4 / 3, 4096)
+#endif
+#define MESSAGE_JOURNAL_LIMIT   (MESSAGE_JOURNAL_SIZE / 4)
+#define MESSAGE_JOURNAL_RESERVE (2 * MESSAGE_RECORD_MAX)
+
+#ifdef CONFIG_MSG_STORAGE_BATCH_SIZE
+#define MESSAGE_BATCH_SIZE CONFIG_MSG_STORAGE_BATCH_SIZE
+#else
+#define MESSAGE_BATCH_SIZE 2048
+#endif
+
+struct msg_link {
+    uint16_t next;
+    uint16_t prev;
+};
+
 struct msg_database {
-#define MESSAGE_MAGIC 0x1eebcaa1
-	uint32_t m_magic;
 	uint32_t m_bitmap[MESSAGE_BITMAP_SIZE];
 	struct msg_node m_node[MAX_MESSAGES];
-    uint16_t m_first;  /* First message node index */ 
-    uint16_t m_last;   /* Last message node index */ 
-	uint32_t m_offset; /* The offset of content */
-#ifdef CONFIG_MSG_STORAGE_CHECKSUM
-    uint16_t m_crc;
-#endif
+    uint32_t m_pos[MAX_MESSAGES]; /* Journal position of message */
+    struct msg_link m_age[MAX_MESSAGES]; /* Messages by journal position */
+    uint16_t m_first;  /* First message node index */
+    uint16_t m_last;   /* Last message node index */
+    uint16_t m_oldest; /* The message that is the oldest in journal */
+    uint16_t m_newest;
 };
 
 struct msg_notifstate {
@@ -55,9 +131,28 @@ struct msg_notifstate {
 #endif
 };
 
-struct msg_context {
-    struct msg_database db; /* message database */
+struct msg_checkpoint {
+#define MESSAGE_MAGIC 0x1eebcaa2
+    uint32_t magic;
+    uint32_t gen;      /* Generation (The newer checkpoint is larger) */
+    uint32_t head;     /* Journal position that replay starts from */
+    struct msg_database db;
     struct msg_notifstate state;
+    uint16_t crc;
+};
+
+/* The index of messages (RAM only) */
+struct msg_index {
+    uint32_t seq;                       /* Sequence of the next message */
+    uint32_t m_seq[MAX_MESSAGES];       /* Sequence of message */
+    uint16_t order[MAX_MESSAGES];       /* Messages by time */
+    uint16_t t_order[MAX_MESSAGES];     /* Messages by type and time */
+    uint16_t t_start[MAX_MESSAGE_TYPES + 1]; /* Start of type in t_order */
+};
+
+struct msg_context {
+    struct msg_checkpoint cp; /* message database and state */
+    struct msg_index index;
     const struct msg_fops *f_ops;
     struct observer_base obs;
     os_mutex_t lock;
@@ -66,15 +161,32 @@ struct msg_context {
     DECLARE_KFIFO(fifo, uint16_t, 32);
     message_notif_cb notify;
     void *user_data;
-    bool dirty; /* mean to the message database has been modified */
-    bool state_dirty;
+    uint32_t head; /* Journal position to append */
+    bool dirty; /* mean to the journal has not been flushed */
     uint16_t new_idx;
+    union {
+        struct msg_record hdr;
+        uint8_t buf[MESSAGE_RECORD_MAX];
+    } rec;
+
+    /* The journal that has been read (Reset by write) */
+    uint32_t win_pos;
+    uint32_t win_len;
+    uint8_t window[MESSAGE_BATCH_SIZE];
 };
 
+_Static_assert(MAX_MESSAGES < NULL_NODE, "Too many messages");
+_Static_assert(MESSAGE_BATCH_SIZE >= MESSAGE_RECORD_MAX,
+    "The message batch size is too small");
+_Static_assert(MESSAGE_JOURNAL_SIZE % 4 == 0 && MESSAGE_JOURNAL_SIZE >=
+    (MAX_MESSAGES + 4) * MESSAGE_RECORD_MAX * 4 / 3,
+    "The message journal is too small");
+
 #define MTX_LOCK()   (void)os_mtx_lock(&msg_context.lock)
 #define MTX_UNLOCK() (void)os_mtx_unlock(&msg_context.lock)
 #define MTX_INIT()   (void)os_mtx_init(&msg_context.lock, 0)
 
+#define MSG_RECORD_DATA(ctx) ((ctx)->rec.buf + sizeof(struct msg_record))
 
 static struct msg_context msg_context;
 
@@ -95,14 +207,14 @@ static inline int fmsg_close(struct msg_context *ctx) {
     return 0;
 }
 
-static inline ssize_t fmsg_write(struct msg_context *ctx, 
+static inline ssize_t fmsg_write(struct msg_context *ctx,
     const void *buf, size_t size, uint32_t offset) {
     assert(ctx != NULL);
     assert(ctx->f_ops->write != NULL);
     return ctx->f_ops->write(ctx->fd, buf, size, offset);
 }
 
-static inline ssize_t fmsg_read(struct msg_context *ctx, 
+static inline ssize_t fmsg_read(struct msg_context *ctx,
     void *buf, size_t size, uint32_t offset) {
     assert(ctx != NULL);
     assert(ctx->f_ops->read != NULL);
@@ -123,8 +235,8 @@ static inline int fmsg_remove(struct msg_context *ctx, const char *name) {
     return -ENOSYS;
 }
 
-static inline uint32_t fmsg_offset(struct msg_database *mdb, int index) {
-    return mdb->m_offset + index * sizeof(struct msg_payload);
+static inline uint32_t fmsg_offset(uint32_t pos) {
+    return MESSAGE_JOURNAL_OFFSET + pos % MESSAGE_JOURNAL_SIZE;
 }
 
 static inline void msg_node_init(struct msg_node *node) {
@@ -134,7 +246,7 @@ static inline void msg_node_init(struct msg_node *node) {
     node->type = INVALID_TYPE;
 }
 
-static inline void msg_notify(struct msg_context *ctx, int idx, 
+static inline void msg_notify(struct msg_context *ctx, int idx,
     enum notification_state state) {
     if (state == MSG_NOTIF_NORMAL) {
         pr_dbg("%s: message notification is normal state\n", __func__);
@@ -143,11 +255,11 @@ static inline void msg_notify(struct msg_context *ctx, int idx,
     }
 }
 
-#ifdef CONFIG_MSG_STORAGE_CHECKSUM
-static inline uint16_t msg_calculate_crc(const struct msg_database *db) {
-    return lib_crc16((uint8_t *)db, offsetof(struct msg_database, m_crc));
+static inline uint16_t msg_checkpoint_crc(const struct msg_checkpoint *cp) {
+    return lib_crc16((uint8_t *)cp, offsetof(struct msg_checkpoint, crc));
 }
 
+#ifdef CONFIG_MSG_STORAGE_CHECKSUM
 static inline uint16_t msg_state_calculate_crc(const struct msg_notifstate *sta) {
     return lib_crc16((uint8_t *)sta, offsetof(struct msg_notifstate, crc));
 }
@@ -158,77 +270,14 @@ static void msg_mark_dirty(struct msg_context *ctx) {
     ctx->dirty = true;
 }
 
-static int msg_header_write(struct msg_context *ctx) {
-#ifdef CONFIG_MSG_STORAGE_CHECKSUM
-    ctx->db.m_crc = msg_calculate_crc(&ctx->db);
-#endif 
-    int ret = fmsg_write(ctx, &ctx->db, sizeof(ctx->db), 0);
-    if (ret < 0) {
-        pr_err("write message header failed(%d)\n", ret);
-        return ret;
-    }
-    return 0;
-}
-
-static int msg_state_write(struct msg_context *ctx) {
-#ifdef CONFIG_MSG_STORAGE_CHECKSUM
-    ctx->state.crc = msg_state_calculate_crc(&ctx->state);
-#endif
-    int ret = fmsg_write(ctx, &ctx->state, sizeof(ctx->state), 
-        MESSAGE_STATE_OFFSET);
-    if (ret < 0) {
-        pr_err("write message state failed(%d)\n", ret);
-        return ret;
-    }
-    return 0;
-}
-
-static inline int msg_flush_header_locked(struct msg_context *ctx) {
-    int err = 0;
-    if (ctx->dirty) {
-        int err;
-        ctx->dirty = false;
-        err = msg_header_write(ctx);
-        if (err) {
-            pr_err("flush message cache failed\n");
-            goto _out;
-        }
-    }
-    if (ctx->state_dirty) {
-        err |= msg_state_write(ctx);
-        ctx->state_dirty = false;
-    }
-_out:
-    return err;
-}
-
 static void msg_reinit_database(struct msg_database *mdb) {
     memset(mdb->m_bitmap, 0, sizeof(mdb->m_bitmap));
-    for (int i = 0; i < MAX_MESSAGES; i++) 
+    for (int i = 0; i < MAX_MESSAGES; i++)
         msg_node_init(&mdb->m_node[i]);
-    mdb->m_magic = MESSAGE_MAGIC;
     mdb->m_first = NULL_NODE;
     mdb->m_last = NULL_NODE;
-    mdb->m_offset = MESSAGE_CONTENT_OFFSET;
-}
-
-static void msg_reset_locked(struct msg_database *mdb, bool force) {
-    if (!force && mdb->m_magic == MESSAGE_MAGIC) {
-#ifdef CONFIG_MSG_STORAGE_CHECKSUM
-        if (mdb->m_crc != msg_calculate_crc(mdb))
-            msg_reinit_database(mdb);
-#else /* !CONFIG_MSG_STORAGE_CHECKSUM */
-        int nr = 0;
-        MSG_STORAGE_FOREACH(idx) {
-            if (++nr > MAX_MESSAGES) {
-                msg_reinit_database(mdb);
-                break;
-            }
-        }
-#endif /* CONFIG_MSG_STORAGE_CHECKSUM */
-    } else {
-        msg_reinit_database(mdb);
-    }
+    mdb->m_oldest = NULL_NODE;
+    mdb->m_newest = NULL_NODE;
 }
 
 static void msg_state_reinit(struct msg_notifstate *state) {
@@ -248,24 +297,175 @@ static void msg_state_reset_locked(struct msg_notifstate *state, bool force) {
     }
 }
 
-static void msg_remove_node(struct msg_database *mdb, int idx) {
+static int msg_index_search(const struct msg_index *mi, const uint16_t *ids,
+    int lo, int hi, uint32_t seq) {
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (mi->m_seq[ids[mid]] < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void msg_index_add(struct msg_index *mi, int idx, uint16_t type) {
+    uint16_t count = mi->t_start[MAX_MESSAGE_TYPES];
+    uint16_t ofs = mi->t_start[type + 1];
+
+    mi->m_seq[idx] = mi->seq++;
+    mi->order[count] = (uint16_t)idx;
+
+    /* Insert at the end of type */
+    memmove(&mi->t_order[ofs + 1], &mi->t_order[ofs],
+        (count - ofs) * sizeof(uint16_t));
+    mi->t_order[ofs] = (uint16_t)idx;
+    for (int t = type + 1; t <= MAX_MESSAGE_TYPES; t++)
+        mi->t_start[t]++;
+}
+
+static void msg_index_del(struct msg_index *mi, int idx, uint16_t type) {
+    uint16_t count = mi->t_start[MAX_MESSAGE_TYPES];
+    int ofs;
+
+    ofs = msg_index_search(mi, mi->order, 0, count, mi->m_seq[idx]);
+    assert(ofs < count && mi->order[ofs] == idx);
+    memmove(&mi->order[ofs], &mi->order[ofs + 1],
+        (count - ofs - 1) * sizeof(uint16_t));
+
+    ofs = msg_index_search(mi, mi->t_order, mi->t_start[type],
+        mi->t_start[type + 1], mi->m_seq[idx]);
+    assert(ofs < mi->t_start[type + 1] && mi->t_order[ofs] == idx);
+    memmove(&mi->t_order[ofs], &mi->t_order[ofs + 1],
+        (count - ofs - 1) * sizeof(uint16_t));
+    for (int t = type + 1; t <= MAX_MESSAGE_TYPES; t++)
+        mi->t_start[t]--;
+}
+
+static void msg_index_rebuild(struct msg_context *ctx) {
+    struct msg_database *mdb = &ctx->cp.db;
+    struct msg_index *mi = &ctx->index;
+    uint16_t count = 0;
+
+    memset(mi->t_start, 0, sizeof(mi->t_start));
+    mi->seq = 0;
+    for (uint16_t idx = mdb->m_first; idx != NULL_NODE && count < MAX_MESSAGES;
+        idx = mdb->m_node[idx].n_index) {
+        mi->m_seq[idx] = mi->seq++;
+        mi->order[count++] = idx;
+        mi->t_start[mdb->m_node[idx].type + 1]++;
+    }
+
+    /* Counting sort by type (t_start is the cursor of type when filling) */
+    for (int t = 0; t < MAX_MESSAGE_TYPES; t++)
+        mi->t_start[t + 1] += mi->t_start[t];
+    for (uint16_t i = 0; i < count; i++) {
+        uint16_t idx = mi->order[i];
+        mi->t_order[mi->t_start[mdb->m_node[idx].type]++] = idx;
+    }
+    memmove(&mi->t_start[1], &mi->t_start[0],
+        MAX_MESSAGE_TYPES * sizeof(uint16_t));
+    mi->t_start[0] = 0;
+}
+
+static void msg_age_append(struct msg_database *mdb, int idx) {
+    struct msg_link *link = &mdb->m_age[idx];
+
+    link->next = NULL_NODE;
+    link->prev = mdb->m_newest;
+    if (mdb->m_newest != NULL_NODE)
+        mdb->m_age[mdb->m_newest].next = (uint16_t)idx;
+    else
+        mdb->m_oldest = (uint16_t)idx;
+    mdb->m_newest = (uint16_t)idx;
+}
+
+static void msg_age_remove(struct msg_database *mdb, int idx) {
+    struct msg_link *link = &mdb->m_age[idx];
+
+    if (link->next != NULL_NODE)
+        mdb->m_age[link->next].prev = link->prev;
+    else
+        mdb->m_newest = link->prev;
+    if (link->prev != NULL_NODE)
+        mdb->m_age[link->prev].next = link->next;
+    else
+        mdb->m_oldest = link->next;
+}
+
+static void msg_unlink_node(struct msg_context *ctx, int idx) {
+    struct msg_database *mdb = &ctx->cp.db;
     struct msg_node *node = &mdb->m_node[idx];
 
+    /* The slot has not been linked */
+    if (node->index == NULL_NODE)
+        return;
+
+    msg_index_del(&ctx->index, idx, node->type);
+    msg_age_remove(mdb, idx);
+
     /* Remove from message list */
-    if (node->n_index != NULL_NODE) 
+    if (node->n_index != NULL_NODE)
         mdb->m_node[node->n_index].p_index = node->p_index;
-    if (node->p_index != NULL_NODE) 
+    if (node->p_index != NULL_NODE)
         mdb->m_node[node->p_index].n_index = node->n_index;
     if (mdb->m_first == idx)
         mdb->m_first = mdb->m_node[idx].n_index;
     if (mdb->m_last == idx)
         mdb->m_last = mdb->m_node[idx].p_index;
-    
+
     /* Make node invalid */
     msg_node_init(&mdb->m_node[idx]);
 }
 
-static int msg_slot_allocate(struct msg_database *mdb) {
+static void msg_link_node(struct msg_context *ctx, int index,
+    uint16_t type, uint32_t pos) {
+    struct msg_database *mdb = &ctx->cp.db;
+    struct msg_node *node = &mdb->m_node[index];
+
+    node->type = type;
+    node->index = (uint16_t)index;
+
+    /* Append message list */
+    if (mdb->m_last != NULL_NODE) {
+        struct msg_node *pnode = &mdb->m_node[mdb->m_last];
+        pnode->n_index = node->index;
+        node->p_index = pnode->index;
+    } else {
+        mdb->m_first = node->index;
+        node->p_index = NULL_NODE;
+    }
+    mdb->m_last = node->index;
+    node->n_index = NULL_NODE;
+
+    mdb->m_pos[index] = pos;
+    msg_age_append(mdb, index);
+    msg_index_add(&ctx->index, index, type);
+}
+
+static void msg_move_node(struct msg_context *ctx, int index, uint32_t pos) {
+    struct msg_database *mdb = &ctx->cp.db;
+
+    mdb->m_pos[index] = pos;
+    msg_age_remove(mdb, index);
+    msg_age_append(mdb, index);
+}
+
+static inline bool msg_slot_used(struct msg_database *mdb, int index) {
+    return (mdb->m_bitmap[index >> 5] & BIT(index & 31)) != 0;
+}
+
+static void msg_slot_release(struct msg_context *ctx, int index) {
+    struct msg_database *mdb = &ctx->cp.db;
+
+    /* Remove from bitmap */
+    mdb->m_bitmap[index >> 5] &= ~BIT((index & 31));
+    msg_unlink_node(ctx, index);
+}
+
+static int msg_slot_allocate(struct msg_context *ctx) {
+    struct msg_database *mdb = &ctx->cp.db;
     int index = 0;
     for (int i = 0; i < (int)rte_array_size(mdb->m_bitmap); i++) {
         uint32_t mask = mdb->m_bitmap[i];
@@ -283,77 +483,499 @@ static int msg_slot_allocate(struct msg_database *mdb) {
 
     /* If the message slot is full then remove the first one */
 	index = mdb->m_first;
-    msg_remove_node(mdb, mdb->m_first);
+    msg_unlink_node(ctx, mdb->m_first);
     pr_dbg("replace idx %d\n", index);
     return index;
 }
 
+static size_t msg_text_size(const char *text, uint16_t len, size_t max) {
+    return rte_max(strnlen(text, max), rte_min((size_t)len, max));
+}
+
+static size_t msg_payload_size(const struct msg_payload *content) {
+    return sizeof(struct msg_packed) +
+        msg_text_size(content->contact, content->c_len, MAX_CONTACT_SIZE) +
+        msg_text_size(content->buffer, content->m_len, MAX_MESSAGE_SIZE);
+}
+
+static size_t msg_payload_pack(const struct msg_payload *content, void *buf) {
+    struct msg_packed *pk = buf;
+    char *p = (char *)(pk + 1);
+
+    pk->timestamp = content->timestamp;
+    pk->id = content->id;
+    pk->type = content->type;
+    pk->c_len = content->c_len;
+    pk->m_len = content->m_len;
+    pk->c_size = (uint16_t)msg_text_size(content->contact, content->c_len,
+        MAX_CONTACT_SIZE);
+    pk->m_size = (uint16_t)msg_text_size(content->buffer, content->m_len,
+        MAX_MESSAGE_SIZE);
+    memcpy(p, content->contact, pk->c_size);
+    memcpy(p + pk->c_size, content->buffer, pk->m_size);
+    return sizeof(*pk) + pk->c_size + pk->m_size;
+}
+
+static int msg_payload_unpack(const void *buf, size_t len,
+    struct msg_payload *content) {
+    const struct msg_packed *pk = buf;
+    const char *p = (const char *)(pk + 1);
+
+    if (len < sizeof(*pk) || pk->c_size > MAX_CONTACT_SIZE ||
+        pk->m_size > MAX_MESSAGE_SIZE ||
+        sizeof(*pk) + pk->c_size + pk->m_size != len)
+        return -EIO;
+
+    /* The unused text is zero */
+    memset(content, 0, sizeof(*content));
+    content->timestamp = pk->timestamp;
+    content->id = pk->id;
+    content->type = pk->type;
+    content->c_len = pk->c_len;
+    content->m_len = pk->m_len;
+    memcpy(content->contact, p, pk->c_size);
+    memcpy(content->buffer, p + pk->c_size, pk->m_size);
+    return 0;
+}
+
+/*
+ * Check the record header (return the data size)
+ */
+static int msg_record_header(const struct msg_record *rec, uint32_t pos) {
+    if (rec->magic != MESSAGE_RECORD_MAGIC || rec->pos != pos)
+        return -ENODATA;
+
+    /* The padding record has no data */
+    if (rec->type == MSG_REC_PAD)
+        return 0;
+    if (rec->len > MESSAGE_RECORD_MAX - sizeof(*rec))
+        return -ENODATA;
+    return rec->len;
+}
+
+/*
+ * Check the record in ctx->rec (return rec->len)
+ */
+static int msg_record_check(struct msg_context *ctx) {
+    struct msg_record *rec = &ctx->rec.hdr;
+    size_t size = sizeof(*rec);
+    uint16_t crc = rec->crc;
+
+    if (rec->type != MSG_REC_PAD)
+        size += rec->len;
+    rec->crc = 0;
+    if (lib_crc16(ctx->rec.buf, size) != crc)
+        return -ENODATA;
+    return rec->len;
+}
+
+static inline bool msg_record_of(const struct msg_record *rec, int idx) {
+    return rec->index == idx &&
+        (rec->type == MSG_REC_ADD || rec->type == MSG_REC_MOVE);
+}
+
+/*
+ * Read the record at journal position to ctx->rec (return data size)
+ */
+static int msg_record_load(struct msg_context *ctx, uint32_t pos) {
+    struct msg_record *rec = &ctx->rec.hdr;
+    int ret, len;
+
+    memset(rec, 0, sizeof(*rec));
+    ret = fmsg_read(ctx, rec, sizeof(*rec), fmsg_offset(pos));
+    if (ret < 0)
+        return ret;
+    len = msg_record_header(rec, pos);
+    if (len <= 0)
+        return len < 0? len: msg_record_check(ctx);
+
+    ret = fmsg_read(ctx, MSG_RECORD_DATA(ctx), len,
+        fmsg_offset(pos + sizeof(*rec)));
+    if (ret < 0)
+        return ret;
+    return msg_record_check(ctx);
+}
+
+static int msg_window_fill(struct msg_context *ctx, uint32_t pos) {
+    uint32_t len = MESSAGE_JOURNAL_SIZE - pos % MESSAGE_JOURNAL_SIZE;
+    int ret;
+
+    len = rte_min(len, (uint32_t)MESSAGE_BATCH_SIZE);
+    ctx->win_len = 0;
+    memset(ctx->window, 0, len);
+    ret = fmsg_read(ctx, ctx->window, len, fmsg_offset(pos));
+    if (ret < 0)
+        return ret;
+    ctx->win_pos = pos;
+    ctx->win_len = len;
+    return 0;
+}
+
+/*
+ * Read the record to ctx->rec through the journal window, So the records
+ * that are close to each other are read by one disk access
+ */
+static int msg_record_fetch(struct msg_context *ctx, uint32_t pos) {
+    struct msg_record *rec = &ctx->rec.hdr;
+    uint32_t ofs = pos - ctx->win_pos;
+    int len;
+
+    for (int filled = 0; ; filled++) {
+        if (ofs < ctx->win_len && ctx->win_len - ofs >= sizeof(*rec)) {
+            memcpy(rec, &ctx->window[ofs], sizeof(*rec));
+            len = msg_record_header(rec, pos);
+            if (len < 0)
+                return len;
+            if (ctx->win_len - ofs - sizeof(*rec) >= (uint32_t)len) {
+                memcpy(MSG_RECORD_DATA(ctx), &ctx->window[ofs + sizeof(*rec)],
+                    len);
+                return msg_record_check(ctx);
+            }
+        }
+        if (filled)
+            return -ENODATA;
+
+        len = msg_window_fill(ctx, pos);
+        if (len < 0)
+            return len;
+        ofs = 0;
+    }
+}
+
+static inline void msg_record_fill(struct msg_context *ctx, int type,
+    int arg, int index) {
+    struct msg_record *rec = &ctx->rec.hdr;
+
+    rec->magic = MESSAGE_RECORD_MAGIC;
+    rec->type = (uint8_t)type;
+    rec->arg = (uint8_t)arg;
+    rec->index = (uint16_t)index;
+}
+
+static inline uint32_t msg_journal_need(struct msg_context *ctx,
+    uint32_t size) {
+    uint32_t rest = MESSAGE_JOURNAL_SIZE - ctx->head % MESSAGE_JOURNAL_SIZE;
+
+    /* The record is never split at the end of journal */
+    return rest < size? rest + size: size;
+}
+
+/*
+ * Get the bytes of journal that are still in use
+ *
+ * @oldest: the message that is older than the last checkpoint
+ */
+static uint32_t msg_journal_used(struct msg_context *ctx, uint16_t *oldest) {
+    struct msg_database *mdb = &ctx->cp.db;
+    uint32_t used = ctx->head - ctx->cp.head;
+    uint16_t idx = mdb->m_oldest;
+
+    *oldest = NULL_NODE;
+    if (idx != NULL_NODE && ctx->head - mdb->m_pos[idx] > used) {
+        used = ctx->head - mdb->m_pos[idx];
+        *oldest = idx;
+    }
+    return used;
+}
+
+/*
+ * Append the record in ctx->rec to journal
+ */
+static int msg_journal_append(struct msg_context *ctx, size_t len,
+    uint32_t *ppos) {
+    struct msg_record *rec = &ctx->rec.hdr;
+    uint32_t size = RTE_ALIGN(sizeof(*rec) + len, 4);
+    uint32_t rest = MESSAGE_JOURNAL_SIZE - ctx->head % MESSAGE_JOURNAL_SIZE;
+    uint16_t oldest;
+    int ret;
+
+    ctx->win_len = 0;
+    if (msg_journal_used(ctx, &oldest) + msg_journal_need(ctx, size) >
+        MESSAGE_JOURNAL_SIZE) {
+        pr_err("message journal is full\n");
+        return -ENOSPC;
+    }
+
+    if (rest < size) {
+        if (rest >= sizeof(*rec)) {
+            struct msg_record pad = {0};
+
+            pad.magic = MESSAGE_RECORD_MAGIC;
+            pad.type = MSG_REC_PAD;
+            pad.len = (uint16_t)(rest - sizeof(pad));
+            pad.pos = ctx->head;
+            pad.crc = lib_crc16((uint8_t *)&pad, sizeof(pad));
+            ret = fmsg_write(ctx, &pad, sizeof(pad), fmsg_offset(ctx->head));
+            if (ret < 0)
+                goto _failed;
+        }
+        ctx->head += rest;
+    }
+
+    rec->len = (uint16_t)len;
+    rec->pos = ctx->head;
+    rec->crc = 0;
+    rec->reserved = 0;
+    rec->crc = lib_crc16(ctx->rec.buf, sizeof(*rec) + len);
+    ret = fmsg_write(ctx, ctx->rec.buf, sizeof(*rec) + len,
+        fmsg_offset(ctx->head));
+    if (ret < 0)
+        goto _failed;
+
+    *ppos = ctx->head;
+    ctx->head += size;
+    msg_mark_dirty(ctx);
+    return 0;
+
+_failed:
+    pr_err("write message journal failed(%d)\n", ret);
+    return ret;
+}
+
+static int msg_checkpoint_locked(struct msg_context *ctx) {
+    struct msg_checkpoint *cp = &ctx->cp;
+    uint32_t head = cp->head;
+    int ret;
+
+    /* The messages that referenced by checkpoint must be in disk */
+    ret = fmsg_flush(ctx);
+    if (ret)
+        goto _failed;
+
+    cp->magic = MESSAGE_MAGIC;
+    cp->gen++;
+    cp->head = ctx->head;
+    cp->crc = msg_checkpoint_crc(cp);
+    ret = fmsg_write(ctx, cp, sizeof(*cp),
+        (cp->gen & 1) * MESSAGE_CHECKPOINT_SIZE);
+
+    /* The journal before new head is reused only after checkpoint is in disk */
+    if (ret >= 0)
+        ret = fmsg_flush(ctx);
+    if (ret < 0) {
+        cp->gen--;
+        cp->head = head;
+        goto _failed;
+    }
+    ctx->dirty = false;
+    return 0;
+
+_failed:
+    pr_err("write message checkpoint failed(%d)\n", ret);
+    return ret;
+}
+
+static int msg_checkpoint_load(struct msg_context *ctx, int slot) {
+    struct msg_checkpoint *cp = &ctx->cp;
+    int ret;
+
+    memset(cp, 0, sizeof(*cp));
+    ret = fmsg_read(ctx, cp, sizeof(*cp), slot * MESSAGE_CHECKPOINT_SIZE);
+    if (ret < 0)
+        return ret;
+    if (cp->magic != MESSAGE_MAGIC || cp->crc != msg_checkpoint_crc(cp))
+        return 0;
+    return 1;
+}
+
+/*
+ * Move the message to the head of journal
+ */
+static int msg_record_move(struct msg_context *ctx, uint16_t idx) {
+    struct msg_database *mdb = &ctx->cp.db;
+    uint32_t pos;
+    int len, err;
+
+    len = msg_record_load(ctx, mdb->m_pos[idx]);
+    if (len < 0 || !msg_record_of(&ctx->rec.hdr, idx)) {
+        pr_err("message(%d) is broken\n", idx);
+        msg_slot_release(ctx, idx);
+        msg_record_fill(ctx, MSG_REC_REMOVE, 0, idx);
+        return msg_journal_append(ctx, 0, &pos);
+    }
+
+    ctx->rec.hdr.type = MSG_REC_MOVE;
+    err = msg_journal_append(ctx, len, &pos);
+
+    /* The old record is overwritten only after the moved one is in disk */
+    if (!err)
+        err = fmsg_flush(ctx);
+    if (!err)
+        msg_move_node(ctx, idx, pos);
+    return err;
+}
+
+/*
+ * Make room for a record of @size bytes (It must be called before the
+ * record is filled, Because ctx->rec is used to move messages)
+ */
+static int msg_journal_reserve(struct msg_context *ctx, size_t size) {
+    uint32_t need = RTE_ALIGN(sizeof(struct msg_record) + size, 4);
+    uint16_t oldest;
+    int err;
+
+    while (msg_journal_used(ctx, &oldest) + msg_journal_need(ctx, need) +
+        MESSAGE_JOURNAL_RESERVE > MESSAGE_JOURNAL_SIZE) {
+        if (oldest != NULL_NODE)
+            err = msg_record_move(ctx, oldest);
+        else if (ctx->cp.head != ctx->head)
+            err = msg_checkpoint_locked(ctx);
+        else
+            err = -ENOSPC;
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+static void msg_journal_check(struct msg_context *ctx) {
+    if (ctx->head - ctx->cp.head >= MESSAGE_JOURNAL_LIMIT)
+        msg_checkpoint_locked(ctx);
+}
+
+static int msg_record_write(struct msg_context *ctx, int type, int arg,
+    int index, const void *data, size_t len) {
+    uint32_t pos;
+    int err;
+
+    err = msg_journal_reserve(ctx, len);
+    if (err)
+        return err;
+
+    msg_record_fill(ctx, type, arg, index);
+    if (len > 0)
+        memcpy(MSG_RECORD_DATA(ctx), data, len);
+    err = msg_journal_append(ctx, len, &pos);
+    if (!err)
+        msg_journal_check(ctx);
+    return err;
+}
+
+static void msg_record_apply(struct msg_context *ctx, uint32_t pos,
+    size_t len) {
+    struct msg_database *mdb = &ctx->cp.db;
+    struct msg_notifstate *sta = &ctx->cp.state;
+    struct msg_record *rec = &ctx->rec.hdr;
+    const struct msg_packed *pk = (const struct msg_packed *)MSG_RECORD_DATA(ctx);
+
+    switch (rec->type) {
+    case MSG_REC_ADD:
+        if (rec->index >= MAX_MESSAGES || len < sizeof(*pk) ||
+            pk->type >= MAX_MESSAGE_TYPES)
+            break;
+        /* The oldest message has been replaced */
+        if (msg_slot_used(mdb, rec->index))
+            msg_unlink_node(ctx, rec->index);
+        mdb->m_bitmap[rec->index >> 5] |= BIT(rec->index & 31);
+        msg_link_node(ctx, rec->index, pk->type, pos);
+        break;
+    case MSG_REC_MOVE:
+        if (rec->index < MAX_MESSAGES && msg_slot_used(mdb, rec->index))
+            msg_move_node(ctx, rec->index, pos);
+        break;
+    case MSG_REC_REMOVE:
+        if (rec->index < MAX_MESSAGES)
+            msg_slot_release(ctx, rec->index);
+        break;
+    case MSG_REC_NOTIF:
+        if (rec->index < MAX_MESSAGE_TYPES)
+            sta->state[rec->index] = rec->arg;
+        break;
+    case MSG_REC_SWITCH:
+        sta->notif_enable = rec->arg != 0;
+        break;
+    case MSG_REC_BITVEC:
+        if (len == sizeof(sta->bitvect))
+            memcpy(&sta->bitvect, MSG_RECORD_DATA(ctx), len);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Replay the journal since last checkpoint (Stop at the first broken record)
+ */
+static void msg_journal_replay(struct msg_context *ctx) {
+    uint32_t pos = ctx->cp.head;
+    int len;
+
+    while (pos - ctx->cp.head < MESSAGE_JOURNAL_SIZE) {
+        uint32_t rest = MESSAGE_JOURNAL_SIZE - pos % MESSAGE_JOURNAL_SIZE;
+
+        if (rest < sizeof(struct msg_record)) {
+            pos += rest;
+            continue;
+        }
+        len = msg_record_fetch(ctx, pos);
+        if (len < 0)
+            break;
+        msg_record_apply(ctx, pos, len);
+        pos += RTE_ALIGN(sizeof(struct msg_record) + len, 4);
+    }
+
+    pr_dbg("replay %u bytes of journal\n", pos - ctx->cp.head);
+    ctx->head = pos;
+}
+
 static int msg_slot_free(struct msg_context *ctx, int index) {
     struct msg_database *mdb;
-    uint16_t idx;
 
-    if (index >= MAX_MESSAGES) {
+    if (index < 0 || index >= MAX_MESSAGES) {
         pr_err("Invalid slot index\n");
         return -EINVAL;
     }
-    idx = (uint16_t)index;
-    mdb = &ctx->db;
-
-    /* Remove from bitmap */
-    mdb->m_bitmap[idx >> 5] &= ~BIT((idx & 31));
+    mdb = &ctx->cp.db;
+    if (!msg_slot_used(mdb, index))
+        return 0;
 
-    msg_remove_node(mdb, idx);
-    msg_mark_dirty(ctx);
-    return 0;
+    msg_slot_release(ctx, index);
+    return msg_record_write(ctx, MSG_REC_REMOVE, 0, index, NULL, 0);
 }
 
-static int msg_content_write(struct msg_context *ctx, 
+static int msg_content_write(struct msg_context *ctx,
     const struct msg_payload *content, int *idx) {
-    struct msg_database *mdb = &ctx->db;
-    struct msg_node *node;
+    uint32_t pos;
+    size_t len;
     int index, ret;
 
+    /* Make room before the slot is allocated */
+    ret = msg_journal_reserve(ctx, msg_payload_size(content));
+    if (ret)
+        return ret;
+
     /* Allocate free message slot */
-    index = msg_slot_allocate(mdb);
+    index = msg_slot_allocate(ctx);
     assert(index >= 0 && index < MAX_MESSAGES);
-    node = &mdb->m_node[index];
-    node->type = content->type;
-    node->index = (uint16_t)index;
-
-    /* Append message list */
-    if (mdb->m_last != NULL_NODE) {
-        struct msg_node *pnode = &mdb->m_node[mdb->m_last];
-        pnode->n_index = node->index;
-        node->p_index = pnode->index;
-    } else {
-        mdb->m_first = node->index;
-        node->p_index = NULL_NODE;
-    }
-    mdb->m_last = node->index;
-    node->n_index = NULL_NODE;
 
     /* Write message to disk */
-    uint32_t offset = fmsg_offset(mdb, node->index);
-    ret = fmsg_write(ctx, content, sizeof(*content), offset);
+    msg_record_fill(ctx, MSG_REC_ADD, 0, index);
+    len = msg_payload_pack(content, MSG_RECORD_DATA(ctx));
+    ret = msg_journal_append(ctx, len, &pos);
     if (ret < 0) {
         pr_err("write message content failed(%d)\n", ret);
         goto _failed;
     }
-    msg_mark_dirty(ctx);
+    msg_link_node(ctx, index, content->type, pos);
+    msg_journal_check(ctx);
+
     kfifo_put(&ctx->fifo, (uint16_t)index);
     *idx = index;
     ctx->new_idx = index;
     pr_dbg("write message(idx: %d) completed\n", index);
     return 0;
 _failed:
-    msg_slot_free(ctx, node->index);
+    msg_slot_free(ctx, index);
     return ret;
 }
 
 static void msg_check_cb(os_timer_t timer, void *arg) {
     struct msg_context *ctx = arg;
     MTX_LOCK();
-    msg_flush_header_locked(ctx);
+    if (ctx->dirty) {
+        ctx->dirty = false;
+        fmsg_flush(ctx);
+    }
     MTX_UNLOCK();
     os_timer_mod(timer, MESSAGE_CHECK_PERIOD);
 }
@@ -369,57 +991,118 @@ static int msg_storage_listen(struct observer_base *nb,
 }
 
 static int msg_flush_locked(void) {
-    int err = msg_flush_header_locked(&msg_context);
-    if (!err)
-        err = fmsg_flush(&msg_context);
-    return err;
+    msg_context.dirty = false;
+    return fmsg_flush(&msg_context);
+}
+
+static size_t msg_index_range(struct msg_context *ctx, int type,
+    const uint16_t **ids) {
+    struct msg_index *mi = &ctx->index;
+
+    if (type < 0) {
+        *ids = mi->order;
+        return mi->t_start[MAX_MESSAGE_TYPES];
+    }
+    *ids = &mi->t_order[mi->t_start[type]];
+    return mi->t_start[type + 1] - mi->t_start[type];
 }
 
 size_t msg_storage_numbers(void) {
-    size_t n = 0;
+    return msg_storage_count(MSG_TYPE_ALL);
+}
+
+size_t msg_storage_count(int type) {
+    const uint16_t *ids;
+    size_t n;
+
+    if (type >= MAX_MESSAGE_TYPES)
+        return 0;
     MTX_LOCK();
-    MSG_STORAGE_FOREACH(idx) {
-        n++;
-    }
+    n = msg_index_range(&msg_context, type, &ids);
     MTX_UNLOCK();
-    pr_dbg("message numbers: %d\n", n);
+    pr_dbg("message numbers: %d\n", (int)n);
     return n;
 }
 
+ssize_t msg_storage_query(int type, size_t start, int *ids, size_t n) {
+    const uint16_t *order;
+    size_t total, i;
+
+    if (ids == NULL || type >= MAX_MESSAGE_TYPES)
+        return -EINVAL;
+
+    MTX_LOCK();
+    total = msg_index_range(&msg_context, type, &order);
+    for (i = 0; i < n && start + i < total; i++)
+        ids[i] = order[start + i];
+    MTX_UNLOCK();
+    return (ssize_t)i;
+}
+
+ssize_t msg_storage_read_range(int type, size_t start,
+    struct msg_payload *payloads, size_t n) {
+    struct msg_context *ctx = &msg_context;
+    const uint16_t *order;
+    size_t total, i;
+    int err = 0;
+
+    if (payloads == NULL || type >= MAX_MESSAGE_TYPES)
+        return -EINVAL;
+
+    MTX_LOCK();
+    total = msg_index_range(ctx, type, &order);
+    for (i = 0; i < n && start + i < total; i++) {
+        uint16_t idx = order[start + i];
+
+        err = msg_record_fetch(ctx, ctx->cp.db.m_pos[idx]);
+        if (err >= 0)
+            err = msg_record_of(&ctx->rec.hdr, idx)?
+                msg_payload_unpack(MSG_RECORD_DATA(ctx), err, &payloads[i]): -EIO;
+        if (err < 0)
+            break;
+    }
+    MTX_UNLOCK();
+    if (err < 0) {
+        pr_err("read messages failed (type:%d  error:%d)\n", type, err);
+        return err;
+    }
+    return (ssize_t)i;
+}
+
 int msg_storage_read(int id, struct msg_payload *payload) {
     struct msg_context *ctx;
-    uint32_t offset;
-    uint16_t idx = (uint16_t)id;
     int err;
 
     if (payload == NULL) {
         pr_err("invalid paramters\n");
         return -EINVAL;
     }
-    if (idx > MAX_MESSAGES || idx == NULL_NODE) {
+    if (id < 0 || id >= MAX_MESSAGES) {
         pr_err("invalid message id(%d)\n", id);
         return -EINVAL;
     }
 
     MTX_LOCK();
     ctx = &msg_context;
-    if (ctx->db.m_node[idx].type == INVALID_TYPE) {
+    if (ctx->cp.db.m_node[id].type == INVALID_TYPE) {
         MTX_UNLOCK();
         pr_err("invalid message type\n");
         return -EINVAL;
     }
-    offset = fmsg_offset(&ctx->db, idx);
+    err = msg_record_load(ctx, ctx->cp.db.m_pos[id]);
+    if (err >= 0)
+        err = msg_record_of(&ctx->rec.hdr, id)?
+            msg_payload_unpack(MSG_RECORD_DATA(ctx), err, payload): -EIO;
     MTX_UNLOCK();
-    err = fmsg_read(ctx, payload, sizeof(*payload), offset);
     if (err < 0) {
-        pr_err("read message failed (index:%d  offset:%d)\n", idx, offset);
+        pr_err("read message failed (index:%d  error:%d)\n", id, err);
         return err;
     }
     return 0;
 }
 
 int msg_storage_first(void) {
-    uint16_t idx = msg_context.db.m_first;
+    uint16_t idx = msg_context.cp.db.m_first;
     if (idx == NULL_NODE)
         return -EINVAL;
     return idx;
@@ -431,7 +1114,7 @@ int msg_storage_next(int id) {
         return -EINVAL;
     }
     if (id < MAX_MESSAGES) {
-        int idx = msg_context.db.m_node[id].n_index;
+        int idx = msg_context.cp.db.m_node[id].n_index;
         if (idx == NULL_NODE)
             return -EINVAL;
         return idx;
@@ -462,8 +1145,8 @@ int msg_storage_write(const struct msg_payload *content) {
     ctx = &msg_context;
     MTX_LOCK();
     int type = content->type;
-    enum notification_state state = ctx->state.state[type];
-    if (ctx->state.notif_enable && 
+    enum notification_state state = ctx->cp.state.state[type];
+    if (ctx->cp.state.notif_enable &&
         state != MSG_NOTIF_DISABLE) {
         err = msg_content_write(ctx, content, &idx);
         if (!err) {
@@ -513,16 +1196,20 @@ int msg_storage_clean(void) {
     int err = 0;
     MTX_LOCK();
     fmsg_close(ctx);
-    if (fmsg_remove(ctx, MSG_FILENAME)) {
+    if (fmsg_remove(ctx, MSG_FILENAME))
         pr_dbg("clear msgfile.db failed\n");
-        msg_context.db.m_magic = 0;
-        msg_context.dirty = true;
-        err = msg_flush_locked();
-    } else {
-        err = fmsg_open(ctx, MSG_FILENAME);
-        assert(err == 0);
-        msg_reset_locked(&ctx->db, true);
+    else
         pr_dbg("clear msgfile.db success\n");
+
+    /* The new checkpoint drops all of the journal */
+    err = fmsg_open(ctx, MSG_FILENAME);
+    if (!err) {
+        ctx->win_len = 0;
+        msg_reinit_database(&ctx->cp.db);
+        msg_index_rebuild(ctx);
+        err = msg_checkpoint_locked(ctx);
+        if (!err)
+            err = msg_flush_locked();
     }
     MTX_UNLOCK();
     return err;
@@ -531,36 +1218,39 @@ int msg_storage_clean(void) {
 int msg_storage_set_bitvec(uint32_t setmsk, uint32_t clrmsk) {
     struct msg_context *ctx = &msg_context;
     uint32_t newval;
+    int err = 0;
 
     MTX_LOCK();
-    newval = (ctx->state.bitvect & ~clrmsk) | setmsk;
-    if (ctx->state.bitvect != newval) {
-        ctx->state.bitvect = newval;
-        ctx->state_dirty = true;
+    newval = (ctx->cp.state.bitvect & ~clrmsk) | setmsk;
+    if (ctx->cp.state.bitvect != newval) {
+        ctx->cp.state.bitvect = newval;
+        err = msg_record_write(ctx, MSG_REC_BITVEC, 0, 0, &newval,
+            sizeof(newval));
     }
     MTX_UNLOCK();
-    return 0;
+    return err;
 }
 
 uint32_t msg_storage_get_bitvect(void) {
     struct msg_context *ctx = &msg_context;
 
     MTX_LOCK();
-    uint32_t val = ctx->state.bitvect;
+    uint32_t val = ctx->cp.state.bitvect;
     MTX_UNLOCK();
     return val;
 }
 
 int msg_storage_set_notif_switch(bool enable) {
     struct msg_context *ctx = &msg_context;
+    int err = 0;
 
     MTX_LOCK();
-    if (ctx->state.notif_enable != enable) {
-        ctx->state.notif_enable = enable;
-        ctx->state_dirty = true;
+    if (ctx->cp.state.notif_enable != enable) {
+        ctx->cp.state.notif_enable = enable;
+        err = msg_record_write(ctx, MSG_REC_SWITCH, enable, 0, NULL, 0);
     }
     MTX_UNLOCK();
-    return 0;
+    return err;
 }
 
 bool msg_storage_get_notif_switch(void) {
@@ -568,28 +1258,30 @@ bool msg_storage_get_notif_switch(void) {
     bool on;
 
     MTX_LOCK();
-    on = ctx->state.notif_enable;
+    on = ctx->cp.state.notif_enable;
     MTX_UNLOCK();
-    return on;  
+    return on;
 }
 
 int msg_storage_set_notification(int type, enum notification_state state) {
     struct msg_context *ctx = &msg_context;
-    int err = -EINVAL;
+    int err = 0;
 
-    if (type >= MAX_MESSAGE_TYPES) {
+    if (type < 0 || type >= MAX_MESSAGE_TYPES) {
         pr_err("invalid message type(%d)\n", type);
         return -EINVAL;
     }
 
     MTX_LOCK();
-    if (!ctx->state.notif_enable) {
+    if (!ctx->cp.state.notif_enable) {
         pr_warn("message notification disabled\n");
         err = -EACCES;
         goto _unlock;
     }
-    ctx->state.state[type] = state;
-    ctx->state_dirty = true;
+    if (ctx->cp.state.state[type] != state) {
+        ctx->cp.state.state[type] = state;
+        err = msg_record_write(ctx, MSG_REC_NOTIF, state, type, NULL, 0);
+    }
 _unlock:
     MTX_UNLOCK();
     return err;
@@ -600,8 +1292,8 @@ int msg_storage_get_notification(int type, enum notification_state *sta) {
     if (!sta|| type >= MAX_MESSAGE_TYPES)
         return -EINVAL;
     MTX_LOCK();
-    if (ctx->state.notif_enable)
-        *sta = ctx->state.state[type];
+    if (ctx->cp.state.notif_enable)
+        *sta = ctx->cp.state.state[type];
     else
         *sta = MSG_NOTIF_DISABLE;
     MTX_UNLOCK();
@@ -619,35 +1311,53 @@ int __rte_notrace msg_storage_register_notifier(message_notif_cb cb, void *arg)
 
 int __rte_notrace msg_storage_init(void) {
     struct msg_context *ctx = &msg_context;
-    struct msg_database *mdb = &ctx->db;
-    struct msg_notifstate *sta = &ctx->state;
-    int err;
+    struct msg_checkpoint *cp = &ctx->cp;
+    uint32_t gen = 0;
+    int err, slot, newer = -1;
 
     err = fmsg_open(ctx, MSG_FILENAME);
     if (err) {
         pr_err("open message file failed(%d)\n", err);
         return err;
     }
-    err = fmsg_read(ctx, mdb, sizeof(*mdb), 0);
-    if (err < 0) {
-        pr_err("read message header failed(%d)\n", err);
-        return err;
-    }
-    err = fmsg_read(ctx, sta, sizeof(*sta), MESSAGE_STATE_OFFSET);
-    if (err < 0) {
-        pr_err("read message state failed(%d)\n", err);
-        return err;
+
+    /* Load the newer checkpoint */
+    for (slot = 0; slot < 2; slot++) {
+        err = msg_checkpoint_load(ctx, slot);
+        if (err < 0) {
+            pr_err("read message checkpoint failed(%d)\n", err);
+            return err;
+        }
+        if (err > 0 && (newer < 0 || cp->gen > gen)) {
+            gen = cp->gen;
+            newer = slot;
+        }
     }
+    if (newer == 0)
+        msg_checkpoint_load(ctx, newer);
 
     MTX_INIT();
     MTX_LOCK();
-    msg_reset_locked(mdb, false);
-    msg_state_reset_locked(sta, false);
-    err = os_timer_create(&ctx->timer, msg_check_cb, 
+    err = os_timer_create(&ctx->timer, msg_check_cb,
         ctx, false);
     if (err)
         pr_err("create timer failed(%d)\n", err);
 
+    ctx->win_len = 0;
+    if (newer >= 0) {
+        msg_index_rebuild(ctx);
+        msg_journal_replay(ctx);
+    } else {
+        /* Keep the notification state of old format */
+        memset(cp, 0, sizeof(*cp));
+        fmsg_read(ctx, &cp->state, sizeof(cp->state), MESSAGE_STATE_OFFSET);
+        msg_state_reset_locked(&cp->state, false);
+        msg_reinit_database(&cp->db);
+        msg_index_rebuild(ctx);
+        ctx->head = 0;
+        msg_checkpoint_locked(ctx);
+    }
+
     INIT_KFIFO(ctx->fifo);
     /* Register observer for system shutdown/reoot */
     ctx->obs.update = msg_storage_listen;
@@ -657,9 +1367,30 @@ int __rte_notrace msg_storage_init(void) {
     return err;
 }
 
+int __rte_notrace msg_storage_drop(void) {
+    struct msg_context *ctx = &msg_context;
+    MTX_LOCK();
+    if (ctx->timer) {
+        os_timer_del(ctx->timer);
+        ctx->timer = NULL;
+    }
+    if (ctx->fd) {
+        fmsg_close(ctx);
+        ctx->fd = NULL;
+    }
+    memset(&ctx->cp, 0, sizeof(ctx->cp));
+    ctx->head = 0;
+    ctx->dirty = false;
+    ctx->win_len = 0;
+    MTX_UNLOCK();
+    return 0;
+}
+
 int __rte_notrace msg_storage_deinit(void) {
     struct msg_context *ctx = &msg_context;
     MTX_LOCK();
+    if (ctx->fd && ctx->head != ctx->cp.head)
+        msg_checkpoint_locked(ctx);
     msg_flush_locked();
     if (ctx->timer) {
         os_timer_del(ctx->timer);
@@ -64,6 +64,9 @@ struct msg_node {
     uint16_t p_index; /* previous index of the node */
 };
 
+/* All message types (for msg_storage_count/query/read_range) */
+#define MSG_TYPE_ALL (-1)
+
 /*
  * Walk around messages by time order
  */
@@ -79,6 +82,25 @@ struct msg_node {
  */
 size_t msg_storage_numbers(void);
 
+/*
+ * msg_storage_count - Get the number of messages by type
+ *
+ * @type: message type (MSG_TYPE_ALL for all types)
+ * return the numbers of message
+ */
+size_t msg_storage_count(int type);
+
+/*
+ * msg_storage_query - Get the message IDs by type in time order
+ *
+ * @type: message type (MSG_TYPE_ALL for all types)
+ * @start: the position of first message (0 is the oldest)
+ * @ids: buffer for message IDs
+ * @n: the size of buffer
+ * return the number of IDs if success (< 0 is error)
+ */
+ssize_t msg_storage_query(int type, size_t start, int *ids, size_t n);
+
 /*
  * msg_storage_clean - Clean all messages
  *
@@ -113,11 +135,26 @@ int msg_storage_remove(int id);
  * msg_storage_read - Read message content by message id
  *
  * @id: message id
- * @playload: message content
+ * @playload: message content (The unused text is zero)
  * return 0 if success
  */
 int msg_storage_read(int id, struct msg_payload *payload);
 
+/*
+ * msg_storage_read_range - Read message contents by type in time order
+ *
+ * The adjacent messages in storage are read by one disk access
+ * (CONFIG_MSG_STORAGE_BATCH_SIZE)
+ *
+ * @type: message type (MSG_TYPE_ALL for all types)
+ * @start: the position of first message (0 is the oldest)
+ * @payloads: buffer for message contents
+ * @n: the size of buffer
+ * return the number of messages if success (< 0 is error)
+ */
+ssize_t msg_storage_read_range(int type, size_t start,
+    struct msg_payload *payloads, size_t n);
+
 /*
  * msg_storage_read - Write message content to database
  *
@@ -168,6 +205,14 @@ int msg_storage_register(const struct msg_fops *fops);
  */
 int msg_storage_deinit(void);
 
+/*
+ * msg_storage_drop - Close message database without checkpoint and flush
+ * (The state in RAM is dropped as if the power is lost, It is used by test)
+ *
+ * return 0 if success
+ */
+int msg_storage_drop(void);
+
 /*
  * msg_storage_set_notification - Set notification state of message by type
  *
@@ -0,0 +1,292 @@
+/*
+ * CopyRight 2024 wtcat
+ *
+ * The software timer implemention that base on hierarchical timing-wheel
+ *
+ * Each level has TW_LVL_SIZE slots and a occupancy bitmap. A slot of level N
+ * covers TW_LVL_SIZE^N ticks. Timers are hashed into a slot by absolute
+ * expiration time and are cascaded to the lower level when the clock crosses
+ * the slot boundary. So insert/delete is O(1) and timer_schedule() jumps from
+ * event to event by bitmap search instead of walking every tick.
+ */
+
+#ifdef CONFIG_HEADER_FILE
+#include CONFIG_HEADER_FILE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "basework/os/osapi.h"
+#include "basework/lib/timer/timer_list.h"
+#include "basework/log.h"
+
+#ifndef CONFIG_TIMER_WHEEL_LEVELS
+#define CONFIG_TIMER_WHEEL_LEVELS 6
+#endif
+
+#define TW_LVL_BITS   5
+#define TW_LVL_SIZE   (1ul << TW_LVL_BITS)
+#define TW_LVL_MASK   (TW_LVL_SIZE - 1)
+#define TW_LEVELS     CONFIG_TIMER_WHEEL_LEVELS
+#define TW_LVL_SHIFT(lvl) ((lvl) * TW_LVL_BITS)
+#define TW_LVL_GRAN(lvl)  (1ul << TW_LVL_SHIFT(lvl))
+#define TW_LVL_DIGIT(t, lvl) (((t) >> TW_LVL_SHIFT(lvl)) & TW_LVL_MASK)
+#define TW_MAX_DELTA  ((1ul << TW_LVL_SHIFT(TW_LEVELS)) - 1)
+#define TW_INDEX(lvl, slot) ((lvl) * TW_LVL_SIZE + (slot))
+
+#define TIMER_LOCK_DECLARE os_critical_declare
+#define TIMER_LOCK()       os_critical_lock
+#define TIMER_UNLOCK()     os_critical_unlock
+#define TIMER_LIST(ptr) rte_container_of(ptr, struct timer_list, node)
+
+_Static_assert(TW_LEVELS * TW_LVL_BITS < sizeof(unsigned long) * 8,
+	"The timer wheel levels is too large");
+
+struct timer_wheel {
+	struct rte_list slots[TW_LEVELS * TW_LVL_SIZE];
+	uint32_t bitmap[TW_LEVELS];
+	unsigned long clk;
+	size_t count;
+	bool ready;
+};
+
+os_critical_global_declare
+static struct timer_wheel timer_wheel;
+
+static void timer_wheel_init(struct timer_wheel *tw) {
+	for (size_t i = 0; i < rte_array_size(tw->slots); i++)
+		RTE_INIT_LIST(&tw->slots[i]);
+	tw->ready = true;
+}
+
+/*
+ * Return the distance from @from to the first occupied slot
+ * (search circularly)
+ */
+static inline unsigned int tw_next_distance(uint32_t bitmap,
+	unsigned int from) {
+	if (from)
+		bitmap = (bitmap >> from) | (bitmap << (TW_LVL_SIZE - from));
+	return __builtin_ctz(bitmap);
+}
+
+static void timer_enqueue_locked(struct timer_wheel *tw,
+	struct timer_list *timer) {
+	unsigned long expires = (unsigned long)timer->expires;
+	unsigned long delta = expires - tw->clk;
+	unsigned int lvl, slot, idx;
+
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+		if (delta < TW_LVL_GRAN(lvl + 1))
+			break;
+	}
+	slot = TW_LVL_DIGIT(expires, lvl);
+	idx = TW_INDEX(lvl, slot);
+	timer->wheel_idx = (uint16_t)idx;
+	rte_list_add_tail(&timer->node, &tw->slots[idx]);
+	tw->bitmap[lvl] |= 1u << slot;
+}
+
+static void timer_dequeue_locked(struct timer_wheel *tw,
+	struct timer_list *timer) {
+	unsigned int idx = timer->wheel_idx;
+
+	rte_list_del(&timer->node);
+	if (rte_list_empty(&tw->slots[idx]))
+		tw->bitmap[idx / TW_LVL_SIZE] &= ~(1u << (idx & TW_LVL_MASK));
+}
+
+/*
+ * Get the time of the next event (expiration or cascade)
+ */
+static bool timer_next_event_locked(struct timer_wheel *tw,
+	unsigned long *next) {
+	unsigned long clk = tw->clk;
+	unsigned long best = 0;
+	bool found = false;
+
+	for (unsigned int lvl = 0; lvl < TW_LEVELS; lvl++) {
+		unsigned long base, t;
+		unsigned int from;
+
+		if (!tw->bitmap[lvl])
+			continue;
+		from = (TW_LVL_DIGIT(clk, lvl) + 1) & TW_LVL_MASK;
+		base = clk & ~(TW_LVL_GRAN(lvl) - 1);
+		t = base + (tw_next_distance(tw->bitmap[lvl], from) + 1) *
+			TW_LVL_GRAN(lvl);
+		if (!found || (long)(t - best) < 0) {
+			best = t;
+			found = true;
+		}
+	}
+	*next = best;
+	return found;
+}
+
+static void timer_cascade_locked(struct timer_wheel *tw, unsigned int lvl) {
+	unsigned int slot = TW_LVL_DIGIT(tw->clk, lvl);
+	struct rte_list *head = &tw->slots[TW_INDEX(lvl, slot)];
+	struct rte_list list;
+
+	if (rte_list_empty(head))
+		return;
+	RTE_INIT_LIST(&list);
+	rte_list_splice_init(head, &list);
+	tw->bitmap[lvl] &= ~(1u << slot);
+	while (!rte_list_empty(&list)) {
+		struct timer_list *timer = TIMER_LIST(list.next);
+		rte_list_del(&timer->node);
+		timer_enqueue_locked(tw, timer);
+	}
+}
+
+static int timer_add_locked(struct timer_list *timer,
+	long expires) {
+	struct timer_wheel *tw = &timer_wheel;
+
+	if (rte_unlikely(timer->state != TIMER_STATE_IDLE))
+		return -EBUSY;
+	if (rte_unlikely(!tw->ready))
+		timer_wheel_init(tw);
+
+	/*
+	 * The timer will be expired at next tick at least
+	 */
+	if (expires <= 0)
+		expires = 1;
+	else if ((unsigned long)expires > TW_MAX_DELTA)
+		expires = (long)TW_MAX_DELTA;
+
+	timer->state = TIMER_STATE_INSERT;
+	timer->expires = (long)(tw->clk + (unsigned long)expires);
+	timer_enqueue_locked(tw, timer);
+	tw->count++;
+	timer->state = TIMER_STATE_ACTIVED;
+	return 0;
+}
+
+static int timer_remove_locked(struct timer_list *timer) {
+	if (timer->state == TIMER_STATE_IDLE)
+		return 0;
+
+	timer_dequeue_locked(&timer_wheel, timer);
+	timer_wheel.count--;
+	timer->state = TIMER_STATE_IDLE;
+	return 1;
+}
+
+long timer_schedule(long expires) {
+	TIMER_LOCK_DECLARE
+	struct timer_wheel *tw = &timer_wheel;
+	unsigned long target, next;
+	long next_expired;
+	bool found;
+
+	TIMER_LOCK();
+	target = tw->clk + (unsigned long)expires;
+
+	/*
+	 * If has no more work to do, then return
+	 */
+	if (rte_unlikely(!tw->count)) {
+		tw->clk = target;
+		next_expired = 0;
+		goto _unlock;
+	}
+
+	found = timer_next_event_locked(tw, &next);
+	while (found && (long)(next - target) <= 0) {
+		struct rte_list *head;
+
+		tw->clk = next;
+
+		/* Move the timers of upper level to lower level */
+		for (unsigned int lvl = 1; lvl < TW_LEVELS; lvl++) {
+			if (next & (TW_LVL_GRAN(lvl) - 1))
+				break;
+			timer_cascade_locked(tw, lvl);
+		}
+
+		head = &tw->slots[TW_INDEX(0, TW_LVL_DIGIT(next, 0))];
+		while (!rte_list_empty(head)) {
+			struct timer_list *timer = TIMER_LIST(head->next);
+			void (*fn)(struct timer_list*, void *);
+
+			timer_dequeue_locked(tw, timer);
+			tw->count--;
+			fn = timer->expired_fn;
+			timer->state = TIMER_STATE_IDLE;
+			TIMER_UNLOCK();
+			fn(timer, timer->arg);
+			TIMER_LOCK();
+		}
+		found = timer_next_event_locked(tw, &next);
+	}
+	tw->clk = target;
+
+	if (!found) {
+		next_expired = 0;
+		goto _unlock;
+	}
+	next_expired = (long)(next - target);
+
+_unlock:
+	TIMER_UNLOCK();
+	return next_expired;
+}
+
+void timer_init(struct timer_list *timer,
+    void (*expired_fn)(struct timer_list *, void *), void *arg) {
+    timer->expired_fn = expired_fn;
+    timer->expires = 0;
+    timer->arg = arg;
+    timer->state = 0;
+}
+
+int timer_mod(struct timer_list *timer, long expires) {
+	TIMER_LOCK_DECLARE
+	TIMER_LOCK();
+	timer_remove_locked(timer);
+	int ret = timer_add_locked(timer, expires);
+	TIMER_UNLOCK();
+	return ret;
+}
+
+int timer_add(struct timer_list *timer, long expires) {
+	TIMER_LOCK_DECLARE
+	TIMER_LOCK();
+	int ret = timer_add_locked(timer, expires);
+	TIMER_UNLOCK();
+	return ret;
+}
+
+int timer_del(struct timer_list *timer) {
+	TIMER_LOCK_DECLARE
+	TIMER_LOCK();
+	int pending = timer_remove_locked(timer);
+	TIMER_UNLOCK();
+	return pending;
+}
+
+int timer_visit(void (*visitor)(struct timer_list *)) {
+    TIMER_LOCK_DECLARE
+    struct rte_list *node;
+    if (visitor == NULL)
+        return -EINVAL;
+    TIMER_LOCK();
+	for (unsigned int lvl = 0; lvl < TW_LEVELS; lvl++) {
+		uint32_t bitmap = timer_wheel.bitmap[lvl];
+		while (bitmap) {
+			unsigned int slot = __builtin_ctz(bitmap);
+			bitmap &= bitmap - 1;
+			rte_list_foreach(node, &timer_wheel.slots[TW_INDEX(lvl, slot)]) {
+				visitor(TIMER_LIST(node));
+			}
+		}
+	}
+    TIMER_UNLOCK();
+    return 0;
+}
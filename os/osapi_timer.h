@@ -177,6 +177,19 @@ unsigned int __os_timer_gettime(void);
 int os_timer_trace(os_timer_t timer, bool enable);
 #endif
 
+#ifdef CONFIG_BASEWORK_RQ_POOL
+struct rq_pool;
+
+/*
+ * __os_timer_attach_pool - Dispatch timer callback to run-queue pool
+ * (The callbacks of the same timer are always executed in order)
+ *
+ * @pool: run-queue pool (NULL: use system run-queue)
+ * return 0 if success
+ */
+int __os_timer_attach_pool(struct rq_pool *pool);
+#endif
+
 #else /* CONFIG_OS_TIMER_DISABLE */
 
 static inline int os_timer_create(os_timer_t *timer, 
@@ -48,9 +48,14 @@ typedef sem_t os_completion_t;
 static inline int 
 __os_completion_timedwait(sem_t* sem, uint32_t ms) {
 	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* sem_timedwait() measures the absolute timeout against CLOCK_REALTIME */
+	clock_gettime(CLOCK_REALTIME, &ts);
 	ts.tv_sec += ms / 1000;
-	ts.tv_nsec += ms * 1000000;
+	ts.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
 	return sem_timedwait(sem, &ts);
 }
 
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * File-backed block device for bcache (POSIX)
+ *
+ * The transfer requests are pushed to a bounded submission queue and done
+ * by a pool of I/O threads (pread/pwrite). The completion is signaled by
+ * bcache_request_done() from the I/O thread.
+ */
+
+#define pr_fmt(fmt) "<bcache_file>: "fmt
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "basework/generic.h"
+#include "basework/malloc.h"
+#include "basework/os/osapi.h"
+#include "basework/log.h"
+#include "basework/os/posix/os_bcache_file.h"
+
+#define BCACHE_FILE_QUEUE_DEPTH 16
+
+struct bcache_file {
+	int fd;
+	uint32_t latency_us;
+	uint32_t depth;
+	uint32_t head;
+	uint32_t count;
+	uint32_t inflight;
+	os_mutex_t lock;
+	os_cond_t not_empty;
+	os_cond_t not_full;
+	struct bcache_file_stats stats;
+	os_thread_t *threads;
+	struct bcache_request **queue;
+};
+
+static int
+bcache_file_ioctl(struct bcache_device *dd, uint32_t req, void *argp);
+
+static int
+bcache_file_transfer(struct bcache_file *bf, struct bcache_request *r,
+	size_t blksize) {
+	struct bcache_sg_buffer *sg = r->bufs;
+	ssize_t ret;
+
+	if (bf->latency_us)
+		usleep(bf->latency_us);
+
+	for (uint32_t i = 0; i < r->bufnum; i++, sg++) {
+		off_t offset = (off_t)sg->block * blksize;
+
+		if (r->req == BCACHE_DEV_REQ_READ)
+			ret = pread(bf->fd, sg->buffer, sg->length, offset);
+		else
+			ret = pwrite(bf->fd, sg->buffer, sg->length, offset);
+		if (ret != (ssize_t)sg->length)
+			return ret < 0? -errno: -EIO;
+	}
+	return 0;
+}
+
+static void
+bcache_file_complete(struct bcache_file *bf, struct bcache_request *r,
+	int err) {
+	os_mtx_lock(&bf->lock);
+	bf->inflight--;
+	bf->stats.completed++;
+	os_mtx_unlock(&bf->lock);
+	bcache_request_done(r, err);
+}
+
+static void
+bcache_file_thread(void *arg) {
+	struct bcache_device *dd = arg;
+	struct bcache_file *bf = bcache_disk_get_driver_data(dd);
+	struct bcache_request *r;
+
+	for ( ; ; ) {
+		os_mtx_lock(&bf->lock);
+		while (bf->count == 0)
+			os_cv_wait(&bf->not_empty, &bf->lock);
+		r = bf->queue[bf->head];
+		if (++bf->head == bf->depth)
+			bf->head = 0;
+		bf->count--;
+		os_cv_signal(&bf->not_full);
+		os_mtx_unlock(&bf->lock);
+
+		bcache_file_complete(bf, r, bcache_file_transfer(bf, r, dd->block_size));
+	}
+}
+
+static int
+bcache_file_submit(struct bcache_device *dd, struct bcache_request *r) {
+	struct bcache_file *bf = bcache_disk_get_driver_data(dd);
+	uint32_t idx;
+
+	if (r->req != BCACHE_DEV_REQ_READ && r->req != BCACHE_DEV_REQ_WRITE)
+		return -EINVAL;
+
+	os_mtx_lock(&bf->lock);
+	bf->stats.submitted++;
+	if (++bf->inflight > bf->stats.inflight_max)
+		bf->stats.inflight_max = bf->inflight;
+
+	/* Synchronous mode */
+	if (bf->threads == NULL) {
+		os_mtx_unlock(&bf->lock);
+		bcache_file_complete(bf, r, bcache_file_transfer(bf, r, dd->block_size));
+		return 0;
+	}
+
+	while (bf->count == bf->depth)
+		os_cv_wait(&bf->not_full, &bf->lock);
+	idx = bf->head + bf->count;
+	if (idx >= bf->depth)
+		idx -= bf->depth;
+	bf->queue[idx] = r;
+	bf->count++;
+	os_cv_signal(&bf->not_empty);
+	os_mtx_unlock(&bf->lock);
+	return 0;
+}
+
+static int
+bcache_file_ioctl(struct bcache_device *dd, uint32_t req, void *argp) {
+	if (rte_likely(req == BCACHE_IO_REQUEST))
+		return bcache_file_submit(dd, argp);
+	return bcache_ioctl(dd, req, argp);
+}
+
+int
+bcache_file_create(const char *device, const struct bcache_file_config *cfg,
+	struct bcache_device **dd) {
+	struct bcache_file *bf;
+	uint32_t depth;
+	int err;
+
+	if (!device || !cfg || !cfg->path || !dd)
+		return -EINVAL;
+
+	depth = cfg->queue_depth? cfg->queue_depth: BCACHE_FILE_QUEUE_DEPTH;
+	bf = general_calloc(1, sizeof(*bf) + depth * sizeof(bf->queue[0]) +
+		cfg->threads * sizeof(bf->threads[0]));
+	if (!bf)
+		return -ENOMEM;
+
+	bf->fd = open(cfg->path, O_RDWR | O_CREAT, 0644);
+	if (bf->fd < 0) {
+		err = -errno;
+		goto _free;
+	}
+	if (ftruncate(bf->fd, (off_t)cfg->blksize * cfg->blocks) < 0) {
+		err = -errno;
+		goto _close;
+	}
+
+	bf->latency_us = cfg->latency_us;
+	bf->depth = depth;
+	bf->queue = (struct bcache_request **)(bf + 1);
+	os_mtx_init(&bf->lock, 0);
+	os_cv_init(&bf->not_empty, NULL);
+	os_cv_init(&bf->not_full, NULL);
+
+	err = bcache_blkdev_create(device, cfg->blksize, cfg->blocks,
+		bcache_file_ioctl, bf, dd);
+	if (err)
+		goto _close;
+
+	/*
+	 * The device has been registered, So it runs with the started threads
+	 * (or in synchronous mode) if the thread creation failed.
+	 */
+	for (uint32_t i = 0; i < cfg->threads; i++) {
+		os_thread_t *threads = (os_thread_t *)(bf->queue + depth);
+
+		err = os_thread_spawn(&threads[i], "bcache-file", NULL, 0, 0,
+			bcache_file_thread, *dd);
+		if (err) {
+			pr_err("create I/O thread(%d) failed(%d)\n", i, err);
+			break;
+		}
+		os_mtx_lock(&bf->lock);
+		bf->threads = threads;
+		os_mtx_unlock(&bf->lock);
+	}
+	return 0;
+
+_close:
+	close(bf->fd);
+_free:
+	general_free(bf);
+	return err;
+}
+
+int
+bcache_file_get_stats(struct bcache_device *dd, struct bcache_file_stats *stats) {
+	struct bcache_file *bf;
+
+	if (!dd || !stats || dd->ioctl != bcache_file_ioctl)
+		return -EINVAL;
+
+	bf = bcache_disk_get_driver_data(dd);
+	os_mtx_lock(&bf->lock);
+	*stats = bf->stats;
+	os_mtx_unlock(&bf->lock);
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * File-backed block device for bcache (POSIX)
+ */
+#ifndef BASEWORK_OS_POSIX_BCACHE_FILE_H_
+#define BASEWORK_OS_POSIX_BCACHE_FILE_H_
+
+#include "basework/dev/bcache.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+struct bcache_file_config {
+    const char *path;       /* Image file (It will be created if not exist) */
+    uint32_t blksize;       /* Media block size */
+    bcache_num_t blocks;    /* Media block count */
+    uint32_t threads;       /* I/O threads (0: The request is done in caller) */
+    uint32_t queue_depth;   /* Submission queue depth (0: 16) */
+    uint32_t latency_us;    /* Emulated media latency of each request */
+};
+
+struct bcache_file_stats {
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t inflight_max;  /* The maximum number of requests in flight */
+};
+
+/*
+ * bcache_file_create - Create a bcache device over a file image
+ *
+ * The transfer requests are queued and done by the I/O threads, So the
+ * requests from swapout and different readers can overlap.
+ *
+ * @device: device name
+ * @cfg: configuration
+ * @dd: the created bcache device
+ * return 0 if success
+ */
+int bcache_file_create(const char *device, const struct bcache_file_config *cfg,
+    struct bcache_device **dd);
+
+/*
+ * bcache_file_get_stats - Get the request statistics of file device
+ */
+int bcache_file_get_stats(struct bcache_device *dd, struct bcache_file_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASEWORK_OS_POSIX_BCACHE_FILE_H_ */
@@ -2,37 +2,77 @@
  * Copyright 2022 wtcat
  *
  * Timer implement for POSIX
+ *
+ * All timers are managed by timer_list and driven by a single dispatcher
+ * thread that sleeps on CLOCK_MONOTONIC until the next expiration.
  */
- 
+
 #ifdef CONFIG_HEADER_FILE
 #include CONFIG_HEADER_FILE
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define pr_fmt(fmt) "os_timer: "fmt
 
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
-#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "basework/os/osapi_timer.h"
+#include "basework/os/osapi_obj.h"
+#include "basework/lib/timer/timer_list.h"
+#include "basework/malloc.h"
 #include "basework/log.h"
 #include "basework/rq.h"
+#ifdef CONFIG_BASEWORK_RQ_POOL
+#include "basework/rq_pool.h"
+#endif
 
+/*
+ * The size of timer pool. The pool will be expanded with the same size
+ * when all timers have been allocated
+ */
 #ifndef CONFIG_OS_MAX_TIMERS
-#define CONFIG_OS_MAX_TIMERS 3
+#define CONFIG_OS_MAX_TIMERS 32
 #endif
 
+#define NSEC_PER_MSEC 1000000ll
+#define NSEC_PER_SEC  1000000000ll
+
 struct os_timer {
-    struct sigevent sig;
-    struct itimerspec time;
-    timer_t id;
+    struct timer_list timer;
     void (*task)(os_timer_t, void *);
     void *arg;
 };
 
+struct timer_dispatcher {
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    pthread_t thread;
+    int64_t last_ns;
+    bool ready;
+};
+
 static struct os_timer timer_objs[CONFIG_OS_MAX_TIMERS];
 static struct os_robj timer_robj;
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static struct timer_dispatcher dispatcher = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER
+};
+#ifdef CONFIG_BASEWORK_RQ_POOL
+static struct rq_pool *timer_pool;
+#endif
+
+static int64_t timer_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
 static void timer_task_wrapper(void *arg) {
     struct os_timer *timer = arg;
@@ -41,47 +81,125 @@ static void timer_task_wrapper(void *arg) {
     timer->task(timer, timer->arg);
 }
 
-static void timer_signal_cb(__sigval_t val) {
-    struct os_timer *timer = val.sival_ptr;
-    rq_submit(timer_task_wrapper, timer);
+static void timer_expired_cb(struct timer_list *tl, void *arg) {
+    (void) tl;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (timer_pool) {
+        rq_pool_submit(timer_pool, timer_task_wrapper, arg, (uintptr_t)arg, false);
+        return;
+    }
+#endif
+    rq_submit(timer_task_wrapper, arg);
+}
+
+/*
+ * Advance the timer list to current time (dispatcher->mtx must be held)
+ */
+static long timer_advance_locked(struct timer_dispatcher *td) {
+    int64_t now = timer_now_ns();
+    long elapsed = (long)((now - td->last_ns) / NSEC_PER_MSEC);
+
+    td->last_ns += (int64_t)elapsed * NSEC_PER_MSEC;
+    return timer_schedule(elapsed);
+}
+
+static void *timer_dispatch_thread(void *arg) {
+    struct timer_dispatcher *td = arg;
+    struct timespec ts;
+    long next;
+
+    pthread_mutex_lock(&td->mtx);
+    for ( ; ; ) {
+        next = timer_advance_locked(td);
+        if (next == 0) {
+            pthread_cond_wait(&td->cv, &td->mtx);
+            continue;
+        }
+
+        /* Sleep until the next expiration (or new timer has been added) */
+        int64_t deadline = td->last_ns + (int64_t)next * NSEC_PER_MSEC;
+        ts.tv_sec = (time_t)(deadline / NSEC_PER_SEC);
+        ts.tv_nsec = (long)(deadline % NSEC_PER_SEC);
+        pthread_cond_timedwait(&td->cv, &td->mtx, &ts);
+    }
+    pthread_mutex_unlock(&td->mtx);
+    return NULL;
+}
+
+static void timer_dispatcher_setup(void) {
+    struct timer_dispatcher *td = &dispatcher;
+    pthread_condattr_t attr;
+    int err;
+
+    err = os_obj_initialize(&timer_robj, timer_objs,
+        sizeof(timer_objs), sizeof(timer_objs[0]));
+    if (err) {
+        pr_err("Initialize timer object failed (%d)\n", err);
+        os_panic();
+        return;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&td->cv, &attr);
+    pthread_condattr_destroy(&attr);
+    td->last_ns = timer_now_ns();
+    err = pthread_create(&td->thread, NULL, timer_dispatch_thread, td);
+    if (err) {
+        pr_err("Create timer dispatcher failed (%d)\n", err);
+        os_panic();
+        return;
+    }
+    pthread_detach(td->thread);
+    pthread_setname_np(td->thread, "os_timer");
+    td->ready = true;
+}
+
+static struct os_timer *timer_allocate(void) {
+    struct os_timer *p;
+
+    p = os_obj_allocate(&timer_robj);
+    if (p)
+        return p;
+
+    /* Expand timer pool */
+    size_t size = sizeof(struct os_timer) * CONFIG_OS_MAX_TIMERS;
+    void *pool = general_malloc(size);
+    if (!pool)
+        return NULL;
+    if (os_obj_initialize(&timer_robj, pool, size, sizeof(struct os_timer))) {
+        general_free(pool);
+        return NULL;
+    }
+    return os_obj_allocate(&timer_robj);
 }
 
-int __os_timer_create(os_timer_t *timer, 
-    void (*timeout_cb)(os_timer_t, void *), 
-    void *arg, 
+int __os_timer_create(os_timer_t *timer,
+    void (*timeout_cb)(os_timer_t, void *),
+    void *arg,
     bool isr_context) {
     struct os_timer *p;
-    int err;
 
+    (void) isr_context;
     if (!timer || !timeout_cb)
         return -EINVAL;
-    if (!os_obj_ready(&timer_robj)) {
-        int err = os_obj_initialize(&timer_robj, timer_objs, 
-            sizeof(timer_objs), sizeof(timer_objs[0]));
-        if (err) {
-            pr_err("Initialize timer object failed (%d)\n", err);
-            os_panic();
-            return err;
-        }
-    }
-    p = os_obj_allocate(&timer_robj);
+
+    pthread_once(&timer_once, timer_dispatcher_setup);
+    if (!dispatcher.ready)
+        return -ENODEV;
+
+    pthread_mutex_lock(&dispatcher.mtx);
+    p = timer_allocate();
+    pthread_mutex_unlock(&dispatcher.mtx);
     if (!p) {
         pr_err("Allocate timer object failed\n");
         return -ENOMEM;
     }
 
     memset(p, 0, sizeof(*p));
-    *p = (struct os_timer){ 0 };
     p->arg = arg;
     p->task = timeout_cb;
-    p->sig.sigev_value.sival_ptr = p;
-    p->sig.sigev_notify = SIGEV_THREAD;
-    p->sig.sigev_notify_function = timer_signal_cb;
-    err = timer_create(CLOCK_MONOTONIC, &p->sig, &p->id);
-    if (err) {
-        pr_err("Create timer failed!\n");
-        return err;
-    }
+    timer_init(&p->timer, timer_expired_cb, p);
     *timer = p;
     return 0;
 }
@@ -89,34 +207,74 @@ int __os_timer_create(os_timer_t *timer,
 int __os_timer_mod(os_timer_t timer, long expires) {
     assert(timer != NULL);
     struct os_timer *p = timer;
-    long sec;
-
-    sec = expires / 1000;
-    expires -= sec * 1000;
-    p->time.it_value.tv_sec = sec;
-    p->time.it_value.tv_nsec = expires * 1000000;
-    p->time.it_interval.tv_sec = 0;
-    p->time.it_interval.tv_nsec = 0;
-    timer_settime(p->id, 0, &p->time, NULL);
-    return 0;
+    struct timer_dispatcher *td = &dispatcher;
+    int64_t delta;
+    int err;
+
+    pthread_mutex_lock(&td->mtx);
+
+    /*
+     * The expiration time of timer_list is relative to the last schedule
+     * point, So we need to compensate the time that has elapsed since then
+     */
+    delta = timer_now_ns() - td->last_ns;
+    expires += (long)((delta + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+    err = timer_mod(&p->timer, expires);
+    pthread_cond_signal(&td->cv);
+    pthread_mutex_unlock(&td->mtx);
+    return err;
 }
 
 int __os_timer_add(os_timer_t timer, long expires) {
     assert(timer != NULL);
-    os_timer_mod(timer, expires);
-    return 0;
+    return __os_timer_mod(timer, expires);
 }
 
 int __os_timer_del(os_timer_t timer) {
     assert(timer != NULL);
-    os_timer_mod(timer, 0);
+    struct os_timer *p = timer;
+    timer_del(&p->timer);
+    return 0;
+}
+
+int __os_timer_update_handler(os_timer_t timer,
+    void (*fn)(os_timer_t, void *), void *arg) {
+    assert(timer != NULL);
+    struct os_timer *p = timer;
+    if (fn == NULL)
+        return -EINVAL;
+    p->task = fn;
+    p->arg = arg;
     return 0;
 }
 
 int __os_timer_destroy(os_timer_t timer) {
     assert(timer != NULL);
     struct os_timer *p = timer;
-    timer_delete(p->id);
+
+    /* The pool is also changed by timer_allocate() under the lock */
+    pthread_mutex_lock(&dispatcher.mtx);
+    timer_del(&p->timer);
     os_obj_free(&timer_robj, p);
+    pthread_mutex_unlock(&dispatcher.mtx);
+    return 0;
+}
+
+unsigned int __os_timer_gettime(void) {
+    return (unsigned int)(timer_now_ns() / NSEC_PER_MSEC);
+}
+
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+uint32_t _rq_profile_clock(void) {
+    return (uint32_t)(timer_now_ns() / 1000);
+}
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
+
+#ifdef CONFIG_BASEWORK_RQ_POOL
+int __os_timer_attach_pool(struct rq_pool *pool) {
+    pthread_mutex_lock(&dispatcher.mtx);
+    timer_pool = pool;
+    pthread_mutex_unlock(&dispatcher.mtx);
     return 0;
 }
+#endif /* CONFIG_BASEWORK_RQ_POOL */
@@ -20,7 +20,7 @@ extern "C"{
 
 #define TX_CALLERR(fn, arg...) 0 - (int)fn(arg) 
 
-#define os_in_isr()
+#define os_in_isr() 0
 #define os_panic(...) TX_SYSTEM_PANIC()
 
 /* Critical lock */
@@ -6,21 +6,50 @@
 #define CONFIG_LOGLEVEL LOGLEVEL_DEBUG
 
 #include <errno.h>
+#include <string.h>
 #include <device.h>
 #include <drivers/flash.h>
 
 #include "basework/generic.h"
 #include "basework/malloc.h"
+#include "basework/os/osapi.h"
 #include "basework/dev/bcache.h"
+#include "basework/dev/bcache_flash.h"
 #include "basework/dev/partition.h"
 #include "basework/dev/disk.h"
 #include "basework/log.h"
 
+#ifdef CONFIG_BCACHE_FLASH_SECTOR_SIZE
+#define BDEV_SECTOR_SIZE CONFIG_BCACHE_FLASH_SECTOR_SIZE
+#else
+#define BDEV_SECTOR_SIZE 0
+#endif
+
 struct flash_context {
+	struct bcache_flash_media fm;
 	const struct device *dev;
-	uint32_t start;
 	uint32_t size;
-	uint32_t blksize;
+};
+
+static int
+bdev_flash_read(void *dev, uint32_t offset, void *buf, size_t size) {
+	return flash_read((const struct device *)dev, offset, buf, size);
+}
+
+static int
+bdev_flash_write(void *dev, uint32_t offset, const void *buf, size_t size) {
+	return flash_write((const struct device *)dev, offset, buf, size);
+}
+
+static int
+bdev_flash_erase(void *dev, uint32_t offset, size_t size) {
+	return flash_erase((const struct device *)dev, offset, size);
+}
+
+static const struct bcache_flash_ops bdev_flash_ops = {
+	.read = bdev_flash_read,
+	.write = bdev_flash_write,
+	.erase = bdev_flash_erase
 };
 
 static __rte_always_inline int
@@ -33,7 +62,7 @@ bdev_io_request(struct flash_context *ctx, struct bcache_request *r,
 	case BCACHE_DEV_REQ_READ:
 		pr_dbg("%s read %d blocks (blksize: %d)\n", __func__, r->bufs, blksize);
 		for (uint32_t i = 0; i < r->bufnum; i++, sg++) {
-			uint32_t offset = ctx->start + sg->block * blksize;
+			uint32_t offset = ctx->fm.start + sg->block * blksize;
 			err = flash_read(ctx->dev, offset, sg->buffer, sg->length);
 			if (err)
 				break;
@@ -41,8 +70,12 @@ bdev_io_request(struct flash_context *ctx, struct bcache_request *r,
 		break;
 	case BCACHE_DEV_REQ_WRITE:
 		pr_dbg("%s write %d blocks (blksize: %d)\n", __func__, r->bufs, blksize);
+		if (ctx->fm.unit_buf) {
+			err = bcache_flash_write_units(&ctx->fm, r);
+			break;
+		}
 		for (uint32_t i = 0; i < r->bufnum; i++, sg++) {
-			uint32_t offset = ctx->start + sg->block * blksize;
+			uint32_t offset = ctx->fm.start + sg->block * blksize;
 			err = flash_erase(ctx->dev, offset, blksize);
 			if (rte_unlikely(err))
 				break;
@@ -69,6 +102,11 @@ bdev_driver_handler(struct bcache_device *dd, uint32_t req, void *argp) {
 	if (rte_likely(req == BCACHE_IO_REQUEST))
 		return bdev_io_request(ctx, argp, dd->block_size);
 
+	if (req == BCACHE_IO_GETERASESIZE) {
+		*(uint32_t *)argp = ctx->fm.erase_size;
+		return 0;
+	}
+
 	if (req == BCACHE_IO_CAPABILITIES) {
 		*(uint32_t *)argp = BCACHE_DEV_CAP_SYNC;
 		return 0;
@@ -80,23 +118,37 @@ bdev_driver_handler(struct bcache_device *dd, uint32_t req, void *argp) {
 int
 platform_bdev_register(struct disk_device *dd) {
 	struct flash_context *media;
+	size_t sector_size = dd->blk_size;
+
+	/* The erase unit is divided into sectors */
+	if (BDEV_SECTOR_SIZE > 0 && BDEV_SECTOR_SIZE < dd->blk_size)
+		sector_size = BDEV_SECTOR_SIZE;
 
-	media = general_malloc(sizeof(*media));
+	media = general_malloc(sizeof(*media) + 
+		(sector_size < dd->blk_size? dd->blk_size: 0));
 	if (media) {
 		media->dev = (struct device *)dd->dev;
-		media->start = dd->addr;
 		media->size = dd->len;
-		media->blksize = dd->blk_size;
+		media->fm.ops = &bdev_flash_ops;
+		media->fm.dev = (void *)media->dev;
+		media->fm.start = dd->addr;
+		media->fm.blksize = sector_size;
+		media->fm.erase_size = dd->blk_size;
+		media->fm.unit_buf = NULL;
+		if (sector_size < dd->blk_size) {
+			media->fm.unit_buf = (uint8_t *)(media + 1);
+			os_mtx_init(&media->fm.lock, 0);
+		}
 		int err = bcache_blkdev_create(disk_device_get_name(dd),
-			media->blksize,
-			media->size / media->blksize, 
+			media->fm.blksize,
+			media->size / media->fm.blksize, 
 			bdev_driver_handler,
 			media,
 			(struct bcache_device **)&dd->bdev
 		);
 		if (err) {
 			pr_err("create bcache device(start: 0x%x size:0x%x blksize:%x) failed(%d)\n", 
-				media->start, media->size, media->blksize, err);
+				media->fm.start, media->size, media->fm.blksize, err);
 			general_free(media);
 			return err;
 		}
@@ -119,5 +171,9 @@ const struct bcache_config bcache_configuration = {
 	.size = 32*1024,
 	.buffer_min = 2048,
 	.buffer_max = 4096,
-	.read_ahead_priority = 8
+	.read_ahead_priority = 8,
+	.policy = BCACHE_POLICY_LRU,
+	.io_depth = 1,
+	.dirty_ratio_low = BCACHE_DIRTY_RATIO_LOW_DEFAULT,
+	.dirty_ratio_high = BCACHE_DIRTY_RATIO_HIGH_DEFAULT
 };
@@ -70,6 +70,9 @@ static int _monitor_init(const struct device *device) {
     monitor_register(&fps_mon_class);
 #endif
     monitor_register(&rq_mon_class);
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+    monitor_register(&_rq_profile_monitor);
+#endif
     (void) device;
     return 0;
 }
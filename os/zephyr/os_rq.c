@@ -111,6 +111,24 @@ void _rq_execute_post(struct rq_context *rq) {
         APP_WAKE_LOCK_USER);
 }
 
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+/*
+ * Extend the 32bit hardware cycle counter to 64bit (The counter must be
+ * read at least once per wrap-around period)
+ */
+uint32_t _rq_profile_clock(void) {
+    static uint64_t cycles64;
+    static uint32_t last_cycles;
+    unsigned int key = irq_lock();
+    uint32_t now = k_cycle_get_32();
+
+    cycles64 += now - last_cycles;
+    last_cycles = now;
+    irq_unlock(key);
+    return (uint32_t)k_cyc_to_us_floor64(cycles64);
+}
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
+
 #ifdef USE_RQ_HISTORY
 void _rq_dump_history(void) {
     uint8_t idx = queue_current_head;
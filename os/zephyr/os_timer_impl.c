@@ -24,6 +24,9 @@
 #include "basework/lib/timer/timer_list.h"
 #include "basework/log.h"
 #include "basework/rq.h"
+#ifdef CONFIG_BASEWORK_RQ_POOL
+#include "basework/rq_pool.h"
+#endif
 
 /* Enable timer merge */
 #define CONFIG_TIMER_MERGE
@@ -43,6 +46,7 @@ struct os_timer {
     bool slave;
 #endif
     bool deleted;
+    bool pooled; /* pnode is the handle of timer_pool */
     void *pnode;
 };
 
@@ -57,6 +61,9 @@ static uint32_t boottimer_ticks __rte_section(".ram.noinit");
 static void *timer_executing __rte_section(".ram.noinit");
 static struct os_timer timer_objs[CONFIG_OS_MAX_TIMERS] __rte_section(".ram.noinit");
 static struct os_robj timer_robj;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+static struct rq_pool *timer_pool;
+#endif
 
 static void timer_task_wrapper(void *arg) {
     struct os_timer *timer = arg;
@@ -83,6 +90,15 @@ static void timer_task_wrapper(void *arg) {
 static void __rte_unused timeout_adaptor(os_timer_t timer, void *arg) {
     struct os_timer *p = timer;
     (void)arg;
+#ifdef CONFIG_BASEWORK_RQ_POOL
+    if (timer_pool) {
+        p->pooled = true;
+        rq_pool_submit_ext(timer_pool, timer_task_wrapper, timer, 
+            (uintptr_t)timer, false, &p->pnode);
+        return;
+    }
+    p->pooled = false;
+#endif
     rq_submit_ext_arg(timer_task_wrapper, timer, p->pnode, p->task);
     PR_TRACE(p, "timer submit: %p arg(%p) pnode(%p)\n", timer, arg, p->pnode);
 }
@@ -201,6 +217,11 @@ int __os_timer_del(os_timer_t timer) {
     if (!p->deleted) {
         p->deleted = true;
         if (p->pnode) {
+#ifdef CONFIG_BASEWORK_RQ_POOL
+            if (p->pooled)
+                rq_pool_cancel(timer_pool, p->pnode);
+            else
+#endif
             _rq_node_delete(_system_rq, (struct rq_node *)p->pnode);
             p->pnode = NULL;
         }
@@ -272,6 +293,13 @@ int os_timer_trace(os_timer_t timer, bool enable) {
 }
 #endif
 
+#ifdef CONFIG_BASEWORK_RQ_POOL
+int __os_timer_attach_pool(struct rq_pool *pool) {
+    timer_pool = pool;
+    return 0;
+}
+#endif /* CONFIG_BASEWORK_RQ_POOL */
+
 #ifdef CONFIG_TIMER_MERGE
 static int os_timer_setup(const struct device *dev) {
     pr_dbg("slave timer setup\n");
@@ -156,7 +156,10 @@ static int xipfs_impl_reset(os_filesystem_t fs) {
 
 static void *xipfs_impl_map(os_file_t fd, size_t *size) {
     struct file *fp = (struct file *)fd;
-    uint32_t offset = fxip_ll_map(XIPFS, fp->fp, size);
+    uint32_t offset;
+
+    if (fxip_ll_map(XIPFS, fp->fp, size, &offset))
+        return NULL;
     return (void *)(CONFIG_SPI_XIP_VADDR + offset);
 }
 
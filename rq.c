@@ -21,6 +21,14 @@
 #include "basework/container/list.h"
 #include "basework/malloc.h"
 #include "basework/log.h"
+#if defined(CONFIG_BASEWORK_RQ_LOCKFREE) || defined(CONFIG_BASEWORK_RQ_PROFILE)
+#include "basework/arch/generic/rte_stdatomic.h"
+#endif
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+#include "basework/os/osapi_timer.h"
+#include "basework/lib/printer.h"
+#include "basework/mon.h"
+#endif
 
 struct iter_param {
     int idx;
@@ -38,13 +46,66 @@ do { \
     os_panic(); \
 } while (0)
 
-#define BUFFER_HDR_SIZE(sz) ((sz) + sizeof(struct buffer_hdr))
+#define RQ_NODE_SIZE(rq) \
+    rte_roundup(sizeof(struct rq_node) + (rq)->itemsize, sizeof(void *))
+#define RQ_PAYLOAD(rn) ((void *)((struct rq_node *)(rn) + 1))
 
-struct buffer_hdr {
-    struct rq_context *rq;
-    void (*cb)(void *arg, size_t);
-    size_t len;
-    char data[];
+/*
+ * In lock-free mode the producers never take the critical lock, 
+ * The free node is acquired by CAS and pending node is pushed to 
+ * lock-free stack that only be consumed by rq thread.
+ */
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+#define RQ_LOCK_DECLARE
+#define RQ_LOCK()
+#define RQ_UNLOCK()
+#define RQ_CANCELLED ((void **)1)
+#define RQ_STAT_INC(rq, _field) \
+    rte_atomic_fetch_add_explicit(&(rq)->stats._field, 1, rte_memory_order_relaxed)
+#else
+#define RQ_LOCK_DECLARE os_critical_declare
+#define RQ_LOCK()   os_critical_lock
+#define RQ_UNLOCK() os_critical_unlock
+#define RQ_STAT_INC(rq, _field) (rq)->stats._field++
+#endif
+
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+#define RQ_PROFILE_MASK (CONFIG_BASEWORK_RQ_PROFILE_SLOTS - 1)
+#define RQ_PROFILE_DECLARE uint32_t __ts, __start;
+#define RQ_PROFILE_FETCH(_rn) __ts = (_rn)->ts
+#define RQ_PROFILE_COPY(_dst, _src) (_dst)->ts = (_src)->ts
+#define RQ_PROFILE_START() __start = _rq_profile_clock()
+#define RQ_PROFILE_END(_rq) \
+    rq_profile_update((void *)(_rq)->fn_executing, __ts, __start)
+#define RQ_PROFILE_STAMP(_rq, _rn, _nr) \
+do { \
+    (_rn)->ts = _rq_profile_clock(); \
+    rq_profile_depth(_rq, _nr); \
+} while (0)
+
+_Static_assert((CONFIG_BASEWORK_RQ_PROFILE_SLOTS & RQ_PROFILE_MASK) == 0,
+    "CONFIG_BASEWORK_RQ_PROFILE_SLOTS must be power of 2");
+#else
+#define RQ_PROFILE_DECLARE
+#define RQ_PROFILE_FETCH(_rn)
+#define RQ_PROFILE_COPY(_dst, _src)
+#define RQ_PROFILE_START()
+#define RQ_PROFILE_END(_rq)
+#define RQ_PROFILE_STAMP(_rq, _rn, _nr)
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
+
+#define RQ_LF_URGENT RQ_PRIO_BANDS
+
+enum rq_payload_type {
+    RQ_PAYLOAD_NONE,
+    RQ_PAYLOAD_INLINE,
+    RQ_PAYLOAD_SLAB,
+    RQ_PAYLOAD_HEAP
+};
+
+/* The order of serving priority bands */
+static const uint8_t rq_prio_order[RQ_PRIO_BANDS] = {
+    RQ_PRIO_HIGH, RQ_PRIO_NORMAL, RQ_PRIO_LOW
 };
 
 
@@ -77,39 +138,372 @@ static void _rq_dump_iterator(struct rq_node *n, void *arg) {
 	param->idx++;
 }
 
-static void exec_adaptor_cb(void *arg) {
-    struct buffer_hdr *bh = (struct buffer_hdr *)arg;
-    _rq_set_executing(bh->rq, bh->cb);
-    bh->cb(bh->data, bh->len);
-    pr_dbg("free buffer: %p\n", bh);
-    general_free(bh);
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+static struct rq_profile_record rq_profile_table[CONFIG_BASEWORK_RQ_PROFILE_SLOTS];
+static uint32_t rq_profile_overflow;
+
+uint32_t RTE_WEAKHOOK(_rq_profile_clock, void) {
+    return (uint32_t)os_timer_gettime() * 1000;
 }
 
-void _rq_static_init(struct rq_context *rq) {
-    struct rq_node *p = (struct rq_node *)rq->buffer;
+static inline void rq_profile_max(uint32_t *p, uint32_t v) {
+    uint32_t old = rte_atomic_load_explicit(p, rte_memory_order_relaxed);
+    while (v > old && !rte_atomic_compare_exchange_weak_explicit(p, &old, v,
+        rte_memory_order_relaxed, rte_memory_order_relaxed));
+}
+
+static inline void rq_profile_depth(struct rq_context *rq, uint16_t nr) {
+    uint16_t old = rte_atomic_load_explicit(&rq->nr_max, rte_memory_order_relaxed);
+    while (nr > old && !rte_atomic_compare_exchange_weak_explicit(&rq->nr_max, 
+        &old, nr, rte_memory_order_relaxed, rte_memory_order_relaxed));
+}
+
+/*
+ * Find the record of function (open addressing). The free slot is claimed
+ * with CAS, So the table can be updated by multiple run-queue without lock
+ */
+static struct rq_profile_record *rq_profile_lookup(void *fn) {
+    uint32_t hash = (uint32_t)((uintptr_t)fn >> 2);
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu;
+    hash ^= hash >> 16;
+    for (unsigned int i = 0; i < CONFIG_BASEWORK_RQ_PROFILE_SLOTS; i++) {
+        struct rq_profile_record *rec = 
+            &rq_profile_table[(hash + i) & RQ_PROFILE_MASK];
+        void *key = rte_atomic_load_explicit(&rec->fn, rte_memory_order_acquire);
+
+        if (key == NULL) {
+            if (rte_atomic_compare_exchange_strong_explicit(&rec->fn, &key, fn,
+                rte_memory_order_acq_rel, rte_memory_order_acquire))
+                return rec;
+        }
+        if (key == fn)
+            return rec;
+    }
+
+    rte_atomic_fetch_add_explicit(&rq_profile_overflow, 1, rte_memory_order_relaxed);
+    return NULL;
+}
+
+static void rq_profile_update(void *fn, uint32_t ts, uint32_t start) {
+    uint32_t end = _rq_profile_clock();
+    uint32_t wait = start - ts;
+    uint32_t exec = end - start;
+    struct rq_profile_record *rec;
+    unsigned int bucket;
+
+    rec = rq_profile_lookup(fn);
+    if (rte_unlikely(!rec))
+        return;
+
+    bucket = exec? 32 - __builtin_clz(exec): 0;
+    if (bucket >= RQ_PROFILE_BUCKETS)
+        bucket = RQ_PROFILE_BUCKETS - 1;
+    rte_atomic_fetch_add_explicit(&rec->count, 1, rte_memory_order_relaxed);
+    rte_atomic_fetch_add_explicit(&rec->wait_sum, wait, rte_memory_order_relaxed);
+    rte_atomic_fetch_add_explicit(&rec->exec_sum, exec, rte_memory_order_relaxed);
+    rte_atomic_fetch_add_explicit(&rec->exec_hist[bucket], 1, rte_memory_order_relaxed);
+    rq_profile_max(&rec->wait_max, wait);
+    rq_profile_max(&rec->exec_max, exec);
+}
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
+
+static inline struct rq_node *rq_node_at(struct rq_context *rq, 
+    unsigned int idx) {
+    return (struct rq_node *)((char *)rq->buffer + idx * RQ_NODE_SIZE(rq));
+}
+
+static int rq_slab_class(size_t size) {
+    for (int i = 0; i < RQ_SLAB_CLASSES; i++) {
+        if (size <= (size_t)(RQ_SLAB_MINSIZE << i))
+            return i;
+    }
+    return -1;
+}
+
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+/*
+ * The cached object is taken or put back by exchanging one slot, So the 
+ * producers never see a stale next pointer (ABA) as a lock-free freelist
+ */
+static void *rq_slab_get(struct rq_context *rq, int cls) {
+    void **slots;
+
+    if (rte_unlikely(cls < 0)) {
+        RQ_STAT_INC(rq, heap_copies);
+        return NULL;
+    }
+
+    slots = rq->slab[cls];
+    for (int i = 0; i < CONFIG_BASEWORK_RQ_SLAB_SLOTS; i++) {
+        void *p;
+
+        if (!rte_atomic_load_explicit(&slots[i], rte_memory_order_relaxed))
+            continue;
+        p = rte_atomic_exchange_explicit(&slots[i], NULL, 
+            rte_memory_order_acquire);
+        if (p) {
+            RQ_STAT_INC(rq, slab_copies);
+            return p;
+        }
+    }
+    RQ_STAT_INC(rq, slab_grows);
+    return NULL;
+}
+
+static bool rq_slab_put(struct rq_context *rq, int cls, void *p) {
+    void **slots = rq->slab[cls];
+
+    for (int i = 0; i < CONFIG_BASEWORK_RQ_SLAB_SLOTS; i++) {
+        void *expected = NULL;
+
+        if (rte_atomic_load_explicit(&slots[i], rte_memory_order_relaxed))
+            continue;
+        if (rte_atomic_compare_exchange_strong_explicit(&slots[i], &expected, 
+            p, rte_memory_order_release, rte_memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+#else /* !CONFIG_BASEWORK_RQ_LOCKFREE */
+static void *rq_slab_get(struct rq_context *rq, int cls) {
+    os_critical_declare
+    void *p = NULL;
+
+    os_critical_lock
+    if (rte_unlikely(cls < 0)) {
+        RQ_STAT_INC(rq, heap_copies);
+    } else {
+        p = rq->slab[cls];
+        if (p) {
+            rq->slab[cls] = *(void **)p;
+            RQ_STAT_INC(rq, slab_copies);
+        } else {
+            RQ_STAT_INC(rq, slab_grows);
+        }
+    }
+    os_critical_unlock
+    return p;
+}
+
+static bool rq_slab_put(struct rq_context *rq, int cls, void *p) {
+    os_critical_declare
+
+    os_critical_lock
+    *(void **)p = rq->slab[cls];
+    rq->slab[cls] = p;
+    os_critical_unlock
+    return true;
+}
+#endif /* CONFIG_BASEWORK_RQ_LOCKFREE */
+
+/*
+ * Allocate payload buffer for the data that can not be inlined. The slab 
+ * object is never returned to heap, So the heap is untouched in steady state
+ */
+static void *rq_payload_alloc(struct rq_context *rq, size_t size, 
+    uint8_t *ptype) {
+    int cls = rq_slab_class(size);
+    void *p;
+
+    p = rq_slab_get(rq, cls);
+    if (rte_unlikely(cls < 0)) {
+        *ptype = RQ_PAYLOAD_HEAP;
+        return general_malloc(size);
+    }
+    if (!p) {
+        p = general_malloc(RQ_SLAB_MINSIZE << cls);
+        pr_dbg("allocate slab object(%d bytes): %p\n", RQ_SLAB_MINSIZE << cls, p);
+    }
+    *ptype = RQ_PAYLOAD_SLAB;
+    return p;
+}
 
+static void rq_payload_free(struct rq_context *rq, void *p, 
+    uint8_t ptype, size_t size) {
+    if (ptype == RQ_PAYLOAD_HEAP || !rq_slab_put(rq, rq_slab_class(size), p))
+        general_free(p);
+}
+
+/*
+ * Execute user function (called by rq thread). The copied node is always 
+ * owned by rq thread until it is freed, So the payload is still valid here
+ */
+static inline void rq_node_execute(struct rq_context *rq, struct rq_node *rn,
+    rq_exec_t fn, void *arg, uint8_t ptype, size_t len) {
+    switch (ptype) {
+    case RQ_PAYLOAD_NONE:
+        fn(arg);
+        break;
+    case RQ_PAYLOAD_INLINE:
+        rn->exec_cp(RQ_PAYLOAD(rn), len);
+        break;
+    default:
+        rn->exec_cp(arg, len);
+        rq_payload_free(rq, arg, ptype, len);
+        break;
+    }
+}
+
+void _rq_static_init(struct rq_context *rq) {
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+    for (int i = 0; i <= RQ_PRIO_BANDS; i++) {
+        rq->lf_pending[i] = NULL;
+        rq->lf_batch[i] = NULL;
+    }
+    rq->lf_cursor = 0;
+    rq->lf_idle = 0;
+    rq->nr = 0;
+    os_completion_reinit(&rq->completion);
+    for (int i = 0; i < rq->nq; i++)
+        rq_node_at(rq, i)->inuse = 0;
+#else
     RTE_INIT_LIST(&rq->frees);
-    RTE_INIT_LIST(&rq->pending);
+    for (int i = 0; i < RQ_PRIO_BANDS; i++)
+        RTE_INIT_LIST(&rq->pending[i]);
     os_completion_reinit(&rq->completion);
-    for (int i = 0; i < rq->nq; i++) {
-        rte_list_add_tail(&p->node, &rq->frees);
-        p = (struct rq_node *)((char *)p + sizeof(struct rq_node));
-    }
+    for (int i = 0; i < rq->nq; i++)
+        rte_list_add_tail(&rq_node_at(rq, i)->node, &rq->frees);
+#endif
 }
 
 int _rq_init(struct rq_context *rq, void *buffer, size_t size) {
     if (!rq || !buffer || ((uintptr_t)buffer & 3))
         return -EINVAL;
 
-    if (size < sizeof(struct rq_node))
+    if (size < RQ_NODE_SIZE(rq))
         return -EINVAL;
 
-    rq->nq = (uint16_t)(size / sizeof(struct rq_node));
+    rq->nq = (uint16_t)(size / RQ_NODE_SIZE(rq));
     rq->buffer = buffer;
     _rq_static_init(rq);
     return 0;
 }
 
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+static inline void rq_put_locked(struct rq_context *rq, 
+    struct rq_node *rn) {
+    (void) rq;
+    rte_atomic_store_explicit(&rn->inuse, 0, rte_memory_order_release);
+}
+
+static bool rq_claim_node(struct rq_node *rn) {
+    uint8_t expected = 0;
+    if (rte_atomic_load_explicit(&rn->inuse, rte_memory_order_relaxed))
+        return false;
+    return rte_atomic_compare_exchange_strong_explicit(&rn->inuse, &expected, 1,
+        rte_memory_order_acquire, rte_memory_order_relaxed);
+}
+
+/*
+ * Allocate a free node from node pool. The search start position is 
+ * rotated, So that the node is usually found by first probe
+ */
+static struct rq_node *rq_get_free_locked(struct rq_context *rq) {
+    unsigned int start = rte_atomic_fetch_add_explicit(&rq->lf_cursor, 1, 
+        rte_memory_order_relaxed);
+    for (unsigned int i = 0; i < rq->nq; i++) {
+        struct rq_node *rn = rq_node_at(rq, (start + i) % rq->nq);
+        if (rq_claim_node(rn))
+            return rn;
+    }
+    return NULL;
+}
+
+static void rq_add_node_locked(struct rq_context *rq, struct rq_node *rn, 
+    bool prepend) {
+    struct rte_list **head = &rq->lf_pending[prepend? RQ_LF_URGENT: rn->prio];
+    struct rte_list *first;
+    uint16_t __rte_unused nr;
+
+    nr = rte_atomic_fetch_add_explicit(&rq->nr, 1, rte_memory_order_relaxed);
+    RQ_PROFILE_STAMP(rq, rn, nr + 1);
+    first = rte_atomic_load_explicit(head, rte_memory_order_relaxed);
+    do {
+        rn->node.next = first;
+    } while (!rte_atomic_compare_exchange_weak_explicit(head, &first, &rn->node,
+        rte_memory_order_seq_cst, rte_memory_order_relaxed));
+
+    /* We will wake up the schedule queue if it is waiting for work */
+    if (rte_atomic_load_explicit(&rq->lf_idle, rte_memory_order_seq_cst) &&
+        rte_atomic_exchange_explicit(&rq->lf_idle, 0, rte_memory_order_seq_cst))
+        os_completed(&rq->completion);
+}
+
+/*
+ * Get the next pending node (This can only be called by rq thread). 
+ * The urgent stack is checked before every node so that urgent work 
+ * is executed as soon as possible (LIFO order, same as prepend). The 
+ * normal stack is taken as a batch and reversed to FIFO order.
+ */
+static inline struct rq_node *rq_pop_batch(struct rte_list **batch) {
+    struct rte_list *p = *batch;
+
+    *batch = p->next;
+    p->next = NULL;
+    return rte_container_of(p, struct rq_node, node);
+}
+
+/*
+ * Get the next node to execute. The urgent stack is checked before every 
+ * node and the stack of per-band is taken only when its batch is empty, 
+ * So the work of higher band can overtake the batch of lower band
+ */
+static struct rq_node *rq_get_pending(struct rq_context *rq) {
+    struct rte_list *p, *next, *prev;
+
+    if (rte_atomic_load_explicit(&rq->lf_pending[RQ_LF_URGENT], 
+        rte_memory_order_relaxed)) {
+        p = rte_atomic_exchange_explicit(&rq->lf_pending[RQ_LF_URGENT], NULL, 
+            rte_memory_order_acquire);
+        for (prev = p; prev->next; prev = prev->next);
+        prev->next = rq->lf_batch[RQ_LF_URGENT];
+        rq->lf_batch[RQ_LF_URGENT] = p;
+        RQ_STAT_INC(rq, batches);
+    }
+    if (rq->lf_batch[RQ_LF_URGENT])
+        return rq_pop_batch(&rq->lf_batch[RQ_LF_URGENT]);
+
+    for (int i = 0; i < RQ_PRIO_BANDS; i++) {
+        struct rte_list **batch = &rq->lf_batch[rq_prio_order[i]];
+        struct rte_list **stack = &rq->lf_pending[rq_prio_order[i]];
+
+        if (!*batch && rte_atomic_load_explicit(stack, rte_memory_order_relaxed)) {
+            p = rte_atomic_exchange_explicit(stack, NULL, rte_memory_order_acquire);
+            for (prev = NULL; p; p = next) {
+                next = p->next;
+                p->next = prev;
+                prev = p;
+            }
+            *batch = prev;
+            RQ_STAT_INC(rq, batches);
+        }
+        if (*batch)
+            return rq_pop_batch(batch);
+    }
+    return NULL;
+}
+
+static bool rq_has_pending(struct rq_context *rq) {
+    for (int i = 0; i <= RQ_PRIO_BANDS; i++) {
+        if (rte_atomic_load_explicit(&rq->lf_pending[i], rte_memory_order_seq_cst))
+            return true;
+    }
+    return false;
+}
+
+static void rq_wait_for_work(struct rq_context *rq) {
+    rte_atomic_store_explicit(&rq->lf_idle, 1, rte_memory_order_seq_cst);
+    if (rq_has_pending(rq)) {
+        rte_atomic_store_explicit(&rq->lf_idle, 0, rte_memory_order_relaxed);
+        return;
+    }
+    os_completion_wait(&rq->completion);
+}
+
+#else /* !CONFIG_BASEWORK_RQ_LOCKFREE */
 static inline void rq_put_locked(struct rq_context *rq, 
     struct rq_node *rn) {
     rte_list_add(&rn->node, &rq->frees);
@@ -124,6 +518,10 @@ static struct rq_node *rq_get_first_locked(struct rte_list *head) {
     return NULL;
 }
 
+static inline struct rq_node *rq_get_free_locked(struct rq_context *rq) {
+    return rq_get_first_locked(&rq->frees);
+}
+
 static void rq_add_node_locked(struct rq_context *rq, struct rq_node *rn, 
     bool prepend) {
     int need_wakeup;
@@ -131,16 +529,18 @@ static void rq_add_node_locked(struct rq_context *rq, struct rq_node *rn,
      * When the pending list is empty that the run-queue is sleep,
      * So we need to wake up it at later.
      */
-    need_wakeup = rte_list_empty(&rq->pending);
+    need_wakeup = !rq->nr;
     if (prepend)
-        rte_list_add(&rn->node, &rq->pending);
+        rte_list_add(&rn->node, &rq->pending[RQ_PRIO_HIGH]);
     else
-        rte_list_add_tail(&rn->node, &rq->pending);
+        rte_list_add_tail(&rn->node, &rq->pending[rn->prio]);
     rq->nr++;
+    RQ_PROFILE_STAMP(rq, rn, rq->nr);
     /* We will wake up the schedule queue if necessary */
     if (need_wakeup)
         os_completed(&rq->completion);
 } 
+#endif /* CONFIG_BASEWORK_RQ_LOCKFREE */
 
 #ifdef USE_RQ_DEBUG
 int _rq_submit_with_copy(struct rq_context *rq, void (*exec)(void *, size_t), 
@@ -151,35 +551,45 @@ int _rq_submit_with_copy(struct rq_context *rq, void (*exec)(void *, size_t),
 #endif
     assert(rq != NULL);
     assert(exec != NULL);
-    os_critical_declare
-    struct buffer_hdr *bh;
+    RQ_LOCK_DECLARE
+    void *buf = NULL;
+    uint8_t ptype = RQ_PAYLOAD_INLINE;
     struct rq_node *rn;
 
-    pr_dbg("allocate %d bytes\n", BUFFER_HDR_SIZE(size));
-    bh = general_malloc(BUFFER_HDR_SIZE(size));
-    if (rte_unlikely(!bh)) {
-        RQ_PANIC(rq, "*** no more memory! ***");
-        return -ENOMEM;
+    if (rte_unlikely(size > UINT16_MAX))
+        return -EINVAL;
+
+    /* The payload is too large to be inlined */
+    if (size > rq->itemsize) {
+        buf = rq_payload_alloc(rq, size, &ptype);
+        if (rte_unlikely(!buf)) {
+            RQ_PANIC(rq, "*** no more memory! ***");
+            return -ENOMEM;
+        }
+        memcpy(buf, data, size);
     }
-    pr_dbg("allocated buffer: %p\n", bh);
-    memcpy(bh->data, data, size);
-    bh->rq = rq;
-    bh->cb = exec;
-    bh->len = size;
 
-    os_critical_lock
+    RQ_LOCK();
 
     /* Allocate a new rq-node from free list */
-    rn = rq_get_first_locked(&rq->frees);
+    rn = rq_get_free_locked(rq);
     if (rte_unlikely(!rn)) {
-        os_critical_unlock
-        general_free(bh);
+        RQ_UNLOCK();
+        if (buf)
+            rq_payload_free(rq, buf, ptype, size);
         RQ_PANIC(rq, "*** rq-scheduler queue is full! ***");
         return -EBUSY;
     }
 
-    rn->exec = exec_adaptor_cb;
-    rn->arg = bh;
+    if (!buf) {
+        memcpy(RQ_PAYLOAD(rn), data, size);
+        RQ_STAT_INC(rq, inline_copies);
+    }
+    rn->exec_cp = exec;
+    rn->arg = buf;
+    rn->ptype = ptype;
+    rn->prio = RQ_PRIO_NORMAL;
+    rn->len = (uint16_t)size;
     rn->refp = NULL;
     rn->dofree = true;
 #ifdef USE_RQ_DEBUG
@@ -187,7 +597,7 @@ int _rq_submit_with_copy(struct rq_context *rq, void (*exec)(void *, size_t),
 #endif
 
     rq_add_node_locked(rq, rn, prepend); 
-    os_critical_unlock
+    RQ_UNLOCK();
     return 0;
 }
 
@@ -195,55 +605,81 @@ int _rq_submit_entry(struct rq_context *rq, struct rq_node *rn,
     bool prepend) {
     assert(rq != NULL);
     assert(rn != NULL);
-    os_critical_declare
+    RQ_LOCK_DECLARE
 
-    os_critical_lock
+    if (rte_unlikely(rn->prio >= RQ_PRIO_BANDS))
+        return -EINVAL;
+
+    RQ_LOCK();
     if (!rn->exec) {
-        os_critical_unlock
+        RQ_UNLOCK();
         return -EINVAL;
     }
+    rn->dofree = false;
+    rn->ptype = RQ_PAYLOAD_NONE;
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+    if (rq_claim_node(rn))
+        rq_add_node_locked(rq, rn, prepend);
+#else
     if (rn->node.next == NULL)
         rq_add_node_locked(rq, rn, prepend);
-    rn->dofree = false;
-    os_critical_unlock
+#endif
+    RQ_UNLOCK();
     return 0;
 }
 
 #ifdef USE_RQ_DEBUG
-int _rq_submit(struct rq_context *rq, void (*exec)(void *), void *arg, 
-    bool prepend, const void *pfn) {
+int _rq_submit_prio(struct rq_context *rq, void (*exec)(void *), void *arg, 
+    int prio, bool prepend, const void *pfn) {
 #else
-int _rq_submit(struct rq_context *rq, void (*exec)(void *), void *arg, 
-    bool prepend) {
+int _rq_submit_prio(struct rq_context *rq, void (*exec)(void *), void *arg, 
+    int prio, bool prepend) {
 #endif
     assert(rq != NULL);
     assert(exec != NULL);
-    os_critical_declare
+    RQ_LOCK_DECLARE
     struct rq_node *rn;
 
-    os_critical_lock
+    if (rte_unlikely((unsigned int)prio >= RQ_PRIO_BANDS))
+        return -EINVAL;
+
+    RQ_LOCK();
 
     /* Allocate a new rq-node from free list */
-    rn = rq_get_first_locked(&rq->frees);
+    rn = rq_get_free_locked(rq);
     if (!rn) {
-        os_critical_unlock
+        RQ_UNLOCK();
         RQ_PANIC(rq, "*** rq-scheduler queue is full! ***");
         return -EBUSY;
     }
 
     rn->exec = exec;
     rn->arg = arg;
+    rn->ptype = RQ_PAYLOAD_NONE;
+    rn->prio = (uint8_t)prio;
     rn->refp = NULL;
     rn->dofree = true;
 #ifdef USE_RQ_DEBUG
 	rn->pfn = pfn;
 #endif
     rq_add_node_locked(rq, rn, prepend); 
-    os_critical_unlock
+    RQ_UNLOCK();
 
     return 0;
 }
 
+#ifdef USE_RQ_DEBUG
+int _rq_submit(struct rq_context *rq, void (*exec)(void *), void *arg, 
+    bool prepend, const void *pfn) {
+    return _rq_submit_prio(rq, exec, arg, RQ_PRIO_NORMAL, prepend, pfn);
+}
+#else
+int _rq_submit(struct rq_context *rq, void (*exec)(void *), void *arg, 
+    bool prepend) {
+    return _rq_submit_prio(rq, exec, arg, RQ_PRIO_NORMAL, prepend);
+}
+#endif
+
 #ifdef USE_RQ_DEBUG
 int _rq_submit_ext(struct rq_context *rq, void (*exec)(void *), void *arg, 
     bool prepend, void **pnode, const void *pfn) {
@@ -255,21 +691,23 @@ int _rq_submit_ext(struct rq_context *rq, void (*exec)(void *), void *arg,
     assert(rq != NULL);
     assert(exec != NULL);
     assert(pnode != NULL);
-    os_critical_declare
+    RQ_LOCK_DECLARE
     struct rq_node *rn;
 
-    os_critical_lock
+    RQ_LOCK();
 
     /* Allocate a new rq-node from free list */
-    rn = rq_get_first_locked(&rq->frees);
+    rn = rq_get_free_locked(rq);
     if (!rn) {
-        os_critical_unlock
+        RQ_UNLOCK();
         RQ_PANIC(rq, "*** rq-scheduler queue is full! ***");
         return -EBUSY;
     }
 
     rn->exec = exec;
     rn->arg = arg;
+    rn->ptype = RQ_PAYLOAD_NONE;
+    rn->prio = RQ_PRIO_NORMAL;
 #ifdef USE_RQ_DEBUG
 	rn->pfn = pfn;
 #endif
@@ -277,11 +715,84 @@ int _rq_submit_ext(struct rq_context *rq, void (*exec)(void *), void *arg,
     rn->refp = pnode;
     *pnode = rn;
     rq_add_node_locked(rq, rn, prepend);
-    os_critical_unlock
+    RQ_UNLOCK();
 
     return 0;
 }
 
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+void _rq_node_delete(struct rq_context *rq, struct rq_node *pnode) {
+    void **refp;
+
+    /*
+     * The node can not be removed from lock-free stack, So we just mark 
+     * it as cancelled and the rq thread will release it.
+     */
+    (void) rq;
+    refp = rte_atomic_load_explicit(&pnode->refp, rte_memory_order_acquire);
+    if (refp && refp != RQ_CANCELLED &&
+        rte_atomic_compare_exchange_strong_explicit(&pnode->refp, &refp, 
+            RQ_CANCELLED, rte_memory_order_acq_rel, rte_memory_order_relaxed))
+        *refp = NULL;
+    pr_dbg("_rq_node_delete: %p caller(%p)\n", pnode, __builtin_return_address(0));
+}
+
+void _rq_schedule(struct rq_context *rq) {
+    struct rq_node *rn;
+    rq_exec_t fn;
+    void **refp;
+    void *arg;
+    bool dofree;
+    uint8_t ptype;
+    size_t len;
+    RQ_PROFILE_DECLARE
+
+    for ( ; ; ) {
+        rn = rq_get_pending(rq);
+        if (rte_unlikely(!rn)) {
+            /*
+             * Now, The queue is empty and we have no more work to do, So we
+             * trigger task schedule and switch to other task.
+             */
+            rq_wait_for_work(rq);
+            continue;
+        }
+        rte_atomic_fetch_sub_explicit(&rq->nr, 1, rte_memory_order_relaxed);
+        refp = rte_atomic_exchange_explicit(&rn->refp, NULL,
+            rte_memory_order_acq_rel);
+        if (rte_unlikely(refp == RQ_CANCELLED)) {
+            rq_put_locked(rq, rn);
+            continue;
+        }
+        if (refp)
+            *refp = NULL;
+        fn = rn->exec;
+        arg = rn->arg;
+        dofree = rn->dofree;
+        ptype = rn->ptype;
+        len = rn->len;
+        RQ_PROFILE_FETCH(rn);
+
+        /* The static node can be submitted again from now on */
+        if (!dofree)
+            rq_put_locked(rq, rn);
+
+        /* Executing user function */
+        _rq_set_executing(rq, fn);
+        _rq_execute_prepare(rq);
+        RQ_PROFILE_START();
+        rq_node_execute(rq, rn, fn, arg, ptype, len);
+        RQ_PROFILE_END(rq);
+        _rq_execute_post(rq);
+        _rq_set_executing(rq, NULL);
+        RQ_STAT_INC(rq, executed);
+
+        /* Free rn-node to node pool */
+        if (rte_likely(dofree))
+            rq_put_locked(rq, rn);
+    }
+}
+#else /* !CONFIG_BASEWORK_RQ_LOCKFREE */
 void _rq_node_delete(struct rq_context *rq, struct rq_node *pnode) {
     os_critical_declare
 
@@ -289,27 +800,113 @@ void _rq_node_delete(struct rq_context *rq, struct rq_node *pnode) {
     if (pnode->refp) {
         *pnode->refp = NULL;
         pnode->refp = NULL;
-        rq->nr--;
-        rte_list_del(&pnode->node);
-        rq_put_locked(rq, pnode);
+
+        /*
+         * The node that has been taken by dispatcher (node.next is NULL) is
+         * dropped before it runs
+         */
+        if (pnode->node.next != NULL) {
+            rq->nr--;
+            rte_list_del(&pnode->node);
+            rq_put_locked(rq, pnode);
+        }
     }
     os_critical_unlock
     pr_dbg("_rq_node_delete: %p caller(%p)\n", pnode, __builtin_return_address(0));
 }
 
-void _rq_schedule(struct rq_context *rq) {
-    os_critical_declare
+struct rq_batch_item {
     struct rq_node *rn;
     rq_exec_t fn;
     void *arg;
+    void **refp;
     bool dofree;
+    uint8_t ptype;
+    uint16_t len;
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+    uint32_t ts;
+#endif
+};
+
+/*
+ * Take nodes (CONFIG_BASEWORK_RQ_BATCH at most) from the highest non-empty 
+ * band. The node can still be canceled until it runs (rq_claim_batch_item)
+ */
+static int rq_take_batch_locked(struct rq_context *rq, 
+    struct rq_batch_item *batch) {
+    struct rte_list *head = NULL;
+    struct rq_node *rn;
+    int n = 0;
+
+    for (int i = 0; i < RQ_PRIO_BANDS; i++) {
+        if (!rte_list_empty(&rq->pending[rq_prio_order[i]])) {
+            head = &rq->pending[rq_prio_order[i]];
+            break;
+        }
+    }
+    if (!head)
+        return 0;
+
+    while (n < CONFIG_BASEWORK_RQ_BATCH && 
+        (rn = rq_get_first_locked(head)) != NULL) {
+        struct rq_batch_item *item = &batch[n++];
+
+        item->rn = rn;
+        item->fn = rn->exec;
+        item->arg = rn->arg;
+        item->refp = rn->refp;
+        item->dofree = rn->dofree;
+        item->ptype = rn->ptype;
+        item->len = rn->len;
+        RQ_PROFILE_COPY(item, rn);
+    }
+    rq->nr -= n;
+    rq->stats.batches++;
+    rq->stats.executed += n;
+    return n;
+}
+
+/*
+ * Detach the node from its owner before it runs, Return false if the node 
+ * has been canceled after it was taken. The lock is only needed for the 
+ * node that has owner (submitted by _rq_submit_ext)
+ */
+static bool rq_claim_batch_item(struct rq_batch_item *item) {
+    os_critical_declare
+    struct rq_node *rn = item->rn;
+    bool claimed;
+
+    if (!item->refp)
+        return true;
+
+    os_critical_lock
+    claimed = rn->refp != NULL;
+    if (claimed) {
+        *rn->refp = NULL;
+        rn->refp = NULL;
+    }
+    os_critical_unlock
+    return claimed;
+}
+
+void _rq_schedule(struct rq_context *rq) {
+    os_critical_declare
+    struct rq_batch_item batch[CONFIG_BASEWORK_RQ_BATCH];
+    int n = 0;
+    RQ_PROFILE_DECLARE
 
     os_critical_lock
 
     for ( ; ; ) {
-        /* Get the first rq-node from pending list */
-        rn = rq_get_first_locked(&rq->pending);
-        if (rte_unlikely(!rn)) {
+        /* Free the rn-nodes of last batch to free list */
+        for (int i = 0; i < n; i++) {
+            if (rte_likely(batch[i].dofree))
+                rq_put_locked(rq, batch[i].rn);
+        }
+
+        /* Take a batch of rq-nodes from pending list */
+        n = rq_take_batch_locked(rq, batch);
+        if (rte_unlikely(!n)) {
             os_critical_unlock
             /*
              * Now, The queue is empty and we have no more work to do, So we
@@ -319,31 +916,31 @@ void _rq_schedule(struct rq_context *rq) {
             os_critical_lock
             continue;
         }
-        rq->nr--;
-        if (rn->refp) {
-            *rn->refp = NULL;
-            rn->refp = NULL;
-        }
-        fn = rn->exec;
-        arg = rn->arg;
-        dofree = rn->dofree;
         os_critical_unlock
 
-        /* Executing user function */
-        _rq_set_executing(rq, fn);
-        _rq_execute_prepare(rq);
-        fn(arg);
-        _rq_execute_post(rq);
-        _rq_set_executing(rq, NULL);
+        for (int i = 0; i < n; i++) {
+            struct rq_batch_item *item = &batch[i];
+
+            if (rte_unlikely(!rq_claim_batch_item(item)))
+                continue;
+
+            /* Executing user function */
+            _rq_set_executing(rq, item->fn);
+            _rq_execute_prepare(rq);
+            RQ_PROFILE_FETCH(item);
+            RQ_PROFILE_START();
+            rq_node_execute(rq, item->rn, item->fn, item->arg, item->ptype, 
+                item->len);
+            RQ_PROFILE_END(rq);
+            _rq_execute_post(rq);
+            _rq_set_executing(rq, NULL);
+        }
 
         os_critical_lock
-   
-        /* Free rn-node to free list */
-        if (rte_likely(dofree))
-            rq_put_locked(rq, rn);
     }
     os_critical_unlock
 }
+#endif /* CONFIG_BASEWORK_RQ_LOCKFREE */
 
 /*
  * The service thread of run-queue
@@ -378,38 +975,165 @@ int _rq_change_prio(struct rq_context *rq, int prio) {
     return os_thread_change_prio(&rq->thread, prio, NULL);
 }
 
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+/*
+ * The pending stacks can not be detached without disturbing the rq thread,
+ * So this is just a best-effort walk (for debug only)
+ */
+void __rte_notrace _rq_visitor(struct rq_context *rq, 
+	void (*iterator)(struct rq_node *n, void *arg), void *arg) {
+	struct rte_list *heads[(RQ_PRIO_BANDS + 1) * 2], *p;
+	unsigned int n;
+
+	if (!rq || !iterator)
+		return;
+
+	for (int i = 0; i <= RQ_PRIO_BANDS; i++) {
+		int idx = i? rq_prio_order[i - 1]: RQ_LF_URGENT;
+		heads[i * 2] = rq->lf_batch[idx];
+		heads[i * 2 + 1] = rte_atomic_load_explicit(&rq->lf_pending[idx], 
+			rte_memory_order_acquire);
+	}
+	for (int i = 0; i < (int)rte_array_size(heads); i++) {
+		for (p = heads[i], n = 0; p && n < rq->nq; p = p->next, n++)
+			iterator(rte_container_of(p, struct rq_node, node), arg);
+	}
+}
+
+#else /* !CONFIG_BASEWORK_RQ_LOCKFREE */
 void __rte_notrace _rq_visitor(struct rq_context *rq, 
 	void (*iterator)(struct rq_node *n, void *arg), void *arg) {
 	os_critical_declare
-	struct rte_list head, *p;
+	struct rte_list head[RQ_PRIO_BANDS], *p;
+	bool wakeup = false;
 
 	if (!rq || !iterator)
 		return;
 
-	RTE_INIT_LIST(&head);
 	os_critical_lock
-	if (rte_list_empty(&rq->pending)) {
+	if (!rq->nr) {
 		os_critical_unlock
 		return;
 	}
-	rte_list_splice_tail_init(&rq->pending, &head);
+	for (int i = 0; i < RQ_PRIO_BANDS; i++) {
+		RTE_INIT_LIST(&head[i]);
+		rte_list_splice_tail_init(&rq->pending[rq_prio_order[i]], &head[i]);
+	}
 	os_critical_unlock
 	
-	rte_list_foreach(p, &head) {
-		struct rq_node *rn = rte_container_of(p, struct rq_node, node);
-		iterator(rn, arg);
+	for (int i = 0; i < RQ_PRIO_BANDS; i++) {
+		rte_list_foreach(p, &head[i]) {
+			struct rq_node *rn = rte_container_of(p, struct rq_node, node);
+			iterator(rn, arg);
+		}
 	}
 
 	os_critical_lock
-	bool wakeup = rte_list_empty(&rq->pending);
-	rte_list_splice(&head, &rq->pending);
+	for (int i = 0; i < RQ_PRIO_BANDS; i++) {
+		struct rte_list *pending = &rq->pending[rq_prio_order[i]];
+		if (!rte_list_empty(&head[i])) {
+			wakeup |= rte_list_empty(pending);
+			rte_list_splice(&head[i], pending);
+		}
+	}
 	os_critical_unlock
 	if (wakeup)
 		os_completed(&rq->completion);
 }
+#endif /* CONFIG_BASEWORK_RQ_LOCKFREE */
+
+void _rq_get_stats(struct rq_context *rq, struct rq_stats *stats) {
+    os_critical_declare
+
+    if (rq && stats) {
+        os_critical_lock
+        *stats = rq->stats;
+        os_critical_unlock
+    }
+}
 
 void __rte_notrace _rq_dump(struct rq_context *rq) {
     struct iter_param __param = {0};
     pr_err("rq_executing(%p)\n", rq->fn_executing);
     _rq_visitor(rq, _rq_dump_iterator, &__param);
 }
+
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+size_t _rq_profile_snapshot(struct rq_profile_record *buf, size_t n) {
+    size_t count = 0;
+
+    if (!buf)
+        return 0;
+    for (unsigned int i = 0; i < CONFIG_BASEWORK_RQ_PROFILE_SLOTS && count < n; i++) {
+        struct rq_profile_record *rec = &rq_profile_table[i];
+        if (rte_atomic_load_explicit(&rec->fn, rte_memory_order_acquire))
+            buf[count++] = *rec;
+    }
+    return count;
+}
+
+/*
+ * This is not synchronized with run-queue thread, So the records that are
+ * updating may be lost
+ */
+void _rq_profile_reset(struct rq_context *rq) {
+    memset(rq_profile_table, 0, sizeof(rq_profile_table));
+    rq_profile_overflow = 0;
+    if (rq)
+        rq->nr_max = 0;
+}
+
+void _rq_profile_dump(struct rq_context *rq, struct printer *printer) {
+    if (!rq || !printer)
+        return;
+
+    pr_vout(printer, 
+        "rq(%p): queued(%d) max(%d) overflow(%u)\n"
+        "   function      count   wait-avg   wait-max   exec-avg   exec-max (us)\n", 
+        rq, rq->nr, rq->nr_max, rq_profile_overflow);
+    for (unsigned int i = 0; i < CONFIG_BASEWORK_RQ_PROFILE_SLOTS; i++) {
+        struct rq_profile_record rec = rq_profile_table[i];
+
+        if (!rec.fn || !rec.count)
+            continue;
+        pr_vout(printer, "<%p> %8u %10u %10u %10u %10u\n  hist:", 
+            rec.fn, rec.count, rec.wait_sum / rec.count, rec.wait_max,
+            rec.exec_sum / rec.count, rec.exec_max);
+        for (int n = 0; n < RQ_PROFILE_BUCKETS; n++) {
+            if (rec.exec_hist[n])
+                pr_vout(printer, " <%uus:%u", 1u << n, rec.exec_hist[n]);
+        }
+        pr_vout(printer, "\n");
+    }
+}
+
+static void rq_profile_show(void *obj, mon_show_t show, void *arg) {
+    struct rq_context *rq = _system_rq;
+    struct rq_profile_record *top = NULL;
+
+    (void) arg;
+    if (!rq)
+        return;
+    for (unsigned int i = 0; i < CONFIG_BASEWORK_RQ_PROFILE_SLOTS; i++) {
+        struct rq_profile_record *rec = &rq_profile_table[i];
+        if (rec->fn && (!top || rec->exec_max > top->exec_max))
+            top = rec;
+    }
+    if (top)
+        show(obj, "rq: max(%d) top<%p> %uus", rq->nr_max, top->fn, top->exec_max);
+    else
+        show(obj, "rq: max(%d)", rq->nr_max);
+}
+
+static void rq_profile_cmd(int code) {
+    if (code == IMON_CLICK_EVT)
+        _rq_profile_reset(_system_rq);
+}
+
+const struct imon_class _rq_profile_monitor = {
+    .show = rq_profile_show,
+    .cmd = rq_profile_cmd,
+    .arg = NULL,
+    .period = 1000
+};
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
@@ -15,20 +15,110 @@ extern "C"{
 
 typedef void (*rq_exec_t)(void *);
 
+/*
+ * The payload of _rq_submit_with_copy() that is larger than inline area 
+ * will be allocated from per-rq slab (RQ_SLAB_CLASSES classes, the size 
+ * of class n is RQ_SLAB_MINSIZE << n)
+ */
+#define RQ_SLAB_CLASSES 4
+#define RQ_SLAB_MINSIZE 64
+
+/*
+ * In lock-free mode the slab of per-class is a fixed array of cached 
+ * objects, The object that can not be cached is returned to heap
+ */
+#ifndef CONFIG_BASEWORK_RQ_SLAB_SLOTS
+#define CONFIG_BASEWORK_RQ_SLAB_SLOTS 8
+#endif
+
+/*
+ * Priority bands of run-queue. The bands are served in the order of
+ * HIGH -> NORMAL -> LOW (The zero-initialized node is NORMAL)
+ */
+#define RQ_PRIO_NORMAL 0
+#define RQ_PRIO_HIGH   1
+#define RQ_PRIO_LOW    2
+#define RQ_PRIO_BANDS  3
+
+/*
+ * The maximum number of nodes that dispatcher takes with one lock
+ */
+#ifndef CONFIG_BASEWORK_RQ_BATCH
+#define CONFIG_BASEWORK_RQ_BATCH 8
+#endif
+
+#ifndef CONFIG_BASEWORK_RQ_INLINE_SIZE
+#define CONFIG_BASEWORK_RQ_INLINE_SIZE 32
+#endif
+
+struct rq_stats {
+    uint32_t inline_copies; /* Payload copied to rq node */
+    uint32_t slab_copies;   /* Payload copied to slab object */
+    uint32_t slab_grows;    /* Slab object that allocated from heap */
+    uint32_t heap_copies;   /* Payload is too large and allocated from heap */
+    uint32_t batches;       /* The number of batches that dispatcher taken */
+    uint32_t executed;      /* The number of nodes that dispatcher executed */
+};
+
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+#ifndef CONFIG_BASEWORK_RQ_PROFILE_SLOTS
+#define CONFIG_BASEWORK_RQ_PROFILE_SLOTS 32
+#endif
+#define RQ_PROFILE_BUCKETS 16
+
+/*
+ * Profile record of per-function (The time is based on microseconds)
+ */
+struct rq_profile_record {
+    void *fn;
+    uint32_t count;
+    uint32_t wait_sum; /* Queue-wait time (from submit to start) */
+    uint32_t wait_max;
+    uint32_t exec_sum; /* Execution time */
+    uint32_t exec_max;
+    uint32_t exec_hist[RQ_PROFILE_BUCKETS]; /* [n]: 2^(n-1) <= time < 2^n */
+};
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
+
 struct rq_context {
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+    /*
+     * Lock-free pending stacks (one for per-band and the last one is urgent).
+     * The producers push node with CAS and the rq thread takes the whole 
+     * stack at once
+     */
+    struct rte_list *lf_pending[RQ_PRIO_BANDS + 1];
+    struct rte_list *lf_batch[RQ_PRIO_BANDS + 1]; /* Owned by rq thread */
+    uint16_t lf_cursor;        /* Free node search hint */
+    uint16_t lf_idle;          /* rq thread is waiting for work */
+#else
     struct rte_list frees;   /* Free list */
-    struct rte_list pending; /* Pending list */
+    struct rte_list pending[RQ_PRIO_BANDS]; /* Pending list of per-band */
+#endif
     os_completion_declare(completion)
     void *buffer;
     rq_exec_t fn_executing;
     uint16_t nq;
     uint16_t nr; /* queued count */
+    uint16_t itemsize; /* The size of inline payload for per-node */
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+    void *slab[RQ_SLAB_CLASSES][CONFIG_BASEWORK_RQ_SLAB_SLOTS];
+#else
+    void *slab[RQ_SLAB_CLASSES];
+#endif
+    struct rq_stats stats;
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+    uint16_t nr_max; /* The high-water mark of queued count */
+#endif
     os_thread_t thread;
 };
 
 struct rq_node {
     struct rte_list node;
-    rq_exec_t exec; /* User function */
+    union {
+        rq_exec_t exec; /* User function */
+        void (*exec_cp)(void *, size_t);
+    };
     void *arg;
     void **refp;
 #ifdef USE_RQ_DEBUG
@@ -38,13 +128,23 @@ struct rq_node {
 	};
 #endif
     bool dofree;
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+    uint8_t inuse;
+#endif
+    uint8_t ptype; /* Payload type */
+    uint8_t prio;  /* Priority band (RQ_PRIO_XXX) */
+    uint16_t len;  /* Payload length */
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+    uint32_t ts;   /* Submit timestamp */
+#endif
 };
 
 #define RQ_BUFFER_SIZE(_nitem, _itemsize) \
-    ((_nitem) * rte_roundup(sizeof(struct rq_node) + (_itemsize), 4))
+    ((_nitem) * rte_roundup(sizeof(struct rq_node) + (_itemsize), sizeof(void *)))
 
 #define RQ_BUFFER_DEFINE(_name, _nitem, _attr) \
-    char _name[RQ_BUFFER_SIZE(_nitem, sizeof(struct rq_node))] __rte_aligned(4) _attr; \
+    char _name[RQ_BUFFER_SIZE(_nitem, CONFIG_BASEWORK_RQ_INLINE_SIZE)] \
+        __rte_aligned(sizeof(void *)) _attr; \
 
 #define RQ_NODE_DEFINE(_name, _fn, _arg) \
     struct rq_node _name = {\
@@ -65,6 +165,7 @@ struct rq_node {
     struct rq_context _name __rte_used _attr = {    \
         .buffer = _name ## _buffer,   \
         .nq = _nitem,  \
+        .itemsize = CONFIG_BASEWORK_RQ_INLINE_SIZE, \
     }
 
 extern struct rq_context *_system_rq;
@@ -78,6 +179,7 @@ void _rq_static_init(struct rq_context *rq);
 
 /*
  * _rq_init - Initialze run-queue context that defined by user
+ * (The inline payload size of per-node is specified by rq->itemsize)
  *
  * @rq: Run-queue context
  * @buffer: Queue buffer
@@ -121,6 +223,24 @@ int _rq_submit(struct rq_context *rq, void (*exec)(void *), void *arg,
 	bool prepend);
 #endif
 
+/*
+ * _rq_submit_prio - Submit a user-work to run-queue with priority band
+ *
+ * @rq: Run-queue context
+ * @exec: user function
+ * @data: user parameter
+ * @prio: priority band (RQ_PRIO_HIGH, RQ_PRIO_NORMAL or RQ_PRIO_LOW)
+ * @prepend: urgent call (executed before all bands)
+ * return 0 if success
+ */
+#ifdef USE_RQ_DEBUG
+int _rq_submit_prio(struct rq_context *rq, void (*exec)(void *), void *arg, 
+	int prio, bool prepend, const void *pfn);
+#else
+int _rq_submit_prio(struct rq_context *rq, void (*exec)(void *), void *arg, 
+	int prio, bool prepend);
+#endif
+
 /*
  * _rq_submit_ext - Submit a user-work to run-queue
  *
@@ -211,6 +331,55 @@ void _rq_visitor(struct rq_context *rq,
  */
 void _rq_dump(struct rq_context *rq);
 
+/*
+ * _rq_get_stats - Get the payload allocation statistics of run-queue
+ *
+ * @rq: run queue context
+ * @stats: statistics buffer
+ */
+void _rq_get_stats(struct rq_context *rq, struct rq_stats *stats);
+
+#ifdef CONFIG_BASEWORK_RQ_PROFILE
+struct printer;
+struct imon_class;
+
+/*
+ * _rq_profile_clock - Get the timestamp for profiler (microseconds)
+ * (The default implement is based on os_timer_gettime(), 
+ *  The platform should overwrite it with high resolution clock)
+ */
+uint32_t _rq_profile_clock(void);
+
+/*
+ * _rq_profile_snapshot - Copy the profile records (shared by all run-queue)
+ *
+ * @buf: record buffer
+ * @n: the number of records that can be stored in buffer
+ * return the number of records
+ */
+size_t _rq_profile_snapshot(struct rq_profile_record *buf, size_t n);
+
+/*
+ * _rq_profile_reset - Clear the profile records and high-water mark
+ *
+ * @rq: run queue context (NULL: ignore high-water mark)
+ */
+void _rq_profile_reset(struct rq_context *rq);
+
+/*
+ * _rq_profile_dump - Print the profile records
+ *
+ * @rq: run queue context
+ * @printer: output printer
+ */
+void _rq_profile_dump(struct rq_context *rq, struct printer *printer);
+
+/*
+ * Monitor class for system run-queue (Register it by monitor_register())
+ */
+extern const struct imon_class _rq_profile_monitor;
+#endif /* CONFIG_BASEWORK_RQ_PROFILE */
+
 /*
  * Default run-queue public interface
  */
@@ -257,6 +426,8 @@ static inline int rq_init(struct rq_context *rq) {
 	_rq_submit_ext(_system_rq, _exec, _data, false, &(_pnode), (void *)#_exec)
 # define rq_submit_ext_urgent(_exec, _data, _pnode, ...) \
 	_rq_submit_ext(_system_rq, _exec, _data, true, &(_pnode), (void *)#_exec)
+# define rq_submit_prio(_exec, _data, _prio) \
+	_rq_submit_prio(_system_rq, _exec, _data, _prio, false, (void *)#_exec)
 
 #else
 # define rq_submit_arg rq_submit
@@ -271,6 +442,8 @@ static inline int rq_init(struct rq_context *rq) {
 	_rq_submit_ext(_system_rq, _exec, _data, false, &(_pnode))
 # define rq_submit_ext_urgent(_exec, _data, _pnode, ...) \
 	_rq_submit(_system_rq, _exec, _data, true, &(_pnode))
+# define rq_submit_prio(_exec, _data, _prio) \
+	_rq_submit_prio(_system_rq, _exec, _data, _prio, false)
 
 #endif /* USE_RQ_DEBUG */
 
@@ -0,0 +1,384 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Run-queue pool
+ *
+ * Each worker owns two bounded deques: the shared deque that can be stolen
+ * by idle siblings and the pinned deque for the works that have affinity
+ * key (So the works for the same object are always executed in order).
+ * The deque operations are O(1) and protected by the critical lock, So
+ * the works can be submitted from interrupt context too.
+ */
+
+#ifdef CONFIG_HEADER_FILE
+#include CONFIG_HEADER_FILE
+#endif
+
+#define pr_fmt(fmt) "<rq_pool>: "fmt
+
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "basework/rq_pool.h"
+#include "basework/malloc.h"
+#include "basework/log.h"
+
+#define RQ_POOL_WORK_SIZE(pool) \
+    rte_roundup(sizeof(struct rq_pool_work) + (pool)->itemsize, sizeof(void *))
+
+os_critical_global_declare
+
+static inline struct rq_pool_work *
+rq_pool_slot(struct rq_pool *pool, struct rq_pool_deque *dq, unsigned int idx) {
+    if (idx >= pool->depth)
+        idx -= pool->depth;
+    return (struct rq_pool_work *)(dq->buffer + idx * RQ_POOL_WORK_SIZE(pool));
+}
+
+static struct rq_pool_work *
+rq_pool_push_locked(struct rq_pool *pool, struct rq_pool_deque *dq,
+    bool urgent) {
+    if (rte_unlikely(dq->count >= pool->depth))
+        return NULL;
+    dq->count++;
+    if (urgent) {
+        dq->head = dq->head? dq->head - 1: pool->depth - 1;
+        return rq_pool_slot(pool, dq, dq->head);
+    }
+    return rq_pool_slot(pool, dq, dq->head + dq->count - 1);
+}
+
+/*
+ * Copy the work out of deque slot, The slot can be reused after this
+ */
+static void rq_pool_detach_locked(struct rq_pool_work *p,
+    struct rq_pool_work *work, void *scratch) {
+    *work = *p;
+    if (p->copied)
+        memcpy(scratch, p + 1, p->len);
+    if (p->refp) {
+        *p->refp = NULL;
+        p->refp = NULL;
+    }
+}
+
+static void rq_pool_pop_locked(struct rq_pool *pool, struct rq_pool_deque *dq,
+    struct rq_pool_work *work, void *scratch) {
+    rq_pool_detach_locked(rq_pool_slot(pool, dq, dq->head), work, scratch);
+    if (++dq->head == pool->depth)
+        dq->head = 0;
+    dq->count--;
+}
+
+/*
+ * Steal the newest work from the tail of sibling's shared deque
+ */
+static bool rq_pool_steal_locked(struct rq_pool *pool,
+    struct rq_pool_worker *worker, struct rq_pool_work *work) {
+    for (unsigned int i = 1; i < pool->nr_workers; i++) {
+        unsigned int idx = worker->id + i;
+        struct rq_pool_deque *dq;
+        struct rq_pool_work *p;
+
+        if (idx >= pool->nr_workers)
+            idx -= pool->nr_workers;
+        dq = &pool->workers[idx].shared;
+        if (!dq->count)
+            continue;
+
+        p = rq_pool_slot(pool, dq, dq->head + dq->count - 1);
+        rq_pool_detach_locked(p, work, worker->scratch);
+        dq->count--;
+        worker->stats.stolen++;
+        return true;
+    }
+    return false;
+}
+
+static bool rq_pool_take_locked(struct rq_pool *pool,
+    struct rq_pool_worker *worker, struct rq_pool_work *work) {
+    struct rq_pool_deque *first, *second;
+
+    /* Take turns between the pinned and shared deque to avoid starvation */
+    worker->turn = !worker->turn;
+    if (worker->turn) {
+        first = &worker->pinned;
+        second = &worker->shared;
+    } else {
+        first = &worker->shared;
+        second = &worker->pinned;
+    }
+
+    if (first->count) {
+        rq_pool_pop_locked(pool, first, work, worker->scratch);
+        return true;
+    }
+    if (second->count) {
+        rq_pool_pop_locked(pool, second, work, worker->scratch);
+        return true;
+    }
+    return rq_pool_steal_locked(pool, worker, work);
+}
+
+static void rq_pool_worker_thread(void *arg) {
+    struct rq_pool_worker *worker = arg;
+    struct rq_pool *pool = worker->pool;
+    struct rq_pool_work work;
+    bool executed = false;
+    os_critical_declare
+
+    for ( ; ; ) {
+        os_critical_lock
+        if (executed) {
+            worker->stats.executed++;
+            executed = false;
+        }
+        if (!rq_pool_take_locked(pool, worker, &work)) {
+            pool->idle |= 1u << worker->id;
+            os_critical_unlock
+            os_completion_wait(&worker->completion);
+            continue;
+        }
+        os_critical_unlock
+
+        /* The work has been cancelled before it is taken */
+        if (rte_unlikely(work.cancelled))
+            continue;
+
+        worker->executing = work.exec;
+        if (work.copied)
+            work.exec_cp(worker->scratch, work.len);
+        else
+            work.exec(work.arg);
+        worker->executing = NULL;
+        executed = true;
+    }
+
+    os_thread_exit();
+}
+
+static struct rq_pool_work *
+rq_pool_enqueue_locked(struct rq_pool *pool, uintptr_t key, bool urgent,
+    struct rq_pool_worker **pworker) {
+    struct rq_pool_worker *worker;
+    struct rq_pool_work *work;
+
+    if (key) {
+        /* The works that have the same key are always executed by one worker */
+        key ^= key >> 16;
+        key *= 0x45d9f3bu;
+        key ^= key >> 16;
+        worker = &pool->workers[key % pool->nr_workers];
+        work = rq_pool_push_locked(pool, &worker->pinned, urgent);
+        if (work)
+            worker->stats.pinned++;
+    } else {
+        /* Prefer to idle worker */
+        if (pool->idle) {
+            worker = &pool->workers[__builtin_ctz(pool->idle)];
+        } else {
+            worker = &pool->workers[pool->cursor];
+            if (++pool->cursor == pool->nr_workers)
+                pool->cursor = 0;
+        }
+        work = rq_pool_push_locked(pool, &worker->shared, urgent);
+    }
+
+    *pworker = worker;
+    return work;
+}
+
+static void rq_pool_wakeup_locked(struct rq_pool *pool,
+    struct rq_pool_worker *worker, bool *wakeup) {
+    uint32_t mask = 1u << worker->id;
+
+    *wakeup = !!(pool->idle & mask);
+    pool->idle &= ~mask;
+}
+
+int rq_pool_submit(struct rq_pool *pool, void (*exec)(void *), void *arg,
+    uintptr_t key, bool urgent) {
+    return rq_pool_submit_ext(pool, exec, arg, key, urgent, NULL);
+}
+
+int rq_pool_submit_ext(struct rq_pool *pool, void (*exec)(void *), void *arg,
+    uintptr_t key, bool urgent, void **pnode) {
+    struct rq_pool_worker *worker;
+    struct rq_pool_work *work;
+    bool wakeup;
+    os_critical_declare
+
+    if (rte_unlikely(!pool || !exec))
+        return -EINVAL;
+
+    os_critical_lock
+    work = rq_pool_enqueue_locked(pool, key, urgent, &worker);
+    if (rte_unlikely(!work)) {
+        pool->full++;
+        os_critical_unlock
+        pr_err("*** worker(%d) queue is full! ***\n", worker->id);
+        return -EBUSY;
+    }
+    work->exec = exec;
+    work->arg = arg;
+    work->refp = pnode;
+    work->len = 0;
+    work->copied = false;
+    work->cancelled = false;
+    if (pnode)
+        *pnode = work;
+    rq_pool_wakeup_locked(pool, worker, &wakeup);
+    os_critical_unlock
+
+    if (wakeup)
+        os_completed(&worker->completion);
+    return 0;
+}
+
+int rq_pool_submit_cp(struct rq_pool *pool, void (*exec)(void *, size_t),
+    const void *data, size_t size, uintptr_t key, bool urgent) {
+    struct rq_pool_worker *worker;
+    struct rq_pool_work *work;
+    bool wakeup;
+    os_critical_declare
+
+    if (rte_unlikely(!pool || !exec))
+        return -EINVAL;
+    if (rte_unlikely(size > pool->itemsize))
+        return -EINVAL;
+
+    os_critical_lock
+    work = rq_pool_enqueue_locked(pool, key, urgent, &worker);
+    if (rte_unlikely(!work)) {
+        pool->full++;
+        os_critical_unlock
+        pr_err("*** worker(%d) queue is full! ***\n", worker->id);
+        return -EBUSY;
+    }
+    work->exec_cp = exec;
+    work->arg = NULL;
+    work->refp = NULL;
+    work->len = (uint16_t)size;
+    work->copied = true;
+    work->cancelled = false;
+    memcpy(work + 1, data, size);
+    rq_pool_wakeup_locked(pool, worker, &wakeup);
+    os_critical_unlock
+
+    if (wakeup)
+        os_completed(&worker->completion);
+    return 0;
+}
+
+/*
+ * The cancelled work is still in deque and it will be dropped by worker
+ */
+void rq_pool_cancel(struct rq_pool *pool, void *pnode) {
+    struct rq_pool_work *work = pnode;
+    os_critical_declare
+
+    (void) pool;
+    if (!work)
+        return;
+
+    os_critical_lock
+    if (work->refp) {
+        *work->refp = NULL;
+        work->refp = NULL;
+        work->cancelled = true;
+    }
+    os_critical_unlock
+}
+
+int rq_pool_create(struct rq_pool **pool, unsigned int nr_workers,
+    unsigned int depth, size_t itemsize, size_t stack_size, int prio) {
+    struct rq_pool *p;
+    size_t dqsize;
+    char *buffer;
+    int err;
+
+    if (!pool || !nr_workers || nr_workers > RQ_POOL_MAX_WORKERS)
+        return -EINVAL;
+    if (!depth || depth > UINT16_MAX || itemsize > UINT16_MAX)
+        return -EINVAL;
+
+    p = general_calloc(1, sizeof(*p) + nr_workers * sizeof(p->workers[0]));
+    if (!p)
+        return -ENOMEM;
+
+    p->workers = (struct rq_pool_worker *)(p + 1);
+    p->nr_workers = (uint16_t)nr_workers;
+    p->depth = (uint16_t)depth;
+    p->itemsize = (uint16_t)rte_roundup(itemsize, sizeof(void *));
+    dqsize = RQ_POOL_WORK_SIZE(p) * depth;
+
+    for (unsigned int i = 0; i < nr_workers; i++) {
+        struct rq_pool_worker *worker = &p->workers[i];
+
+        /* Deque (shared + pinned) + scratch + stack */
+        buffer = general_malloc(dqsize * 2 + p->itemsize + stack_size);
+        if (!buffer) {
+            err = -ENOMEM;
+            goto _failed;
+        }
+        worker->pool = p;
+        worker->id = (uint8_t)i;
+        worker->shared.buffer = buffer;
+        worker->pinned.buffer = buffer + dqsize;
+        worker->scratch = buffer + dqsize * 2;
+        os_completion_reinit(&worker->completion);
+    }
+
+    for (unsigned int i = 0; i < nr_workers; i++) {
+        struct rq_pool_worker *worker = &p->workers[i];
+        void *stack = stack_size?
+            (char *)worker->scratch + p->itemsize: NULL;
+
+        err = os_thread_spawn(&worker->thread, "RunQueuePool", stack,
+            stack_size, prio, rq_pool_worker_thread, worker);
+        if (err) {
+            /* The workers that have been started can not be stopped */
+            pr_err("Create worker(%d) failed(%d)\n", i, err);
+            *pool = p;
+            return err;
+        }
+    }
+
+    *pool = p;
+    return 0;
+
+_failed:
+    for (unsigned int i = 0; i < nr_workers; i++)
+        general_free(p->workers[i].shared.buffer);
+    general_free(p);
+    return err;
+}
+
+int rq_pool_get_stats(struct rq_pool *pool, unsigned int idx,
+    struct rq_pool_stats *stats) {
+    os_critical_declare
+
+    if (!pool || !stats || idx >= pool->nr_workers)
+        return -EINVAL;
+
+    os_critical_lock
+    *stats = pool->workers[idx].stats;
+    os_critical_unlock
+    return 0;
+}
+
+void rq_pool_dump(struct rq_pool *pool) {
+    if (!pool)
+        return;
+
+    pr_notice("rq_pool: workers(%d) depth(%d) itemsize(%d) idle(0x%x) full(%u)\n",
+        pool->nr_workers, pool->depth, pool->itemsize, pool->idle, pool->full);
+    for (unsigned int i = 0; i < pool->nr_workers; i++) {
+        struct rq_pool_worker *worker = &pool->workers[i];
+
+        pr_notice("[%d] executing<%p> shared(%d) pinned(%d) executed(%u) stolen(%u)\n",
+            i, worker->executing, worker->shared.count, worker->pinned.count,
+            worker->stats.executed, worker->stats.stolen);
+    }
+}
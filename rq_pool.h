@@ -0,0 +1,161 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Run-queue pool (multiple worker threads with work stealing)
+ */
+#ifndef BASEWORK_RQ_POOL_H_
+#define BASEWORK_RQ_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "basework/os/osapi.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define RQ_POOL_MAX_WORKERS 32
+
+struct rq_pool;
+
+struct rq_pool_work {
+    union {
+        void (*exec)(void *);
+        void (*exec_cp)(void *, size_t);
+    };
+    void *arg;
+    void **refp;  /* Cleared when the work is taken by worker */
+    uint16_t len; /* The length of inline payload (0: no payload) */
+    uint8_t copied;
+    uint8_t cancelled;
+};
+
+struct rq_pool_deque {
+    char *buffer;
+    uint16_t head;
+    uint16_t count;
+};
+
+struct rq_pool_stats {
+    uint32_t executed; /* The number of works that executed by worker */
+    uint32_t stolen;   /* The number of works that stolen from siblings */
+    uint32_t pinned;   /* The number of works that submitted with key */
+};
+
+struct rq_pool_worker {
+    struct rq_pool *pool;
+    struct rq_pool_deque shared; /* Can be stolen by siblings */
+    struct rq_pool_deque pinned; /* The works that have affinity key */
+    os_completion_declare(completion)
+    os_thread_t thread;
+    void (*executing)(void *);
+    void *scratch; /* Payload buffer for executing */
+    struct rq_pool_stats stats;
+    uint8_t id;
+    bool turn;
+};
+
+struct rq_pool {
+    struct rq_pool_worker *workers;
+    uint16_t nr_workers;
+    uint16_t depth;    /* The capacity of per-deque */
+    uint16_t itemsize; /* The maximum payload size of rq_pool_submit_cp() */
+    uint16_t cursor;
+    uint32_t idle;     /* Idle worker bitmap */
+    uint32_t full;     /* The number of submissions that failed by full */
+};
+
+/*
+ * rq_pool_create - Create a run-queue pool and start worker threads
+ *
+ * @pool: the pointer of pool
+ * @nr_workers: the number of workers (1 ~ RQ_POOL_MAX_WORKERS)
+ * @depth: the capacity of per-worker deque
+ * @itemsize: the maximum payload size of rq_pool_submit_cp()
+ * @stack_size: the stack size of worker (0: default size)
+ * @prio: the priority of worker thread
+ * return 0 if success
+ */
+int rq_pool_create(struct rq_pool **pool, unsigned int nr_workers,
+    unsigned int depth, size_t itemsize, size_t stack_size, int prio);
+
+/*
+ * rq_pool_submit - Submit a work to run-queue pool
+ *
+ * The works that have the same non-zero key will be executed by the same
+ * worker in submission order, Otherwise the work will be queued to an idle
+ * worker (or round-robin) and can be stolen by other workers.
+ *
+ * @pool: run-queue pool
+ * @exec: user function
+ * @arg: user parameter
+ * @key: affinity key (0: no affinity)
+ * @urgent: insert to the head of deque
+ * return 0 if success
+ */
+int rq_pool_submit(struct rq_pool *pool, void (*exec)(void *), void *arg,
+    uintptr_t key, bool urgent);
+
+/*
+ * rq_pool_submit_ext - Submit a work to run-queue pool with cancel handle
+ *
+ * The handle is saved to *pnode and it will be cleared when the work has
+ * been taken by worker (The same as _rq_submit_ext())
+ *
+ * @pool: run-queue pool
+ * @exec: user function
+ * @arg: user parameter
+ * @key: affinity key (0: no affinity)
+ * @urgent: insert to the head of deque
+ * @pnode: the pointer of cancel handle
+ * return 0 if success
+ */
+int rq_pool_submit_ext(struct rq_pool *pool, void (*exec)(void *), void *arg,
+    uintptr_t key, bool urgent, void **pnode);
+
+/*
+ * rq_pool_cancel - Cancel a work that has not been taken by worker
+ *
+ * @pool: run-queue pool
+ * @pnode: cancel handle that saved by rq_pool_submit_ext()
+ */
+void rq_pool_cancel(struct rq_pool *pool, void *pnode);
+
+/*
+ * rq_pool_submit_cp - Submit a work to run-queue pool and copy buffer
+ *
+ * @pool: run-queue pool
+ * @exec: user function
+ * @data: user data
+ * @size: the size of data (must not be larger than pool->itemsize)
+ * @key: affinity key (0: no affinity)
+ * @urgent: insert to the head of deque
+ * return 0 if success
+ */
+int rq_pool_submit_cp(struct rq_pool *pool, void (*exec)(void *, size_t),
+    const void *data, size_t size, uintptr_t key, bool urgent);
+
+/*
+ * rq_pool_get_stats - Get the statistics of pool worker
+ *
+ * @pool: run-queue pool
+ * @idx: worker index
+ * @stats: statistics buffer
+ * return 0 if success
+ */
+int rq_pool_get_stats(struct rq_pool *pool, unsigned int idx,
+    struct rq_pool_stats *stats);
+
+/*
+ * rq_pool_dump - Dump the state of pool workers
+ *
+ * @pool: run-queue pool
+ */
+void rq_pool_dump(struct rq_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASEWORK_RQ_POOL_H_ */
@@ -1,11 +1,16 @@
 /*
  * Copyright 2023 wtcat
  */
+#include <dlfcn.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
+#include <semaphore.h>
 
 #include "basework/async_call.h"
+#include "basework/async_future.h"
+#include "basework/rq.h"
 #include "gtest/gtest.h"
 
 
@@ -13,6 +18,17 @@
 #pragma GCC diagnostic ignored "-Wcast-function-type"
 #endif
 
+RQ_DEFINE(async_rq, 32, );
+static sem_t async_sem;
+static uintptr_t async_args[5];
+
+static void async_start(void) {
+    if (!_system_rq) {
+        sem_init(&async_sem, 0, 0);
+        ASSERT_EQ(_rq_new_thread(&async_rq, NULL, 0, 0), 0);
+    }
+}
+
 static void print_hello(void) {
     printf("Hello World\n");
 }
@@ -26,7 +42,144 @@ static void call_done(const struct call_param *p) {
 }
 
 TEST(async_call, api_test) {
+    async_start();
     ASSERT_EQ(async_call0(print_hello), 0);
     ASSERT_EQ(async_done_call3(calc_add3, call_done, 1, 2, 3), 0);
     usleep(1000000);
-}
\ No newline at end of file
+}
+static uintptr_t record_args(uintptr_t a1, uintptr_t a2, uintptr_t a3,
+    uintptr_t a4, uintptr_t a5) {
+    async_args[0] = a1;
+    async_args[1] = a2;
+    async_args[2] = a3;
+    async_args[3] = a4;
+    async_args[4] = a5;
+    sem_post(&async_sem);
+    return 0;
+}
+
+TEST(async_call, variadic_args) {
+    async_start();
+    ASSERT_EQ(async_call(record_args, 1, 2, 3, 4), 0);
+    sem_wait(&async_sem);
+    EXPECT_EQ(async_args[2], 3u);
+    EXPECT_EQ(async_args[3], 4u);
+    EXPECT_EQ(async_args[4], 0u);
+
+    ASSERT_EQ(async_call(record_args, 1, 2, 3, 4, 5), 0);
+    sem_wait(&async_sem);
+    for (int i = 0; i < 5; i++)
+        EXPECT_EQ(async_args[i], (uintptr_t)i + 1);
+}
+
+static void future_add(struct async_future *f) {
+    int *v = (int *)async_future_arg(f);
+    usleep(1000);
+    async_future_result(f) = (uintptr_t)(v[0] + v[1]);
+}
+
+static void future_double(struct async_future *f) {
+    struct async_future *prev = (struct async_future *)async_future_arg(f);
+    async_future_result(f) = async_future_result(prev) * 2;
+}
+
+TEST(async_call, future) {
+    struct async_future f, next;
+    int v[2] = {3, 4};
+
+    async_start();
+    async_future_init(&f, future_add, v);
+    async_future_init(&next, future_double, &f);
+    ASSERT_EQ(async_future_then(&f, &next), 0);
+    EXPECT_FALSE(async_future_done(&next));
+
+    ASSERT_EQ(async_future_submit(&f, false), 0);
+    EXPECT_EQ(async_future_submit(&f, false), -EBUSY);
+    EXPECT_EQ(async_future_wait(&next), 14u);
+    EXPECT_TRUE(async_future_done(&f));
+    EXPECT_EQ(async_future_result(&f), 7u);
+
+    /* The chain is released after completed */
+    v[0] = 10;
+    ASSERT_EQ(async_future_submit(&f, true), 0);
+    EXPECT_EQ(async_future_timedwait(&f, 1000), 0);
+    EXPECT_EQ(async_future_result(&f), 14u);
+    EXPECT_EQ(async_future_result(&next), 14u);
+}
+
+static void future_nop(struct async_future *f) {
+    async_future_result(f) = 1;
+}
+
+/*
+ * Delay the completion of the watched future, So the window between the
+ * completion and DONE is wide enough to be observed
+ */
+static sem_t *volatile post_delay_sem;
+
+extern "C" int sem_post(sem_t *sem) {
+    static int (*real_post)(sem_t *);
+
+    if (!real_post)
+        real_post = (int (*)(sem_t *))dlsym(RTLD_NEXT, "sem_post");
+    if (sem == post_delay_sem)
+        usleep(2000);
+    return real_post(sem);
+}
+
+TEST(async_call, future_free_on_done) {
+    struct async_future sync;
+    int touched = 0;
+
+    async_start();
+    async_future_init(&sync, future_nop, NULL);
+
+    /* 
+     * The future is released as soon as it is seen as done (It is filled 
+     * with a pattern here), The worker must not write it after that
+     */
+    for (int i = 0; i < 20; i++) {
+        struct async_future *f = new struct async_future;
+        unsigned char *p = (unsigned char *)f;
+
+        async_future_init(f, future_nop, NULL);
+        post_delay_sem = &f->completion;
+        ASSERT_EQ(async_future_submit(f, false), 0);
+        while (!async_future_done(f))
+            sched_yield();
+        memset(f, 0x5a, sizeof(*f));
+
+        /* The run-queue is idle after the next future completed */
+        post_delay_sem = NULL;
+        ASSERT_EQ(async_future_submit(&sync, false), 0);
+        async_future_wait(&sync);
+        for (size_t n = 0; n < sizeof(*f); n++) {
+            if (p[n] != 0x5a) {
+                touched++;
+                break;
+            }
+        }
+        delete f;
+    }
+    EXPECT_EQ(touched, 0);
+}
+
+static int typed_add(int a, int b) {
+    return a + b;
+}
+
+TEST(async_call, typed_task) {
+    async_start();
+    base::async_task<int (*)(int, int), int, int> task(typed_add, 20, 22);
+    int scaled = 0;
+    auto scale = [&task, &scaled]() { scaled = task.get() * 10; };
+    base::async_task<decltype(scale)> next(scale);
+
+    ASSERT_EQ(task.then(next), 0);
+    ASSERT_EQ(task.submit(), 0);
+    next.get();
+    EXPECT_TRUE(task.done());
+    EXPECT_EQ(task.get(), 42);
+    EXPECT_EQ(scaled, 420);
+    EXPECT_TRUE(task.wait_for(10));
+}
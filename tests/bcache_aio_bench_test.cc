@@ -0,0 +1,175 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for pipelined swapout over file-backed bcache device
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "basework/dev/bcache.h"
+#include "basework/os/posix/os_bcache_file.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define AIO_BLKSIZE   512
+#define AIO_BLOCKS    256
+#define AIO_LATENCY   500  /* us */
+
+#ifdef CONFIG_BCACHE_SHARDS
+#define AIO_SHARDS    CONFIG_BCACHE_SHARDS
+#else
+#define AIO_SHARDS    1
+#endif
+
+struct aio_result {
+    bcache_num_t dirty;
+    uint64_t ns;
+    struct bcache_file_stats stats;
+};
+
+static void aio_pattern(char *buf, bcache_num_t block, int seed) {
+    for (int i = 0; i < AIO_BLKSIZE; i++)
+        buf[i] = (char)(block * 7 + i + seed);
+}
+
+/*
+ * The number of dirty blocks that fit the cache (So the swapout is not
+ * triggered before bcache_syncdev)
+ */
+static bcache_num_t aio_dirty_blocks(void) {
+    const struct bcache_config *cfg = &bcache_configuration;
+    uint32_t bufsz = cfg->buffer_min > AIO_BLKSIZE? cfg->buffer_min: AIO_BLKSIZE;
+    bcache_num_t n = (bcache_num_t)(cfg->size / bufsz) * 3 / 4;
+
+    return n < AIO_BLOCKS? n: AIO_BLOCKS;
+}
+
+static void aio_run(const char *name, const char *path, uint32_t threads,
+    struct aio_result *result) {
+    struct bcache_file_config cfg = {
+        .path = path,
+        .blksize = AIO_BLKSIZE,
+        .blocks = AIO_BLOCKS,
+        .threads = threads,
+        .queue_depth = 0,
+        .latency_us = AIO_LATENCY
+    };
+    struct bcache_device *dd;
+    char buf[AIO_BLKSIZE], img[AIO_BLKSIZE];
+    uint64_t start;
+    int fd, errors = 0;
+
+    result->dirty = aio_dirty_blocks();
+    unlink(path);
+    ASSERT_EQ(bcache_file_create(name, &cfg, &dd), 0);
+
+    for (bcache_num_t blk = 0; blk < result->dirty; blk++) {
+        aio_pattern(buf, blk, threads);
+        ASSERT_EQ(bcache_blkdev_write(dd, buf, AIO_BLKSIZE,
+            (off_t)blk * AIO_BLKSIZE), AIO_BLKSIZE);
+    }
+
+    start = bench_now();
+    ASSERT_EQ(bcache_syncdev(dd), 0);
+    result->ns = bench_now() - start;
+    ASSERT_EQ(bcache_file_get_stats(dd, &result->stats), 0);
+
+    /* Check the image contents */
+    fd = open(path, O_RDONLY);
+    ASSERT_GE(fd, 0);
+    for (bcache_num_t blk = 0; blk < result->dirty; blk++) {
+        aio_pattern(buf, blk, threads);
+        if (pread(fd, img, AIO_BLKSIZE, (off_t)blk * AIO_BLKSIZE) != AIO_BLKSIZE ||
+            memcmp(buf, img, AIO_BLKSIZE))
+            errors++;
+    }
+    close(fd);
+    unlink(path);
+    EXPECT_EQ(errors, 0);
+}
+
+TEST(bcache_aio, swapout_throughput) {
+    const struct bcache_config *cfg = &bcache_configuration;
+    struct aio_result sync, async;
+
+    /* The dirty blocks are held until bcache_syncdev */
+    ASSERT_EQ(bcache_set_dirty_ratio(0, 0), 0);
+    aio_run("aio-sync", "/tmp/bcache_aio_sync.img", 0, &sync);
+    aio_run("aio-async", "/tmp/bcache_aio_async.img", 4, &async);
+    bcache_set_dirty_ratio(cfg->dirty_ratio_low, cfg->dirty_ratio_high);
+
+    printf("bcache_aio: sync  requests(%u) inflight(%u) time(%llu us) %.1f KB/s\n",
+        sync.stats.completed, sync.stats.inflight_max,
+        (unsigned long long)sync.ns / 1000,
+        sync.dirty * AIO_BLKSIZE * 1e9 / 1024.0 / sync.ns);
+    printf("bcache_aio: async requests(%u) inflight(%u) time(%llu us) %.1f KB/s\n",
+        async.stats.completed, async.stats.inflight_max,
+        (unsigned long long)async.ns / 1000,
+        async.dirty * AIO_BLKSIZE * 1e9 / 1024.0 / async.ns);
+
+    EXPECT_EQ(sync.stats.inflight_max, 1u);
+    EXPECT_EQ(async.stats.submitted, async.stats.completed);
+
+    /* The write requests of each shard overlap only if there are more than one */
+    if (bcache_configuration.io_depth > 1 &&
+        async.dirty / AIO_SHARDS > bcache_configuration.max_write_blocks)
+        EXPECT_GT(async.stats.inflight_max, 1u);
+}
+
+#ifdef CONFIG_BCACHE_READ_AHEAD
+/*
+ * The read-ahead requests of streams are submitted without waiting, So
+ * they overlap in the driver
+ */
+TEST(bcache_aio, read_ahead_overlap) {
+    const int nr_streams = BCACHE_READ_AHEAD_STREAMS < 4? BCACHE_READ_AHEAD_STREAMS: 4;
+    const uint32_t window = 16;
+    const char *path = "/tmp/bcache_aio_ra.img";
+    struct bcache_file_config cfg = {
+        .path = path,
+        .blksize = AIO_BLKSIZE,
+        .blocks = AIO_BLOCKS,
+        .threads = 4,
+        .queue_depth = 0,
+        .latency_us = AIO_LATENCY
+    };
+    struct bcache_file_stats fstats;
+    struct bcache_stats stats;
+    struct bcache_device *dd;
+    char buf[AIO_BLKSIZE];
+
+    if (bcache_configuration.max_read_ahead_blocks < window)
+        GTEST_SKIP() << "read-ahead is disabled";
+
+    unlink(path);
+    ASSERT_EQ(bcache_file_create("aio-ra", &cfg, &dd), 0);
+    for (int i = 0; i < nr_streams; i++)
+        bcache_peek(dd, i * (AIO_BLOCKS / nr_streams), window);
+
+    /* Wait for the read-ahead task */
+    for (int ms = 0; ms < 1000; ms++) {
+        ASSERT_EQ(bcache_file_get_stats(dd, &fstats), 0);
+        if (fstats.completed >= (uint32_t)nr_streams)
+            break;
+        usleep(1000);
+    }
+
+    /* The blocks are read by the read-ahead task */
+    for (int i = 0; i < nr_streams; i++) {
+        ASSERT_EQ(bcache_blkdev_read(dd, buf, AIO_BLKSIZE,
+            (off_t)(i * (AIO_BLOCKS / nr_streams) + window - 1) * AIO_BLKSIZE),
+            AIO_BLKSIZE);
+    }
+    bcache_get_device_stats(dd, &stats);
+    ASSERT_EQ(bcache_file_get_stats(dd, &fstats), 0);
+    unlink(path);
+
+    printf("bcache_aio: read-ahead streams(%d) requests(%u) inflight(%u)\n",
+        nr_streams, fstats.completed, fstats.inflight_max);
+    EXPECT_EQ(stats.read_misses, 0u);
+    if (bcache_configuration.io_depth > 1 && nr_streams > 1)
+        EXPECT_GT(fstats.inflight_max, 1u);
+}
+#endif /* CONFIG_BCACHE_READ_AHEAD */
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for read latency of bcache during a write burst (dirty ratio)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "basework/dev/bcache.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define DIRTY_BLKSIZE    512
+#define DIRTY_BLOCKS     2048
+#define DIRTY_READ_AREA  512   /* Blocks read randomly (Larger than the cache) */
+#define DIRTY_BURST      1024  /* Blocks written by the burst */
+#define DIRTY_RD_LATENCY 50    /* us per request */
+#define DIRTY_WR_LATENCY 100   /* us per block */
+
+struct dirty_result {
+    uint64_t max_ns;
+    uint64_t avg_ns;
+    uint32_t reads;
+    uint64_t burst_ns;
+    struct bcache_stats stats;
+};
+
+static std::atomic<bool> dirty_burst_done;
+
+static struct bcache_device *dirty_device(void) {
+    /* Emulate the media: The program time of flash is per block */
+    static uint8_t area[DIRTY_BLKSIZE * DIRTY_BLOCKS];
+    static struct bench_ramdisk ramdisk = {area, DIRTY_RD_LATENCY, DIRTY_WR_LATENCY};
+    static struct bcache_device *dd;
+
+    if (dd == NULL) {
+        bench_ramdisk_fill(&ramdisk, DIRTY_BLKSIZE, DIRTY_BLOCKS);
+        EXPECT_EQ(bench_ramdisk_create("dirty-ramdisk", &ramdisk, DIRTY_BLKSIZE,
+            DIRTY_BLOCKS, &dd), 0);
+    }
+    return dd;
+}
+
+/*
+ * The burst writer rewrites the area behind the read area as fast as it can
+ */
+static void *dirty_writer(void *arg) {
+    struct bcache_device *dd = (struct bcache_device *)arg;
+    char buf[DIRTY_BLKSIZE];
+
+    for (bcache_num_t i = 0; i < DIRTY_BURST; i++) {
+        bcache_num_t blk = DIRTY_READ_AREA + i;
+
+        memset(buf, (int)blk, sizeof(buf));
+        if (bcache_blkdev_write(dd, buf, sizeof(buf), (off_t)blk * DIRTY_BLKSIZE) !=
+            (ssize_t)sizeof(buf))
+            break;
+    }
+    dirty_burst_done = true;
+    return NULL;
+}
+
+static void dirty_run(uint32_t low, uint32_t high, struct dirty_result *result) {
+    struct bcache_device *dd = dirty_device();
+    uint64_t total = 0, start;
+    uint32_t seed = 1;
+    pthread_t writer;
+    uint8_t data[16];
+
+    memset(result, 0, sizeof(*result));
+    ASSERT_NE(dd, nullptr);
+    ASSERT_EQ(bcache_set_dirty_ratio(low, high), 0);
+    bcache_purge_dev(dd);
+    bcache_reset_device_stats(dd);
+
+    dirty_burst_done = false;
+    start = bench_now();
+    ASSERT_EQ(pthread_create(&writer, NULL, dirty_writer, dd), 0);
+
+    /* The reader misses the cache and needs a clean buffer for each read */
+    while (!dirty_burst_done) {
+        uint64_t t0, ns;
+        bcache_num_t blk;
+
+        seed = seed * 1103515245u + 12345u;
+        blk = (seed >> 8) % DIRTY_READ_AREA;
+        t0 = bench_now();
+        ASSERT_EQ(bcache_blkdev_read(dd, data, sizeof(data), (off_t)blk * DIRTY_BLKSIZE),
+            (ssize_t)sizeof(data));
+        ns = bench_now() - t0;
+        EXPECT_EQ(data[0], (uint8_t)blk);
+
+        total += ns;
+        result->reads++;
+        if (ns > result->max_ns)
+            result->max_ns = ns;
+    }
+    pthread_join(writer, NULL);
+    result->burst_ns = bench_now() - start;
+
+    ASSERT_EQ(bcache_syncdev(dd), 0);
+    bcache_get_device_stats(dd, &result->stats);
+    result->avg_ns = result->reads? total / result->reads: 0;
+}
+
+static void dirty_print(const char *name, const struct dirty_result *r) {
+    printf("bcache_dirty: %-9s reads(%u) avg(%llu us) max(%llu us) burst(%llu us)"
+        " background(%u) throttles(%u) throttle(%u ms)\n", name, r->reads,
+        (unsigned long long)r->avg_ns / 1000, (unsigned long long)r->max_ns / 1000,
+        (unsigned long long)r->burst_ns / 1000, r->stats.write_background,
+        r->stats.write_throttles, r->stats.write_throttle_ms);
+}
+
+TEST(bcache_dirty, read_latency_in_write_burst) {
+    const struct bcache_config *cfg = &bcache_configuration;
+    struct dirty_result off, on;
+
+    dirty_run(0, 0, &off);
+    dirty_run(BCACHE_DIRTY_RATIO_LOW_DEFAULT, BCACHE_DIRTY_RATIO_HIGH_DEFAULT, &on);
+    bcache_set_dirty_ratio(cfg->dirty_ratio_low, cfg->dirty_ratio_high);
+
+    dirty_print("unlimited", &off);
+    dirty_print("ratio", &on);
+
+    EXPECT_EQ(off.stats.write_background, 0u);
+    EXPECT_EQ(off.stats.write_throttles, 0u);
+    EXPECT_GT(on.stats.write_background, 0u);
+
+    /* The reader does not wait for the writeback of a cache full of dirty blocks */
+    EXPECT_LT(on.max_ns, off.max_ns);
+}
+
+struct dirty_throttled {
+    struct bcache_device *dd;
+    bcache_num_t block;
+    uint64_t done_ns;
+};
+
+static void *dirty_throttled_writer(void *arg) {
+    struct dirty_throttled *t = (struct dirty_throttled *)arg;
+    char buf[DIRTY_BLKSIZE];
+
+    memset(buf, (int)t->block, sizeof(buf));
+    EXPECT_EQ(bcache_blkdev_write(t->dd, buf, sizeof(buf), (off_t)t->block * DIRTY_BLKSIZE),
+        (ssize_t)sizeof(buf));
+    t->done_ns = bench_now();
+    return NULL;
+}
+
+TEST(bcache_dirty, wake_all_throttled) {
+    const struct bcache_config *cfg = &bcache_configuration;
+    struct bcache_device *dd = dirty_device();
+    uint32_t unit = cfg->buffer_min > DIRTY_BLKSIZE? cfg->buffer_min: DIRTY_BLKSIZE;
+    bcache_num_t fill = cfg->size / unit / 2;
+    struct dirty_throttled writers[3];
+    pthread_t tids[3];
+    struct bcache_stats st;
+    uint64_t release, woken = 0;
+    uint32_t pause;
+    char buf[DIRTY_BLKSIZE];
+
+    ASSERT_NE(dd, nullptr);
+    ASSERT_EQ(bcache_syncdev(dd), 0);
+    bcache_purge_dev(dd);
+
+    /* Half of the cache is dirty before the limit is set */
+    ASSERT_EQ(bcache_set_dirty_ratio(0, 0), 0);
+    for (bcache_num_t i = 0; i < fill; i++) {
+        bcache_num_t blk = DIRTY_READ_AREA + i;
+
+        memset(buf, (int)blk, sizeof(buf));
+        ASSERT_EQ(bcache_blkdev_write(dd, buf, sizeof(buf), (off_t)blk * DIRTY_BLKSIZE),
+            (ssize_t)sizeof(buf));
+    }
+    ASSERT_EQ(bcache_set_dirty_ratio(0, 10), 0);
+    bcache_reset_device_stats(dd);
+
+    for (int i = 0; i < 3; i++) {
+        writers[i].dd = dd;
+        writers[i].block = DIRTY_READ_AREA + fill + i;
+        ASSERT_EQ(pthread_create(&tids[i], NULL, dirty_throttled_writer, &writers[i]), 0);
+    }
+    usleep(5000);
+
+    /* Lifting the limit releases every paused writer at once */
+    release = bench_now();
+    ASSERT_EQ(bcache_set_dirty_ratio(0, 0), 0);
+    for (int i = 0; i < 3; i++) {
+        pthread_join(tids[i], NULL);
+        if (writers[i].done_ns > release && writers[i].done_ns - release > woken)
+            woken = writers[i].done_ns - release;
+    }
+    bcache_get_device_stats(dd, &st);
+    ASSERT_EQ(bcache_set_dirty_ratio(cfg->dirty_ratio_low, cfg->dirty_ratio_high), 0);
+    ASSERT_EQ(bcache_syncdev(dd), 0);
+
+    pause = st.write_throttles? st.write_throttle_ms / st.write_throttles: 0;
+    printf("bcache_dirty: throttles(%u) pause(%u ms) woken(%llu us)\n",
+        st.write_throttles, pause, (unsigned long long)woken / 1000);
+    if (pause > 40) {
+        EXPECT_LT(woken, (uint64_t)pause * 1000000ull / 2);
+    } else {
+        printf("bcache_dirty: pause too short to check the wakeup\n");
+    }
+}
+
+TEST(bcache_dirty, writeback_retry) {
+    static uint8_t area[DIRTY_BLKSIZE * 16];
+    static struct bench_ramdisk ramdisk = {area};
+    struct bcache_device *dd;
+    struct bcache_stats st;
+    char buf[DIRTY_BLKSIZE];
+
+    ASSERT_EQ(bench_ramdisk_create("retry-ramdisk", &ramdisk, DIRTY_BLKSIZE, 16, &dd), 0);
+    memset(buf, 0x5a, sizeof(buf));
+    ASSERT_EQ(bcache_blkdev_write(dd, buf, sizeof(buf), 3 * DIRTY_BLKSIZE),
+        (ssize_t)sizeof(buf));
+
+    /* The failed writeback keeps the data modified and writes it again */
+    ramdisk.wr_failures = 1;
+    bcache_syncdev(dd);
+    if (area[3 * DIRTY_BLKSIZE] != 0x5a) {
+        ASSERT_EQ(bcache_syncdev(dd), 0);
+    }
+    EXPECT_EQ(ramdisk.wr_failures, 0u);
+    EXPECT_EQ(memcmp(area + 3 * DIRTY_BLKSIZE, buf, sizeof(buf)), 0);
+    bcache_get_device_stats(dd, &st);
+    EXPECT_EQ(st.write_errors, 1u);
+}
+
+TEST(bcache_dirty, invalid_ratio) {
+    EXPECT_EQ(bcache_set_dirty_ratio(101, 0), -EINVAL);
+    EXPECT_EQ(bcache_set_dirty_ratio(60, 40), -EINVAL);
+    EXPECT_EQ(bcache_set_dirty_ratio(0, 40), 0);
+    EXPECT_EQ(bcache_set_dirty_ratio(bcache_configuration.dirty_ratio_low,
+        bcache_configuration.dirty_ratio_high), 0);
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test for erase-aware write coalescing of bcache swapout
+ */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "basework/dev/bcache.h"
+#include "gtest/gtest.h"
+
+#define ERASE_SECTOR   512
+#define ERASE_UNIT     4096
+#define ERASE_SECTORS  (ERASE_UNIT / ERASE_SECTOR)
+#define ERASE_UNITS    64
+
+#ifdef CONFIG_BCACHE_SHARDS
+#define ERASE_SHARDS   CONFIG_BCACHE_SHARDS
+#else
+#define ERASE_SHARDS   1
+#endif
+
+struct erase_flash {
+    uint8_t area[ERASE_UNIT * ERASE_UNITS];
+    uint8_t unit[ERASE_UNIT];
+    uint32_t erases;
+    uint32_t unit_splits;  /* Erase unit written by more than one request */
+    int last_unit;
+};
+
+static void erase_unit(struct erase_flash *fl, uint32_t unit) {
+    memset(fl->area + unit * ERASE_UNIT, 0xFF, ERASE_UNIT);
+    fl->erases++;
+    if ((int)unit == fl->last_unit)
+        fl->unit_splits++;
+    fl->last_unit = unit;
+}
+
+/*
+ * The flash driver does one read-modify-erase-write for the sectors of
+ * an erase unit
+ */
+static void erase_write(struct erase_flash *fl, struct bcache_request *r) {
+    struct bcache_sg_buffer *sg = r->bufs;
+    struct bcache_sg_buffer *end = sg + r->bufnum;
+
+    while (sg < end) {
+        uint32_t unit = sg->block / ERASE_SECTORS;
+
+        memcpy(fl->unit, fl->area + unit * ERASE_UNIT, ERASE_UNIT);
+        for ( ; sg < end && sg->block / ERASE_SECTORS == unit; sg++) {
+            memcpy(fl->unit + (sg->block % ERASE_SECTORS) * ERASE_SECTOR,
+                sg->buffer, sg->length);
+        }
+        erase_unit(fl, unit);
+        memcpy(fl->area + unit * ERASE_UNIT, fl->unit, ERASE_UNIT);
+    }
+}
+
+static int erase_driver(struct bcache_device *dd, uint32_t req, void *argp) {
+    struct erase_flash *fl = (struct erase_flash *)bcache_disk_get_driver_data(dd);
+    struct bcache_request *r = (struct bcache_request *)argp;
+
+    switch (req) {
+    case BCACHE_IO_REQUEST:
+        if (r->req == BCACHE_DEV_REQ_READ) {
+            for (uint32_t i = 0; i < r->bufnum; i++) {
+                struct bcache_sg_buffer *sg = &r->bufs[i];
+                memcpy(sg->buffer, fl->area + sg->block * ERASE_SECTOR, sg->length);
+            }
+        } else {
+            erase_write(fl, r);
+        }
+        bcache_request_done(r, 0);
+        return 0;
+    case BCACHE_IO_GETERASESIZE:
+        *(uint32_t *)argp = ERASE_UNIT;
+        return 0;
+    default:
+        return bcache_ioctl(dd, req, argp);
+    }
+}
+
+static void erase_pattern(uint8_t *buf, bcache_num_t sector) {
+    for (int i = 0; i < ERASE_SECTOR; i++)
+        buf[i] = (uint8_t)(sector * 3 + i);
+}
+
+/*
+ * The number of dirty sectors that fit the cache (and each shard), So the
+ * swapout is not triggered before bcache_syncdev
+ */
+static uint32_t erase_budget(uint32_t *per_unit) {
+    const struct bcache_config *cfg = &bcache_configuration;
+    uint32_t bufsz = cfg->buffer_min > ERASE_SECTOR? cfg->buffer_min: ERASE_SECTOR;
+    uint32_t buffers = (uint32_t)(cfg->size / bufsz);
+
+    *per_unit = buffers / ERASE_SHARDS / 2;
+    return buffers / 2;
+}
+
+TEST(bcache_erase, coalesce_erase_unit) {
+    static struct erase_flash flash;
+    struct bcache_device *dd;
+    struct bcache_stats stats;
+    std::vector<bcache_num_t> dirty;
+    uint32_t per_unit, units = 0;
+    uint32_t budget = erase_budget(&per_unit);
+    uint8_t buf[ERASE_SECTOR];
+    int errors = 0;
+
+    /* The dirty sectors are held until bcache_syncdev */
+    ASSERT_EQ(bcache_set_dirty_ratio(0, 0), 0);
+    memset(flash.area, 0x5A, sizeof(flash.area));
+    flash.last_unit = -1;
+    ASSERT_EQ(bcache_blkdev_create("erase-flash", ERASE_SECTOR,
+        ERASE_UNIT * ERASE_UNITS / ERASE_SECTOR, erase_driver, &flash, &dd), 0);
+
+    /*
+     * A full erase unit and the partial ones (Every other unit, So the
+     * units are spread over the shard clusters)
+     */
+    for (uint32_t u = 0; u < ERASE_UNITS && dirty.size() < budget; u += 2, units++) {
+        uint32_t step = (u == 0)? 1: 2;
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < ERASE_SECTORS && n < per_unit &&
+            dirty.size() < budget; i += step, n++)
+            dirty.push_back(u * ERASE_SECTORS + i);
+    }
+    ASSERT_GT(dirty.size(), (size_t)units);
+
+    for (bcache_num_t sector : dirty) {
+        erase_pattern(buf, sector);
+        ASSERT_EQ(bcache_blkdev_write(dd, buf, ERASE_SECTOR,
+            (off_t)sector * ERASE_SECTOR), ERASE_SECTOR);
+    }
+    bcache_reset_device_stats(dd);
+    flash.erases = 0;
+    ASSERT_EQ(bcache_syncdev(dd), 0);
+    bcache_get_device_stats(dd, &stats);
+    bcache_set_dirty_ratio(bcache_configuration.dirty_ratio_low,
+        bcache_configuration.dirty_ratio_high);
+
+    printf("bcache_erase: sectors(%zu) units(%u) erases(%u) erase-units(%u) saved(%u)\n",
+        dirty.size(), units, flash.erases, stats.write_erase_units,
+        stats.write_erases_saved);
+
+    /* Check the flash: The clean sectors of partial units are kept */
+    for (bcache_num_t s = 0; s < ERASE_UNITS * ERASE_SECTORS; s++) {
+        const uint8_t *p = flash.area + s * ERASE_SECTOR;
+        bool is_dirty = false;
+
+        for (bcache_num_t d : dirty)
+            is_dirty |= (d == s);
+        if (is_dirty) {
+            erase_pattern(buf, s);
+            errors += memcmp(p, buf, ERASE_SECTOR) != 0;
+        } else {
+            errors += p[0] != 0x5A || p[ERASE_SECTOR - 1] != 0x5A;
+        }
+    }
+
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(flash.erases, units);
+    EXPECT_EQ(flash.unit_splits, 0u);
+    EXPECT_EQ(stats.write_erase_units, units);
+    EXPECT_EQ(stats.write_erases_saved, dirty.size() - units);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test for zero-copy mapped read of bcache
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "basework/dev/bcache.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define MAP_BLKSIZE   512
+#define MAP_BLOCKS    64
+#define MAP_LOOPS     20000
+
+static uint8_t map_pattern(size_t offset) {
+    return (uint8_t)(offset * 7 + (offset >> 9));
+}
+
+static struct bcache_device *map_device(struct bench_ramdisk **rdp) {
+    static uint8_t area[MAP_BLKSIZE * MAP_BLOCKS];
+    static struct bench_ramdisk ramdisk = {area};
+    static struct bcache_device *dd;
+
+    if (dd == NULL) {
+        for (size_t i = 0; i < sizeof(area); i++)
+            area[i] = map_pattern(i);
+        EXPECT_EQ(bench_ramdisk_create("map-ramdisk", &ramdisk, MAP_BLKSIZE,
+            MAP_BLOCKS, &dd), 0);
+    }
+    *rdp = &ramdisk;
+    return dd;
+}
+
+static int map_check(const struct bcache_map *map, size_t offset) {
+    const uint8_t *p = (const uint8_t *)map->data;
+    int errors = 0;
+
+    for (size_t i = 0; i < map->len; i++)
+        errors += p[i] != map_pattern(offset + i);
+    return errors;
+}
+
+TEST(bcache_map, single_block) {
+    struct bench_ramdisk *rd;
+    struct bcache_device *dd = map_device(&rd);
+    struct bcache_map map;
+
+    ASSERT_NE(dd, nullptr);
+
+    /* The span is limited to the block of offset */
+    ASSERT_EQ(bcache_blkdev_map(dd, 100, 1000, &map), MAP_BLKSIZE - 100);
+    EXPECT_EQ(map.len, (size_t)MAP_BLKSIZE - 100);
+    EXPECT_EQ(map_check(&map, 100), 0);
+    EXPECT_EQ(bcache_blkdev_unmap(&map), 0);
+    EXPECT_EQ(bcache_blkdev_unmap(&map), -EINVAL);
+
+    ASSERT_EQ(bcache_blkdev_map(dd, 3 * MAP_BLKSIZE + 8, 16, &map), 16);
+    EXPECT_EQ(map_check(&map, 3 * MAP_BLKSIZE + 8), 0);
+    EXPECT_EQ(bcache_blkdev_unmap(&map), 0);
+
+    EXPECT_EQ(bcache_blkdev_map(dd, 0, 0, &map), -EINVAL);
+    EXPECT_EQ(bcache_blkdev_map(dd, (off_t)MAP_BLKSIZE * MAP_BLOCKS, 16, &map), -EIO);
+}
+
+TEST(bcache_map, gather) {
+    struct bench_ramdisk *rd;
+    struct bcache_device *dd = map_device(&rd);
+    struct bcache_map maps[2];
+    size_t offset = 5 * MAP_BLKSIZE + 300;
+    ssize_t len;
+
+    ASSERT_NE(dd, nullptr);
+    len = bcache_blkdev_mapv(dd, offset, MAP_BLKSIZE, maps, 2);
+    ASSERT_EQ(len, MAP_BLKSIZE);
+    EXPECT_EQ(maps[0].len, (size_t)MAP_BLKSIZE - 300);
+    EXPECT_EQ(maps[1].len, 300u);
+    EXPECT_EQ(map_check(&maps[0], offset), 0);
+    EXPECT_EQ(map_check(&maps[1], offset + maps[0].len), 0);
+    bcache_blkdev_unmapv(maps, 2);
+
+    /* The maps are not enough for the span */
+    len = bcache_blkdev_mapv(dd, 0, 4 * MAP_BLKSIZE, maps, 2);
+    EXPECT_EQ(len, 2 * MAP_BLKSIZE);
+    bcache_blkdev_unmapv(maps, 2);
+
+    /* The span ends in the first block */
+    len = bcache_blkdev_mapv(dd, 10, 20, maps, 2);
+    EXPECT_EQ(len, 20);
+    EXPECT_EQ(maps[1].bd, nullptr);
+    bcache_blkdev_unmapv(maps, 2);
+
+    /* The maps can not hold all the buffers */
+    EXPECT_EQ(bcache_blkdev_mapv(dd, 0, MAP_BLKSIZE, maps, 1000), -EINVAL);
+}
+
+TEST(bcache_map, purge_while_mapped) {
+    struct bench_ramdisk *rd;
+    struct bcache_device *dd = map_device(&rd);
+    struct bcache_map map;
+    uint8_t data[16];
+    uint32_t reads;
+
+    ASSERT_NE(dd, nullptr);
+    ASSERT_EQ(bcache_blkdev_map(dd, 9 * MAP_BLKSIZE, MAP_BLKSIZE, &map), MAP_BLKSIZE);
+
+    /* The mapped data is kept by purge and is dropped by unmap */
+    bcache_purge_dev(dd);
+    rd->area[9 * MAP_BLKSIZE] ^= 0xFF;
+    EXPECT_EQ(map_check(&map, 9 * MAP_BLKSIZE), 0);
+    EXPECT_EQ(bcache_blkdev_unmap(&map), 0);
+
+    reads = rd->reads;
+    ASSERT_EQ(bcache_blkdev_read(dd, data, sizeof(data), 9 * MAP_BLKSIZE),
+        (ssize_t)sizeof(data));
+    EXPECT_GT(rd->reads, reads);
+    EXPECT_EQ(data[0], (uint8_t)(map_pattern(9 * MAP_BLKSIZE) ^ 0xFF));
+    rd->area[9 * MAP_BLKSIZE] ^= 0xFF;
+    bcache_purge_dev(dd);
+}
+
+TEST(bcache_map, modified_block) {
+    struct bench_ramdisk *rd;
+    struct bcache_device *dd = map_device(&rd);
+    struct bcache_map map;
+    uint8_t data[MAP_BLKSIZE];
+
+    ASSERT_NE(dd, nullptr);
+    memset(data, 0xA5, sizeof(data));
+    ASSERT_EQ(bcache_blkdev_write(dd, data, sizeof(data), 12 * MAP_BLKSIZE),
+        (ssize_t)sizeof(data));
+
+    /* The map of a modified block sees the new data and keeps it modified */
+    ASSERT_EQ(bcache_blkdev_map(dd, 12 * MAP_BLKSIZE, MAP_BLKSIZE, &map), MAP_BLKSIZE);
+    EXPECT_EQ(memcmp(map.data, data, sizeof(data)), 0);
+    EXPECT_EQ(bcache_blkdev_unmap(&map), 0);
+    ASSERT_EQ(bcache_syncdev(dd), 0);
+    EXPECT_EQ(memcmp(rd->area + 12 * MAP_BLKSIZE, data, sizeof(data)), 0);
+
+    for (size_t i = 0; i < MAP_BLKSIZE; i++)
+        rd->area[12 * MAP_BLKSIZE + i] = map_pattern(12 * MAP_BLKSIZE + i);
+    bcache_purge_dev(dd);
+}
+
+TEST(bcache_map, hit_throughput) {
+    struct bench_ramdisk *rd;
+    struct bcache_device *dd = map_device(&rd);
+    uint8_t data[MAP_BLKSIZE];
+    uint64_t start, copy_ns, map_ns;
+    uint32_t sum = 0;
+
+    ASSERT_NE(dd, nullptr);
+    start = bench_now();
+    for (int i = 0; i < MAP_LOOPS; i++) {
+        ASSERT_EQ(bcache_blkdev_read(dd, data, sizeof(data), (i & 3) * MAP_BLKSIZE),
+            (ssize_t)sizeof(data));
+        sum += data[i & (MAP_BLKSIZE - 1)];
+    }
+    copy_ns = bench_now() - start;
+
+    start = bench_now();
+    for (int i = 0; i < MAP_LOOPS; i++) {
+        struct bcache_map map;
+
+        ASSERT_EQ(bcache_blkdev_map(dd, (i & 3) * MAP_BLKSIZE, MAP_BLKSIZE, &map),
+            MAP_BLKSIZE);
+        sum -= ((const uint8_t *)map.data)[i & (MAP_BLKSIZE - 1)];
+        bcache_blkdev_unmap(&map);
+    }
+    map_ns = bench_now() - start;
+
+    printf("bcache_map: read %.1f ns/op, map %.1f ns/op\n",
+        (double)copy_ns / MAP_LOOPS, (double)map_ns / MAP_LOOPS);
+    EXPECT_EQ(sum, 0u);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Trace-replay benchmark for bcache replacement policies
+ */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "basework/dev/bcache.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define POLICY_BLKSIZE   512
+#define POLICY_BLOCKS    1024
+#define POLICY_META      4    /* FAT/directory blocks */
+#define POLICY_DATA      100  /* The first block of file data */
+#define POLICY_SCAN      768  /* Length of sequential pass */
+#define POLICY_INTERVAL  32   /* Metadata access interval in sequential pass */
+
+#ifdef CONFIG_BCACHE_SHARDS
+#define POLICY_SHARDS    CONFIG_BCACHE_SHARDS
+#else
+#define POLICY_SHARDS    1
+#endif
+
+struct policy_result {
+    uint64_t ns;
+    struct bcache_stats stats;
+};
+
+static struct bcache_device *policy_device(void) {
+    static uint8_t area[POLICY_BLKSIZE * POLICY_BLOCKS];
+    static struct bench_ramdisk ramdisk = {area};
+    static struct bcache_device *dd;
+
+    /* The read-ahead would hide the misses of sequential pass */
+    if (dd == NULL) {
+        EXPECT_EQ(bench_ramdisk_create("policy-ramdisk", &ramdisk, POLICY_BLKSIZE,
+            POLICY_BLOCKS, &dd), 0);
+        EXPECT_EQ(bcache_set_read_ahead(dd, false), 0);
+    }
+    return dd;
+}
+
+/*
+ * The trace of copying a large file on FAT filesystem: The metadata blocks
+ * are looked up a few times when the file is opened, And then the file data
+ * is read sequentially with periodic FAT accesses.
+ */
+static std::vector<bcache_num_t> policy_trace(size_t *nr_meta) {
+    std::vector<bcache_num_t> trace;
+
+    for (int i = 0; i < POLICY_META; i++) {
+        trace.push_back(i);
+        trace.push_back(i);
+    }
+    *nr_meta = 0;
+    for (int i = 0; i < POLICY_SCAN; i++) {
+        trace.push_back(POLICY_DATA + i);
+        if ((i % POLICY_INTERVAL) == POLICY_INTERVAL - 1) {
+            trace.push_back((i / POLICY_INTERVAL) % POLICY_META);
+            (*nr_meta)++;
+        }
+    }
+    return trace;
+}
+
+/*
+ * The buffers of 2Q hot queue in a shard (The cold queue takes 1/4 of it)
+ */
+static size_t policy_hot_buffers(void) {
+    const struct bcache_config *cfg = &bcache_configuration;
+    uint32_t bufsz = cfg->buffer_min > POLICY_BLKSIZE? cfg->buffer_min: POLICY_BLKSIZE;
+    size_t nr = cfg->size / bufsz / POLICY_SHARDS;
+    size_t cold = nr / 4 > 0? nr / 4: 1;
+
+    return nr > cold? nr - cold: 0;
+}
+
+static void policy_replay(int policy, const std::vector<bcache_num_t> &trace,
+    struct policy_result *result) {
+    struct bcache_device *dd = policy_device();
+    uint64_t start;
+
+    ASSERT_EQ(bcache_set_policy(policy), 0);
+    bcache_purge_dev(dd);
+    bcache_reset_device_stats(dd);
+
+    start = bench_now();
+    for (bcache_num_t block : trace) {
+        struct bcache_buffer *bd;
+
+        ASSERT_EQ(bcache_read(dd, block, &bd), 0);
+        ASSERT_EQ(bcache_release(bd), 0);
+    }
+    result->ns = bench_now() - start;
+    bcache_get_device_stats(dd, &result->stats);
+}
+
+TEST(bcache_policy, trace_replay) {
+    static const char *names[] = {"LRU", "2Q"};
+    struct policy_result results[2];
+    size_t nr_meta;
+
+    ASSERT_NE(policy_device(), nullptr);
+    std::vector<bcache_num_t> trace = policy_trace(&nr_meta);
+
+    for (int policy = BCACHE_POLICY_LRU; policy <= BCACHE_POLICY_2Q; policy++) {
+        const struct bcache_stats *st = &results[policy].stats;
+
+        policy_replay(policy, trace, &results[policy]);
+        printf("bcache_policy: %-3s accesses(%zu) hits(%u) misses(%u) hit-ratio(%.1f%%)"
+            " hot(%u) cold(%u) ghost(%u) evictions(%u) time(%llu us)\n",
+            names[policy], trace.size(), st->read_hits, st->read_misses,
+            100.0 * st->read_hits / trace.size(), st->hot_hits, st->cold_hits,
+            st->ghost_hits, st->evictions,
+            (unsigned long long)results[policy].ns / 1000);
+    }
+
+    /*
+     * The metadata blocks survive the sequential pass only with 2Q (They are
+     * in the same shard, So its hot queue must hold them all)
+     */
+    if (policy_hot_buffers() > POLICY_META) {
+        EXPECT_EQ(results[BCACHE_POLICY_2Q].stats.read_hits, POLICY_META + nr_meta);
+        EXPECT_GT(results[BCACHE_POLICY_2Q].stats.read_hits,
+            results[BCACHE_POLICY_LRU].stats.read_hits);
+    } else {
+        printf("bcache_policy: The shard is too small for the metadata blocks\n");
+    }
+    EXPECT_EQ(bcache_set_policy(-1), -EINVAL);
+    EXPECT_EQ(bcache_set_policy(BCACHE_POLICY_LRU), 0);
+}
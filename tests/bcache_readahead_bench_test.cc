@@ -0,0 +1,104 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for multi-stream read-ahead of bcache (CONFIG_BCACHE_READ_AHEAD)
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "basework/dev/bcache.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#ifdef CONFIG_BCACHE_READ_AHEAD
+
+#define RA_BLKSIZE   512
+#define RA_BLOCKS    512
+#define RA_FILESIZE  128  /* Blocks of each file */
+#define RA_RANDOM    256
+#define RA_LATENCY   200  /* us */
+
+static struct bcache_device *ra_device(void) {
+    /* Emulate the command latency of media */
+    static uint8_t area[RA_BLKSIZE * RA_BLOCKS];
+    static struct bench_ramdisk ramdisk = {area, RA_LATENCY, RA_LATENCY};
+    static struct bcache_device *dd;
+
+    if (dd == NULL) {
+        bench_ramdisk_fill(&ramdisk, RA_BLKSIZE, RA_BLOCKS);
+        EXPECT_EQ(bench_ramdisk_create("ra-ramdisk", &ramdisk, RA_BLKSIZE,
+            RA_BLOCKS, &dd), 0);
+    }
+    return dd;
+}
+
+static int ra_read(struct bcache_device *dd, bcache_num_t block) {
+    uint8_t data[16];
+
+    if (bcache_blkdev_read(dd, data, sizeof(data), (off_t)block * RA_BLKSIZE) !=
+        (ssize_t)sizeof(data) || data[0] != (uint8_t)block)
+        return 1;
+    return 0;
+}
+
+static void ra_print(const char *phase, const struct bcache_stats *st, uint64_t ns) {
+    printf("bcache_readahead: %-10s hits(%u) misses(%u) transfers(%u) streams(%u)"
+        " cancels(%u) time(%llu us)\n", phase, st->read_hits, st->read_misses,
+        st->read_ahead_transfers, st->read_ahead_streams, st->read_ahead_cancels,
+        (unsigned long long)ns / 1000);
+    for (int i = 0; i < BCACHE_READ_AHEAD_STREAMS; i++) {
+        const struct bcache_stream_stats *ss = &st->streams[i];
+        if (ss->triggers)
+            printf("bcache_readahead:   stream%d triggers(%u) blocks(%u) thrashes(%u)"
+                " window(%u)\n", i, ss->triggers, ss->blocks, ss->thrashes, ss->window);
+    }
+}
+
+TEST(bcache_readahead, parallel_streams) {
+    struct bcache_device *dd = ra_device();
+    struct bcache_stats seq, rnd;
+    uint32_t window = 0, seed = 1;
+    uint64_t start;
+    int errors = 0;
+
+    ASSERT_NE(dd, nullptr);
+    if (bcache_configuration.max_read_ahead_blocks == 0)
+        return;
+    bcache_purge_dev(dd);
+    bcache_reset_device_stats(dd);
+
+    /* Two files are read in parallel */
+    start = bench_now();
+    for (bcache_num_t i = 0; i < RA_FILESIZE; i++) {
+        errors += ra_read(dd, i);
+        errors += ra_read(dd, RA_BLOCKS / 2 + i);
+    }
+    bcache_get_device_stats(dd, &seq);
+    ra_print("sequential", &seq, bench_now() - start);
+
+    /* Random access */
+    bcache_purge_dev(dd);
+    bcache_reset_device_stats(dd);
+    start = bench_now();
+    for (int i = 0; i < RA_RANDOM; i++) {
+        seed = seed * 1103515245u + 12345u;
+        errors += ra_read(dd, (seed >> 8) % RA_BLOCKS);
+    }
+    bcache_get_device_stats(dd, &rnd);
+    ra_print("random", &rnd, bench_now() - start);
+
+    for (int i = 0; i < BCACHE_READ_AHEAD_STREAMS; i++)
+        window = seq.streams[i].window > window? seq.streams[i].window: window;
+
+    EXPECT_EQ(errors, 0);
+    EXPECT_LT(rnd.read_ahead_transfers, (uint32_t)RA_RANDOM / 8);
+
+    /* The two streams evict each other if only one is tracked */
+    if (BCACHE_READ_AHEAD_STREAMS >= 2) {
+        EXPECT_GE(seq.read_ahead_streams, 2u);
+        EXPECT_GT(seq.read_hits, seq.read_misses);
+        EXPECT_GT(window, bcache_configuration.max_read_ahead_blocks / 4);
+    }
+}
+
+#endif /* CONFIG_BCACHE_READ_AHEAD */
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for cache-hit path of sharded bcache (CONFIG_BCACHE_SHARDS)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "basework/dev/bcache.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define SHARD_BLKSIZE   512
+#define SHARD_BLOCKS    64
+#define SHARD_LOOPS     20000
+#define SHARD_MAXTHRS   4
+#define SHARD_WORKSET   2
+
+static std::atomic<int> shard_errors;
+
+static struct bcache_device *shard_device(void) {
+    static uint8_t area[SHARD_BLKSIZE * SHARD_BLOCKS];
+    static struct bench_ramdisk ramdisk = {area};
+    static struct bcache_device *dd;
+
+    if (dd == NULL) {
+        bench_ramdisk_fill(&ramdisk, SHARD_BLKSIZE, SHARD_BLOCKS);
+        EXPECT_EQ(bench_ramdisk_create("shard-ramdisk", &ramdisk, SHARD_BLKSIZE,
+            SHARD_BLOCKS, &dd), 0);
+    }
+    return dd;
+}
+
+/*
+ * Each thread reads a few blocks of its own region repeatedly, So all the
+ * accesses hit the cache after the first loop.
+ */
+static void *shard_reader(void *arg) {
+    struct bcache_device *dd = shard_device();
+    bcache_num_t base = (bcache_num_t)(uintptr_t)arg;
+    uint8_t data[16];
+
+    for (int i = 0; i < SHARD_LOOPS; i++) {
+        bcache_num_t block = base + (i % SHARD_WORKSET);
+
+        if (bcache_blkdev_read(dd, data, sizeof(data), 
+            (off_t)block * SHARD_BLKSIZE) != (ssize_t)sizeof(data) ||
+            data[0] != (uint8_t)block)
+            shard_errors++;
+    }
+    return NULL;
+}
+
+static double shard_run(int nthreads) {
+    pthread_t threads[SHARD_MAXTHRS];
+    uint64_t start;
+
+    start = bench_now();
+    for (int i = 0; i < nthreads; i++) {
+        uintptr_t base = (uintptr_t)i * (SHARD_BLOCKS / SHARD_MAXTHRS);
+        pthread_create(&threads[i], NULL, shard_reader, (void *)base);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    return (double)nthreads * SHARD_LOOPS * 1e9 / (double)(bench_now() - start);
+}
+
+TEST(bcache_shard, hit_throughput) {
+    struct bcache_device *dd = shard_device();
+    struct bcache_stats stats;
+
+    ASSERT_NE(dd, nullptr);
+
+    /* Warm up */
+    shard_run(SHARD_MAXTHRS);
+    bcache_reset_device_stats(dd);
+
+    for (int n = 1; n <= SHARD_MAXTHRS; n <<= 1) {
+        double ops = shard_run(n);
+        printf("bcache_shard: threads(%d) read(%.0f ops/s)\n", n, ops);
+    }
+
+    bcache_get_device_stats(dd, &stats);
+    printf("bcache_shard: hits(%u) misses(%u)\n", stats.read_hits, stats.read_misses);
+    EXPECT_EQ(shard_errors, 0);
+    EXPECT_EQ(stats.read_hits + stats.read_misses, 7u * SHARD_LOOPS);
+}
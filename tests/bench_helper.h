@@ -0,0 +1,82 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Shared helpers of benchmark tests
+ */
+#ifndef BASEWORK_TESTS_BENCH_HELPER_H_
+#define BASEWORK_TESTS_BENCH_HELPER_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef BASEWORK_DEV_BCACHE_H_
+/*
+ * RAM backed bcache device, The latency emulates the media (Zero for none)
+ */
+struct bench_ramdisk {
+    uint8_t *area;
+    uint32_t rd_latency;  /* us per read request */
+    uint32_t wr_latency;  /* us per written block */
+    uint32_t reads;       /* Blocks read from the area */
+    uint32_t wr_failures; /* The next write requests that fail with -EIO */
+};
+
+static inline int bench_ramdisk_driver(struct bcache_device *dd, uint32_t req,
+    void *argp) {
+    struct bench_ramdisk *rd = (struct bench_ramdisk *)bcache_disk_get_driver_data(dd);
+    struct bcache_request *r = (struct bcache_request *)argp;
+    bool read;
+
+    if (req != BCACHE_IO_REQUEST)
+        return bcache_ioctl(dd, req, argp);
+
+    read = r->req == BCACHE_DEV_REQ_READ;
+    if (!read && rd->wr_failures > 0) {
+        rd->wr_failures--;
+        bcache_request_done(r, -EIO);
+        return 0;
+    }
+    if (read && rd->rd_latency)
+        usleep(rd->rd_latency);
+    else if (!read && rd->wr_latency)
+        usleep(rd->wr_latency * r->bufnum);
+    for (uint32_t i = 0; i < r->bufnum; i++) {
+        struct bcache_sg_buffer *sg = &r->bufs[i];
+        uint8_t *p = rd->area + sg->block * dd->block_size;
+
+        if (read) {
+            memcpy(sg->buffer, p, sg->length);
+            __atomic_fetch_add(&rd->reads, 1, __ATOMIC_RELAXED);
+        } else {
+            memcpy(p, sg->buffer, sg->length);
+        }
+    }
+    bcache_request_done(r, 0);
+    return 0;
+}
+
+/* Fill every byte of block i with i */
+static inline void bench_ramdisk_fill(struct bench_ramdisk *rd, uint32_t blksize,
+    uint32_t blocks) {
+    for (uint32_t i = 0; i < blocks; i++)
+        memset(rd->area + i * blksize, (int)i, blksize);
+}
+
+static inline int bench_ramdisk_create(const char *name, struct bench_ramdisk *rd,
+    uint32_t blksize, uint32_t blocks, struct bcache_device **pdd) {
+    return bcache_blkdev_create(name, blksize, blocks, bench_ramdisk_driver,
+        rd, pdd);
+}
+#endif /* BASEWORK_DEV_BCACHE_H_ */
+
+#endif /* BASEWORK_TESTS_BENCH_HELPER_H_ */
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test and benchmark for deferred binary log
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "basework/lib/binlog.h"
+#include "basework/lib/iovpr.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define BINLOG_LOOPS 200000
+
+static std::mutex binlog_mtx;
+static std::string binlog_text;
+
+static void binlog_putc(int c, void *arg) {
+    ((std::string *)arg)->push_back((char)c);
+}
+
+static int binlog_capture(void *context, const char *fmt, va_list ap) {
+    std::lock_guard<std::mutex> lock(binlog_mtx);
+    return _IO_Vprintf(binlog_putc, context, fmt, ap);
+}
+
+static std::string binlog_expect(const char *fmt, ...) {
+    std::string s;
+    va_list ap;
+
+    va_start(ap, fmt);
+    _IO_Vprintf(binlog_putc, &s, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+static struct printer text_printer = {binlog_capture, &binlog_text};
+static struct printer bin_printer;
+
+static void binlog_setup(void) {
+    static bool initialized;
+
+    if (!initialized) {
+        binlog_format_init(&bin_printer);
+        binlog_init(&text_printer, false);
+        initialized = true;
+    }
+}
+
+/*
+ * The record may be formatted by the drain timer, So wait for the text
+ */
+static std::string binlog_wait(size_t len) {
+    for (int i = 0; i < 100; i++) {
+        binlog_drain();
+        {
+            std::lock_guard<std::mutex> lock(binlog_mtx);
+            if (binlog_text.size() >= len) {
+                std::string s = binlog_text;
+                binlog_text.clear();
+                return s;
+            }
+        }
+        usleep(10000);
+    }
+    return std::string();
+}
+
+#define BINLOG_CHECK(fmt, ...) \
+do { \
+    std::string expect = binlog_expect(fmt, ##__VA_ARGS__); \
+    virt_format(&bin_printer, fmt, ##__VA_ARGS__); \
+    EXPECT_EQ(binlog_wait(expect.size()), expect) << fmt; \
+} while (0)
+
+TEST(binlog, format) {
+    char local[16];
+    uint8_t data[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+
+    binlog_setup();
+    strcpy(local, "local");
+    BINLOG_CHECK("plain text\n");
+    BINLOG_CHECK("%d %u %x %X %o %c %%\n", -5, 3000000000u, 0xabc, 0xdef, 8, 'z');
+    BINLOG_CHECK("%ld %lu %lld %llu %zu %p\n", -1L, 2UL, -3LL, 4ULL, (size_t)77, (void *)0x1234);
+    BINLOG_CHECK("%08x|%-6d|%6d|%#x|%5.3d\n", 0x12, 4, 5, 0x10, 7);
+    BINLOG_CHECK("%*d|%-*d|%.*s|%*.*d\n", 6, 42, 4, 7, 3, "abcdef", 8, 4, 9);
+    BINLOG_CHECK("%s %s %.2s %10s|%-8s|\n", "hello", local, "xyz", "r", "l");
+    BINLOG_CHECK("%8D|%*D\n", data, ":", 4, data, "");
+}
+
+TEST(binlog, cost) {
+    const char *fmt = "<binlog_test>: request(%d) of %s failed at 0x%08x (%d)\n";
+    uint64_t t0, text_ns, bin_ns = 0;
+    size_t text_bytes = 0, bin_bytes = 0;
+
+    binlog_setup();
+    t0 = bench_now();
+    for (int i = 0; i < BINLOG_LOOPS; i++)
+        text_bytes += binlog_expect(fmt, i, "flash", i * 512, -5).size();
+    text_ns = bench_now() - t0;
+
+    /* The drain is not included (It is done by the drain timer) */
+    for (int i = 0; i < BINLOG_LOOPS; i += 32) {
+        t0 = bench_now();
+        for (int j = i; j < i + 32; j++)
+            bin_bytes += virt_format(&bin_printer, fmt, j, "flash", j * 512, -5);
+        bin_ns += bench_now() - t0;
+        binlog_wait(1);
+    }
+
+    printf("binlog: format(%.1f ns/call %zu bytes) binary(%.1f ns/call %zu bytes)"
+        " dropped(%u)\n",
+        (double)text_ns / BINLOG_LOOPS, text_bytes / BINLOG_LOOPS,
+        (double)bin_ns / BINLOG_LOOPS, bin_bytes / BINLOG_LOOPS, binlog_dropped());
+    EXPECT_LT(bin_bytes, text_bytes);
+}
+
+/*
+ * The drain runs while the producers wrap the ring many times. Each record
+ * must be output whole and once, in the order of its producer (The drained slots
+ * are cleared, So a slot that is reserved again is not seen as committed)
+ */
+TEST(binlog, ring_wrap) {
+    const int producers = 2, records = 20000;
+    static const char pad[] = "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx";
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop(false);
+    std::vector<int> next(producers, 0);
+    uint32_t dropped;
+    std::string text;
+    size_t pos = 0;
+    int lines = 0;
+
+    binlog_setup();
+    binlog_wait(0);
+    dropped = binlog_dropped();
+
+    std::thread drainer([&stop] {
+        while (!stop.load())
+            binlog_drain();
+    });
+    for (int t = 0; t < producers; t++) {
+        threads.emplace_back([t, records] {
+            /* The dropped record is written again after the drain */
+            for (int i = 0; i < records; i++) {
+                while (!virt_format(&bin_printer, "w%d %d %.*s\n", t, i, i % 40, pad))
+                    usleep(10);
+            }
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+    stop.store(true);
+    drainer.join();
+    binlog_drain();
+    dropped = binlog_dropped() - dropped;
+
+    {
+        std::lock_guard<std::mutex> lock(binlog_mtx);
+        text.swap(binlog_text);
+    }
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        int t, i, n = 0;
+
+        ASSERT_NE(end, std::string::npos);
+        ASSERT_EQ(sscanf(text.c_str() + pos, "w%d %d%n", &t, &i, &n), 2)
+            << text.substr(pos, end - pos);
+        ASSERT_EQ(text[pos + n++], ' ');
+        ASSERT_TRUE(t >= 0 && t < producers);
+        ASSERT_EQ(i, next[t]);
+        ASSERT_EQ(text.substr(pos + n, end - pos - n), std::string(i % 40, 'x'));
+        next[t] = i + 1;
+        pos = end + 1;
+        lines++;
+    }
+    printf("binlog: wrap records(%d) retried(%u)\n", lines, dropped);
+    EXPECT_EQ(lines, producers * records);
+}
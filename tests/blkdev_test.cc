@@ -209,3 +209,137 @@ TEST_F(cc_blkdev_test, disklog) {
     ASSERT_STREQ(copyright, str_buffer);
 
 }
+
+#ifndef CONFIG_BCACHE
+#ifndef CONFIG_BLKDEV_NR_BUFS
+#define CONFIG_BLKDEV_NR_BUFS 4
+#endif
+#define RAM_BLKSZ   32
+#define RAM_WRITES  (CONFIG_BLKDEV_NR_BUFS * 16)
+
+/*
+ * The RAM disk records the order of the written blocks
+ */
+struct ram_disk {
+    char *area;
+    int reads;
+    int writes;
+    size_t written[RAM_WRITES];
+};
+
+static int ram_read(device_t dev, void *buf, size_t size, long offset) {
+    struct ram_disk *rd = (struct ram_disk *)dev;
+    memcpy(buf, rd->area + offset, size);
+    rd->reads++;
+    return 0;
+}
+
+static int ram_write(device_t dev, const void *buf, size_t size, long offset) {
+    struct ram_disk *rd = (struct ram_disk *)dev;
+    memcpy(rd->area + offset, buf, size);
+    if (rd->writes < RAM_WRITES)
+        rd->written[rd->writes] = offset / RAM_BLKSZ;
+    rd->writes++;
+    return 0;
+}
+
+static int ram_erase(device_t dev, long offset, size_t size) {
+    (void) dev;
+    (void) offset;
+    (void) size;
+    return 0;
+}
+
+static int ram_ioctl(device_t dev, long cmd, void *arg) {
+    (void) dev;
+    (void) cmd;
+    (void) arg;
+    return 0;
+}
+
+static void ram_disk_setup(struct disk_device *dd, struct ram_disk *rd,
+    const char *name, size_t blocks) {
+    rd->area = new char[blocks * RAM_BLKSZ]();
+    strcpy(dd->name, name);
+    dd->dev = rd;
+    dd->len = blocks * RAM_BLKSZ;
+    dd->blk_size = RAM_BLKSZ;
+    dd->read = ram_read;
+    dd->write = ram_write;
+    dd->erase = ram_erase;
+    dd->ioctl = ram_ioctl;
+}
+
+static void ram_block_fill(char *buf, size_t blkno, int seed) {
+    memset(buf, (int)(blkno * 3 + seed), RAM_BLKSZ);
+}
+
+TEST(simple_blkdev, hash_lookup) {
+    static struct disk_device dd;
+    static struct ram_disk rd;
+    size_t nr_hash, blocks;
+    char buf[RAM_BLKSZ], expect[RAM_BLKSZ];
+
+    /* The blocks of a stride of the hash size are in the same bucket */
+    for (nr_hash = 1; nr_hash < CONFIG_BLKDEV_NR_BUFS; nr_hash <<= 1);
+    blocks = nr_hash * CONFIG_BLKDEV_NR_BUFS + CONFIG_BLKDEV_NR_BUFS * 8;
+    ram_disk_setup(&dd, &rd, "ram-hash", blocks);
+    ASSERT_EQ(simple_blkdev_init(&dd), 0);
+
+    /* Many inserts and evictions */
+    for (size_t i = 0; i < CONFIG_BLKDEV_NR_BUFS * 8; i++) {
+        ram_block_fill(buf, i, 1);
+        ASSERT_EQ(simple_blkdev_write(&dd, buf, RAM_BLKSZ, i * RAM_BLKSZ), RAM_BLKSZ);
+    }
+    for (size_t i = 0; i < CONFIG_BLKDEV_NR_BUFS * 8; i++) {
+        ASSERT_EQ(simple_blkdev_read(&dd, buf, RAM_BLKSZ, i * RAM_BLKSZ), RAM_BLKSZ);
+        ram_block_fill(expect, i, 1);
+        ASSERT_EQ(memcmp(buf, expect, RAM_BLKSZ), 0) << "block " << i;
+    }
+
+    /* Every buffer hashed to one bucket, And each of them is still found */
+    for (size_t i = 0; i < CONFIG_BLKDEV_NR_BUFS; i++) {
+        size_t blkno = CONFIG_BLKDEV_NR_BUFS * 8 + i * nr_hash;
+
+        ram_block_fill(buf, blkno, 2);
+        ASSERT_EQ(simple_blkdev_write(&dd, buf, RAM_BLKSZ, blkno * RAM_BLKSZ), RAM_BLKSZ);
+    }
+    rd.reads = 0;
+    for (size_t i = CONFIG_BLKDEV_NR_BUFS; i > 0; i--) {
+        size_t blkno = CONFIG_BLKDEV_NR_BUFS * 8 + (i - 1) * nr_hash;
+
+        ASSERT_EQ(simple_blkdev_read(&dd, buf, RAM_BLKSZ, blkno * RAM_BLKSZ), RAM_BLKSZ);
+        ram_block_fill(expect, blkno, 2);
+        ASSERT_EQ(memcmp(buf, expect, RAM_BLKSZ), 0) << "block " << blkno;
+    }
+    EXPECT_EQ(rd.reads, 0);
+    ASSERT_EQ(simple_blkdev_sync(), 0);
+}
+
+TEST(simple_blkdev, writeback_in_expire_order) {
+    static const size_t order[] = {5, 2, 7, 1};
+    static struct disk_device dd;
+    static struct ram_disk rd;
+    char buf[RAM_BLKSZ];
+    size_t n = CONFIG_BLKDEV_NR_BUFS < 4? CONFIG_BLKDEV_NR_BUFS: 4;
+
+    ram_disk_setup(&dd, &rd, "ram-expire", 8);
+    ASSERT_EQ(simple_blkdev_init(&dd), 0);
+
+    for (size_t i = 0; i < n; i++) {
+        ram_block_fill(buf, order[i], 1);
+        ASSERT_EQ(simple_blkdev_write(&dd, buf, RAM_BLKSZ, order[i] * RAM_BLKSZ), RAM_BLKSZ);
+    }
+
+    /* Rewriting a dirty buffer does not extend its hold time */
+    ram_block_fill(buf, order[0], 2);
+    ASSERT_EQ(simple_blkdev_write(&dd, buf, RAM_BLKSZ, order[0] * RAM_BLKSZ), RAM_BLKSZ);
+    EXPECT_EQ(rd.writes, 0);
+
+    ASSERT_EQ(simple_blkdev_sync(), 0);
+    ASSERT_EQ(rd.writes, (int)n);
+    for (size_t i = 0; i < n; i++)
+        EXPECT_EQ(rd.written[i], order[i]);
+    EXPECT_EQ(memcmp(rd.area + order[0] * RAM_BLKSZ, buf, RAM_BLKSZ), 0);
+}
+#endif /* !CONFIG_BCACHE */
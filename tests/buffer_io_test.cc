@@ -0,0 +1,150 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test for the LRU replacement and the flush order of buffered_io blocks
+ */
+#include <string.h>
+#include <vector>
+
+#include "basework/dev/disk.h"
+#include "basework/dev/buffer_io.h"
+#include "gtest/gtest.h"
+
+#define BIO_BLKSZ   256
+#define BIO_WAYS    CONFIG_BUFFERED_IO_MAX_BLKS
+#define BIO_BLOCKS  (BIO_WAYS * 2)
+
+/*
+ * The RAM disk records the order of the erased blocks
+ */
+struct bio_disk {
+    char area[BIO_BLKSZ * BIO_BLOCKS];
+    std::vector<uint32_t> erased;
+};
+
+static int bio_disk_read(device_t dev, void *buf, size_t size, long offset) {
+    struct bio_disk *disk = (struct bio_disk *)dev;
+    memcpy(buf, disk->area + offset, size);
+    return 0;
+}
+
+static int bio_disk_write(device_t dev, const void *buf, size_t size, long offset) {
+    struct bio_disk *disk = (struct bio_disk *)dev;
+    memcpy(disk->area + offset, buf, size);
+    return 0;
+}
+
+static int bio_disk_erase(device_t dev, long offset, size_t size) {
+    struct bio_disk *disk = (struct bio_disk *)dev;
+    memset(disk->area + offset, 0xFF, size);
+    disk->erased.push_back(offset / BIO_BLKSZ);
+    return 0;
+}
+
+static int bio_disk_ioctl(device_t dev, long cmd, void *arg) {
+    (void) dev;
+    (void) cmd;
+    (void) arg;
+    return 0;
+}
+
+static void bio_write_block(struct buffered_io *bio, uint32_t blkno) {
+    char data[16];
+
+    memset(data, (int)blkno, sizeof(data));
+    ASSERT_EQ(buffered_write(bio, data, sizeof(data), blkno * BIO_BLKSZ + 8),
+        (ssize_t)sizeof(data));
+}
+
+static void bio_disk_setup(struct bio_disk *disk, struct disk_device *dd) {
+    memset(disk->area, 0xFF, sizeof(disk->area));
+    disk->erased.clear();
+    strcpy(dd->name, "bio-ram");
+    dd->dev = disk;
+    dd->len = sizeof(disk->area);
+    dd->blk_size = BIO_BLKSZ;
+    dd->read = bio_disk_read;
+    dd->write = bio_disk_write;
+    dd->erase = bio_disk_erase;
+    dd->ioctl = bio_disk_ioctl;
+}
+
+TEST(buffered_io, lru_replacement) {
+    static struct bio_disk disk;
+    static struct disk_device dd;
+    struct buffered_io *bio;
+    struct buffered_iostat st;
+    std::vector<uint32_t> evicted;
+    char data[16];
+
+    bio_disk_setup(&disk, &dd);
+    ASSERT_EQ(buffered_iocreate(&dd, BIO_BLKSZ, BIO_WAYS + 1, false, &bio), -EINVAL);
+    ASSERT_EQ(buffered_iocreate(&dd, BIO_BLKSZ, BIO_WAYS, false, &bio), 0);
+
+    /* Each block misses once, And the second write of block 0 hits */
+    for (uint32_t i = 0; i < BIO_WAYS; i++)
+        bio_write_block(bio, i);
+    bio_write_block(bio, 0);
+    buffered_iostat(bio, &st);
+    EXPECT_EQ(st.fills, (uint32_t)BIO_WAYS);
+    EXPECT_EQ(st.hits, 1u);
+    EXPECT_EQ(st.erases, 0u);
+
+    /*
+     * The misses replace the least recently written blocks (Block 0 was
+     * written last, So it is replaced after the others)
+     */
+    for (uint32_t i = 0; i < BIO_WAYS; i++) {
+        bio_write_block(bio, BIO_WAYS + i);
+        evicted.push_back(i < BIO_WAYS - 1? i + 1: 0);
+    }
+    EXPECT_EQ(disk.erased, evicted);
+    buffered_iostat(bio, &st);
+    EXPECT_EQ(st.fills, (uint32_t)BIO_WAYS * 2);
+    EXPECT_EQ(st.hits, 1u);
+    EXPECT_EQ(st.erases, (uint32_t)BIO_WAYS);
+
+    /* The replaced and the cached blocks read back the written data */
+    for (uint32_t i = 0; i < BIO_BLOCKS; i++) {
+        ASSERT_EQ(buffered_read(bio, data, sizeof(data), i * BIO_BLKSZ + 8),
+            (ssize_t)sizeof(data));
+        for (size_t k = 0; k < sizeof(data); k++)
+            ASSERT_EQ(data[k], (char)i) << "block " << i;
+    }
+
+    ASSERT_EQ(buffered_ioflush(bio, true), 0);
+    EXPECT_EQ(disk.erased.size(), (size_t)BIO_BLOCKS);
+    for (uint32_t i = 0; i < BIO_BLOCKS; i++)
+        EXPECT_EQ(disk.area[i * BIO_BLKSZ + 8], (char)i);
+    buffered_iodestroy(bio);
+}
+
+TEST(buffered_io, flush_order) {
+    static struct bio_disk disk;
+    static struct disk_device dd;
+    struct buffered_io *bio;
+
+    bio_disk_setup(&disk, &dd);
+    ASSERT_EQ(buffered_iocreate(&dd, BIO_BLKSZ, BIO_WAYS, false, &bio), 0);
+
+    /*
+     * The blocks are written back in the order of their last write,
+     * Not in the order of their slots
+     */
+    bio_write_block(bio, 3);
+    bio_write_block(bio, 2);
+    bio_write_block(bio, 1);
+    bio_write_block(bio, 0);
+    bio_write_block(bio, 2);
+    ASSERT_EQ(buffered_ioflush(bio, false), 0);
+    EXPECT_EQ(disk.erased, std::vector<uint32_t>({3, 1, 0, 2}));
+
+    /* The header (block 0) that is updated after its data goes out last */
+    disk.erased.clear();
+    bio_write_block(bio, 1);
+    bio_write_block(bio, 3);
+    bio_write_block(bio, 0);
+    ASSERT_EQ(buffered_ioflush(bio, false), 0);
+    EXPECT_EQ(disk.erased, std::vector<uint32_t>({1, 3, 0}));
+    buffered_iodestroy(bio);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test for the compressed segments of disklog
+ */
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "basework/lib/disklog.h"
+#include "gtest/gtest.h"
+
+#ifdef CONFIG_DISKLOG_COMPRESS
+#define SEGMENT_LINES 3000
+
+static bool segment_collect(void *ctx, char *buf, size_t size) {
+    ((std::string *)ctx)->append(buf, size);
+    return true;
+}
+
+static std::string segment_fill(int lines) {
+    static const char *const mods[] = {"<ble>", "<sensor>", "<ui>", "<power>"};
+    std::string text;
+    char msg[128];
+
+    for (int i = 0; i < lines; i++) {
+        int n = snprintf(msg, sizeof(msg), "[%d.%03d] %s event(%d) value=%d\n",
+            i / 10, (i * 37) % 1000, mods[i % 4], i % 13, (i * 7919) % 1000);
+        if (disklog_input(msg, n))
+            break;
+        text.append(msg, n);
+    }
+    return text;
+}
+
+TEST(disklog_segment, text) {
+    std::string expect, text;
+
+    ASSERT_EQ(disklog_init(), 0);
+    disklog_reset();
+    expect = segment_fill(SEGMENT_LINES);
+
+    ASSERT_EQ(disklog_ouput(segment_collect, &text, 0), 0);
+    EXPECT_EQ(text, expect);
+}
+
+TEST(disklog_segment, seek) {
+    struct disklog_seghdr hdr;
+    std::vector<char> text(CONFIG_DISKLOG_SEGMENT_RAW);
+    std::string expect, all;
+    uint32_t first, last, seq;
+
+    ASSERT_EQ(disklog_init(), 0);
+    disklog_reset();
+    expect = segment_fill(SEGMENT_LINES);
+    disklog_flush();
+
+    ASSERT_EQ(disklog_segment_range(&first, &last), 0);
+    ASSERT_EQ(disklog_segment_find(0, &seq), 0);
+    EXPECT_EQ(seq, first);
+
+    /* The segments are decoded alone and joined in order */
+    for (seq = first; seq <= last; seq++) {
+        ssize_t len = disklog_segment_read(seq, text.data(), text.size(),
+            true, &hdr);
+        ASSERT_GE(len, 0);
+        EXPECT_EQ(hdr.seq, seq);
+        EXPECT_LE(hdr.ts_first, hdr.ts_last);
+        all.append(text.data(), len);
+    }
+    EXPECT_EQ(all, expect);
+}
+
+TEST(disklog_segment, upload) {
+    struct log_upload_class luc = {};
+    std::string expect, image, text;
+
+    ASSERT_EQ(disklog_init(), 0);
+    disklog_reset();
+    expect = segment_fill(SEGMENT_LINES);
+
+    luc.upload = segment_collect;
+    luc.ctx = &image;
+    luc.compressed = true;
+    disklog_upload_cb(&luc);
+    printf("disklog_segment: text(%zu bytes) uploaded(%zu bytes)\n",
+        expect.size(), image.size());
+    EXPECT_LT(image.size(), expect.size() / 2);
+
+    /* The uploaded log has been consumed */
+    ASSERT_EQ(disklog_ouput(segment_collect, &text, 0), 0);
+    EXPECT_EQ(text, "");
+}
+#endif /* CONFIG_DISKLOG_COMPRESS */
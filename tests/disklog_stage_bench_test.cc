@@ -0,0 +1,197 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test and benchmark for the staging ring of disklog
+ */
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "basework/lib/disklog.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+/* The load is less than the syslog partition (100KB), So nothing is overwritten */
+#define STAGE_PRODUCERS 4
+#define STAGE_LOOPS     2000
+#define STAGE_MSGSIZE   10 /* "T0:000000\n" */
+
+static bool stage_collect(void *ctx, char *buf, size_t size) {
+    ((std::string *)ctx)->append(buf, size);
+    return true;
+}
+
+TEST(disklog_stage, order) {
+    std::string expect, text;
+    char msg[64];
+
+    ASSERT_EQ(disklog_init(), 0);
+    disklog_reset();
+
+    /* Less than the staging ring (The flush timer may not run) */
+    for (int i = 0; i < 50; i++) {
+        int n = snprintf(msg, sizeof(msg), "staged message %d\n", i);
+        ASSERT_EQ(disklog_input(msg, n), 0);
+        expect.append(msg, n);
+    }
+
+    /* The staged log is written before it is read */
+    ASSERT_EQ(disklog_ouput(stage_collect, &text, 0), 0);
+    EXPECT_EQ(text, expect);
+}
+
+TEST(disklog_stage, long_input) {
+    std::string expect, text;
+    static const size_t sizes[] = {1500, 3000, 9000};
+
+    ASSERT_EQ(disklog_init(), 0);
+    disklog_reset();
+
+    /* The long log is staged whole or written directly, But never partly */
+    for (int i = 0; i < 3; i++) {
+        std::string line = "short " + std::to_string(i) + "\n";
+        std::string log(sizes[i], 'a' + i);
+
+        log.back() = '\n';
+        ASSERT_EQ(disklog_input(line.data(), line.size()), 0);
+        ASSERT_EQ(disklog_input(log.data(), log.size()), 0);
+        expect += line + log;
+    }
+
+    ASSERT_EQ(disklog_ouput(stage_collect, &text, 0), 0);
+    EXPECT_EQ(text, expect);
+}
+
+/*
+ * The long inputs (staged and written directly) are never interleaved
+ * with the short ones that are input concurrently
+ */
+static int stage_long_round(int *lost_long) {
+    static const size_t sizes[] = {1500, 2000, 700, 5000};
+    std::vector<std::thread> threads;
+    std::vector<int> lost(STAGE_PRODUCERS + 1);
+    std::string text;
+    int errors = 0, longs = 0;
+
+    disklog_reset();
+    for (int t = 0; t < STAGE_PRODUCERS; t++) {
+        threads.emplace_back([t, &lost] {
+            char msg[16];
+
+            for (int i = 0; i < STAGE_LOOPS / 4; i++) {
+                snprintf(msg, sizeof(msg), "T%d:%06d\n", t, i);
+                if (disklog_input(msg, STAGE_MSGSIZE))
+                    lost[t]++;
+            }
+        });
+    }
+    threads.emplace_back([&lost] {
+        for (int i = 0; i < 20; i++) {
+            std::string log = "L" + std::to_string(i) + ":";
+
+            log.append(sizes[i % 4] - log.size() - 1, 'a' + i % 26);
+            log += '\n';
+            if (disklog_input(log.data(), log.size()))
+                lost[STAGE_PRODUCERS]++;
+        }
+    });
+    for (auto &thr : threads)
+        thr.join();
+
+    /* Each line is either a whole short message or a whole long one */
+    if (disklog_ouput(stage_collect, &text, 0))
+        return 1;
+    for (size_t ofs = 0, end; ofs < text.size(); ofs = end + 1) {
+        int t, i;
+
+        end = text.find('\n', ofs);
+        if (end == std::string::npos)
+            return errors + 1;
+        if (text[ofs] == 'L' && sscanf(text.c_str() + ofs, "L%d:", &i) == 1) {
+            std::string line = text.substr(ofs, end - ofs + 1);
+            size_t head = line.find(':') + 1;
+
+            errors += line.size() != sizes[i % 4];
+            errors += line.find_first_not_of((char)('a' + i % 26), head) !=
+                line.size() - 1;
+            longs++;
+            continue;
+        }
+        errors += end - ofs + 1 != STAGE_MSGSIZE;
+        errors += sscanf(text.c_str() + ofs, "T%d:%06d", &t, &i) != 2;
+    }
+    errors += longs + lost[STAGE_PRODUCERS] != 20;
+    *lost_long += lost[STAGE_PRODUCERS];
+    return errors;
+}
+
+TEST(disklog_stage, long_input_producers) {
+    int lost = 0;
+
+    ASSERT_EQ(disklog_init(), 0);
+    for (int round = 0; round < 20; round++)
+        ASSERT_EQ(stage_long_round(&lost), 0) << "round " << round;
+    printf("disklog_stage: long inputs dropped(%d)\n", lost);
+}
+
+TEST(disklog_stage, producers) {
+    std::vector<std::thread> threads;
+    std::vector<int> failed(STAGE_PRODUCERS), last(STAGE_PRODUCERS, -1);
+    std::vector<int> count(STAGE_PRODUCERS);
+    struct disklog_drop drops[16];
+    uint32_t dropped, base = disklog_dropped();
+    std::string text;
+    uint64_t t0, ns;
+    int errors = 0;
+
+    ASSERT_EQ(disklog_init(), 0);
+    disklog_reset();
+    t0 = bench_now();
+    for (int t = 0; t < STAGE_PRODUCERS; t++) {
+        threads.emplace_back([t, &failed] {
+            char msg[16];
+
+            for (int i = 0; i < STAGE_LOOPS; i++) {
+                snprintf(msg, sizeof(msg), "T%d:%06d\n", t, i);
+                if (disklog_input(msg, STAGE_MSGSIZE))
+                    failed[t]++;
+            }
+        });
+    }
+    for (auto &thr : threads)
+        thr.join();
+    ns = bench_now() - t0;
+
+    /* Every producer's log must be in order and nothing is lost silently */
+    ASSERT_EQ(disklog_ouput(stage_collect, &text, 0), 0);
+    ASSERT_EQ(text.size() % STAGE_MSGSIZE, 0u);
+    for (size_t ofs = 0; ofs < text.size(); ofs += STAGE_MSGSIZE) {
+        int t, i;
+
+        if (sscanf(text.c_str() + ofs, "T%d:%06d", &t, &i) != 2 ||
+            t < 0 || t >= STAGE_PRODUCERS) {
+            errors++;
+            break;
+        }
+        errors += i <= last[t];
+        last[t] = i;
+        count[t]++;
+    }
+    EXPECT_EQ(errors, 0);
+
+    dropped = 0;
+    for (int t = 0; t < STAGE_PRODUCERS; t++) {
+        EXPECT_EQ(count[t] + failed[t], STAGE_LOOPS);
+        dropped += failed[t];
+    }
+    EXPECT_EQ(disklog_dropped() - base, dropped);
+    if (dropped > 0) {
+        EXPECT_GT(disklog_drop_snapshot(drops, 16), 0u);
+    }
+
+    printf("disklog_stage: %d producers %.1f ns/input written(%zu) dropped(%u)\n",
+        STAGE_PRODUCERS, (double)ns / (STAGE_PRODUCERS * STAGE_LOOPS),
+        text.size() / STAGE_MSGSIZE, dropped);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test and benchmark for erased-state check of flash data
+ */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "basework/dev/flash_erased.h"
+#include "basework/tests/bench_helper.h"
+#include "gtest/gtest.h"
+
+#define ERASED_MAXSIZE  (64 * 1024)
+#define ERASED_BYTES    (64ull * 1024 * 1024) /* Bytes checked for each size */
+
+static bool byte_erased(const uint8_t *p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+static bool byte_programmable(const uint8_t *old, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if ((old[i] & data[i]) != data[i])
+            return false;
+    }
+    return true;
+}
+
+TEST(flash_erased, erased_state) {
+    std::vector<uint8_t> buf(512 + 16, 0xFF);
+
+    /* Every size and alignment with one cleared bit at every position */
+    for (size_t ofs = 0; ofs < 16; ofs++) {
+        for (size_t size = 0; size <= 512; size += (size < 80? 1: 37)) {
+            uint8_t *p = buf.data() + ofs;
+
+            ASSERT_TRUE(flash_range_erased(p, size)) << ofs << " " << size;
+            for (size_t i = 0; i < size; i++) {
+                p[i] = 0x7F;
+                ASSERT_FALSE(flash_range_erased(p, size)) << ofs << " " << size << " " << i;
+                p[i] = 0xFF;
+            }
+        }
+    }
+}
+
+TEST(flash_erased, programmable) {
+    std::vector<uint8_t> old(512 + 16), data(512 + 16);
+    uint32_t seed = 1;
+    int errors = 0;
+
+    for (int loop = 0; loop < 20000; loop++) {
+        size_t ofs, size, bit;
+
+        seed = seed * 1103515245u + 12345u;
+        ofs = (seed >> 4) & 15;
+        size = (seed >> 9) % 512;
+        for (size_t i = 0; i < old.size(); i++) {
+            seed = seed * 1103515245u + 12345u;
+            old[i] = (uint8_t)(seed >> 16);
+            data[i] = old[i] & (uint8_t)(seed >> 24);
+        }
+
+        /* Set a bit that was cleared sometimes */
+        if (size > 0 && (loop & 1)) {
+            bit = (seed >> 3) % (size * 8);
+            old[ofs + bit / 8] &= ~(1u << (bit & 7));
+            data[ofs + bit / 8] |= 1u << (bit & 7);
+        }
+        errors += flash_range_programmable(old.data() + ofs, data.data() + ofs, size) !=
+            byte_programmable(old.data() + ofs, data.data() + ofs, size);
+    }
+    EXPECT_EQ(errors, 0);
+}
+
+TEST(flash_erased, throughput) {
+    std::vector<uint8_t> old(ERASED_MAXSIZE, 0xFF), data(ERASED_MAXSIZE, 0xFF);
+    volatile bool sink = false;
+
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(0xF0 | i);
+
+    for (size_t size = 256; size <= ERASED_MAXSIZE; size <<= 2) {
+        size_t loops = ERASED_BYTES / size;
+        uint64_t t0, byte_ns, erased_ns, prog_ns;
+
+        t0 = bench_now();
+        for (size_t i = 0; i < loops; i++)
+            sink = byte_erased(old.data(), size);
+        byte_ns = bench_now() - t0;
+
+        t0 = bench_now();
+        for (size_t i = 0; i < loops; i++)
+            sink = flash_range_erased(old.data(), size);
+        erased_ns = bench_now() - t0;
+
+        t0 = bench_now();
+        for (size_t i = 0; i < loops; i++)
+            sink = flash_range_programmable(old.data(), data.data(), size);
+        prog_ns = bench_now() - t0;
+
+        printf("flash_erased: size(%6zu) bytewise(%6.2f GB/s) erased(%6.2f GB/s)"
+            " programmable(%6.2f GB/s)\n", size,
+            (double)ERASED_BYTES / byte_ns, (double)ERASED_BYTES / erased_ns,
+            (double)ERASED_BYTES / prog_ns);
+        EXPECT_LT(erased_ns, byte_ns);
+    }
+    (void) sink;
+}
@@ -2,7 +2,12 @@
  * Copyright 2023 wtcat
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
 #include "basework/lib/msg_storage.h"
 
 #include "gtest/gtest.h"
@@ -84,3 +89,293 @@ TEST(msg_storage, save) {
     ASSERT_TRUE(msg_storage_clean() == 0);
     ASSERT_TRUE(msg_storage_deinit() == 0);
 }
+
+static void message_fill(struct msg_payload *msg, int i) {
+	memset(msg, 0, sizeof(*msg));
+	msg->timestamp = i;
+	msg->id = i;
+	msg->type = i % 20 + 1;
+	msg->c_len = snprintf(msg->contact, sizeof(msg->contact), "contact-%d", i);
+	msg->m_len = snprintf(msg->buffer, sizeof(msg->buffer), "message %d", i);
+	for (int n = i % 7; n > 0 && msg->m_len < MAX_MESSAGE_SIZE - 16; n--)
+		msg->m_len += snprintf(msg->buffer + msg->m_len,
+			sizeof(msg->buffer) - msg->m_len, " more text %d", n);
+}
+
+static int message_check(const int *expect, int n) {
+	int count = 0;
+
+	MSG_STORAGE_FOREACH(i) {
+		struct msg_payload msg, ref;
+
+		if (count >= n || msg_storage_read(i, &msg))
+			return -1;
+		message_fill(&ref, expect[count++]);
+		if (memcmp(&msg, &ref, sizeof(msg)))
+			return -1;
+	}
+	return count == n? 0: -1;
+}
+
+TEST(msg_storage, journal) {
+	std::vector<int> expect;
+	enum notification_state state;
+	struct msg_payload msg;
+
+	/* The journal wraps many times */
+	ASSERT_EQ(msg_storage_init(), 0);
+	ASSERT_EQ(msg_storage_clean(), 0);
+	ASSERT_EQ(msg_storage_set_notification(3, MSG_NOTIF_SILENCE), 0);
+	ASSERT_EQ(msg_storage_set_bitvec(0x5a, 0), 0);
+	for (int i = 0; i < NR_MSGS; i++) {
+		message_fill(&msg, i);
+		ASSERT_EQ(msg_storage_write(&msg), 0);
+		expect.push_back(i);
+		if (expect.size() > MAX_MESSAGES)
+			expect.erase(expect.begin());
+
+		/* Remove some messages in the middle of list */
+		if (i % 17 == 0 && expect.size() > 2) {
+			int id = msg_storage_next(msg_storage_first());
+			ASSERT_EQ(msg_storage_remove(id), 0);
+			expect.erase(expect.begin() + 1);
+		}
+	}
+	ASSERT_EQ(message_check(expect.data(), expect.size()), 0);
+
+	/* Reopen with checkpoint */
+	ASSERT_EQ(msg_storage_deinit(), 0);
+	ASSERT_EQ(msg_storage_init(), 0);
+	EXPECT_EQ(message_check(expect.data(), expect.size()), 0);
+
+	/* Reopen without checkpoint (The journal is replayed) */
+	for (int i = NR_MSGS; i < NR_MSGS + 5; i++) {
+		message_fill(&msg, i);
+		ASSERT_EQ(msg_storage_write(&msg), 0);
+		expect.push_back(i);
+		if (expect.size() > MAX_MESSAGES)
+			expect.erase(expect.begin());
+	}
+	ASSERT_EQ(msg_storage_remove(msg_storage_first()), 0);
+	expect.erase(expect.begin());
+	ASSERT_EQ(msg_storage_set_notif_switch(false), 0);
+	ASSERT_EQ(msg_storage_flush(), 0);
+	ASSERT_EQ(msg_storage_drop(), 0);
+	ASSERT_EQ(msg_storage_init(), 0);
+	EXPECT_EQ(message_check(expect.data(), expect.size()), 0);
+	EXPECT_FALSE(msg_storage_get_notif_switch());
+	ASSERT_EQ(msg_storage_set_notif_switch(true), 0);
+	ASSERT_EQ(msg_storage_get_notification(3, &state), 0);
+	EXPECT_EQ(state, MSG_NOTIF_SILENCE);
+	EXPECT_EQ(msg_storage_get_bitvect(), 0x5au);
+
+	ASSERT_EQ(msg_storage_clean(), 0);
+	ASSERT_EQ(msg_storage_deinit(), 0);
+}
+
+static int message_range_check(int type, const std::vector<int> &expect) {
+	struct msg_payload msgs[4], ref;
+	int ids[4];
+	size_t pos = 0;
+
+	if (msg_storage_count(type) != expect.size())
+		return -1;
+	for (;;) {
+		ssize_t n = msg_storage_query(type, pos, ids, 4);
+		ssize_t m = msg_storage_read_range(type, pos, msgs, 4);
+
+		if (n < 0 || n != m)
+			return -1;
+		if (n == 0)
+			break;
+		for (ssize_t i = 0; i < n; i++) {
+			struct msg_payload msg;
+
+			if (msg_storage_read(ids[i], &msg) ||
+				memcmp(&msg, &msgs[i], sizeof(msg)))
+				return -1;
+			message_fill(&ref, expect[pos + i]);
+			if (memcmp(&msgs[i], &ref, sizeof(ref)))
+				return -1;
+		}
+		pos += n;
+	}
+	return pos == expect.size()? 0: -1;
+}
+
+TEST(msg_storage, index) {
+	std::vector<int> expect;
+	struct msg_payload msg;
+
+	ASSERT_EQ(msg_storage_init(), 0);
+	ASSERT_EQ(msg_storage_clean(), 0);
+	for (int i = 0; i < 3 * MAX_MESSAGES; i++) {
+		message_fill(&msg, i);
+		ASSERT_EQ(msg_storage_write(&msg), 0);
+		expect.push_back(i);
+		if (expect.size() > MAX_MESSAGES)
+			expect.erase(expect.begin());
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		EXPECT_EQ(msg_storage_numbers(), expect.size());
+		EXPECT_EQ(message_range_check(MSG_TYPE_ALL, expect), 0);
+		for (int type = 0; type < 22; type++) {
+			std::vector<int> sub;
+
+			for (int i : expect) {
+				if (i % 20 + 1 == type)
+					sub.push_back(i);
+			}
+			EXPECT_EQ(message_range_check(type, sub), 0) << type;
+		}
+
+		/* The index is rebuilt after reopen */
+		ASSERT_EQ(msg_storage_deinit(), 0);
+		ASSERT_EQ(msg_storage_init(), 0);
+	}
+	EXPECT_EQ(msg_storage_query(MAX_MESSAGE_TYPES, 0, NULL, 0), -EINVAL);
+
+	ASSERT_EQ(msg_storage_clean(), 0);
+	EXPECT_EQ(msg_storage_count(MSG_TYPE_ALL), 0u);
+	ASSERT_EQ(msg_storage_deinit(), 0);
+}
+
+/*
+ * The RAM file keeps the writes in cache until flush. When the power is
+ * lost, some of the writes in cache reach the disk (Any of them, The cache
+ * does not keep the order of writes)
+ */
+struct crash_io {
+	uint32_t offset;
+	std::vector<uint8_t> data;
+};
+
+static std::vector<uint8_t> crash_disk;
+static std::vector<crash_io> crash_cache;
+
+static void crash_copy(void *buf, size_t size, uint32_t offset,
+	const uint8_t *src, uint32_t start, size_t len) {
+	uint32_t from = std::max(offset, start);
+	uint32_t to = std::min<uint32_t>(offset + size, start + len);
+
+	if (from < to)
+		memcpy((uint8_t *)buf + (from - offset), src + (from - start), to - from);
+}
+
+static int crash_open(const char *name, void **fd) {
+	(void) name;
+	*fd = &crash_disk;
+	return 0;
+}
+
+static int crash_close(void *fd) {
+	(void) fd;
+	return 0;
+}
+
+static int crash_flush(void *fd) {
+	(void) fd;
+	for (const crash_io &w : crash_cache) {
+		if (crash_disk.size() < w.offset + w.data.size())
+			crash_disk.resize(w.offset + w.data.size(), 0xff);
+		memcpy(&crash_disk[w.offset], w.data.data(), w.data.size());
+	}
+	crash_cache.clear();
+	return 0;
+}
+
+static ssize_t crash_write(void *fd, const void *buf, size_t size,
+	uint32_t offset) {
+	const uint8_t *p = (const uint8_t *)buf;
+
+	(void) fd;
+	crash_cache.push_back({offset, std::vector<uint8_t>(p, p + size)});
+	return size;
+}
+
+static ssize_t crash_read(void *fd, void *buf, size_t size, uint32_t offset) {
+	(void) fd;
+	memset(buf, 0xff, size);
+	crash_copy(buf, size, offset, crash_disk.data(), 0, crash_disk.size());
+	for (const crash_io &w : crash_cache)
+		crash_copy(buf, size, offset, w.data.data(), w.offset, w.data.size());
+	return size;
+}
+
+static int crash_unlink(const char *name) {
+	(void) name;
+	crash_disk.clear();
+	crash_cache.clear();
+	return 0;
+}
+
+static void crash_power_loss(void) {
+	std::vector<crash_io> cache;
+
+	cache.swap(crash_cache);
+	for (crash_io &w : cache) {
+		if (rand() & 1)
+			crash_cache.push_back(std::move(w));
+	}
+	crash_flush(NULL);
+}
+
+TEST(msg_storage, power_loss) {
+	static struct msg_fops fops;
+	struct msg_payload msg, ref;
+	int pinned;
+
+	fops.open = crash_open;
+	fops.close = crash_close;
+	fops.flush = crash_flush;
+	fops.write = crash_write;
+	fops.read = crash_read;
+	fops.unlink = crash_unlink;
+	ASSERT_EQ(msg_storage_register(&fops), 0);
+	ASSERT_EQ(msg_storage_init(), 0);
+	ASSERT_EQ(msg_storage_clean(), 0);
+
+	/*
+	 * The first message is kept, So it is moved when the journal wraps
+	 * (Every new message is removed after it is written)
+	 */
+	message_fill(&msg, 0);
+	ASSERT_EQ(msg_storage_write(&msg), 0);
+	ASSERT_EQ(msg_storage_flush(), 0);
+	pinned = msg_storage_first();
+	for (int i = 1; i < NR_MSGS; i++) {
+		bool found = false;
+
+		message_fill(&msg, i);
+		ASSERT_EQ(msg_storage_write(&msg), 0);
+		ASSERT_EQ(msg_storage_remove(msg_storage_get_node_newidx()), 0);
+		if (i % 7)
+			continue;
+
+		/*
+		 * The messages that survive the power loss must be intact (The
+		 * removed one may come back if its record is lost)
+		 */
+		ASSERT_EQ(msg_storage_drop(), 0);
+		crash_power_loss();
+		ASSERT_EQ(msg_storage_init(), 0);
+		MSG_STORAGE_FOREACH(id) {
+			ASSERT_EQ(msg_storage_read(id, &msg), 0) << i;
+			message_fill(&ref, msg.id);
+			ASSERT_EQ(memcmp(&msg, &ref, sizeof(msg)), 0) << i;
+			found |= id == pinned;
+		}
+		ASSERT_TRUE(found) << i;
+		for (int id = msg_storage_first(); id >= 0; id = msg_storage_first()) {
+			if (id == pinned)
+				id = msg_storage_next(id);
+			if (id < 0)
+				break;
+			ASSERT_EQ(msg_storage_remove(id), 0);
+		}
+	}
+
+	ASSERT_EQ(msg_storage_deinit(), 0);
+	ASSERT_EQ(msg_file_backend_init(), 0);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Latency and jitter benchmark for os_timer
+ */
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "basework/os/osapi_timer.h"
+#include "basework/rq.h"
+#include "gtest/gtest.h"
+
+#define BENCH_PERIOD_MS 10
+#define BENCH_ROUNDS    50
+
+struct bench_timer {
+    os_timer_t timer;
+    int64_t expected_ns;
+    int rounds;
+    std::vector<int64_t> *samples;
+};
+
+RQ_DEFINE(bench_rq, 1024, );
+static std::atomic<int> bench_finished;
+static sem_t bench_sem;
+static pthread_mutex_t bench_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void bench_timer_cb(os_timer_t timer, void *arg) {
+    struct bench_timer *bt = (struct bench_timer *)arg;
+    int64_t now = bench_now_ns();
+
+    pthread_mutex_lock(&bench_mtx);
+    bt->samples->push_back(now - bt->expected_ns);
+    pthread_mutex_unlock(&bench_mtx);
+    if (++bt->rounds < BENCH_ROUNDS) {
+        bt->expected_ns = now + BENCH_PERIOD_MS * 1000000ll;
+        __os_timer_mod(timer, BENCH_PERIOD_MS);
+    } else if (++bench_finished == 0) {
+        sem_post(&bench_sem);
+    }
+}
+
+static void os_timer_benchmark(int nr) {
+    std::vector<struct bench_timer> timers(nr);
+    std::vector<int64_t> samples;
+    double mean = 0, var = 0;
+
+    if (!_system_rq)
+        _rq_new_thread(&bench_rq, NULL, 0, 0);
+
+    samples.reserve(nr * BENCH_ROUNDS);
+    bench_finished = -nr;
+    sem_init(&bench_sem, 0, 0);
+    for (int i = 0; i < nr; i++) {
+        struct bench_timer *bt = &timers[i];
+        bt->rounds = 0;
+        bt->samples = &samples;
+        ASSERT_EQ(__os_timer_create(&bt->timer, bench_timer_cb, bt, false), 0);
+    }
+    for (int i = 0; i < nr; i++) {
+        struct bench_timer *bt = &timers[i];
+        bt->expected_ns = bench_now_ns() + BENCH_PERIOD_MS * 1000000ll;
+        __os_timer_add(bt->timer, BENCH_PERIOD_MS);
+    }
+
+    sem_wait(&bench_sem);
+    for (int i = 0; i < nr; i++)
+        __os_timer_destroy(timers[i].timer);
+
+    ASSERT_EQ(samples.size(), (size_t)nr * BENCH_ROUNDS);
+    std::sort(samples.begin(), samples.end());
+    for (int64_t v : samples)
+        mean += (double)v;
+    mean /= samples.size();
+    for (int64_t v : samples)
+        var += ((double)v - mean) * ((double)v - mean);
+    var /= samples.size();
+
+    printf("os_timer(%d x %dms): latency mean %.1fus p99 %.1fus max %.1fus "
+        "jitter(stddev) %.1fus\n",
+        nr, BENCH_PERIOD_MS, mean / 1000,
+        samples[samples.size() * 99 / 100] / 1000.0,
+        samples.back() / 1000.0, sqrt(var) / 1000);
+
+    /* The timer must not expire earlier than expected */
+    EXPECT_GE(samples.front(), 0);
+}
+
+TEST(os_timer_bench, timers_10) {
+    os_timer_benchmark(10);
+}
+
+TEST(os_timer_bench, timers_100) {
+    os_timer_benchmark(100);
+}
+
+TEST(os_timer_bench, timers_500) {
+    os_timer_benchmark(500);
+}
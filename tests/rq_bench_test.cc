@@ -0,0 +1,89 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Contention benchmark for run-queue submission
+ */
+#include <stdio.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "basework/rq.h"
+#include "gtest/gtest.h"
+
+#ifdef CONFIG_BASEWORK_RQ_LOCKFREE
+#define RQ_MODE "lock-free"
+#else
+#define RQ_MODE "locked"
+#endif
+
+#define BENCH_QUEUE_SIZE 512
+#define BENCH_SUBMITS    200000
+
+RQ_DEFINE(bench_rq, BENCH_QUEUE_SIZE, );
+static volatile size_t bench_executed;
+static size_t bench_expected;
+static sem_t bench_done;
+
+static void bench_work(void *arg) {
+    (void) arg;
+    if (++bench_executed == bench_expected)
+        sem_post(&bench_done);
+}
+
+static void bench_producer(int submits) {
+    for (int i = 0; i < submits; i++) {
+        /* Avoid overflowing the run-queue */
+        while (_rq_get_nodes(&bench_rq) >= BENCH_QUEUE_SIZE - 64)
+            sched_yield();
+#ifdef USE_RQ_DEBUG
+        _rq_submit(&bench_rq, bench_work, NULL, false, NULL);
+#else
+        _rq_submit(&bench_rq, bench_work, NULL, false);
+#endif
+    }
+}
+
+static void rq_contention_benchmark(int nr_threads) {
+    std::vector<std::thread> producers;
+    static bool ready;
+
+    if (!ready) {
+        sem_init(&bench_done, 0, 0);
+        ASSERT_EQ(_rq_new_thread(&bench_rq, NULL, 0, 0), 0);
+        ready = true;
+    }
+
+    bench_executed = 0;
+    bench_expected = (size_t)BENCH_SUBMITS * nr_threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nr_threads; i++)
+        producers.emplace_back(bench_producer, BENCH_SUBMITS);
+    for (auto &thr : producers)
+        thr.join();
+    sem_wait(&bench_done);
+    auto end = std::chrono::steady_clock::now();
+
+    double sec = std::chrono::duration<double>(end - start).count();
+    printf("[%s] producers(%d): %.2f Mops/s\n", RQ_MODE, nr_threads,
+        bench_expected / sec / 1e6);
+    ASSERT_EQ(bench_executed, bench_expected);
+}
+
+TEST(rq_bench, producers_1) {
+    rq_contention_benchmark(1);
+}
+
+TEST(rq_bench, producers_2) {
+    rq_contention_benchmark(2);
+}
+
+TEST(rq_bench, producers_4) {
+    rq_contention_benchmark(4);
+}
+
+TEST(rq_bench, producers_8) {
+    rq_contention_benchmark(8);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Payload copy test for run-queue (_rq_submit_with_copy)
+ */
+#include <string.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#include "basework/rq.h"
+#include "gtest/gtest.h"
+
+#define COPY_ROUNDS 1000
+
+RQ_DEFINE(copy_rq, 64, );
+static sem_t copy_sem;
+static size_t copy_errors;
+
+static void copy_work(void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != (unsigned char)(size + i))
+            copy_errors++;
+    }
+    sem_post(&copy_sem);
+}
+
+static void copy_submit(size_t size) {
+    unsigned char buffer[1024];
+
+    for (size_t i = 0; i < size; i++)
+        buffer[i] = (unsigned char)(size + i);
+#ifdef USE_RQ_DEBUG
+    ASSERT_EQ(_rq_submit_with_copy(&copy_rq, copy_work, buffer, size,
+        false, NULL), 0);
+#else
+    ASSERT_EQ(_rq_submit_with_copy(&copy_rq, copy_work, buffer, size, false), 0);
+#endif
+    sem_wait(&copy_sem);
+
+    /* Wait for the payload to be released */
+    while (__atomic_load_n(&copy_rq.fn_executing, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void copy_round(const size_t *sizes, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        copy_submit(sizes[i]);
+}
+
+TEST(rq_copy, payload) {
+    static const size_t sizes[] = {
+        1, CONFIG_BASEWORK_RQ_INLINE_SIZE, CONFIG_BASEWORK_RQ_INLINE_SIZE + 1,
+        RQ_SLAB_MINSIZE, RQ_SLAB_MINSIZE << (RQ_SLAB_CLASSES - 1)
+    };
+    const size_t large = (RQ_SLAB_MINSIZE << (RQ_SLAB_CLASSES - 1)) + 1;
+    struct rq_stats first, stats;
+
+    sem_init(&copy_sem, 0, 0);
+    ASSERT_EQ(_rq_new_thread(&copy_rq, NULL, 0, 0), 0);
+
+    /* Warm up slab (Class 0 and class 3 will be allocated) */
+    copy_round(sizes, rte_array_size(sizes));
+    copy_submit(large);
+    _rq_get_stats(&copy_rq, &first);
+    EXPECT_EQ(first.inline_copies, 2u);
+    EXPECT_EQ(first.slab_grows, 2u);
+    EXPECT_EQ(first.slab_copies, 1u);
+    EXPECT_EQ(first.heap_copies, 1u);
+
+    /* The heap should not be touched in steady state */
+    for (int n = 0; n < COPY_ROUNDS; n++)
+        copy_round(sizes, rte_array_size(sizes));
+    _rq_get_stats(&copy_rq, &stats);
+    EXPECT_EQ(stats.inline_copies, first.inline_copies + 2 * COPY_ROUNDS);
+    EXPECT_EQ(stats.slab_copies, first.slab_copies + 3 * COPY_ROUNDS);
+    EXPECT_EQ(stats.slab_grows, first.slab_grows);
+    EXPECT_EQ(stats.heap_copies, first.heap_copies);
+    EXPECT_EQ(copy_errors, 0u);
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test for run-queue pool
+ */
+#include <string.h>
+#include <semaphore.h>
+#include <atomic>
+
+#include "basework/rq_pool.h"
+#include "gtest/gtest.h"
+
+#define POOL_KEYS  4
+#define POOL_WORKS 100
+
+static struct rq_pool *test_pool;
+static std::atomic<int> pool_done;
+static sem_t pool_sem;
+static int key_last[POOL_KEYS];
+static int key_errors;
+
+static struct rq_pool *pool_get(void) {
+    if (!test_pool) {
+        sem_init(&pool_sem, 0, 0);
+        EXPECT_EQ(rq_pool_create(&test_pool, 2, 256, 16, 0, 0), 0);
+    }
+    return test_pool;
+}
+
+static void blocker_work(void *arg) {
+    sem_wait((sem_t *)arg);
+}
+
+static void quick_work(void *arg) {
+    (void) arg;
+    if (++pool_done == POOL_WORKS)
+        sem_post(&pool_sem);
+}
+
+static void keyed_work(void *data, size_t size) {
+    int v[2];
+
+    ASSERT_EQ(size, sizeof(v));
+    memcpy(v, data, sizeof(v));
+    if (key_last[v[0]] + 1 != v[1])
+        key_errors++;
+    key_last[v[0]] = v[1];
+    if (++pool_done == POOL_KEYS * POOL_WORKS)
+        sem_post(&pool_sem);
+}
+
+TEST(rq_pool, keyed_order) {
+    struct rq_pool *pool = pool_get();
+
+    pool_done = 0;
+    memset(key_last, 0, sizeof(key_last));
+    for (int i = 1; i <= POOL_WORKS; i++) {
+        for (int k = 0; k < POOL_KEYS; k++) {
+            int v[2] = {k, i};
+            ASSERT_EQ(rq_pool_submit_cp(pool, keyed_work, v, sizeof(v),
+                (uintptr_t)k + 1, false), 0);
+        }
+    }
+    sem_wait(&pool_sem);
+    EXPECT_EQ(key_errors, 0);
+    for (int k = 0; k < POOL_KEYS; k++)
+        EXPECT_EQ(key_last[k], POOL_WORKS);
+}
+
+TEST(rq_pool, slow_work_and_steal) {
+    struct rq_pool *pool = pool_get();
+    struct rq_pool_stats stats[2];
+    static sem_t gate[2];
+
+    sem_init(&gate[0], 0, 0);
+    sem_init(&gate[1], 0, 0);
+    pool_done = 0;
+
+    /* Both workers are blocked */
+    ASSERT_EQ(rq_pool_submit(pool, blocker_work, &gate[0], 0, false), 0);
+    ASSERT_EQ(rq_pool_submit(pool, blocker_work, &gate[1], 0, false), 0);
+    while (pool->idle)
+        sched_yield();
+
+    for (int i = 0; i < POOL_WORKS; i++)
+        ASSERT_EQ(rq_pool_submit(pool, quick_work, NULL, 0, false), 0);
+
+    /*
+     * Release one of the workers, It must finish all works (include the
+     * works that queued to the blocked worker)
+     */
+    sem_post(&gate[1]);
+    sem_wait(&pool_sem);
+    EXPECT_EQ(pool_done, POOL_WORKS);
+
+    sem_post(&gate[0]);
+    ASSERT_EQ(rq_pool_get_stats(pool, 0, &stats[0]), 0);
+    ASSERT_EQ(rq_pool_get_stats(pool, 1, &stats[1]), 0);
+    EXPECT_GT(stats[0].stolen + stats[1].stolen, 0u);
+}
+
+static void cancel_work(void *arg) {
+    ++*(std::atomic<int> *)arg;
+}
+
+static void post_work(void *arg) {
+    sem_post((sem_t *)arg);
+}
+
+TEST(rq_pool, cancel) {
+    struct rq_pool *pool = pool_get();
+    static std::atomic<int> count;
+    static sem_t gate, done;
+    void *pnode[2] = {NULL, NULL};
+
+    sem_init(&gate, 0, 0);
+    sem_init(&done, 0, 0);
+
+    /* The pinned works are queued behind the blocker of same key */
+    ASSERT_EQ(rq_pool_submit(pool, blocker_work, &gate, 7, false), 0);
+    ASSERT_EQ(rq_pool_submit_ext(pool, cancel_work, &count, 7, false,
+        &pnode[0]), 0);
+    ASSERT_EQ(rq_pool_submit_ext(pool, cancel_work, &count, 7, false,
+        &pnode[1]), 0);
+    ASSERT_NE(pnode[0], nullptr);
+    ASSERT_NE(pnode[1], nullptr);
+
+    rq_pool_cancel(pool, pnode[0]);
+    EXPECT_EQ(pnode[0], nullptr);
+    ASSERT_EQ(rq_pool_submit(pool, post_work, &done, 7, false), 0);
+    sem_post(&gate);
+    sem_wait(&done);
+
+    /* The handle is cleared when the work is taken */
+    EXPECT_EQ(count, 1);
+    EXPECT_EQ(pnode[1], nullptr);
+}
+
+TEST(rq_pool, invalid) {
+    struct rq_pool *pool = pool_get();
+    char buffer[64] = {0};
+
+    EXPECT_EQ(rq_pool_submit(NULL, quick_work, NULL, 0, false), -EINVAL);
+    EXPECT_EQ(rq_pool_submit_cp(pool, keyed_work, buffer, sizeof(buffer), 0,
+        false), -EINVAL);
+    EXPECT_EQ(rq_pool_create(&pool, 0, 16, 0, 0, 0), -EINVAL);
+}
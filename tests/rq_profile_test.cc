@@ -0,0 +1,94 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Test for run-queue profiler (CONFIG_BASEWORK_RQ_PROFILE)
+ */
+#include <unistd.h>
+#include <semaphore.h>
+
+#include "basework/rq.h"
+#include "basework/lib/printer.h"
+#include "gtest/gtest.h"
+
+#define PROFILE_WORKS 20
+
+RQ_DEFINE(profile_rq, 64, );
+static sem_t profile_sem;
+
+static void fast_work(void *arg) {
+    (void) arg;
+}
+
+static void slow_work(void *arg) {
+    (void) arg;
+    usleep(2000);
+}
+
+static void done_work(void *arg) {
+    (void) arg;
+    sem_post(&profile_sem);
+}
+
+static void profile_submit(void (*fn)(void *)) {
+#ifdef USE_RQ_DEBUG
+    ASSERT_EQ(_rq_submit(&profile_rq, fn, NULL, false, NULL), 0);
+#else
+    ASSERT_EQ(_rq_submit(&profile_rq, fn, NULL, false), 0);
+#endif
+}
+
+static const struct rq_profile_record *
+profile_find(const struct rq_profile_record *recs, size_t n, void *fn) {
+    for (size_t i = 0; i < n; i++) {
+        if (recs[i].fn == fn)
+            return &recs[i];
+    }
+    return NULL;
+}
+
+TEST(rq_profile, record) {
+    struct rq_profile_record recs[CONFIG_BASEWORK_RQ_PROFILE_SLOTS];
+    const struct rq_profile_record *fast, *slow;
+    struct printer pr;
+    size_t n;
+
+    sem_init(&profile_sem, 0, 0);
+    ASSERT_EQ(_rq_new_thread(&profile_rq, NULL, 0, 0), 0);
+    _rq_profile_reset(&profile_rq);
+
+    for (int i = 0; i < PROFILE_WORKS; i++) {
+        profile_submit(slow_work);
+        profile_submit(fast_work);
+    }
+    profile_submit(done_work);
+    sem_wait(&profile_sem);
+    usleep(1000);
+
+    n = _rq_profile_snapshot(recs, CONFIG_BASEWORK_RQ_PROFILE_SLOTS);
+    fast = profile_find(recs, n, (void *)fast_work);
+    slow = profile_find(recs, n, (void *)slow_work);
+    ASSERT_NE(fast, nullptr);
+    ASSERT_NE(slow, nullptr);
+
+    EXPECT_EQ(fast->count, (uint32_t)PROFILE_WORKS);
+    EXPECT_EQ(slow->count, (uint32_t)PROFILE_WORKS);
+    EXPECT_GE(slow->exec_max, 2000u);
+    EXPECT_GE(slow->exec_sum / slow->count, 2000u);
+    EXPECT_LT(fast->exec_max, slow->exec_max);
+
+    /* The last fast work has been waiting for all slow works */
+    EXPECT_GE(fast->wait_max, 2000u * (PROFILE_WORKS - 1));
+    EXPECT_GE(profile_rq.nr_max, 2 * PROFILE_WORKS - 1);
+
+    uint32_t total = 0;
+    for (int i = 0; i < RQ_PROFILE_BUCKETS; i++)
+        total += slow->exec_hist[i];
+    EXPECT_EQ(total, slow->count);
+    EXPECT_EQ(slow->exec_hist[0] + slow->exec_hist[1], 0u);
+
+    printf_format_init(&pr);
+    _rq_profile_dump(&profile_rq, &pr);
+
+    _rq_profile_reset(&profile_rq);
+    EXPECT_EQ(_rq_profile_snapshot(recs, CONFIG_BASEWORK_RQ_PROFILE_SLOTS), 0u);
+}
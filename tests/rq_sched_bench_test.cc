@@ -0,0 +1,222 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for batched and priority-aware run-queue dispatcher
+ */
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <algorithm>
+#include <atomic>
+
+#include "basework/rq.h"
+#include "gtest/gtest.h"
+
+#define SCHED_ITEMS      200
+#define SCHED_BULK       150
+#define SCHED_BULK_SPIN  200  /* us */
+#define SCHED_PROBES     20
+#define SCHED_PROBE_GAP  1000 /* us */
+
+RQ_DEFINE(sched_rq, 256, );
+static sem_t sched_sem;
+static std::atomic<int> sched_done;
+static uint64_t probe_submit[SCHED_PROBES];
+static uint64_t probe_latency[SCHED_PROBES];
+
+static uint64_t sched_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sched_start(void) {
+    static bool started;
+    if (!started) {
+        sem_init(&sched_sem, 0, 0);
+        ASSERT_EQ(_rq_new_thread(&sched_rq, NULL, 0, 0), 0);
+        started = true;
+    }
+}
+
+static void sched_submit(void (*fn)(void *), void *arg, int prio) {
+#ifdef USE_RQ_DEBUG
+    ASSERT_EQ(_rq_submit_prio(&sched_rq, fn, arg, prio, false, NULL), 0);
+#else
+    ASSERT_EQ(_rq_submit_prio(&sched_rq, fn, arg, prio, false), 0);
+#endif
+}
+
+static void gate_work(void *arg) {
+    sem_wait((sem_t *)arg);
+}
+
+static void count_work(void *arg) {
+    int total = (int)(intptr_t)arg;
+    if (++sched_done == total)
+        sem_post(&sched_sem);
+}
+
+static void bulk_work(void *arg) {
+    uint64_t end = sched_now() + SCHED_BULK_SPIN;
+    while (sched_now() < end);
+    count_work(arg);
+}
+
+static void probe_work(void *arg) {
+    int idx = (int)(intptr_t)arg;
+    probe_latency[idx] = sched_now() - probe_submit[idx];
+    count_work((void *)(intptr_t)(SCHED_BULK + SCHED_PROBES));
+}
+
+/*
+ * Submit a burst of low priority bulk work and then the periodic probes,
+ * Return the p99 of probe latency (submit -> start)
+ */
+static uint64_t sched_probe_run(int bulk_prio, int probe_prio, uint64_t *p50) {
+    sched_done = 0;
+    for (int i = 0; i < SCHED_BULK; i++)
+        sched_submit(bulk_work, (void *)(intptr_t)(SCHED_BULK + SCHED_PROBES),
+            bulk_prio);
+    for (int i = 0; i < SCHED_PROBES; i++) {
+        usleep(SCHED_PROBE_GAP);
+        probe_submit[i] = sched_now();
+        sched_submit(probe_work, (void *)(intptr_t)i, probe_prio);
+    }
+    sem_wait(&sched_sem);
+
+    std::sort(probe_latency, probe_latency + SCHED_PROBES);
+    *p50 = probe_latency[SCHED_PROBES / 2];
+    return probe_latency[(SCHED_PROBES * 99) / 100];
+}
+
+TEST(rq_sched, batch_lock) {
+    struct rq_stats first, stats;
+    static sem_t gate;
+
+    sched_start();
+    sem_init(&gate, 0, 0);
+    sched_done = 0;
+
+    /* Block the dispatcher so that all items are pending */
+    sched_submit(gate_work, &gate, RQ_PRIO_NORMAL);
+    usleep(1000);
+    _rq_get_stats(&sched_rq, &first);
+    for (int i = 0; i < SCHED_ITEMS; i++)
+        sched_submit(count_work, (void *)(intptr_t)SCHED_ITEMS, RQ_PRIO_NORMAL);
+    sem_post(&gate);
+    sem_wait(&sched_sem);
+    usleep(1000);
+
+    _rq_get_stats(&sched_rq, &stats);
+    uint32_t executed = stats.executed - first.executed;
+    uint32_t batches = stats.batches - first.batches;
+    printf("rq_sched: executed(%u) batches(%u) locks/item(%.3f) (unbatched: 1.000)\n",
+        executed, batches, (double)batches / executed);
+    EXPECT_GE(executed, (uint32_t)SCHED_ITEMS);
+    EXPECT_LE(batches * CONFIG_BASEWORK_RQ_BATCH, executed + 2 * CONFIG_BASEWORK_RQ_BATCH);
+}
+
+static void *cancel_pnode[2];
+static std::atomic<int> cancel_runs;
+
+static void cancel_peer_work(void *arg) {
+    (void) arg;
+    /* The peer has been taken with this node but it has not run */
+    if (cancel_pnode[1])
+        _rq_node_delete(&sched_rq, (struct rq_node *)cancel_pnode[1]);
+}
+
+static void cancel_count_work(void *arg) {
+    (void) arg;
+    cancel_runs++;
+}
+
+static void sched_submit_ext(void (*fn)(void *), void **pnode) {
+#ifdef USE_RQ_DEBUG
+    ASSERT_EQ(_rq_submit_ext(&sched_rq, fn, NULL, false, pnode, NULL), 0);
+#else
+    ASSERT_EQ(_rq_submit_ext(&sched_rq, fn, NULL, false, pnode), 0);
+#endif
+}
+
+TEST(rq_sched, cancel_taken) {
+    static sem_t gate;
+
+    sched_start();
+    sem_init(&gate, 0, 0);
+    sched_done = 0;
+    cancel_runs = 0;
+
+    /* All nodes are taken by dispatcher as one batch */
+    sched_submit(gate_work, &gate, RQ_PRIO_NORMAL);
+    usleep(1000);
+    sched_submit_ext(cancel_peer_work, &cancel_pnode[0]);
+    sched_submit_ext(cancel_count_work, &cancel_pnode[1]);
+    sched_submit(count_work, (void *)(intptr_t)1, RQ_PRIO_NORMAL);
+    sem_post(&gate);
+    sem_wait(&sched_sem);
+
+    EXPECT_EQ(cancel_runs, 0);
+    EXPECT_EQ(cancel_pnode[0], nullptr);
+    EXPECT_EQ(cancel_pnode[1], nullptr);
+}
+
+static std::atomic<int> entry_runs;
+static sem_t entry_sem;
+
+static void entry_work(void *arg) {
+    (void) arg;
+    entry_runs++;
+    sem_post(&entry_sem);
+}
+
+static int entry_wait(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    return sem_timedwait(&entry_sem, &ts);
+}
+
+TEST(rq_sched, resubmit_entry) {
+    static RQ_NODE_DEFINE(entry, entry_work, NULL);
+    static sem_t gate;
+
+    sched_start();
+    sem_init(&gate, 0, 0);
+    sem_init(&entry_sem, 0, 0);
+    entry_runs = 0;
+
+    /* The entry that is still pending is not queued twice */
+    sched_submit(gate_work, &gate, RQ_PRIO_NORMAL);
+    usleep(1000);
+    ASSERT_EQ(_rq_submit_entry(&sched_rq, &entry, false), 0);
+    ASSERT_EQ(_rq_submit_entry(&sched_rq, &entry, false), 0);
+    sem_post(&gate);
+    ASSERT_EQ(entry_wait(), 0);
+    usleep(1000);
+    EXPECT_EQ(entry_runs, 1);
+
+    /* The entry can be submitted again after it has run */
+    ASSERT_EQ(_rq_submit_entry(&sched_rq, &entry, false), 0);
+    ASSERT_EQ(entry_wait(), 0);
+    usleep(1000);
+    EXPECT_EQ(entry_runs, 2);
+}
+
+TEST(rq_sched, priority_latency) {
+    uint64_t fifo_p50, fifo_p99, prio_p50, prio_p99;
+
+    sched_start();
+
+    /* Everything is in the same band (Equal to the old FIFO dispatcher) */
+    fifo_p99 = sched_probe_run(RQ_PRIO_NORMAL, RQ_PRIO_NORMAL, &fifo_p50);
+    prio_p99 = sched_probe_run(RQ_PRIO_LOW, RQ_PRIO_HIGH, &prio_p50);
+    printf("rq_sched: fifo p50(%llu us) p99(%llu us), priority p50(%llu us) p99(%llu us)\n",
+        (unsigned long long)fifo_p50, (unsigned long long)fifo_p99,
+        (unsigned long long)prio_p50, (unsigned long long)prio_p99);
+    EXPECT_LT(prio_p99, fifo_p99);
+    EXPECT_LT(prio_p50, fifo_p50);
+}
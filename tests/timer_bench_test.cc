@@ -0,0 +1,185 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for software timer (timer_list.c or timer_wheel.c)
+ *
+ * Build it twice (with and without CONFIG_TIMER_WHEEL) to compare
+ * the delta-list and timing-wheel backends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+#include "basework/lib/timer/timer_list.h"
+#include "gtest/gtest.h"
+
+#ifdef CONFIG_TIMER_WHEEL
+#define TIMER_BACKEND "timer-wheel"
+#else
+#define TIMER_BACKEND "timer-list"
+#endif
+
+static size_t bench_expired;
+
+static void bench_timer_cb(struct timer_list *timer, void *arg) {
+    (void) timer;
+    (void) arg;
+    bench_expired++;
+}
+
+static double bench_elapsed_ns(std::chrono::steady_clock::time_point start,
+    size_t loops) {
+    auto end = std::chrono::steady_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count() / loops;
+}
+
+static void timer_benchmark(size_t nr) {
+    std::vector<struct timer_list> timers(nr);
+    std::vector<long> expires(nr);
+    const size_t ticks = 10000;
+    double add_ns, mod_ns, tick_ns, del_ns;
+
+    srand(1);
+    for (size_t i = 0; i < nr; i++) {
+        timer_init(&timers[i], bench_timer_cb, NULL);
+        expires[i] = 20000 + rand() % 100000;
+    }
+
+    /* Arm all timers */
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nr; i++)
+        timer_add(&timers[i], expires[i]);
+    add_ns = bench_elapsed_ns(start, nr);
+
+    /* Re-arm all timers */
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nr; i++)
+        timer_mod(&timers[i], expires[nr - i - 1]);
+    mod_ns = bench_elapsed_ns(start, nr);
+
+    /* Tick without expiration */
+    bench_expired = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ticks; i++)
+        timer_schedule(1);
+    tick_ns = bench_elapsed_ns(start, ticks);
+    ASSERT_EQ(bench_expired, (size_t)0);
+
+    /* Disarm all timers */
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nr; i++)
+        ASSERT_EQ(timer_del(&timers[i]), 1);
+    del_ns = bench_elapsed_ns(start, nr);
+
+    printf("[%s] timers(%zu): add %.1fns mod %.1fns tick %.1fns del %.1fns\n",
+        TIMER_BACKEND, nr, add_ns, mod_ns, tick_ns, del_ns);
+}
+
+static void timer_expire_check(size_t nr) {
+    std::vector<struct timer_list> timers(nr);
+
+    bench_expired = 0;
+    for (size_t i = 0; i < nr; i++) {
+        timer_init(&timers[i], bench_timer_cb, NULL);
+        timer_add(&timers[i], 1 + (long)(i % 5000));
+    }
+    for (int i = 0; i < 5000; i++)
+        timer_schedule(1);
+    ASSERT_EQ(bench_expired, nr);
+    ASSERT_EQ(timer_schedule(0), 0);
+}
+
+/*
+ * The expiry tick of timers that cross the slot boundaries of wheel levels
+ * (The tick is counted by test)
+ */
+static const long bench_delays[] = {
+    1, 31, 32, 33, 1023, 1024, 1025, 32767, 32768, 32769,
+    1048575, 1048576, 1048577
+};
+#define BENCH_NR_DELAYS (sizeof(bench_delays) / sizeof(bench_delays[0]))
+
+static long bench_tick;
+
+static void bench_tick_cb(struct timer_list *timer, void *arg) {
+    (void) timer;
+    *(long *)arg = bench_tick;
+}
+
+static long bench_next_expiry(const long *fired, long base) {
+    long next = 0;
+
+    for (size_t i = 0; i < BENCH_NR_DELAYS; i++) {
+        long delta = base + bench_delays[i] - bench_tick;
+
+        if (fired[i] < 0 && (next == 0 || delta < next))
+            next = delta;
+    }
+    return next;
+}
+
+static void timer_expire_tick_check(bool tickless) {
+    struct timer_list timers[BENCH_NR_DELAYS];
+    long fired[BENCH_NR_DELAYS];
+    long base, step = 1;
+
+    /* Start out of the slot boundary */
+    bench_tick = 0;
+    ASSERT_EQ(timer_schedule(7), 0);
+    bench_tick += 7;
+    base = bench_tick;
+    for (size_t i = 0; i < BENCH_NR_DELAYS; i++) {
+        fired[i] = -1;
+        timer_init(&timers[i], bench_tick_cb, &fired[i]);
+        ASSERT_EQ(timer_add(&timers[i], bench_delays[i]), 0);
+    }
+
+    /*
+     * Step by tick, Or jump to the next expiry that is returned by
+     * timer_schedule() (as the tickless timer interrupt does)
+     */
+    while (step > 0) {
+        long next, expect;
+
+        bench_tick += step;
+        next = timer_schedule(step);
+        expect = bench_next_expiry(fired, base);
+#ifdef CONFIG_TIMER_WHEEL
+        /* The wheel may wake up earlier to move timers between levels */
+        ASSERT_EQ(next == 0, expect == 0) << "tick " << bench_tick;
+        ASSERT_LE(next, expect) << "tick " << bench_tick;
+#else
+        ASSERT_EQ(next, expect) << "tick " << bench_tick;
+#endif
+        step = tickless? next: (next? 1: 0);
+    }
+
+    for (size_t i = 0; i < BENCH_NR_DELAYS; i++)
+        EXPECT_EQ(fired[i], base + bench_delays[i]) << "delay " << bench_delays[i];
+}
+
+TEST(timer_bench, timers_10) {
+    timer_benchmark(10);
+}
+
+TEST(timer_bench, timers_100) {
+    timer_benchmark(100);
+}
+
+TEST(timer_bench, timers_10k) {
+    timer_benchmark(10000);
+}
+
+TEST(timer_bench, expire) {
+    timer_expire_check(10000);
+}
+
+TEST(timer_bench, expire_tick) {
+    timer_expire_tick_check(false);
+}
+
+TEST(timer_bench, expire_tickless) {
+    timer_expire_tick_check(true);
+}
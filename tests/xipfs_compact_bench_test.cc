@@ -0,0 +1,253 @@
+/*
+ * Copyright 2024 wtcat
+ *
+ * Benchmark for the compaction of xipfs free space
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "basework/os/osapi_fs.h"
+#include "basework/dev/xipfs.h"
+#include "gtest/gtest.h"
+
+#define FILE_NAME(path) "/XIPFS:" path
+#define COMPACT_FILES   8
+#define COMPACT_BLKS    4  /* The blocks of each small file */
+
+static uint64_t compact_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void compact_create(const char *name, size_t size, char c) {
+    std::vector<char> buf(size, c);
+    os_file_t fd;
+
+    ASSERT_EQ(vfs_open(&fd, name, VFS_O_CREAT | VFS_O_RDWR), 0);
+    ASSERT_EQ(vfs_ioctl(fd, VFS_IOSET_FILESIZE, (void *)size), 0);
+    ASSERT_EQ(vfs_write(fd, buf.data(), size), (ssize_t)size);
+    ASSERT_EQ(vfs_close(fd), 0);
+}
+
+static void compact_verify(const char *name, size_t size, char c) {
+    std::vector<char> buf(size);
+    os_file_t fd;
+
+    ASSERT_EQ(vfs_open(&fd, name, VFS_O_RDONLY), 0);
+    ASSERT_EQ(vfs_read(fd, buf.data(), size), (ssize_t)size);
+    ASSERT_EQ(vfs_close(fd), 0);
+    for (size_t i = 0; i < size; i++)
+        ASSERT_EQ(buf[i], c) << name << " " << i;
+}
+
+static uint16_t compact_blkofs(const char *name) {
+    uint16_t blkofs = UINT16_MAX;
+    os_file_t fd;
+
+    EXPECT_EQ(vfs_open(&fd, name, VFS_O_RDONLY), 0);
+    EXPECT_EQ(vfs_ioctl(fd, XIPFS_IOGET_BLKOFS, &blkofs), 0);
+    EXPECT_EQ(vfs_close(fd), 0);
+    return blkofs;
+}
+
+/*
+ * Make the free space fragmented and return the time (us) that is used
+ * to create a file larger than every hole
+ */
+static uint64_t compact_fragment_and_create(bool wait_background) {
+    const size_t small = COMPACT_BLKS * CONFIG_XIPFS_BLKSIZE;
+    const size_t large = (COMPACT_FILES / 2) * small;
+    char name[32];
+    uint64_t t0;
+
+    for (int i = 0; i < COMPACT_FILES; i++) {
+        snprintf(name, sizeof(name), FILE_NAME("/compact-%d"), i);
+        compact_create(name, small, 'a' + i);
+    }
+    for (int i = 0; i < COMPACT_FILES; i += 2) {
+        snprintf(name, sizeof(name), FILE_NAME("/compact-%d"), i);
+        EXPECT_EQ(vfs_unlink(name), 0);
+    }
+
+    if (wait_background) {
+        usleep((CONFIG_XIPFS_COMPACT_DELAY + 
+            CONFIG_XIPFS_COMPACT_PERIOD * large / CONFIG_XIPFS_BLKSIZE) * 1000 + 500000);
+    }
+
+    t0 = compact_now();
+    compact_create(FILE_NAME("/compact-large"), large, 'z');
+    t0 = compact_now() - t0;
+
+    for (int i = 1; i < COMPACT_FILES; i += 2) {
+        snprintf(name, sizeof(name), FILE_NAME("/compact-%d"), i);
+        compact_verify(name, small, 'a' + i);
+        EXPECT_EQ(vfs_unlink(name), 0);
+    }
+    compact_verify(FILE_NAME("/compact-large"), large, 'z');
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/compact-large")), 0);
+    return t0;
+}
+
+TEST(xipfs_compact, create_latency) {
+    uint64_t sync_us, background_us;
+
+    sync_us = compact_fragment_and_create(false);
+    background_us = compact_fragment_and_create(true);
+    printf("xipfs_compact: create with synchronous compaction(%llu us)"
+        " after background compaction(%llu us)\n",
+        (unsigned long long)sync_us, (unsigned long long)background_us);
+    EXPECT_LT(background_us, sync_us);
+}
+
+TEST(xipfs_compact, fraginfo) {
+    const size_t small = COMPACT_BLKS * CONFIG_XIPFS_BLKSIZE;
+    struct xipfs_fraginfo before, after;
+    char name[32];
+    os_file_t fd;
+
+    for (int i = 0; i < COMPACT_FILES; i++) {
+        snprintf(name, sizeof(name), FILE_NAME("/frag-%d"), i);
+        compact_create(name, small, 'a' + i);
+    }
+    for (int i = 0; i < COMPACT_FILES; i += 2) {
+        snprintf(name, sizeof(name), FILE_NAME("/frag-%d"), i);
+        EXPECT_EQ(vfs_unlink(name), 0);
+    }
+
+    ASSERT_EQ(vfs_open(&fd, FILE_NAME("/frag-1"), VFS_O_RDONLY), 0);
+    ASSERT_EQ(vfs_ioctl(fd, XIPFS_IOGET_FRAGINFO, &before), 0);
+    ASSERT_EQ(vfs_close(fd), 0);
+    EXPECT_GT(before.extents, 1);
+    EXPECT_GT(before.frag, 0);
+    EXPECT_LT(before.largest_blks, before.free_blks);
+
+    usleep((CONFIG_XIPFS_COMPACT_DELAY + CONFIG_XIPFS_COMPACT_PERIOD * 
+        COMPACT_FILES * COMPACT_BLKS) * 1000 + 500000);
+
+    ASSERT_EQ(vfs_open(&fd, FILE_NAME("/frag-1"), VFS_O_RDONLY), 0);
+    ASSERT_EQ(vfs_ioctl(fd, XIPFS_IOGET_FRAGINFO, &after), 0);
+    ASSERT_EQ(vfs_close(fd), 0);
+    printf("xipfs_compact: fragmentation before(%d/1000) after(%d/1000)\n", 
+        before.frag, after.frag);
+    EXPECT_EQ(after.extents, 1);
+    EXPECT_EQ(after.frag, 0);
+    EXPECT_EQ(after.free_blks, before.free_blks);
+
+    for (int i = 1; i < COMPACT_FILES; i += 2) {
+        snprintf(name, sizeof(name), FILE_NAME("/frag-%d"), i);
+        compact_verify(name, small, 'a' + i);
+        EXPECT_EQ(vfs_unlink(name), 0);
+    }
+}
+
+TEST(xipfs_compact, skip_open_file) {
+    const size_t small = COMPACT_BLKS * CONFIG_XIPFS_BLKSIZE;
+    const useconds_t wait = (CONFIG_XIPFS_COMPACT_DELAY + CONFIG_XIPFS_COMPACT_PERIOD * 
+        COMPACT_FILES * COMPACT_BLKS) * 1000 + 500000;
+    struct xipfs_fraginfo info;
+    os_file_t pinned, fd;
+    char name[32];
+
+    for (int i = 0; i < COMPACT_FILES; i++) {
+        snprintf(name, sizeof(name), FILE_NAME("/pin-%d"), i);
+        compact_create(name, small, 'a' + i);
+    }
+    for (int i = 0; i < COMPACT_FILES; i += 2) {
+        snprintf(name, sizeof(name), FILE_NAME("/pin-%d"), i);
+        EXPECT_EQ(vfs_unlink(name), 0);
+    }
+
+    /* The open file is not moved, So the hole in front of it is left */
+    ASSERT_EQ(vfs_open(&pinned, FILE_NAME("/pin-1"), VFS_O_RDONLY), 0);
+    usleep(wait);
+    ASSERT_EQ(vfs_ioctl(pinned, XIPFS_IOGET_FRAGINFO, &info), 0);
+    EXPECT_EQ(info.extents, 2);
+    ASSERT_EQ(vfs_close(pinned), 0);
+
+    /* The compactor resumes after close */
+    usleep(wait);
+    ASSERT_EQ(vfs_open(&fd, FILE_NAME("/pin-1"), VFS_O_RDONLY), 0);
+    ASSERT_EQ(vfs_ioctl(fd, XIPFS_IOGET_FRAGINFO, &info), 0);
+    ASSERT_EQ(vfs_close(fd), 0);
+    EXPECT_EQ(info.extents, 1);
+
+    for (int i = 1; i < COMPACT_FILES; i += 2) {
+        snprintf(name, sizeof(name), FILE_NAME("/pin-%d"), i);
+        compact_verify(name, small, 'a' + i);
+        EXPECT_EQ(vfs_unlink(name), 0);
+    }
+}
+
+/*
+ * The files of the test are in the same size class, So they are placed in
+ * the order of creation (The small ones from the end of free space)
+ */
+#if CONFIG_XIPFS_LARGE_FILE_BLKS > 0 && CONFIG_XIPFS_LARGE_FILE_BLKS <= 6
+#define FIT_BLKS(n) ((n) * CONFIG_XIPFS_LARGE_FILE_BLKS)
+#else
+#define FIT_BLKS(n) (n)
+#endif
+#define FIT_SIZE(n) (FIT_BLKS(n) * CONFIG_XIPFS_BLKSIZE)
+
+TEST(xipfs_compact, best_fit_placement) {
+    static const struct {
+        const char *name;
+        size_t blks;
+    } layout[] = {
+        {FILE_NAME("/fit-hole6"), 6}, {FILE_NAME("/fit-0"), 1},
+        {FILE_NAME("/fit-hole2"), 2}, {FILE_NAME("/fit-1"), 1},
+        {FILE_NAME("/fit-hole4"), 4}, {FILE_NAME("/fit-2"), 1},
+    };
+    struct xipfs_fraginfo info;
+    uint16_t hole2, hole4;
+    os_file_t fd;
+
+    for (size_t i = 0; i < sizeof(layout) / sizeof(layout[0]); i++)
+        compact_create(layout[i].name, FIT_SIZE(layout[i].blks), 'a' + i);
+
+    /* Fill the rest, So the holes are the only free space */
+    ASSERT_EQ(vfs_open(&fd, FILE_NAME("/fit-0"), VFS_O_RDONLY), 0);
+    ASSERT_EQ(vfs_ioctl(fd, XIPFS_IOGET_FRAGINFO, &info), 0);
+    ASSERT_EQ(vfs_close(fd), 0);
+    ASSERT_GT(info.free_blks, 0);
+    compact_create(FILE_NAME("/fit-rest"), info.free_blks * CONFIG_XIPFS_BLKSIZE, 'r');
+
+    hole2 = compact_blkofs(FILE_NAME("/fit-hole2"));
+    hole4 = compact_blkofs(FILE_NAME("/fit-hole4"));
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-hole6")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-hole2")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-hole4")), 0);
+
+    /* The exact fit is taken before the larger holes */
+    compact_create(FILE_NAME("/fit-x"), FIT_SIZE(2), 'x');
+    EXPECT_EQ(compact_blkofs(FILE_NAME("/fit-x")), hole2);
+
+    /* The smallest hole that is large enough */
+    compact_create(FILE_NAME("/fit-y"), FIT_SIZE(3), 'y');
+#if CONFIG_XIPFS_LARGE_FILE_BLKS > 6
+    /* The small file is put at the end of the hole */
+    EXPECT_EQ(compact_blkofs(FILE_NAME("/fit-y")), hole4 + FIT_BLKS(1));
+#else
+    EXPECT_EQ(compact_blkofs(FILE_NAME("/fit-y")), hole4);
+#endif
+
+    ASSERT_EQ(vfs_open(&fd, FILE_NAME("/fit-x"), VFS_O_RDONLY), 0);
+    ASSERT_EQ(vfs_ioctl(fd, XIPFS_IOGET_FRAGINFO, &info), 0);
+    ASSERT_EQ(vfs_close(fd), 0);
+    EXPECT_EQ(info.free_blks, FIT_BLKS(7));
+    EXPECT_EQ(info.largest_blks, FIT_BLKS(6));
+    EXPECT_EQ(info.extents, 2);
+
+    compact_verify(FILE_NAME("/fit-x"), FIT_SIZE(2), 'x');
+    compact_verify(FILE_NAME("/fit-y"), FIT_SIZE(3), 'y');
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-x")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-y")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-rest")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-0")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-1")), 0);
+    EXPECT_EQ(vfs_unlink(FILE_NAME("/fit-2")), 0);
+}
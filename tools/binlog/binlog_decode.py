@@ -0,0 +1,283 @@
+#!/usr/bin/python
+# Copyright 2024 wtcat
+#
+# Decode the binary log (lib/binlog.c) to text
+#
+# The format strings are read from the ELF file of firmware, so the ELF must
+# be the one that generated the log.
+#
+# Usage: binlog_decode.py -e firmware.elf syslog.bin [-o syslog.txt]
+
+import argparse
+import struct
+import sys
+
+BINLOG_MAGIC    = 0xB7
+BINLOG_F_PAD    = 0x01
+BINLOG_F_PTR64  = 0x02
+BINLOG_F_LONG64 = 0x04
+BINLOG_F_TRUNC  = 0x08
+
+ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_PTRDIFF, \
+ARG_PTR, ARG_STR, ARG_HEXDUMP, ARG_STOP = range(10)
+
+SHT_NOBITS = 8
+
+
+class ElfImage:
+    """The sections that have data in ELF (address -> bytes)"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF':
+            raise ValueError('%s is not ELF file' % path)
+        is64 = self.data[4] == 2
+        endian = '<' if self.data[5] == 1 else '>'
+        if is64:
+            shoff, = struct.unpack_from(endian + 'Q', self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + 'HH', self.data, 0x3A)
+            fmt = endian + 'IIQQQQ'
+        else:
+            shoff, = struct.unpack_from(endian + 'I', self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + 'HH', self.data, 0x2E)
+            fmt = endian + 'IIIIII'
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from(fmt,
+                self.data, shoff + i * shentsize)
+            if addr != 0 and size != 0 and sh_type != SHT_NOBITS:
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                end = self.data.find(b'\0', start, offset + size)
+                if end < 0:
+                    return None
+                return self.data[start:end].decode('utf-8', 'replace')
+        return None
+
+
+class Spec:
+    def __init__(self):
+        self.flags = ''
+        self.width = None
+        self.prec = None
+        self.stars = []      # 'w' or 'p' for every '*'
+        self.conv = ''
+        self.type = ARG_STOP
+        self.length = ''
+
+
+def parse_spec(fmt, i):
+    """Parse the conversion after '%' (Same as lib/binlog.c)"""
+    spec = Spec()
+    dot = False
+    while i < len(fmt):
+        ch = fmt[i]
+        i += 1
+        if ch == '.':
+            dot = True
+            spec.prec = spec.prec or 0
+        elif ch in '#+-':
+            spec.flags += ch
+        elif ch == '*':
+            spec.stars.append('p' if dot else 'w')
+        elif ch.isdigit():
+            if ch == '0' and not dot:
+                spec.flags += '0'
+                continue
+            n = int(ch)
+            while i < len(fmt) and fmt[i].isdigit():
+                n = n * 10 + int(fmt[i])
+                i += 1
+            if dot:
+                spec.prec = n
+            else:
+                spec.width = n
+        elif ch in 'hljzt':
+            spec.length += ch
+        else:
+            spec.conv = ch
+            if ch == '%':
+                spec.type = ARG_NONE
+            elif ch == 'c':
+                spec.type = ARG_INT
+            elif ch in 'diouxXy':
+                if 'j' in spec.length or spec.length.count('l') > 1:
+                    spec.type = ARG_LLONG
+                elif 't' in spec.length:
+                    spec.type = ARG_PTRDIFF
+                elif 'l' in spec.length:
+                    spec.type = ARG_LONG
+                elif 'z' in spec.length:
+                    spec.type = ARG_SIZE
+                else:
+                    spec.type = ARG_INT
+            elif ch == 'p':
+                spec.type = ARG_PTR
+            elif ch == 's':
+                spec.type = ARG_STR
+            elif ch == 'D':
+                spec.type = ARG_HEXDUMP
+            else:
+                spec.type = ARG_STOP
+                i -= 1
+            return spec, i
+    return spec, i
+
+
+class Args:
+    def __init__(self, data, flags):
+        self.data = data
+        self.pos = 0
+        self.ptrsz = 8 if flags & BINLOG_F_PTR64 else 4
+        self.longsz = 8 if flags & BINLOG_F_LONG64 else 4
+
+    def size_of(self, t):
+        return {ARG_INT: 4, ARG_LONG: self.longsz, ARG_LLONG: 8,
+            ARG_SIZE: self.ptrsz, ARG_PTRDIFF: self.ptrsz,
+            ARG_PTR: self.ptrsz}[t]
+
+    def integer(self, size, signed):
+        n = (size + 3) & ~3
+        if self.pos + n > len(self.data):
+            raise EOFError
+        v = int.from_bytes(self.data[self.pos:self.pos + size], 'little',
+            signed=signed)
+        self.pos += n
+        return v
+
+    def raw(self, size):
+        n = (size + 3) & ~3
+        if self.pos + n > len(self.data):
+            raise EOFError
+        v = self.data[self.pos:self.pos + size]
+        self.pos += n
+        return v
+
+    def string(self):
+        end = self.data.find(b'\0', self.pos)
+        if end < 0:
+            raise EOFError
+        s = self.data[self.pos:end].decode('utf-8', 'replace')
+        self.pos += (end - self.pos + 1 + 3) & ~3
+        return s
+
+
+def pad(s, spec, width):
+    if width is None or len(s) >= width:
+        return s
+    if '-' in spec.flags:
+        return s + ' ' * (width - len(s))
+    return ' ' * (width - len(s)) + s
+
+
+def format_record(fmt, args):
+    out = []
+    i = 0
+    while True:
+        j = fmt.find('%', i)
+        if j < 0:
+            out.append(fmt[i:])
+            break
+        spec, k = parse_spec(fmt, j + 1)
+        if spec.type == ARG_STOP:
+            out.append(fmt[i:])
+            break
+        out.append(fmt[i:j])
+        i = k
+        try:
+            width, prec = spec.width, spec.prec
+            for star in spec.stars:
+                v = args.integer(4, True)
+                if star == 'w':
+                    if v < 0:
+                        spec.flags += '-'
+                    width = abs(v)
+                else:
+                    prec = max(v, 0)
+
+            if spec.type == ARG_NONE:
+                out.append('%')
+            elif spec.type == ARG_STR:
+                s = args.string()
+                if prec is not None:
+                    s = s[:prec]
+                out.append(pad(s, spec, width))
+            elif spec.type == ARG_HEXDUMP:
+                n = args.integer(2, False)
+                data = args.raw(n)
+                sep = args.string()
+                out.append(sep.join('%02x' % b for b in data))
+            else:
+                size = args.size_of(spec.type)
+                signed = spec.conv in 'diy'
+                v = args.integer(size, signed)
+                if spec.conv == 'c':
+                    out.append(pad(chr(v & 0xFF), spec, width))
+                    continue
+                if spec.type == ARG_INT and 'hh' in spec.length:
+                    v = (v & 0xFF) - (0x100 if signed and v & 0x80 else 0)
+                elif spec.type == ARG_INT and 'h' in spec.length:
+                    v = (v & 0xFFFF) - (0x10000 if signed and v & 0x8000 else 0)
+                conv = {'u': 'd', 'y': 'x', 'p': 'x'}.get(spec.conv, spec.conv)
+                # The '+' is accepted but not output by _IO_Vprintf()
+                flags = spec.flags.replace('+', '')
+                if spec.conv == 'p' and width is None:
+                    flags += '#'
+                pyfmt = '%' + flags + (str(width) if width else '') + \
+                    ('.' + str(prec) if prec is not None else '') + conv
+                out.append(pyfmt % v)
+        except EOFError:
+            out.append('<truncated>\n')
+            break
+    return ''.join(out)
+
+
+def decode(elf, data, output):
+    hdr = struct.Struct('<BBHI')
+    pos = 0
+    count = 0
+    while pos + hdr.size <= len(data):
+        magic, flags, size, ts = hdr.unpack_from(data, pos)
+        ptrsz = 8 if flags & BINLOG_F_PTR64 else 4
+        if magic != BINLOG_MAGIC or flags & BINLOG_F_PAD or \
+            size < hdr.size + ptrsz or size & 3 or pos + size > len(data):
+            pos += 1
+            continue
+        addr = int.from_bytes(data[pos + hdr.size:pos + hdr.size + ptrsz], 'little')
+        fmt = elf.string(addr)
+        if fmt is None:
+            # The record is broken (The head of log ring may be overwritten)
+            pos += 1
+            continue
+        args = Args(data[pos + hdr.size + ptrsz:pos + size], flags)
+        output.write('[%u.%03u] ' % (ts // 1000, ts % 1000))
+        output.write(format_record(fmt, args))
+        pos += size
+        count += 1
+    return count
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode binary log')
+    parser.add_argument('-e', '--elf', required=True, help='firmware ELF file')
+    parser.add_argument('-o', '--output', help='output text file')
+    parser.add_argument('log', help='binary log file (disklog dump)')
+    args = parser.parse_args()
+
+    elf = ElfImage(args.elf)
+    with open(args.log, 'rb') as f:
+        data = f.read()
+    output = open(args.output, 'w') if args.output else sys.stdout
+    count = decode(elf, data, output)
+    if args.output:
+        output.close()
+    sys.stderr.write('%d records decoded\n' % count)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,118 @@
+#!/usr/bin/python
+# Copyright 2024 wtcat
+#
+# Decompress the disklog segments (CONFIG_DISKLOG_COMPRESS) to text
+#
+# The input can be the segments that uploaded by disklog_segment_output() or
+# the raw dump of log partition. The segments are sorted by sequence number.
+#
+# Usage: disklog_unpack.py segments.bin [-o syslog.txt] [--since TIMESTAMP]
+
+import argparse
+import binascii
+import struct
+import sys
+
+SEG_MAGIC  = 0x474c5344
+SEG_HDR    = struct.Struct('<IIIIHHHH')
+
+
+def lz4_block(src, out):
+    """Decode a LZ4 block and append to out (out is also the dictionary)"""
+    i = 0
+    n = len(src)
+    while i < n:
+        token = src[i]
+        i += 1
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                b = src[i]
+                i += 1
+                lit += b
+                if b != 255:
+                    break
+        out += src[i:i + lit]
+        i += lit
+        if i >= n:
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        if offset == 0 or offset > len(out):
+            raise ValueError('bad match offset')
+        mlen = token & 15
+        if mlen == 15:
+            while True:
+                b = src[i]
+                i += 1
+                mlen += b
+                if b != 255:
+                    break
+        mlen += 4
+        start = len(out) - offset
+        for k in range(mlen):
+            out.append(out[start + k])
+
+
+def segments(data):
+    """Find the valid segments in data (-> {seq: (ts_first, ts_last, text)})"""
+    segs = {}
+    pos = 0
+    while True:
+        pos = data.find(struct.pack('<I', SEG_MAGIC), pos)
+        if pos < 0 or pos + SEG_HDR.size > len(data):
+            break
+        magic, seq, ts_first, ts_last, raw_size, comp_size, flags, crc = \
+            SEG_HDR.unpack_from(data, pos)
+        end = pos + SEG_HDR.size + comp_size
+        if end > len(data):
+            pos += 1
+            continue
+        hdr = SEG_HDR.pack(magic, seq, ts_first, ts_last, raw_size,
+                           comp_size, flags, 0)
+        if binascii.crc_hqx(data[pos + SEG_HDR.size:end],
+                            binascii.crc_hqx(hdr, 0)) != crc:
+            pos += 1
+            continue
+
+        text = bytearray()
+        p = pos + SEG_HDR.size
+        while p + 2 <= end:
+            csize, = struct.unpack_from('<H', data, p)
+            p += 2
+            lz4_block(data[p:p + csize], text)
+            p += csize
+        if len(text) != raw_size:
+            sys.stderr.write('segment %d: size mismatch\n' % seq)
+        elif seq not in segs:
+            segs[seq] = (ts_first, ts_last, bytes(text))
+        pos = end
+    return segs
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decompress disklog segments')
+    parser.add_argument('-o', '--output', help='output text file')
+    parser.add_argument('--since', type=int, default=0,
+                        help='skip the segments that end before the timestamp')
+    parser.add_argument('log', help='uploaded segments or partition dump')
+    args = parser.parse_args()
+
+    with open(args.log, 'rb') as f:
+        data = f.read()
+    segs = segments(data)
+    output = open(args.output, 'wb') if args.output else sys.stdout.buffer
+    count = 0
+    for seq in sorted(segs):
+        ts_first, ts_last, text = segs[seq]
+        if ts_last < args.since:
+            continue
+        output.write(text)
+        count += 1
+    if args.output:
+        output.close()
+    sys.stderr.write('%d segments decoded\n' % count)
+
+
+if __name__ == '__main__':
+    main()